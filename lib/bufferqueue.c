@@ -4,6 +4,10 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+
+/* the most buffers handed to a single writev() */
+#define BUFFERQUEUE_MAX_IOV 64
 
 /**
  * The struct that represents a single buffer in the nm_bufferqueue.
@@ -287,7 +291,10 @@ int nm_bufferqueue_push(nm_bufferqueue *bq, const void *buf, size_t len)
 
 int nm_bufferqueue_write(nm_bufferqueue *bq, int fd)
 {
+	struct iovec iov[BUFFERQUEUE_MAX_IOV];
+	struct bufferqueue_buffer *buffer;
 	unsigned int sent = 0;
+	int iovcnt;
 
 	errno = 0;
 	if (!bq)
@@ -300,10 +307,17 @@ int nm_bufferqueue_write(nm_bufferqueue *bq, int fd)
 		return -1;
 
 	while (bq->bq_front) {
-		char *buf = bq->bq_front->bqb_buf + bq->bq_front->bqb_offset;
-		size_t len = bq->bq_front->bqb_bufsize - bq->bq_front->bqb_offset;
+		ssize_t new_sent;
+
+		/* send as many of the queued buffers as we can in one go */
+		iovcnt = 0;
+		for (buffer = bq->bq_front; buffer && iovcnt < BUFFERQUEUE_MAX_IOV; buffer = buffer->bqb_next) {
+			iov[iovcnt].iov_base = buffer->bqb_buf + buffer->bqb_offset;
+			iov[iovcnt].iov_len = buffer->bqb_bufsize - buffer->bqb_offset;
+			iovcnt++;
+		}
 
-		int new_sent = write(fd, buf, len);
+		new_sent = writev(fd, iov, iovcnt);
 		if (new_sent < 0) {
 			if (errno == EINTR) {
 				continue;
@@ -316,7 +330,7 @@ int nm_bufferqueue_write(nm_bufferqueue *bq, int fd)
 		}
 		sent += new_sent;
 
-		nm_bufferqueue_unshift(bq, new_sent, NULL);
+		nm_bufferqueue_drop(bq, new_sent);
 	}
 
 	return sent;
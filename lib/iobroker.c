@@ -4,6 +4,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <time.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -57,6 +58,7 @@ struct iobroker_set {
 	iobroker_fd **iobroker_fds;
 	int max_fds; /* max number of sockets we can accept */
 	int num_fds; /* number of sockets we're currently brokering for */
+	void (*profiler)(int, int (*)(int, int, void *), unsigned long);
 #ifdef IOBROKER_USES_EPOLL
 	int epfd;
 	struct epoll_event *ep_events;
@@ -341,6 +343,28 @@ void iobroker_destroy(iobroker_set *iobs, int flags)
 }
 
 
+void iobroker_set_profiler(iobroker_set *iobs, void (*profiler)(int, int (*)(int, int, void *), unsigned long))
+{
+	if (iobs)
+		iobs->profiler = profiler;
+}
+
+/* the handler may unregister the fd, so we mustn't touch s afterwards */
+static inline void iobroker_run_handler(iobroker_set *iobs, iobroker_fd *s, int fd, int events)
+{
+	struct timespec start, stop;
+	int (*handler)(int, int, void *) = s->handler;
+
+	if (!iobs->profiler) {
+		handler(fd, events, s->arg);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	handler(fd, events, s->arg);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	iobs->profiler(fd, handler, (stop.tv_sec - start.tv_sec) * 1000000 + (stop.tv_nsec - start.tv_nsec) / 1000);
+}
+
 int iobroker_poll(iobroker_set *iobs, int timeout)
 {
 	int i, nfds, ret = 0;
@@ -369,7 +393,7 @@ int iobroker_poll(iobroker_set *iobs, int timeout)
 		s = iobs->iobroker_fds[fd];
 
 		if (s) {
-			s->handler(fd, iobs->ep_events[i].events, s->arg);
+			iobroker_run_handler(iobs, s, fd, iobs->ep_events[i].events);
 			ret++;
 		}
 	}
@@ -414,7 +438,7 @@ int iobroker_poll(iobroker_set *iobs, int timeout)
 					/* this should be logged somehow */
 					continue;
 				}
-				s->handler(s->fd, POLLIN, s->arg);
+				iobroker_run_handler(iobs, s, s->fd, POLLIN);
 				ret++;
 			}
 		}
@@ -449,7 +473,7 @@ int iobroker_poll(iobroker_set *iobs, int timeout)
 				/* this should be logged somehow */
 				continue;
 			}
-			s->handler(s->fd, (int)iobs->pfd[i].revents, s->arg);
+			iobroker_run_handler(iobs, s, s->fd, (int)iobs->pfd[i].revents);
 			ret++;
 		}
 	}
@@ -474,16 +498,30 @@ int iobroker_push(iobroker_set *iobs)
 		s = iobs->iobroker_fds[i];
 		if (s->fd > 0 && nm_bufferqueue_get_available(s->bq_out)) {
 			int ret;
-			result = 0;
 			ret = nm_bufferqueue_write(s->bq_out, s->fd);
 			if (ret < 0) {
 				/* TODO: can't log() in lib */
 			}
+			if (nm_bufferqueue_get_available(s->bq_out))
+				result = 0;
 		}
 	}
 	return result;
 }
 
+int iobroker_queue_packet(iobroker_set *iobs, int fd, char *buf, size_t len)
+{
+	if (!iobs)
+		return IOBROKER_ENOSET;
+	if (fd < 0 || fd >= iobs->max_fds || !iobs->iobroker_fds[fd])
+		return IOBROKER_EINVAL;
+	if (!len) {
+		free(buf);
+		return 0;
+	}
+	return nm_bufferqueue_push_block(iobs->iobroker_fds[fd]->bq_out, buf, len);
+}
+
 int iobroker_write_packet(iobroker_set *iobs, int fd, char *buf, size_t len)
 {
 	int ret = 0;
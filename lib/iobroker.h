@@ -174,10 +174,20 @@ extern void iobroker_destroy(iobroker_set *iobs, int flags);
  * @return -1 on errors, or number of filedescriptors with input
  */
 extern int iobroker_poll(iobroker_set *iobs, int timeout);
+/**
+ * Set a function to be called after each input handler that
+ * iobroker_poll() runs, with the descriptor, the handler and the
+ * time the handler took, in microseconds. This lets the caller see
+ * where time goes without wrapping each handler.
+ * @param iobs The socket set to profile
+ * @param profiler The function to call, or NULL to stop profiling
+ */
+extern void iobroker_set_profiler(iobroker_set *iobs, void (*profiler)(int, int (*)(int, int, void *), unsigned long));
+
 /**
  * Push any pending outgoing data
  * @param iobs The socket set to push everything in.
- * @returns 0 if any data was pushed, non-zero otherwise
+ * @returns 0 if some data couldn't be sent yet, non-zero otherwise
  */
 int iobroker_push(iobroker_set *iobs);
 
@@ -194,6 +204,19 @@ int iobroker_push(iobroker_set *iobs);
  */
 int iobroker_write_packet(iobroker_set *iobs, int fd, char *buf, size_t len);
 
+/**
+ * Queue data for this specific fd without sending it. Everything
+ * queued is sent by the next iobroker_push(), in as few system calls
+ * as possible, which lets callers batch up many small packets.
+ *
+ * @param[in] iobs The socket set to send data to
+ * @param[in] fd The socket descriptor to add data to. Must be registered in the set.
+ * @param[in] buf The data to send. Must be malloc()'ed, the iobroker takes ownership of it.
+ * @param[in] len The length of the data.
+ * @returns 0 if everything worked, non-zero otherwise
+ */
+int iobroker_queue_packet(iobroker_set *iobs, int fd, char *buf, size_t len);
+
 NAGIOS_END_DECL
 #endif /* INCLUDE_iobroker_h__ */
 /** @} */
@@ -27,6 +27,8 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <errno.h>
+#include <spawn.h>
+#include <fcntl.h>
 #include "runcmd.h"
 
 
@@ -68,6 +70,9 @@ static int maxfd = 0;
 # endif /* _SC_OPEN_MAX */
 #endif /* OPEN_MAX */
 
+/* Set to 0 to always start commands with fork() */
+static int use_spawn = 1;
+
 
 const char *runcmd_strerror(int code)
 {
@@ -319,70 +324,105 @@ void runcmd_init(void)
 }
 
 
-/* Start running a command */
-int runcmd_open(const char *cmd, int *pfd, int *pfderr, char **env)
+/*
+ * Start a command with posix_spawn(), setting up the child the same way
+ * the fork() path in runcmd_open() does. Modern libc's implement it with
+ * vfork() or clone(CLONE_VM | CLONE_VFORK), so unlike fork() it doesn't
+ * copy the page tables of the (possibly huge) parent. Returns -1 if the
+ * command couldn't be spawned, and the caller then falls back to fork(),
+ * which also takes care of reporting exec() failures the usual way.
+ */
+static pid_t runcmd_spawn(char **argv, int *pfdin, int *pfd, int *pfderr)
 {
-	char **argv = NULL;
-	int cmd2strv_errors, argc = 0;
-	size_t cmdlen;
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
 	pid_t pid;
+	int i, ret;
 
-	int i = 0;
-
-	if (!pids)
-		runcmd_init();
+	if (posix_spawn_file_actions_init(&fa))
+		return -1;
+	if (posix_spawnattr_init(&attr)) {
+		posix_spawn_file_actions_destroy(&fa);
+		return -1;
+	}
 
-	/* if no command was passed, return with no error */
-	if (!*cmd)
-		return RUNCMD_EINVAL;
+	/* make sure all our children are killable by our parent */
+	ret = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	ret |= posix_spawnattr_setpgroup(&attr, 0);
 
-	cmdlen = strlen(cmd);
-	argv = calloc((cmdlen / 2) + 5, sizeof(char *));
-	if (!argv)
-		return RUNCMD_EALLOC;
+	if (pfdin) {
+		ret |= posix_spawn_file_actions_addclose(&fa, pfdin[1]);
+		ret |= posix_spawn_file_actions_adddup2(&fa, pfdin[0], STDIN_FILENO);
+		ret |= posix_spawn_file_actions_addclose(&fa, pfdin[0]);
+	}
+	ret |= posix_spawn_file_actions_addclose(&fa, pfd[0]);
+	if (pfd[1] != STDOUT_FILENO) {
+		ret |= posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+		ret |= posix_spawn_file_actions_addclose(&fa, pfd[1]);
+	}
+	ret |= posix_spawn_file_actions_addclose(&fa, pfderr[0]);
+	if (pfderr[1] != STDERR_FILENO) {
+		ret |= posix_spawn_file_actions_adddup2(&fa, pfderr[1], STDERR_FILENO);
+		ret |= posix_spawn_file_actions_addclose(&fa, pfderr[1]);
+	}
 
-	cmd2strv_errors = runcmd_cmd2strv(cmd, &argc, argv);
-	if (cmd2strv_errors) {
-		/*
-		 * if there are complications, we fall back to running
-		 * the command via the shell
-		 */
-		free(argv[0]);
-		argv[0] = "/bin/sh";
-		argv[1] = "-c";
-		argv[2] = strdup(cmd);
-		if (!argv[2]) {
-			free(argv);
-			return RUNCMD_EALLOC;
-		}
-		argv[3] = NULL;
+	/* close all descriptors in pids[], except the ones handled above */
+	for (i = STDERR_FILENO + 1; !ret && i < maxfd; i++) {
+		if (pids[i] <= 0 || i == pfd[0] || i == pfd[1] || i == pfderr[0] || i == pfderr[1])
+			continue;
+		ret = posix_spawn_file_actions_addclose(&fa, i);
 	}
 
+	if (!ret)
+		ret = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	return ret ? -1 : pid;
+}
+
+
+/*
+ * Start running a command from an argument vector, which the caller
+ * still owns once we return. The child gets a pipe on stdin only if
+ * pfdin is given, and inherits ours otherwise.
+ */
+static int runcmd_start(char **argv, int *pfdin, int *pfd, int *pfderr)
+{
+	pid_t pid;
+	int i = 0;
+
+	if (pfdin && pipe(pfdin) < 0)
+		return RUNCMD_EFD;
 	if (pipe(pfd) < 0) {
-		if (!cmd2strv_errors)
-			free(argv[0]);
-		else
-			free(argv[2]);
-		free(argv);
+		if (pfdin) {
+			close(pfdin[0]);
+			close(pfdin[1]);
+		}
 		return RUNCMD_ECMD;
 	}
 	if (pipe(pfderr) < 0) {
-		if (!cmd2strv_errors)
-			free(argv[0]);
-		else
-			free(argv[2]);
-		free(argv);
+		if (pfdin) {
+			close(pfdin[0]);
+			close(pfdin[1]);
+		}
 		close(pfd[0]);
 		close(pfd[1]);
 		return RUNCMD_EFD;
 	}
-	pid = fork();
+	/* our end of stdin mustn't leak into this or any later child */
+	if (pfdin)
+		fcntl(pfdin[1], F_SETFD, FD_CLOEXEC);
+	pid = -1;
+	if (use_spawn)
+		pid = runcmd_spawn(argv, pfdin, pfd, pfderr);
+	if (pid < 0)
+		pid = fork();
 	if (pid < 0) {
-		if (!cmd2strv_errors)
-			free(argv[0]);
-		else
-			free(argv[2]);
-		free(argv);
+		if (pfdin) {
+			close(pfdin[0]);
+			close(pfdin[1]);
+		}
 		close(pfd[0]);
 		close(pfd[1]);
 		close(pfderr[0]);
@@ -396,6 +436,11 @@ int runcmd_open(const char *cmd, int *pfd, int *pfderr, char **env)
 		/* make sure all our children are killable by our parent */
 		setpgid(getpid(), getpid());
 
+		if (pfdin) {
+			close(pfdin[1]);
+			dup2(pfdin[0], STDIN_FILENO);
+			close(pfdin[0]);
+		}
 		close(pfd[0]);
 		if (pfd[1] != STDOUT_FILENO) {
 			dup2(pfd[1], STDOUT_FILENO);
@@ -416,31 +461,95 @@ int runcmd_open(const char *cmd, int *pfd, int *pfderr, char **env)
 
 		i = execvp(argv[0], argv);
 		fprintf(stderr, "execvp(%s, ...) failed. errno is %d: %s\n", argv[0], errno, strerror(errno));
-		if (!cmd2strv_errors)
-			free(argv[0]);
-		else
-			free(argv[2]);
 		_exit(errno);
 	}
 
 	/* parent picks up execution here */
-	/*
-	 * close childs file descriptors in our address space and
-	 * release the memory we used that won't get passed to the
-	 * caller.
-	 */
+	/* close childs file descriptors in our address space */
+	if (pfdin)
+		close(pfdin[0]);
 	close(pfd[1]);
 	close(pfderr[1]);
+
+	/* tag our file's entry in the pid-list and return it */
+	pids[pfd[0]] = pid;
+
+	return pfd[0];
+}
+
+
+/* Start running a command */
+int runcmd_open(const char *cmd, int *pfd, int *pfderr, char **env)
+{
+	char **argv = NULL;
+	int cmd2strv_errors, argc = 0, ret;
+	size_t cmdlen;
+
+	if (!pids)
+		runcmd_init();
+
+	/* if no command was passed, return with no error */
+	if (!*cmd)
+		return RUNCMD_EINVAL;
+
+	cmdlen = strlen(cmd);
+	argv = calloc((cmdlen / 2) + 5, sizeof(char *));
+	if (!argv)
+		return RUNCMD_EALLOC;
+
+	cmd2strv_errors = runcmd_cmd2strv(cmd, &argc, argv);
+	if (cmd2strv_errors) {
+		/*
+		 * if there are complications, we fall back to running
+		 * the command via the shell
+		 */
+		free(argv[0]);
+		argv[0] = "/bin/sh";
+		argv[1] = "-c";
+		argv[2] = strdup(cmd);
+		if (!argv[2]) {
+			free(argv);
+			return RUNCMD_EALLOC;
+		}
+		argv[3] = NULL;
+	}
+
+	ret = runcmd_start(argv, NULL, pfd, pfderr);
+
+	/* release the memory that won't get passed to the caller */
 	if (!cmd2strv_errors)
 		free(argv[0]);
 	else
 		free(argv[2]);
 	free(argv);
 
-	/* tag our file's entry in the pid-list and return it */
-	pids[pfd[0]] = pid;
+	return ret;
+}
 
-	return pfd[0];
+
+/* Start running a command that's already split into arguments */
+int runcmd_open_argv(char **argv, int *pfd, int *pfderr, char **env)
+{
+	if (!pids)
+		runcmd_init();
+
+	if (!argv[0] || !*argv[0])
+		return RUNCMD_EINVAL;
+
+	return runcmd_start(argv, NULL, pfd, pfderr);
+}
+
+
+/* Start running a command we'll also talk to through its stdin */
+int runcmd_open_argv_stdin(char **argv, int *pfdin, int *pfd, int *pfderr, char **env)
+{
+	if (!pids)
+		runcmd_init();
+
+	if (!argv[0] || !*argv[0])
+		return RUNCMD_EINVAL;
+
+	return runcmd_start(argv, pfdin, pfd, pfderr);
 }
 
 
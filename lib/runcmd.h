@@ -71,6 +71,31 @@ extern const char *runcmd_strerror(int code);
 extern int runcmd_open(const char *cmdstring, int *pfd, int *pfderr, char **env)
 	__attribute__((__nonnull__(1, 2, 3)));
 
+/**
+ * Start a command that's already split into arguments. Unlike
+ * runcmd_open(), this never involves a shell.
+ * @param[in] argv The nul-terminated argument vector, argv[0] being
+ * the program to run (can be $PATH relative)
+ * @param[out] pfd Child's stdout filedescriptor
+ * @param[out] pfderr Child's stderr filedescriptor
+ * @param[in] env Currently ignored for portability
+ */
+extern int runcmd_open_argv(char **argv, int *pfd, int *pfderr, char **env)
+	__attribute__((__nonnull__(1, 2, 3)));
+
+/**
+ * Start a command that's already split into arguments, with a pipe
+ * on its stdin as well. The write end is close-on-exec, so it's only
+ * ever held open by the caller.
+ * @param[in] argv The nul-terminated argument vector
+ * @param[out] pfdin Child's stdin filedescriptor; write to pfdin[1]
+ * @param[out] pfd Child's stdout filedescriptor
+ * @param[out] pfderr Child's stderr filedescriptor
+ * @param[in] env Currently ignored for portability
+ */
+extern int runcmd_open_argv_stdin(char **argv, int *pfdin, int *pfd, int *pfderr, char **env)
+	__attribute__((__nonnull__(1, 2, 3, 4)));
+
 /**
  * Close a command and return its exit status
  * @note Don't use this. It's a retarded way to reap children suitable
@@ -142,6 +142,47 @@ static int conn_spam(struct sockaddr_in *sain)
 	return 0;
 }
 
+static int ignore_input(int fd, int events, void *arg)
+{
+	return 0;
+}
+
+/* queued packets must all go out, in order, on the next push */
+static void test_queue_packet(void)
+{
+	int sv[2], i, len, total = 0;
+	char expect[4096], got[4096];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		t_fail("socketpair() failed: %s", strerror(errno));
+		return;
+	}
+	ok_int(iobroker_queue_packet(iobs, sv[0], strdup("x"), 1), IOBROKER_EINVAL, "queueing on unregistered fd must fail");
+	iobroker_register(iobs, sv[0], NULL, ignore_input);
+
+	for (i = 0; i < 200; i++) {
+		char *buf;
+		len = asprintf(&buf, "packet %d;", i);
+		memcpy(expect + total, buf, len);
+		total += len;
+		ok_int(iobroker_queue_packet(iobs, sv[0], buf, len), 0, "queueing a packet must work");
+	}
+	ok_int(recv(sv[1], got, sizeof(got), MSG_DONTWAIT), -1, "queued packets must not be sent before a push");
+	ok_int(iobroker_push(iobs), 1, "push must send everything queued");
+
+	for (len = 0; len < total; ) {
+		int ret = read(sv[1], got + len, sizeof(got) - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	ok_int(len, total, "all queued data must be received");
+	test(!memcmp(expect, got, total), "queued packets must arrive in order");
+
+	iobroker_close(iobs, sv[0]);
+	close(sv[1]);
+}
+
 int main(int argc, char **argv)
 {
 	int listen_fd, flags, sockopt = 1;
@@ -187,6 +228,7 @@ int main(int argc, char **argv)
 	}
 
 	iobroker_close(iobs, listen_fd);
+	test_queue_packet();
 	iobroker_destroy(iobs, 0);
 
 	t_end();
@@ -1,8 +1,12 @@
 #include "runcmd.c"
 #include "t-utils.h"
 #include <stdio.h>
+#include <time.h>
 
 #define BUF_SIZE 1024
+#define SPAWN_BENCH_COUNT 500
+/* makes fork() pay for page tables like a worker with a big heap does */
+#define SPAWN_BENCH_BALLAST (64 << 20)
 
 struct cases {
 	char *input;
@@ -88,6 +92,37 @@ struct {
 	{ 0, NULL, 0, { NULL, NULL, NULL }},
 };
 
+/* run a command to completion, returning its exit status */
+static int run_cmd(const char *cmd, char *out)
+{
+	int pfd[2] = { -1, -1}, pfderr[2] = { -1, -1};
+	int fd;
+	ssize_t len;
+
+	fd = runcmd_open(cmd, pfd, pfderr, NULL);
+	if (fd < 0)
+		return fd;
+	len = read(pfd[0], out, BUF_SIZE - 1);
+	out[len > 0 ? len : 0] = 0;
+	close(pfderr[0]);
+	return runcmd_close(fd);
+}
+
+static double spawn_rate(int spawn, unsigned int count)
+{
+	struct timespec start, stop;
+	char out[BUF_SIZE];
+	unsigned int i;
+
+	use_spawn = spawn;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		run_cmd("/bin/true", out);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	use_spawn = 1;
+	return count / ((stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9);
+}
+
 int main(int argc, char **argv)
 {
 	int ret, r2;
@@ -149,6 +184,74 @@ int main(int argc, char **argv)
 		}
 	}
 
+	r2 = t_end();
+	ret = r2 ? r2 : ret;
+	t_reset();
+	t_start("argument vectors");
+	{
+		char *argv_in[] = { "/bin/echo", "-n", "it's", "a \"b\" $c", NULL };
+		int pfd[2] = { -1, -1}, pfderr[2] = { -1, -1};
+		char out[BUF_SIZE];
+		int fd;
+		ssize_t len;
+
+		fd = runcmd_open_argv(argv_in, pfd, pfderr, NULL);
+		ok_int(fd >= 0, 1, "runcmd_open_argv() should start the command");
+		len = read(pfd[0], out, BUF_SIZE - 1);
+		out[len > 0 ? len : 0] = 0;
+		ok_str(out, "it's a \"b\" $c", "Arguments should reach the command untouched");
+		close(pfderr[0]);
+		ok_int(runcmd_close(fd), 0, "Exit code of echo");
+	}
+	{
+		char *argv_in[] = { "/bin/cat", NULL };
+		int pfdin[2] = { -1, -1}, pfd[2] = { -1, -1}, pfderr[2] = { -1, -1};
+		char out[BUF_SIZE];
+		int fd, i;
+		ssize_t len;
+
+		for (i = 1; i >= 0; i--) {
+			use_spawn = i;
+			fd = runcmd_open_argv_stdin(argv_in, pfdin, pfd, pfderr, NULL);
+			ok_int(fd >= 0, 1, "runcmd_open_argv_stdin() should start the command");
+			ok_int(write(pfdin[1], "ping", 4), 4, "Writing to the child's stdin");
+			close(pfdin[1]);
+			len = read(pfd[0], out, BUF_SIZE - 1);
+			out[len > 0 ? len : 0] = 0;
+			ok_str(out, "ping", "Input should reach the command");
+			close(pfderr[0]);
+			ok_int(runcmd_close(fd), 0, "cat should exit once its stdin is closed");
+		}
+		use_spawn = 1;
+	}
+	r2 = t_end();
+	ret = r2 ? r2 : ret;
+	t_reset();
+	t_start("spawn and fork paths");
+	{
+		char out[BUF_SIZE], *ballast;
+		unsigned int count = SPAWN_BENCH_COUNT;
+		int i;
+
+		for (i = 1; i >= 0; i--) {
+			use_spawn = i;
+			ok_int(run_cmd("/bin/echo -n foo bar", out), 0, "Exit code of echo");
+			ok_str(out, "foo bar", "Output of echo");
+			ok_int(run_cmd("/bin/sh -c 'exit 3'", out), 3, "Exit code of shell command");
+			ok_int(run_cmd("/nonexistent/plugin", out), ENOENT, "Missing command exits with errno");
+		}
+		use_spawn = 1;
+
+		if (argc > 1)
+			count = strtoul(argv[1], NULL, 10);
+		ballast = malloc(SPAWN_BENCH_BALLAST);
+		if (ballast)
+			memset(ballast, 1, SPAWN_BENCH_BALLAST);
+		t_diag("%u commands with a %dMB heap: spawn %.0f/sec, fork %.0f/sec",
+		       count, SPAWN_BENCH_BALLAST >> 20, spawn_rate(1, count), spawn_rate(0, count));
+		free(ballast);
+	}
+
 	r2 = t_end();
 	return r2 ? r2 : ret;
 }
@@ -1,7 +1,25 @@
 #include "worker.h"
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+
+/* memfd_create() came with glibc 2.27, eventfd() long before that */
+#if defined(__GLIBC__) && defined(__linux)
+#include <features.h>
+# if __GLIBC_PREREQ(2, 27)
+#  define WORKER_RINGS_SUPPORTED
+#  include <sys/eventfd.h>
+#  include <sys/mman.h>
+# endif
+#endif
+
+/* frames start on this boundary, so a wrap marker always fits */
+#define WORKER_RING_ALIGN(len) (((len) + 7) & ~(uint64_t)7)
+#define WORKER_RING_MAX_SIZE (1U << 30)
 
 struct kvvec_buf *build_kvvec_buf(struct kvvec *kvv)
 {
@@ -44,6 +62,231 @@ char *worker_ioc2msg(nm_bufferqueue *bq, size_t *size, int flags)
 	return res;
 }
 
+int worker_bq2frame(nm_bufferqueue *bq, char **frame, size_t *size)
+{
+	struct worker_frame hdr;
+
+	if (nm_bufferqueue_peek(bq, sizeof(hdr), &hdr))
+		return 1;
+	if (hdr.len < sizeof(hdr))
+		return -1;
+	if (nm_bufferqueue_get_available(bq) < hdr.len)
+		return 1;
+
+	*frame = malloc(hdr.len + 1);
+	if (!*frame)
+		return -1;
+	nm_bufferqueue_unshift(bq, hdr.len, *frame);
+	(*frame)[hdr.len] = 0;
+	*size = hdr.len;
+	return 0;
+}
+
+#ifdef WORKER_RINGS_SUPPORTED
+static int worker_rings_map(struct worker_rings *wr, int fd, size_t len)
+{
+	wr->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (wr->map == MAP_FAILED) {
+		wr->map = NULL;
+		return -1;
+	}
+	wr->map_len = len;
+	wr->jobs.shm = (struct worker_ring_shm *)wr->map;
+	wr->results.shm = (struct worker_ring_shm *)((char *)wr->map + len / 2);
+	return 0;
+}
+
+int worker_rings_create(struct worker_rings *wr, size_t size, int fds[3])
+{
+	uint32_t ring_size = WORKER_RING_MIN_SIZE;
+	size_t len;
+	int i;
+
+	memset(wr, 0, sizeof(*wr));
+	fds[0] = fds[1] = fds[2] = -1;
+	while (ring_size < size && ring_size < WORKER_RING_MAX_SIZE)
+		ring_size <<= 1;
+	len = 2 * (sizeof(struct worker_ring_shm) + ring_size);
+
+	fds[0] = memfd_create("naemon-worker-rings", 0);
+	if (fds[0] < 0 || ftruncate(fds[0], len) < 0 || worker_rings_map(wr, fds[0], len) < 0)
+		goto fail;
+	fds[1] = eventfd(0, EFD_NONBLOCK);
+	fds[2] = eventfd(0, EFD_NONBLOCK);
+	if (fds[1] < 0 || fds[2] < 0)
+		goto fail;
+
+	wr->jobs.shm->size = wr->results.shm->size = ring_size;
+	wr->jobs.efd = fds[1];
+	wr->results.efd = fds[2];
+	return 0;
+
+fail:
+	worker_rings_destroy(wr);
+	for (i = 0; i < 3; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+	return -1;
+}
+
+int worker_rings_attach(struct worker_rings *wr, const int fds[3])
+{
+	struct stat st;
+	uint32_t size;
+
+	memset(wr, 0, sizeof(*wr));
+	if (fstat(fds[0], &st) < 0 || st.st_size < (off_t)(2 * sizeof(struct worker_ring_shm)))
+		return -1;
+	if (worker_rings_map(wr, fds[0], st.st_size) < 0)
+		return -1;
+	size = wr->jobs.shm->size;
+	if (size < WORKER_RING_MIN_SIZE || (size & (size - 1)) ||
+	    (size_t)st.st_size != 2 * (sizeof(struct worker_ring_shm) + size) ||
+	    wr->results.shm->size != size) {
+		worker_rings_destroy(wr);
+		errno = EINVAL;
+		return -1;
+	}
+	close(fds[0]);
+	wr->jobs.efd = fds[1];
+	wr->results.efd = fds[2];
+	/* we may be attaching to rings that are already in use */
+	wr->jobs.pos = wr->jobs.shm->tail;
+	wr->results.pos = wr->results.shm->head;
+	return 0;
+}
+
+void worker_rings_destroy(struct worker_rings *wr)
+{
+	if (wr->map)
+		munmap(wr->map, wr->map_len);
+	wr->map = NULL;
+	wr->map_len = 0;
+	wr->jobs.shm = wr->results.shm = NULL;
+}
+#else
+int worker_rings_create(struct worker_rings *wr, size_t size, int fds[3])
+{
+	memset(wr, 0, sizeof(*wr));
+	errno = ENOSYS;
+	return -1;
+}
+
+int worker_rings_attach(struct worker_rings *wr, const int fds[3])
+{
+	memset(wr, 0, sizeof(*wr));
+	errno = ENOSYS;
+	return -1;
+}
+
+void worker_rings_destroy(struct worker_rings *wr)
+{
+	wr->map = NULL;
+}
+#endif
+
+void *worker_ring_reserve(struct worker_ring *r, size_t len)
+{
+	struct worker_ring_shm *shm = r->shm;
+	uint64_t need = WORKER_RING_ALIGN(len), tail;
+	uint32_t off, to_end;
+
+	/* big frames would keep the ring from doing anything else */
+	if (len < sizeof(struct worker_frame) || need > shm->size / 2)
+		return NULL;
+
+	tail = __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+	off = r->pos & (shm->size - 1);
+	to_end = shm->size - off;
+	r->skip = need > to_end ? to_end : 0;
+	if (r->pos + r->skip + need - tail > shm->size)
+		return NULL;
+
+	if (r->skip) {
+		/* a zero length tells the consumer to start over at the beginning */
+		memset(shm->data + off, 0, sizeof(uint32_t));
+		off = 0;
+	}
+	return shm->data + off;
+}
+
+void worker_ring_commit(struct worker_ring *r, size_t len)
+{
+	struct worker_ring_shm *shm = r->shm;
+	uint64_t was = r->pos, one = 1;
+
+	r->pos += r->skip + WORKER_RING_ALIGN(len);
+	r->skip = 0;
+	__atomic_store_n(&shm->head, r->pos, __ATOMIC_RELEASE);
+
+	/*
+	 * Pairs with the fence in worker_ring_peek(): either the consumer
+	 * sees the new head before it goes to sleep, or we see that it
+	 * had read everything before this frame, and wake it up.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) == was) {
+		if (write(r->efd, &one, sizeof(one)) < 0) {
+			/* the counter is non-zero already, or the consumer is gone */
+		}
+	}
+}
+
+int worker_ring_write(struct worker_ring *r, const void *buf, size_t len)
+{
+	void *p = worker_ring_reserve(r, len);
+
+	if (!p)
+		return -1;
+	memcpy(p, buf, len);
+	worker_ring_commit(r, len);
+	return 0;
+}
+
+int worker_ring_peek(struct worker_ring *r, char **frame, size_t *size)
+{
+	struct worker_ring_shm *shm = r->shm;
+	uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+	uint32_t off, len;
+
+	for (;;) {
+		if (head == r->pos) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+			if (head == r->pos)
+				return 1;
+		}
+		off = r->pos & (shm->size - 1);
+		memcpy(&len, shm->data + off, sizeof(len));
+		if (len)
+			break;
+		worker_ring_consume(r, shm->size - off);
+	}
+
+	if (len < sizeof(struct worker_frame) || len > shm->size - off || WORKER_RING_ALIGN(len) > head - r->pos)
+		return -1;
+	*frame = shm->data + off;
+	*size = len;
+	return 0;
+}
+
+void worker_ring_consume(struct worker_ring *r, size_t size)
+{
+	r->pos += WORKER_RING_ALIGN(size);
+	__atomic_store_n(&r->shm->tail, r->pos, __ATOMIC_RELEASE);
+}
+
+void worker_ring_clear(struct worker_ring *r)
+{
+	uint64_t count;
+
+	if (read(r->efd, &count, sizeof(count)) < 0) {
+		/* nothing to clear */
+	}
+}
+
 int spawn_named_helper(char *path, char **argv)
 {
 	int ret, pid;
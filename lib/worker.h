@@ -5,6 +5,7 @@
 #error "Only <naemon/naemon.h> can be included directly."
 #endif
 
+#include <stdint.h>
 #include "lnae-utils.h"
 #include "kvvec.h"
 #include "bufferqueue.h"
@@ -25,6 +26,178 @@ NAGIOS_BEGIN_DECL
 #define PAIR_SEP 0 /**< pair separator for buf2kvvec() and kvvec2buf() */
 #define KV_SEP '=' /**< key/value separator for buf2kvvec() and kvvec2buf() */
 
+/**
+ * @name Binary framing
+ * A worker that registers with "framing=binary" and gets
+ * "OK framing=binary" back sends and receives binary frames instead
+ * of key/value vectors. Workers that don't ask keep using key/value
+ * vectors. Every frame starts with a struct worker_frame, and numbers
+ * are in host byte order, since workers run on the same host as the
+ * core. Strings that follow a frame header are nul-terminated, but
+ * their lengths don't count the nul.
+ * @{
+ */
+#define WORKER_FRAMING_BINARY "binary"
+#define WORKER_FRAME_JOB 1    /**< struct worker_job_frame, core to worker */
+#define WORKER_FRAME_RESULT 2 /**< struct worker_result_frame, worker to core */
+#define WORKER_FRAME_LOG 3    /**< a log message follows the header */
+
+#define WORKER_JOB_ARGV (1 << 0) /**< job flag, see struct worker_job_frame */
+#define WORKER_JOB_PERSISTENT (1 << 1) /**< job flag: hand the job to a persistent argv[0] */
+#define WORKER_RESULT_EXITED_OK (1 << 0) /**< result flag */
+
+struct worker_frame {
+	uint32_t len;   /**< length of the whole frame, this header included */
+	uint16_t type;  /**< one of the WORKER_FRAME_ types */
+	uint16_t flags;
+};
+
+struct worker_job_frame {
+	struct worker_frame hdr;
+	uint32_t job_id;
+	uint32_t timeout;
+	uint32_t output_limit; /**< bytes of stdout and of stderr to keep, 0 for all */
+	uint32_t command_len; /**< followed by the command */
+	/*
+	 * With WORKER_JOB_ARGV set, the command is followed by the
+	 * arguments to run it with, each one nul-terminated, up to the
+	 * end of the frame. The command is then only used in messages.
+	 * WORKER_JOB_PERSISTENT is only valid along with WORKER_JOB_ARGV,
+	 * and has the worker send the arguments to a long-running
+	 * instance of argv[0] instead of starting a new process.
+	 */
+};
+
+struct worker_result_frame {
+	struct worker_frame hdr;
+	uint32_t job_id;
+	int32_t wait_status;
+	int32_t error_code;
+	uint32_t outstd_len;    /**< followed by stdout, */
+	uint32_t outerr_len;    /**< stderr */
+	uint32_t error_msg_len; /**< and the error message */
+	int64_t start_sec, start_usec;
+	int64_t stop_sec, stop_usec;
+	int64_t ru_utime_sec, ru_utime_usec;
+	int64_t ru_stime_sec, ru_stime_usec;
+	int64_t ru_minflt, ru_majflt, ru_inblock, ru_oublock;
+	int64_t ru_maxrss; /**< in kilobytes */
+};
+/** @} */
+
+/**
+ * @name Shared memory rings
+ * Workers the core spawns itself can be handed a memory segment with
+ * two single-producer, single-consumer rings, one carrying job frames
+ * to the worker and one carrying results and log frames back, and an
+ * eventfd per ring. A producer only signals the eventfd when the ring
+ * goes from empty to non-empty, and the consumer drains all of it
+ * before it waits again. Frames that don't fit in a ring at the time
+ * go through the socket as usual, so both ends keep reading that too.
+ * The segment and the eventfds are passed on to the worker as three
+ * inherited file descriptors. Rings are only available on Linux.
+ * @{
+ */
+#define WORKER_RING_MIN_SIZE (64 * 1024)
+
+/** The shared part of a ring */
+struct worker_ring_shm {
+	uint32_t size; /**< bytes of data, a power of two */
+	uint64_t head __attribute__((aligned(64))); /**< bytes ever written, moved by the producer */
+	uint64_t tail __attribute__((aligned(64))); /**< bytes ever read, moved by the consumer */
+	char data[] __attribute__((aligned(64)));
+};
+
+/** One end of a ring, as seen by the process using it */
+struct worker_ring {
+	struct worker_ring_shm *shm;
+	int efd;      /**< eventfd the producer signals and the consumer polls */
+	uint64_t pos; /**< our head as the producer, or tail as the consumer */
+	uint32_t skip; /**< bytes the frame being written skips to wrap around */
+};
+
+struct worker_rings {
+	void *map;
+	size_t map_len;
+	struct worker_ring jobs;    /**< core to worker */
+	struct worker_ring results; /**< worker to core */
+};
+
+/**
+ * Create a segment with two rings and their eventfds, for the core
+ * @param[out] wr The rings to set up
+ * @param[in] size Bytes of data in each ring, rounded up to a power of two
+ * @param[out] fds The segment, the job ring's eventfd and the result
+ *             ring's eventfd, to be inherited by the worker, so
+ *             without FD_CLOEXEC
+ * @return 0 on success, < 0 on errors
+ */
+extern int worker_rings_create(struct worker_rings *wr, size_t size, int fds[3]);
+
+/**
+ * Map the rings the core created, in the worker
+ * @param[out] wr The rings to set up
+ * @param[in] fds The three descriptors worker_rings_create() handed out
+ * @return 0 on success, < 0 on errors
+ */
+extern int worker_rings_attach(struct worker_rings *wr, const int fds[3]);
+
+/**
+ * Unmap the rings. The eventfds are left for the caller to close,
+ * as they're usually registered with an iobroker
+ * @param wr The rings
+ */
+extern void worker_rings_destroy(struct worker_rings *wr);
+
+/**
+ * Reserve room for a frame at the head of a ring
+ * @param r The producer's end of the ring
+ * @param len Length of the frame
+ * @return Where to write the frame, or NULL if it doesn't fit right now
+ */
+extern void *worker_ring_reserve(struct worker_ring *r, size_t len);
+
+/**
+ * Publish the frame written after worker_ring_reserve(), waking the
+ * consumer if the ring was empty
+ * @param r The producer's end of the ring
+ * @param len Length of the frame, as passed to worker_ring_reserve()
+ */
+extern void worker_ring_commit(struct worker_ring *r, size_t len);
+
+/**
+ * Copy a frame into a ring
+ * @param r The producer's end of the ring
+ * @param buf The frame
+ * @param len Length of the frame
+ * @return 0 on success, -1 if it doesn't fit right now
+ */
+extern int worker_ring_write(struct worker_ring *r, const void *buf, size_t len);
+
+/**
+ * Get the next frame in a ring, without copying it
+ * @param r The consumer's end of the ring
+ * @param[out] frame The frame, valid until worker_ring_consume()
+ * @param[out] size Length of the frame
+ * @return 0 on success, 1 if the ring is empty and < 0 if the frame
+ *         header is broken
+ */
+extern int worker_ring_peek(struct worker_ring *r, char **frame, size_t *size);
+
+/**
+ * Release the frame returned by worker_ring_peek()
+ * @param r The consumer's end of the ring
+ * @param size Length of the frame
+ */
+extern void worker_ring_consume(struct worker_ring *r, size_t size);
+
+/**
+ * Reset the eventfd of a ring, before draining it
+ * @param r The consumer's end of the ring
+ */
+extern void worker_ring_clear(struct worker_ring *r);
+/** @} */
+
 /**
  * Spawn a helper with a specific process name
  * The first entry in the argv parameter will be the name of the
@@ -60,6 +233,16 @@ extern struct kvvec_buf *build_kvvec_buf(struct kvvec *kvv);
  */
 extern char *worker_ioc2msg(nm_bufferqueue *ioc, size_t *size, int flags);
 
+/**
+ * Grab a binary frame from a bufferqueue
+ * @param[in] bq The bufferqueue
+ * @param[out] frame The (caller-owned) frame, nul-terminated after its end
+ * @param[out] size Length of the frame
+ * @return 0 on success, 1 if there's no complete frame yet and
+ *         < 0 if the frame header is broken
+ */
+extern int worker_bq2frame(nm_bufferqueue *bq, char **frame, size_t *size);
+
 /**
  * Set some common socket options
  * @param[in] sd The socket to set options for
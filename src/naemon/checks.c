@@ -1,6 +1,8 @@
 #include "checks.h"
 #include "checks_service.h"
 #include "checks_host.h"
+#include "checks_leveling.h"
+#include "checks_passive.h"
 #include "config.h"
 #include "comments.h"
 #include "common.h"
@@ -25,10 +27,26 @@
 /* for process_check_result_* */
 #include <sys/types.h>
 #include <dirent.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 /* forward declarations */
 static const char *spool_file_source_name(void *source);
 static void reap_check_results(struct nm_event_execution_properties *evprop);
+static void watch_check_result_spool(void);
+static int process_spooled_check_result(char *dirname, const char *name, int have_ok);
+static int read_check_result_queue(char *dirname, int *finished);
+
+/*
+ * With a watch on the spool directory, the reaper only looks at the
+ * result files whose ok-to-go file it's been told about. The whole
+ * directory is only read at startup, when the watch has missed events
+ * or when there's no watch to begin with.
+ */
+static int spool_watch_fd = -1;
+static int spool_rescan = TRUE;
+static GQueue spool_ready = G_QUEUE_INIT; /* names of ready result files, oldest first */
 
 
 static struct check_engine nagios_spool_check_engine = {
@@ -51,6 +69,10 @@ void checks_init(void)
 {
 	checks_init_hosts();
 	checks_init_services();
+	checks_leveling_init();
+	checks_passive_init();
+
+	watch_check_result_spool();
 
 	/******** SCHEDULE MISC EVENTS ********/
 
@@ -58,10 +80,124 @@ void checks_init(void)
 	schedule_event(check_reaper_interval, reap_check_results, NULL);
 }
 
+void checks_deinit(void)
+{
+	char *name;
+
+	checks_passive_deinit();
+
+	if (spool_watch_fd >= 0) {
+		close(spool_watch_fd);
+		spool_watch_fd = -1;
+	}
+	while ((name = g_queue_pop_head(&spool_ready)))
+		nm_free(name);
+}
+
 /******************************************************************/
 /********************** CHECK REAPER FUNCTIONS ********************/
 /******************************************************************/
 
+static void watch_check_result_spool(void)
+{
+	spool_rescan = TRUE;
+#ifdef HAVE_SYS_INOTIFY_H
+	if (check_result_path == NULL || spool_watch_fd >= 0)
+		return;
+
+	if ((spool_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		log_debug_info(DEBUGL_CHECKS, 1, "Failed to set up inotify for the check result queue: %s\n", strerror(errno));
+		return;
+	}
+	/* ok-to-go files are created in place, or renamed or linked into place */
+	if (inotify_add_watch(spool_watch_fd, check_result_path, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+		log_debug_info(DEBUGL_CHECKS, 1, "Failed to watch check result queue directory '%s': %s\n", check_result_path, strerror(errno));
+		close(spool_watch_fd);
+		spool_watch_fd = -1;
+	}
+#endif
+}
+
+/* queues the result files the watch says are ready to be processed */
+static void read_spool_events(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(spool_watch_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				spool_rescan = TRUE;
+			} else if (ev->mask & IN_IGNORED) {
+				/* the directory is gone, so is the watch */
+				log_debug_info(DEBUGL_CHECKS, 1, "Lost the watch on the check result queue directory, reading all of it from now on\n");
+				close(spool_watch_fd);
+				spool_watch_fd = -1;
+				spool_rescan = TRUE;
+				return;
+			} else if (ev->len && !(ev->mask & IN_ISDIR) && strlen(ev->name) == 10 &&
+			           ev->name[0] == 'c' && !strcmp(ev->name + 7, ".ok")) {
+				g_queue_push_tail(&spool_ready, nm_strndup(ev->name, 7));
+			}
+		}
+	}
+#endif
+}
+
+/* processes the result files the watch said are ready, oldest first */
+static int process_ready_check_results(char *dirname)
+{
+	char *name;
+	int result, check_result_files = 0;
+	time_t start = time(NULL);
+
+	while ((name = g_queue_pop_head(&spool_ready)) != NULL) {
+		if (sigshutdown == TRUE || sigrestart == TRUE || start + max_check_reaper_time < time(NULL)) {
+			/* leave it for the next reaper run */
+			g_queue_push_head(&spool_ready, name);
+			log_debug_info(DEBUGL_CHECKS, 0, "Breaking out of check result reaper: signal encountered or max time (%ds) exceeded\n", max_check_reaper_time);
+			break;
+		}
+
+		result = process_spooled_check_result(dirname, name, TRUE);
+		nm_free(name);
+		if (result == ERROR) {
+			/* the next run reads the directory, and finds whatever is left */
+			spool_rescan = TRUE;
+			break;
+		}
+		if (result == OK)
+			check_result_files++;
+	}
+
+	return check_result_files;
+}
+
+static int reap_check_result_spool(char *dirname)
+{
+	char *name;
+	int reaped, finished = FALSE;
+
+	if (spool_watch_fd >= 0)
+		read_spool_events();
+
+	if (spool_watch_fd >= 0 && !spool_rescan)
+		return process_ready_check_results(dirname);
+
+	/* whatever was queued so far is covered by reading the directory */
+	while ((name = g_queue_pop_head(&spool_ready)) != NULL)
+		nm_free(name);
+	reaped = read_check_result_queue(dirname, &finished);
+	if (finished)
+		spool_rescan = FALSE;
+	return reaped;
+}
+
 /* reaps host and service check results */
 static void reap_check_results(struct nm_event_execution_properties *evprop)
 {
@@ -75,7 +211,7 @@ static void reap_check_results(struct nm_event_execution_properties *evprop)
 		log_debug_info(DEBUGL_CHECKS, 0, "Starting to reap check results.\n");
 
 		/* process files in the check result queue */
-		reaped_checks = process_check_result_queue(check_result_path);
+		reaped_checks = reap_check_result_spool(check_result_path);
 
 		log_debug_info(DEBUGL_CHECKS, 0, "Finished reaping %d check results\n", reaped_checks);
 	}
@@ -200,16 +336,84 @@ int parse_check_output(char *buf, char **short_output, char **long_output, char
 }
 
 
-/* processes files in the check result queue directory */
-int process_check_result_queue(char *dirname)
+/*
+ * parse_check_output() for the output of a check result, taking over
+ * the parts a parser thread has already split up if there are any
+ */
+int parse_check_result_output(check_result *cr, char **short_output, char **long_output, char **perf_data)
+{
+	if (!cr->parsed)
+		return parse_check_output(cr->output, short_output, long_output, perf_data, TRUE, FALSE);
+
+	*short_output = cr->parsed->short_output;
+	*long_output = cr->parsed->long_output;
+	*perf_data = cr->parsed->perf_data;
+	nm_free(cr->parsed);
+	return OK;
+}
+
+
+/*
+ * processes a file in the check result queue directory by its name, if
+ * it's a check result file with an ok-to-go file. returns OK if it got
+ * processed, ERROR if reaping should stop and SPOOL_FILE_SKIPPED if
+ * the file was skipped.
+ */
+#define SPOOL_FILE_SKIPPED 1
+static int process_spooled_check_result(char *dirname, const char *name, int have_ok)
 {
 	char file[MAX_FILENAME_LENGTH];
-	DIR *dirp = NULL;
-	struct dirent *dirfile = NULL;
-	register int x = 0;
 	struct stat stat_buf;
 	struct stat ok_stat_buf;
 	char *temp_buffer = NULL;
+	int result;
+
+	/* only check result files, please */
+	if (strlen(name) != 7 || name[0] != 'c')
+		return SPOOL_FILE_SKIPPED;
+
+	/* create /path/to/file */
+	snprintf(file, sizeof(file), "%s/%s", dirname, name);
+	file[sizeof(file) - 1] = '\x0';
+
+	if (stat(file, &stat_buf) == -1) {
+		/* the watch may tell us about files that are long gone */
+		if (!have_ok || errno != ENOENT)
+			nm_log(NSLOG_RUNTIME_WARNING,
+			       "Warning: Could not stat() check result file '%s'.\n", file);
+		return SPOOL_FILE_SKIPPED;
+	}
+
+	/* we only care about real files */
+	if (!S_ISREG(stat_buf.st_mode))
+		return SPOOL_FILE_SKIPPED;
+
+	/* at this point we have a regular file... */
+
+	/* if the file is too old, we delete it */
+	if (stat_buf.st_mtime + max_check_result_file_age < time(NULL)) {
+		delete_check_result_file(file);
+		return SPOOL_FILE_SKIPPED;
+	}
+
+	/* can we find the associated ok-to-go file ? */
+	if (!have_ok) {
+		nm_asprintf(&temp_buffer, "%s.ok", file);
+		result = stat(temp_buffer, &ok_stat_buf);
+		nm_free(temp_buffer);
+		if (result == -1)
+			return SPOOL_FILE_SKIPPED;
+	}
+
+	/* process the file */
+	return process_check_result_file(file);
+}
+
+/* reads all of the check result queue directory, noting whether it got to the end */
+static int read_check_result_queue(char *dirname, int *finished)
+{
+	DIR *dirp = NULL;
+	struct dirent *dirfile = NULL;
 	int result = OK, check_result_files = 0;
 	time_t start;
 
@@ -244,56 +448,43 @@ int process_check_result_queue(char *dirname)
 			break;
 		}
 
-		/* create /path/to/file */
-		snprintf(file, sizeof(file), "%s/%s", dirname, dirfile->d_name);
-		file[sizeof(file) - 1] = '\x0';
-
-		/* process this if it's a check result file... */
-		x = strlen(dirfile->d_name);
-		if (x == 7 && dirfile->d_name[0] == 'c') {
-
-			if (stat(file, &stat_buf) == -1) {
-				nm_log(NSLOG_RUNTIME_WARNING,
-				       "Warning: Could not stat() check result file '%s'.\n", file);
-				continue;
-			}
-
-			/* we only care about real files */
-			if (!S_ISREG(stat_buf.st_mode))
-				continue;
-
-			/* at this point we have a regular file... */
+		result = process_spooled_check_result(dirname, dirfile->d_name, FALSE);
 
-			/* if the file is too old, we delete it */
-			if (stat_buf.st_mtime + max_check_result_file_age < time(NULL)) {
-				delete_check_result_file(dirfile->d_name);
-				continue;
-			}
-
-			/* can we find the associated ok-to-go file ? */
-			nm_asprintf(&temp_buffer, "%s.ok", file);
-			result = stat(temp_buffer, &ok_stat_buf);
-			nm_free(temp_buffer);
-			if (result == -1)
-				continue;
-
-			/* process the file */
-			result = process_check_result_file(file);
-
-			/* break out if we encountered an error */
-			if (result == ERROR)
-				break;
+		/* break out if we encountered an error */
+		if (result == ERROR)
+			break;
 
+		if (result == OK)
 			check_result_files++;
-		}
 	}
 
+	if (finished)
+		*finished = (dirfile == NULL);
+
 	closedir(dirp);
 
 	return check_result_files;
 
 }
 
+/* processes files in the check result queue directory */
+int process_check_result_queue(char *dirname)
+{
+	return read_check_result_queue(dirname, NULL);
+}
+
+
+/*
+ * Hosts and services keep pointing to the source of their last result
+ * after the result is freed, so its name is kept in glib's string
+ * table. There are only so many sources, so the table stays small.
+ */
+static const char *stash_check_source(const char *old, const char *source_name)
+{
+	if (old && !strcmp(old, source_name))
+		return old;
+	return g_intern_string(source_name);
+}
 
 int process_check_result(check_result *cr)
 {
@@ -313,7 +504,7 @@ int process_check_result(check_result *cr)
 		}
 		log_debug_info(DEBUGL_CHECKS, 2, "Processing check result for service '%s' on host '%s'\n",
 		               svc->description, svc->host_name);
-		svc->check_source = source_name;
+		svc->check_source = stash_check_source(svc->check_source, source_name);
 		return handle_async_service_check_result(svc, cr);
 	}
 	if (cr->object_check_type == HOST_CHECK) {
@@ -325,7 +516,7 @@ int process_check_result(check_result *cr)
 			return ERROR;
 		}
 		log_debug_info(DEBUGL_CHECKS, 2, "Processing check result for host '%s'\n", hst->name);
-		hst->check_source = source_name;
+		hst->check_source = stash_check_source(hst->check_source, source_name);
 		return handle_async_host_check_result(hst, cr);
 	}
 
@@ -337,6 +528,164 @@ int process_check_result(check_result *cr)
 }
 
 
+/* parses "seconds.microseconds", as found in spool files */
+static int parse_spooled_timeval(const char *val, size_t val_len, struct timeval *tv)
+{
+	const char *dot = memchr(val, '.', val_len);
+
+	if (dot == NULL || dot == val || dot + 1 == val + val_len)
+		return ERROR;
+	tv->tv_sec = strtoul(val, NULL, 0);
+	tv->tv_usec = strtoul(dot + 1, NULL, 10);
+	return OK;
+}
+
+/*
+ * sets a check result field from a line in a spool file. the value
+ * needn't be nul-terminated, but what follows it mustn't look like
+ * more of a number.
+ */
+static void set_spooled_check_result_var(check_result *cr, const char *var, size_t var_len, const char *val, size_t val_len)
+{
+#define SPOOL_VAR_IS(name) (var_len == sizeof(name) - 1 && !memcmp(var, name, var_len))
+	if (SPOOL_VAR_IS("host_name")) {
+		nm_free(cr->host_name);
+		cr->host_name = nm_strndup(val, val_len);
+	} else if (SPOOL_VAR_IS("service_description")) {
+		nm_free(cr->service_description);
+		cr->service_description = nm_strndup(val, val_len);
+		cr->object_check_type = SERVICE_CHECK;
+	} else if (SPOOL_VAR_IS("check_type"))
+		cr->check_type = atoi(val);
+	else if (SPOOL_VAR_IS("check_options"))
+		cr->check_options = atoi(val);
+	else if (SPOOL_VAR_IS("scheduled_check"))
+		cr->scheduled_check = atoi(val);
+	else if (SPOOL_VAR_IS("latency"))
+		cr->latency = strtod(val, NULL);
+	else if (SPOOL_VAR_IS("start_time"))
+		parse_spooled_timeval(val, val_len, &cr->start_time);
+	else if (SPOOL_VAR_IS("finish_time"))
+		parse_spooled_timeval(val, val_len, &cr->finish_time);
+	else if (SPOOL_VAR_IS("early_timeout"))
+		cr->early_timeout = atoi(val);
+	else if (SPOOL_VAR_IS("exited_ok"))
+		cr->exited_ok = atoi(val);
+	else if (SPOOL_VAR_IS("return_code"))
+		cr->return_code = atoi(val);
+	else if (SPOOL_VAR_IS("output")) {
+		nm_free(cr->output);
+		cr->output = nm_strndup(val, val_len);
+	}
+#undef SPOOL_VAR_IS
+}
+
+/*
+ * Batch files carry any number of check results, so feeders can flush
+ * results once in a while rather than writing a file for each one:
+ *
+ *   ### Naemon check result batch ###
+ *   file_time=<when the batch was started>
+ *
+ *   host_name=...
+ *   (the same variables as in single result files, one line each)
+ *
+ *   (more results, each ended by an empty line)
+ *   end_of_batch=<number of results in the batch>
+ *
+ * A batch only counts as complete once its last line is the end of
+ * batch line, so one that was only partially written is dropped as a
+ * whole rather than applied in part. Results are read straight from the
+ * mapped file, in one pass, and the file is deleted afterwards, as its
+ * ok-to-go file is.
+ */
+#define CHECK_RESULT_BATCH_MAGIC "### Naemon check result batch ###\n"
+#define CHECK_RESULT_BATCH_END "end_of_batch="
+
+static int is_check_result_batch(const char *buf, size_t len)
+{
+	return len >= sizeof(CHECK_RESULT_BATCH_MAGIC) - 1 &&
+	       !memcmp(buf, CHECK_RESULT_BATCH_MAGIC, sizeof(CHECK_RESULT_BATCH_MAGIC) - 1);
+}
+
+static void process_spooled_result(check_result *cr, unsigned long *results)
+{
+	/* do we have the minimum amount of data? */
+	if (cr->host_name != NULL && cr->output != NULL) {
+		process_check_result(cr);
+		(*results)++;
+	}
+	free_check_result(cr);
+	init_check_result(cr);
+	cr->engine = &nagios_spool_check_engine;
+}
+
+static int process_check_result_batch(const char *fname, const char *buf, size_t len)
+{
+	const char *p, *eol, *eq, *trailer;
+	unsigned long expected, results = 0;
+	time_t current_time;
+	check_result cr;
+
+	/* the end of batch line must be there, in full */
+	if (buf[len - 1] != '\n') {
+		trailer = NULL;
+	} else {
+		for (trailer = buf + len - 1; trailer > buf && trailer[-1] != '\n'; trailer--)
+			;
+		if (trailer < buf + sizeof(CHECK_RESULT_BATCH_MAGIC) - 1 ||
+		    strncmp(trailer, CHECK_RESULT_BATCH_END, sizeof(CHECK_RESULT_BATCH_END) - 1))
+			trailer = NULL;
+	}
+	if (trailer == NULL) {
+		nm_log(NSLOG_RUNTIME_WARNING,
+		       "Warning: Check result batch file '%s' is incomplete. Dropping the results in it.\n", fname);
+		return ERROR;
+	}
+	expected = strtoul(trailer + sizeof(CHECK_RESULT_BATCH_END) - 1, NULL, 10);
+
+	time(&current_time);
+	init_check_result(&cr);
+	cr.engine = &nagios_spool_check_engine;
+
+	for (p = buf + sizeof(CHECK_RESULT_BATCH_MAGIC) - 1; p < trailer; p = eol + 1) {
+		/* every line before the trailer ends with a newline */
+		eol = memchr(p, '\n', trailer - p);
+
+		/* empty line indicates end of record */
+		if (eol == p) {
+			process_spooled_result(&cr, &results);
+			continue;
+		}
+
+		/* skip comments */
+		if (*p == '#' || (eq = memchr(p, '=', eol - p)) == NULL)
+			continue;
+
+		if (eq - p == sizeof("file_time") - 1 && !memcmp(p, "file_time", eq - p)) {
+			/* batch is too old - ignore the check results it contains */
+			if (max_check_result_file_age > 0 && (current_time - (time_t)(strtoul(eq + 1, NULL, 0)) > max_check_result_file_age))
+				break;
+			continue;
+		}
+
+		set_spooled_check_result_var(&cr, p, eq - p, eq + 1, eol - eq - 1);
+	}
+
+	/* the last result needn't be followed by an empty line */
+	if (p >= trailer)
+		process_spooled_result(&cr, &results);
+	free_check_result(&cr);
+
+	if (p >= trailer && results != expected)
+		nm_log(NSLOG_RUNTIME_WARNING,
+		       "Warning: Check result batch file '%s' should have had %lu results, but %lu were found.\n", fname, expected, results);
+
+	log_debug_info(DEBUGL_CHECKS, 1, "Processed %lu check results from batch file '%s'\n", results, fname);
+	return OK;
+}
+
+
 /* reads check result(s) from a file */
 int process_check_result_file(char *fname)
 {
@@ -344,7 +693,6 @@ int process_check_result_file(char *fname)
 	char *input = NULL;
 	char *var = NULL;
 	char *val = NULL;
-	char *v1 = NULL, *v2 = NULL;
 	time_t current_time;
 	check_result cr;
 
@@ -367,6 +715,14 @@ int process_check_result_file(char *fname)
 		return ERROR;
 	}
 
+	/* batch files are read in a different way altogether */
+	if (is_check_result_batch(thefile->mmap_buf, thefile->file_size)) {
+		process_check_result_batch(fname, thefile->mmap_buf, thefile->file_size);
+		mmap_fclose(thefile);
+		delete_check_result_file(fname);
+		return OK;
+	}
+
 	/* read in all lines from the file */
 	while (1) {
 
@@ -413,43 +769,8 @@ int process_check_result_file(char *fname)
 		}
 
 		/* else we have check result data */
-		else {
-			if (!strcmp(var, "host_name"))
-				cr.host_name = nm_strdup(val);
-			else if (!strcmp(var, "service_description")) {
-				cr.service_description = nm_strdup(val);
-				cr.object_check_type = SERVICE_CHECK;
-			} else if (!strcmp(var, "check_type"))
-				cr.check_type = atoi(val);
-			else if (!strcmp(var, "check_options"))
-				cr.check_options = atoi(val);
-			else if (!strcmp(var, "scheduled_check"))
-				cr.scheduled_check = atoi(val);
-			else if (!strcmp(var, "latency"))
-				cr.latency = strtod(val, NULL);
-			else if (!strcmp(var, "start_time")) {
-				if ((v1 = strtok(val, ".")) == NULL)
-					continue;
-				if ((v2 = strtok(NULL, "\n")) == NULL)
-					continue;
-				cr.start_time.tv_sec = strtoul(v1, NULL, 0);
-				cr.start_time.tv_usec = strtoul(v2, NULL, 0);
-			} else if (!strcmp(var, "finish_time")) {
-				if ((v1 = strtok(val, ".")) == NULL)
-					continue;
-				if ((v2 = strtok(NULL, "\n")) == NULL)
-					continue;
-				cr.finish_time.tv_sec = strtoul(v1, NULL, 0);
-				cr.finish_time.tv_usec = strtoul(v2, NULL, 0);
-			} else if (!strcmp(var, "early_timeout"))
-				cr.early_timeout = atoi(val);
-			else if (!strcmp(var, "exited_ok"))
-				cr.exited_ok = atoi(val);
-			else if (!strcmp(var, "return_code"))
-				cr.return_code = atoi(val);
-			else if (!strcmp(var, "output"))
-				cr.output = nm_strdup(val);
-		}
+		else
+			set_spooled_check_result_var(&cr, var, strlen(var), val, strlen(val));
 	}
 
 	/* do we have the minimum amount of data? */
@@ -514,6 +835,7 @@ int init_check_result(check_result *info)
 	info->output = NULL;
 	info->source = NULL;
 	info->engine = NULL;
+	info->parsed = NULL;
 
 	return OK;
 }
@@ -530,6 +852,12 @@ int free_check_result(check_result *info)
 	nm_free(info->service_description);
 	nm_free(info->output);
 	nm_free(info->source);
+	if (info->parsed) {
+		nm_free(info->parsed->short_output);
+		nm_free(info->parsed->long_output);
+		nm_free(info->parsed->perf_data);
+		nm_free(info->parsed);
+	}
 
 	return OK;
 }
@@ -69,6 +69,7 @@ typedef struct check_result {
 	struct rusage rusage;			/* resource usage by this check */
 	struct check_engine *engine;	/* where did we get this check from? */
 	void *source;					/* engine handles this */
+	struct check_output *parsed;			/* output already split up by a parser thread, or NULL */
 } check_result;
 
 struct check_output {
@@ -78,9 +79,11 @@ struct check_output {
 };
 
 void checks_init(void); /* Init check execution, schedule events */
+void checks_deinit(void); /* Stop watching the check result spool */
 
 int parse_check_output(char *, char **, char **, char **, int, int);
 struct check_output *parse_output(const char *, struct check_output *);
+int parse_check_result_output(check_result *, char **, char **, char **);
 
 int process_check_result_queue(char *);
 int process_check_result_file(char *);
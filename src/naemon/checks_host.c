@@ -1,5 +1,8 @@
 #include "checks.h"
 #include "checks_host.h"
+#include "checks_leveling.h"
+#include "checks_parser.h"
+#include "wproc_usage.h"
 #include "config.h"
 #include "comments.h"
 #include "common.h"
@@ -35,10 +38,11 @@ static int handle_host_state(host *hst, int *alert_recorded);
 
 /* Extra features */
 static void check_host_result_freshness(struct nm_event_execution_properties *evprop);
-static void check_for_orphaned_hosts_eventhandler(struct nm_event_execution_properties *evprop);
+static void handle_orphaned_host_check(host *hst);
 
 /* Status functions, immutable */
 static int is_host_result_fresh(host *temp_host, time_t current_time, int log_this);
+static time_t get_host_result_expiration(host *temp_host, int *threshold);
 static int determine_host_reachability(host *hst);
 
 /******************************************************************************
@@ -60,16 +64,13 @@ void checks_init_hosts(void)
 		update_host_status(temp_host, FALSE);
 
 		/* schedule a new host check event */
-		schedule_next_host_check(temp_host, ranged_urand(0, get_host_check_interval_s(temp_host)), CHECK_OPTION_NONE);
-	}
+		schedule_next_host_check(temp_host, checks_leveling_initial_delay(get_host_check_interval_s(temp_host)), CHECK_OPTION_NONE);
 
-	/* add a host result "freshness" check event */
-	if (check_host_freshness == TRUE) {
-		schedule_event(host_freshness_check_interval, check_host_result_freshness, NULL);
-	}
+		/* check the freshness of its results when they're due to go stale */
+		schedule_host_freshness_check(temp_host);
 
-	if (check_orphaned_hosts == TRUE) {
-		schedule_event(DEFAULT_ORPHAN_CHECK_INTERVAL, check_for_orphaned_hosts_eventhandler, NULL);
+		/* the state may have come from the retention data */
+		update_hostdependencies(temp_host);
 	}
 }
 
@@ -97,6 +98,8 @@ void schedule_next_host_check(host *hst, time_t delay, int options)
 	hst->check_options = options;
 	hst->next_check = delay + current_time;
 	hst->next_check_event = schedule_event(delay, handle_host_check_event, (void*)hst);
+	if (hst->next_check_event != NULL)
+		checks_leveling_add(hst->next_check);
 
 	/* update the status log, since next_check and check_options is updated */
 	update_host_status(hst, FALSE);
@@ -108,6 +111,24 @@ void schedule_host_check(host *hst, time_t check_time, int options)
 	schedule_next_host_check( hst, check_time-time(NULL), options);
 }
 
+void schedule_host_freshness_check(host *hst)
+{
+	time_t current_time, expiration_time;
+
+	if (hst->freshness_check_event != NULL) {
+		destroy_event(hst->freshness_check_event);
+		hst->freshness_check_event = NULL;
+	}
+
+	if (check_host_freshness == FALSE || hst->check_freshness == FALSE)
+		return;
+
+	/* results are stale once their expiration time is in the past */
+	time(&current_time);
+	expiration_time = get_host_result_expiration(hst, NULL);
+	hst->freshness_check_event = schedule_event(expiration_time < current_time ? 0 : expiration_time - current_time + 1, check_host_result_freshness, hst);
+}
+
 static void handle_host_check_event(struct nm_event_execution_properties *evprop)
 {
 	host *hst = (host *)evprop->user_data;
@@ -118,6 +139,9 @@ static void handle_host_check_event(struct nm_event_execution_properties *evprop
 
 	int result = OK;
 
+	/* the check is no longer scheduled, whether it runs or not */
+	checks_leveling_remove(hst->next_check);
+
 	if(evprop->execution_type == EVENT_EXEC_NORMAL) {
 		/* get event latency */
 		gettimeofday(&tv, NULL);
@@ -137,7 +161,7 @@ static void handle_host_check_event(struct nm_event_execution_properties *evprop
 		 * check_interval
 		 */
 		if (hst->check_interval != 0.0)
-			schedule_next_host_check(hst, get_host_check_interval_s(hst), CHECK_OPTION_NONE);
+			schedule_next_host_check(hst, checks_leveling_interval_delay(get_host_check_interval_s(hst)), CHECK_OPTION_NONE);
 
 		/* Don't run checks if checks are disabled, unless foreced */
 		if (execute_host_checks == FALSE && !(options & CHECK_OPTION_FORCE_EXECUTION)) {
@@ -175,6 +199,8 @@ static int run_async_host_check(host *hst, int check_options, double latency)
 	nagios_macros mac;
 	char *raw_command = NULL;
 	char *processed_command = NULL;
+	char *argv = NULL;
+	size_t argv_len = 0;
 	struct timeval start_time, end_time;
 	check_result *cr;
 	int runchk_result = OK;
@@ -259,7 +285,8 @@ static int run_async_host_check(host *hst, int check_options, double latency)
 	}
 
 	/* process any macros contained in the argument */
-	process_macros_r(&mac, raw_command, &processed_command, macro_options);
+	if (expand_argv_template_r(&mac, hst->check_command_ptr->argv_template, &processed_command, &argv, &argv_len, macro_options) != OK)
+		process_macros_r(&mac, raw_command, &processed_command, macro_options);
 	nm_free(raw_command);
 	if (processed_command == NULL) {
 		clear_volatile_macros_r(&mac);
@@ -295,10 +322,11 @@ static int run_async_host_check(host *hst, int check_options, double latency)
 		clear_volatile_macros_r(&mac);
 		free_check_result(cr);
 		nm_free(processed_command);
+		nm_free(argv);
 		return OK;
 	}
 
-	runchk_result = wproc_run_callback(processed_command, host_check_timeout, handle_worker_host_check, (void*)cr, &mac);
+	runchk_result = wproc_run_check(processed_command, argv, argv_len, host_check_timeout, handle_worker_host_check, (void*)cr, &mac);
 	if (runchk_result == ERROR) {
 		nm_log(NSLOG_RUNTIME_ERROR,
 		       "Unable to send check for host '%s' to worker (ret=%d)\n", hst->name, runchk_result);
@@ -313,6 +341,7 @@ static int run_async_host_check(host *hst, int check_options, double latency)
 
 	clear_volatile_macros_r(&mac);
 	nm_free(processed_command);
+	nm_free(argv);
 
 	return OK;
 }
@@ -383,7 +412,7 @@ int update_host_state_post_check(struct host *hst, struct check_result *cr)
 	nm_free(hst->perf_data);
 
 	/* parse check output to get: (1) short output, (2) long output, (3) perf data */
-	parse_check_output(cr->output, &hst->plugin_output, &hst->long_plugin_output, &hst->perf_data, TRUE, FALSE);
+	parse_check_result_output(cr, &hst->plugin_output, &hst->long_plugin_output, &hst->perf_data);
 
 	/* make sure we have some data */
 	if (hst->plugin_output == NULL) {
@@ -482,7 +511,7 @@ int update_host_state_post_check(struct host *hst, struct check_result *cr)
 
 	if (hst->current_attempt >= hst->max_attempts)
 		hst->state_type = HARD_STATE;
-	hst->current_state = result;
+	set_host_current_state(hst, result);
 
 	/* record the time the last state ended */
 	switch (hst->last_state) {
@@ -547,6 +576,12 @@ int handle_async_host_check_result(host *temp_host, check_result *cr)
 	/* process the host check result */
 	process_host_check_result(temp_host, &pre, &alert_recorded);
 
+	/* the hosts depending on this one go by its new state */
+	update_hostdependencies(temp_host);
+
+	/* the results are fresh for a while now */
+	schedule_host_freshness_check(temp_host);
+
 	nm_free(pre.plugin_output);
 	nm_free(pre.long_plugin_output);
 	nm_free(pre.perf_data);
@@ -593,6 +628,9 @@ static void handle_worker_host_check(wproc_result *wpres, void *arg, int flags)
 	hst = find_host(cr->host_name);
 	if (hst && wpres) {
 		hst->is_executing = FALSE;
+		wproc_usage_add(WPROC_USAGE_HOSTS, hst->name, wpres);
+		if (hst->check_command_ptr)
+			wproc_usage_add(WPROC_USAGE_COMMANDS, hst->check_command_ptr->name, wpres);
 		memcpy(&cr->rusage, &wpres->rusage, sizeof(wpres->rusage));
 		cr->start_time.tv_sec = wpres->start.tv_sec;
 		cr->start_time.tv_usec = wpres->start.tv_usec;
@@ -616,8 +654,11 @@ static void handle_worker_host_check(wproc_result *wpres, void *arg, int flags)
 		cr->exited_ok = wpres->exited_ok;
 		cr->engine = NULL;
 		cr->source = wpres->source;
-		process_check_result(cr);
+		checks_parser_submit(cr);
+		return;
 	}
+	if (hst && (flags & WPROC_ORPHANED))
+		handle_orphaned_host_check(hst);
 	free_check_result(cr);
 	free(cr);
 }
@@ -685,7 +726,7 @@ static int process_host_check_result(host *hst, host *prev, int *alert_recorded)
 		if (hst->current_state == STATE_UP) {
 
 			/* set the current state */
-			hst->current_state = STATE_UP;
+			set_host_current_state(hst, STATE_UP);
 
 			/* set the state type */
 			/* set state type to HARD for passive checks and active checks that were previously in a HARD STATE */
@@ -741,7 +782,7 @@ static int process_host_check_result(host *hst, host *prev, int *alert_recorded)
 			/* make a determination of the host's state */
 			/* translate host state between DOWN/UNREACHABLE (only for passive checks if enabled) */
 			if (hst->check_type == CHECK_TYPE_ACTIVE || translate_passive_host_checks == TRUE)
-				hst->current_state = determine_host_reachability(hst);
+				set_host_current_state(hst, determine_host_reachability(hst));
 		}
 	}
 
@@ -785,7 +826,7 @@ static int process_host_check_result(host *hst, host *prev, int *alert_recorded)
 			/* make a (in some cases) preliminary determination of the host's state */
 			/* translate host state between DOWN/UNREACHABLE (for passive checks only if enabled) */
 			if (hst->check_type == CHECK_TYPE_ACTIVE || translate_passive_host_checks == TRUE)
-				hst->current_state = determine_host_reachability(hst);
+				set_host_current_state(hst, determine_host_reachability(hst));
 
 			/* propagate checks to immediate parents if they are UP */
 			/* we do this because a parent host (or grandparent) may have gone down and blocked our route */
@@ -1014,113 +1055,82 @@ static int handle_host_state(host *hst, int *alert_recorded)
  ******************************  EXTRA FEATURES  ******************************
  ******************************************************************************/
 
-/* event handler for checking freshness of host results */
+/*
+ * event handler for checking the freshness of a host's results, run
+ * when they were due to go stale. hosts that can't be freshened right
+ * now are looked at again after the freshness check interval.
+ */
 static void check_host_result_freshness(struct nm_event_execution_properties *evprop)
 {
-	host *temp_host = NULL;
+	host *temp_host = (host *)evprop->user_data;
 	time_t current_time = 0L;
 
+	/* When the callback is called, the pointer to the timed event is invalid */
+	temp_host->freshness_check_event = NULL;
+
 	if(evprop->execution_type == EVENT_EXEC_NORMAL) {
 		/* get the current time */
 		time(&current_time);
 
-		/* Reschedule, since recurring */
-		schedule_event(host_freshness_check_interval, check_host_result_freshness, evprop->user_data);
-
-		log_debug_info(DEBUGL_CHECKS, 2, "Attempting to check the freshness of host check results...\n");
+		log_debug_info(DEBUGL_CHECKS, 2, "Attempting to check the freshness of host '%s'...\n", temp_host->name);
 
-		/* bail out if we're not supposed to be checking freshness */
+		/* bail out if we're not supposed to be checking freshness, enabling it schedules this again */
 		if (check_host_freshness == FALSE) {
 			log_debug_info(DEBUGL_CHECKS, 2, "Host freshness checking is disabled.\n");
 			return;
 		}
 
+		/*
+		 * skip hosts that have both active and passive checks disabled,
+		 * that are currently executing (problems here will be caught by
+		 * orphaned host check), that are already being freshened or that
+		 * are outside of their check period, for now
+		 */
+		if ((temp_host->checks_enabled == FALSE && temp_host->accept_passive_checks == FALSE) ||
+		    temp_host->is_executing == TRUE ||
+		    temp_host->is_being_freshened == TRUE ||
+		    check_time_against_period(current_time, temp_host->check_period_ptr) == ERROR) {
+			temp_host->freshness_check_event = schedule_event(host_freshness_check_interval, check_host_result_freshness, temp_host);
+			return;
+		}
 
-		/* check all hosts... */
-		for (temp_host = host_list; temp_host != NULL; temp_host = temp_host->next) {
-
-			/* skip hosts we shouldn't be checking for freshness */
-			if (temp_host->check_freshness == FALSE)
-				continue;
-
-			/* skip hosts that have both active and passive checks disabled */
-			if (temp_host->checks_enabled == FALSE && temp_host->accept_passive_checks == FALSE)
-				continue;
-
-			/* skip hosts that are currently executing (problems here will be caught by orphaned host check) */
-			if (temp_host->is_executing == TRUE)
-				continue;
-
-			/* skip hosts that are already being freshened */
-			if (temp_host->is_being_freshened == TRUE)
-				continue;
-
-			/* see if the time is right... */
-			if (check_time_against_period(current_time, temp_host->check_period_ptr) == ERROR)
-				continue;
+		/* the results for the last check of this host are stale */
+		if (is_host_result_fresh(temp_host, current_time, TRUE) == FALSE) {
 
-			/* the results for the last check of this host are stale */
-			if (is_host_result_fresh(temp_host, current_time, TRUE) == FALSE) {
+			/* set the freshen flag */
+			temp_host->is_being_freshened = TRUE;
 
-				/* set the freshen flag */
-				temp_host->is_being_freshened = TRUE;
+			/* schedule an immediate forced check of the host */
+			schedule_next_host_check(temp_host, 0, CHECK_OPTION_FORCE_EXECUTION | CHECK_OPTION_FRESHNESS_CHECK);
 
-				/* schedule an immediate forced check of the host */
-				schedule_next_host_check(temp_host, 0, CHECK_OPTION_FORCE_EXECUTION | CHECK_OPTION_FRESHNESS_CHECK);
-			}
+			/* its result schedules this again, unless it never comes */
+			temp_host->freshness_check_event = schedule_event(host_freshness_check_interval, check_host_result_freshness, temp_host);
+			return;
 		}
+
+		/* the results got fresher since this was scheduled */
+		schedule_host_freshness_check(temp_host);
 	}
 }
 
-/* check for hosts that never returned from a check... */
-static void check_for_orphaned_hosts_eventhandler(struct nm_event_execution_properties *evprop)
+/* handles a host check whose results never came back from its worker... */
+static void handle_orphaned_host_check(host *hst)
 {
-	host *temp_host = NULL;
-	time_t current_time = 0L;
-	time_t expected_time = 0L;
-
-	if(evprop->execution_type == EVENT_EXEC_NORMAL) {
-		schedule_event(DEFAULT_ORPHAN_CHECK_INTERVAL, check_for_orphaned_hosts_eventhandler, evprop->user_data);
+	if (check_orphaned_hosts == FALSE || hst->is_executing == FALSE)
+		return;
 
-		/* get the current time */
-		time(&current_time);
-
-		/* check all hosts... */
-		for (temp_host = host_list; temp_host != NULL; temp_host = temp_host->next) {
-
-			/* skip hosts that don't have a set check interval (on-demand checks are missed by the orphan logic) */
-			if (temp_host->next_check == (time_t)0L)
-				continue;
-
-			/* skip hosts that are not currently executing */
-			if (temp_host->is_executing == FALSE)
-				continue;
-
-			/* determine the time at which the check results should have come in (allow 10 minutes slack time) */
-			expected_time = (time_t)(temp_host->next_check + temp_host->latency + host_check_timeout + check_reaper_interval + 600);
+	/* log a warning */
+	nm_log(NSLOG_RUNTIME_WARNING,
+	       "Warning: The check of host '%s' looks like it was orphaned (results never came back).  I'm scheduling an immediate check of the host...\n", hst->name);
 
-			/* this host was supposed to have executed a while ago, but for some reason the results haven't come back in... */
-			if (expected_time < current_time) {
+	log_debug_info(DEBUGL_CHECKS, 1, "Host '%s' was orphaned, so we're scheduling an immediate check...\n", hst->name);
 
-				/* log a warning */
-				nm_log(NSLOG_RUNTIME_WARNING,
-				       "Warning: The check of host '%s' looks like it was orphaned (results never came back).  I'm scheduling an immediate check of the host...\n", temp_host->name);
-
-				log_debug_info(DEBUGL_CHECKS, 1, "Host '%s' was orphaned, so we're scheduling an immediate check...\n", temp_host->name);
-
-				/* decrement the number of running host checks */
-				if (currently_running_host_checks > 0)
-					currently_running_host_checks--;
-
-				/* disable the executing flag */
-				temp_host->is_executing = FALSE;
-
-				/* schedule an immediate check of the host */
-				schedule_next_host_check(temp_host, 0, CHECK_OPTION_NONE);
-			}
+	/* disable the executing flag, the number of running host checks is already down */
+	hst->is_executing = FALSE;
 
-		}
-	}
+	/* schedule an immediate check of the host, unless it's only checked on demand */
+	if (hst->next_check != (time_t)0L)
+		schedule_next_host_check(hst, 0, CHECK_OPTION_NONE);
 }
 
 /******************************************************************************
@@ -1133,15 +1143,23 @@ int check_host_dependencies(host *hst, int dependency_type)
 	hostdependency *temp_dependency = NULL;
 	objectlist *list;
 	host *temp_host = NULL;
-	int state = STATE_UP;
+	unsigned int failing, conditional;
 	time_t current_time = 0L;
 
 	if (dependency_type == NOTIFICATION_DEPENDENCY) {
 		list = hst->notify_deps;
+		failing = hst->failing_notify_deps;
+		conditional = hst->conditional_notify_deps;
 	} else {
 		list = hst->exec_deps;
+		failing = hst->failing_exec_deps;
+		conditional = hst->conditional_exec_deps;
 	}
 
+	/* without timeperiods or inherited dependencies, the failing ones are all that matter */
+	if (!conditional)
+		return failing ? DEPENDENCIES_FAILED : DEPENDENCIES_OK;
+
 	/* check all dependencies... */
 	for (; list; list = list->next) {
 		temp_dependency = (hostdependency *)list->object_ptr;
@@ -1155,14 +1173,8 @@ int check_host_dependencies(host *hst, int dependency_type)
 		if (temp_dependency->dependency_period != NULL && check_time_against_period(current_time, temp_dependency->dependency_period_ptr) == ERROR)
 			return FALSE;
 
-		/* get the status to use (use last hard state if its currently in a soft state) */
-		if (temp_host->state_type == SOFT_STATE && soft_state_dependencies == FALSE)
-			state = temp_host->last_hard_state;
-		else
-			state = temp_host->current_state;
-
 		/* is the host we depend on in state that fails the dependency tests? */
-		if (flag_isset(temp_dependency->failure_options, 1 << state))
+		if (temp_dependency->failing)
 			return DEPENDENCIES_FAILED;
 
 		/* immediate dependencies ok at this point - check parent dependencies if necessary */
@@ -1175,23 +1187,13 @@ int check_host_dependencies(host *hst, int dependency_type)
 	return DEPENDENCIES_OK;
 }
 
-/* checks to see if a hosts's check results are fresh */
-static int is_host_result_fresh(host *temp_host, time_t current_time, int log_this)
+/* gets the time a host's check results go stale after, and optionally the threshold used */
+static time_t get_host_result_expiration(host *temp_host, int *threshold)
 {
 	time_t expiration_time = 0L;
 	int freshness_threshold = 0;
-	int days = 0;
-	int hours = 0;
-	int minutes = 0;
-	int seconds = 0;
-	int tdays = 0;
-	int thours = 0;
-	int tminutes = 0;
-	int tseconds = 0;
 	double interval = 0;
 
-	log_debug_info(DEBUGL_CHECKS, 2, "Checking freshness of host '%s'...\n", temp_host->name);
-
 	/* use user-supplied freshness threshold or auto-calculate a freshness threshold to use? */
 	if (temp_host->freshness_threshold == 0) {
 		if (temp_host->state_type == HARD_STATE || temp_host->current_state == STATE_OK) {
@@ -1243,6 +1245,30 @@ static int is_host_result_fresh(host *temp_host, time_t current_time, int log_th
 		}
 	}
 
+	if (threshold != NULL)
+		*threshold = freshness_threshold;
+
+	return expiration_time;
+}
+
+/* checks to see if a hosts's check results are fresh */
+static int is_host_result_fresh(host *temp_host, time_t current_time, int log_this)
+{
+	time_t expiration_time = 0L;
+	int freshness_threshold = 0;
+	int days = 0;
+	int hours = 0;
+	int minutes = 0;
+	int seconds = 0;
+	int tdays = 0;
+	int thours = 0;
+	int tminutes = 0;
+	int tseconds = 0;
+
+	log_debug_info(DEBUGL_CHECKS, 2, "Checking freshness of host '%s'...\n", temp_host->name);
+
+	expiration_time = get_host_result_expiration(temp_host, &freshness_threshold);
+
 	log_debug_info(DEBUGL_CHECKS, 2, "HBC: %d, PS: %lu, ES: %lu, LC: %lu, CT: %lu, ET: %lu\n", temp_host->has_been_checked, (unsigned long)program_start, (unsigned long)event_start, (unsigned long)temp_host->last_check, (unsigned long)current_time, (unsigned long)expiration_time);
 
 	/* the results for the last check of this host are stale */
@@ -1265,22 +1291,10 @@ static int is_host_result_fresh(host *temp_host, time_t current_time, int log_th
 	return TRUE;
 }
 
-static gboolean is_host_up(gpointer _name, gpointer _hst, gpointer user_data)
-{
-	host *hst = (host *)_hst;
-	gboolean *retval = (gboolean *)user_data;
-	if (hst->current_state == STATE_UP) {
-		*retval = TRUE;
-		return TRUE;
-	}
-	return FALSE;
-}
-
 /* determination of the host's state based on route availability*/
 /* used only to determine difference between DOWN and UNREACHABLE states */
 static int determine_host_reachability(host *hst)
 {
-	gboolean *is_up_result;
 	log_debug_info(DEBUGL_CHECKS, 2, "Determining state of host '%s': current state=%d (%s)\n", hst->name, hst->current_state, host_state_name(hst->current_state));
 
 	/* host is UP - no translation needed */
@@ -1292,9 +1306,8 @@ static int determine_host_reachability(host *hst)
 	if (g_tree_nnodes(hst->parent_hosts) == 0)
 		return STATE_DOWN;
 
-	is_up_result = FALSE;
-	g_tree_foreach(hst->parent_hosts, is_host_up, &is_up_result);
-	if (is_up_result)
+	/* any parent being UP means there's a route to the host */
+	if (hst->up_parents > 0)
 		return STATE_DOWN;
 
 	log_debug_info(DEBUGL_CHECKS, 2, "No parents were up, so host is UNREACHABLE.\n");
@@ -16,6 +16,9 @@ void checks_init_hosts(void);
 void schedule_next_host_check(host *hst, time_t delay, int options);
 void schedule_host_check(host *hst, time_t check_time, int options); /* DEPRECATED */
 
+/* Schedule the freshness check of a host for when its results go stale */
+void schedule_host_freshness_check(host *hst);
+
 /* Result handling, Update a host given a check result */
 int handle_async_host_check_result(host *temp_host, check_result *queued_check_result);
 
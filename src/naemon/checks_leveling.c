@@ -0,0 +1,277 @@
+#include "config.h"
+#include "checks_leveling.h"
+#include "defaults.h"
+#include "logging.h"
+#include "nm_alloc.h"
+#include "query-handler.h"
+#include "lib/nsock.h"
+#include "lib/nsutils.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The occupancy histogram is a ring of one counter per second, so a
+ * check is counted in the slot of (time % CHECKS_LEVELING_SLOTS). Checks
+ * further ahead than that wrap around, which only makes the count for
+ * that slot a bit pessimistic. A min segment tree on top of the ring
+ * finds the least loaded second of any window in O(log n).
+ */
+#define CHECKS_LEVELING_BITS 17
+#define CHECKS_LEVELING_SLOTS (1U << CHECKS_LEVELING_BITS)
+#define CHECKS_LEVELING_MASK (CHECKS_LEVELING_SLOTS - 1)
+
+int check_load_leveling = DEFAULT_CHECK_LOAD_LEVELING;
+int check_load_leveling_window = DEFAULT_CHECK_LOAD_LEVELING_WINDOW;
+
+/* tree[1] is the root, tree[SLOTS + i] holds the count for slot i */
+static unsigned int *tree = NULL;
+static unsigned long placed, moved, displacement;
+
+static inline unsigned int slot_of(time_t when)
+{
+	return (unsigned int)when & CHECKS_LEVELING_MASK;
+}
+
+static void tree_update(unsigned int slot, int delta)
+{
+	unsigned int node = slot + CHECKS_LEVELING_SLOTS;
+
+	if (!tree)
+		tree = nm_calloc(2 * CHECKS_LEVELING_SLOTS, sizeof(*tree));
+
+	if (delta < 0 && !tree[node])
+		return;
+	tree[node] += delta;
+	for (node >>= 1; node; node >>= 1) {
+		unsigned int l = tree[2 * node], r = tree[2 * node + 1];
+		tree[node] = l < r ? l : r;
+	}
+}
+
+/* smallest count within the slots [lo, hi], lo <= hi */
+static unsigned int tree_min(unsigned int lo, unsigned int hi)
+{
+	unsigned int min = ~0U;
+
+	for (lo += CHECKS_LEVELING_SLOTS, hi += CHECKS_LEVELING_SLOTS + 1; lo < hi; lo >>= 1, hi >>= 1) {
+		if ((lo & 1) && tree[lo] < min)
+			min = tree[lo];
+		if (lo & 1)
+			lo++;
+		if ((hi & 1) && tree[--hi] < min)
+			min = tree[hi];
+	}
+	return min;
+}
+
+/* first slot within [lo, hi] with a count of at most max, or -1 */
+static int tree_find(unsigned int node, unsigned int nlo, unsigned int nhi, unsigned int lo, unsigned int hi, unsigned int max)
+{
+	unsigned int mid;
+	int ret;
+
+	if (nhi < lo || nlo > hi || tree[node] > max)
+		return -1;
+	if (nlo == nhi)
+		return nlo;
+	mid = nlo + (nhi - nlo) / 2;
+	ret = tree_find(2 * node, nlo, mid, lo, hi, max);
+	if (ret < 0)
+		ret = tree_find(2 * node + 1, mid + 1, nhi, lo, hi, max);
+	return ret;
+}
+
+/* the same operations on a range of absolute times, which may wrap the ring */
+static unsigned int range_min(time_t earliest, time_t latest)
+{
+	unsigned int lo = slot_of(earliest), hi = slot_of(latest), min;
+
+	if (lo <= hi)
+		return tree_min(lo, hi);
+	min = tree_min(lo, CHECKS_LEVELING_MASK);
+	hi = tree_min(0, hi);
+	return hi < min ? hi : min;
+}
+
+static time_t range_find(time_t earliest, time_t latest, unsigned int max)
+{
+	unsigned int lo = slot_of(earliest), hi = slot_of(latest);
+	int slot;
+
+	if (lo <= hi) {
+		slot = tree_find(1, 0, CHECKS_LEVELING_MASK, lo, hi, max);
+	} else {
+		slot = tree_find(1, 0, CHECKS_LEVELING_MASK, lo, CHECKS_LEVELING_MASK, max);
+		if (slot < 0)
+			slot = tree_find(1, 0, CHECKS_LEVELING_MASK, 0, hi, max);
+	}
+	if (slot < 0)
+		return -1;
+	return earliest + (((unsigned int)slot - lo) & CHECKS_LEVELING_MASK);
+}
+
+void checks_leveling_add(time_t when)
+{
+	tree_update(slot_of(when), 1);
+}
+
+void checks_leveling_remove(time_t when)
+{
+	if (tree)
+		tree_update(slot_of(when), -1);
+}
+
+time_t checks_leveling_place(time_t ideal, time_t earliest, time_t latest)
+{
+	time_t when;
+	unsigned int min;
+
+	if (!tree)
+		tree = nm_calloc(2 * CHECKS_LEVELING_SLOTS, sizeof(*tree));
+
+	if (latest < earliest)
+		latest = earliest;
+	if (latest - earliest >= CHECKS_LEVELING_SLOTS)
+		latest = earliest + CHECKS_LEVELING_SLOTS - 1;
+	if (ideal < earliest)
+		ideal = earliest;
+	else if (ideal > latest)
+		ideal = latest;
+
+	min = range_min(earliest, latest);
+	when = ideal;
+	if (tree[slot_of(ideal) + CHECKS_LEVELING_SLOTS] > min) {
+		/* prefer moving checks later, so intervals aren't shortened */
+		when = range_find(ideal, latest, min);
+		if (when < 0)
+			when = range_find(earliest, ideal, min);
+		if (when < 0)
+			when = ideal;
+	}
+
+	placed++;
+	if (when != ideal) {
+		moved++;
+		displacement += when > ideal ? when - ideal : ideal - when;
+	}
+	return when;
+}
+
+time_t checks_leveling_initial_delay(time_t interval)
+{
+	time_t now;
+
+	if (!check_load_leveling || interval <= 0)
+		return ranged_urand(0, interval);
+
+	/* the first check may go anywhere within the first interval */
+	now = time(NULL);
+	return checks_leveling_place(now + ranged_urand(0, interval), now, now + interval - 1) - now;
+}
+
+time_t checks_leveling_interval_delay(time_t interval)
+{
+	time_t now, ideal, jitter;
+
+	if (!check_load_leveling || interval <= 0)
+		return interval;
+
+	now = time(NULL);
+	ideal = now + interval;
+	jitter = interval * check_load_leveling_window / 200;
+	if (jitter >= interval)
+		jitter = interval - 1;
+	return checks_leveling_place(ideal, ideal - jitter, ideal + jitter) - now;
+}
+
+void checks_leveling_stats(time_t from, unsigned int seconds, struct check_leveling_stats *st)
+{
+	unsigned int i, count;
+	double sum_sq = 0.0;
+
+	memset(st, 0, sizeof(*st));
+	st->placed = placed;
+	st->moved = moved;
+	st->displacement = displacement;
+	if (seconds > CHECKS_LEVELING_SLOTS)
+		seconds = CHECKS_LEVELING_SLOTS;
+	if (!seconds)
+		return;
+
+	st->seconds = seconds;
+	st->min = ~0U;
+	for (i = 0; i < seconds; i++) {
+		count = tree ? tree[slot_of(from + i) + CHECKS_LEVELING_SLOTS] : 0;
+		st->checks += count;
+		sum_sq += (double)count * count;
+		if (count < st->min)
+			st->min = count;
+		if (count > st->max)
+			st->max = count;
+	}
+	st->mean = (double)st->checks / seconds;
+	st->stddev = sqrt(fabs(sum_sq / seconds - st->mean * st->mean));
+}
+
+static int checks_leveling_qh(int sd, char *buf, unsigned int len)
+{
+	struct check_leveling_stats st;
+	unsigned int seconds = 300, i;
+	time_t now = time(NULL);
+	char *space;
+
+	if (!*buf || !strcmp(buf, "help")) {
+		nsock_printf_nul(sd, "Query handler for check scheduling distribution.\n"
+		                 "Available commands:\n"
+		                 "  stats [seconds]       Checks per second over the coming 300 or [seconds] seconds\n"
+		                 "  histogram [seconds]   Number of checks scheduled in each of those seconds\n"
+		                );
+		return 0;
+	}
+
+	if ((space = strchr(buf, ' '))) {
+		*space++ = 0;
+		seconds = strtoul(space, NULL, 10);
+		if (!seconds || seconds > CHECKS_LEVELING_SLOTS)
+			return 400;
+	}
+
+	if (!strcmp(buf, "stats")) {
+		checks_leveling_stats(now, seconds, &st);
+		nsock_printf_nul(sd, "leveling=%d;seconds=%u;checks=%lu;min=%u;max=%u;mean=%.2f;stddev=%.2f;placed=%lu;moved=%lu;displacement=%lu\n",
+		                 check_load_leveling, st.seconds, st.checks, st.min, st.max, st.mean, st.stddev,
+		                 st.placed, st.moved, st.displacement);
+		return 0;
+	}
+
+	if (!strcmp(buf, "histogram")) {
+		for (i = 0; i < seconds; i++)
+			nsock_printf(sd, "%u=%u\n", i, tree ? tree[slot_of(now + i) + CHECKS_LEVELING_SLOTS] : 0);
+		nsock_printf(sd, "%c", 0);
+		return 0;
+	}
+
+	return 404;
+}
+
+int checks_leveling_init(void)
+{
+	struct check_leveling_stats st;
+
+	if (qh_register_handler("scheduling", "Check scheduling distribution", 0, checks_leveling_qh) < 0) {
+		nm_log(NSLOG_RUNTIME_ERROR, "Failed to register check scheduling query handler\n");
+		return ERROR;
+	}
+
+	checks_leveling_stats(time(NULL), 300, &st);
+	log_debug_info(DEBUGL_EVENTS, 1, "Check distribution over the next %u seconds: %lu checks, %u-%u per second (mean %.2f, stddev %.2f)\n",
+	               st.seconds, st.checks, st.min, st.max, st.mean, st.stddev);
+	return OK;
+}
+
+void checks_leveling_deinit(void)
+{
+	nm_free(tree);
+	placed = moved = displacement = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef CHECKS_LEVELING_H_
+#define CHECKS_LEVELING_H_
+
+#if !defined (_NAEMON_H_INSIDE) && !defined (NAEMON_COMPILATION)
+#error "Only <naemon/naemon.h> can be included directly."
+#endif
+
+#include <time.h>
+#include "lib/lnae-utils.h"
+
+NAGIOS_BEGIN_DECL
+
+/*
+ * Load leveling keeps a per-second count of scheduled host and service
+ * checks, and when enabled places each new or rescheduled check in the
+ * least loaded second within a window around its ideal check time.
+ */
+extern int check_load_leveling;
+/* how far a rescheduled check may be moved, in percent of its interval */
+extern int check_load_leveling_window;
+
+/* Distribution of scheduled checks over a range of seconds */
+struct check_leveling_stats {
+	unsigned int seconds; /* length of the range looked at */
+	unsigned long checks; /* checks scheduled within the range */
+	unsigned int min, max; /* fewest and most checks in any one second */
+	double mean, stddev;
+	unsigned long placed; /* checks placed by the leveler since startup */
+	unsigned long moved; /* ...of which were moved off their ideal second */
+	unsigned long displacement; /* total number of seconds checks were moved */
+};
+
+/* Account for a check scheduled at, or no longer scheduled at, a given time */
+void checks_leveling_add(time_t when);
+void checks_leveling_remove(time_t when);
+
+/* Returns the least loaded second in [earliest, latest], preferring ideal */
+time_t checks_leveling_place(time_t ideal, time_t earliest, time_t latest);
+
+/* Delay until the first check of an object with the given interval */
+time_t checks_leveling_initial_delay(time_t interval);
+
+/* Delay until the next regularly scheduled check of an object */
+time_t checks_leveling_interval_delay(time_t interval);
+
+/* Checks per second over the given number of seconds, starting at from */
+void checks_leveling_stats(time_t from, unsigned int seconds, struct check_leveling_stats *st);
+
+int checks_leveling_init(void);
+void checks_leveling_deinit(void);
+
+NAGIOS_END_DECL
+
+#endif
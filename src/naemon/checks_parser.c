@@ -0,0 +1,249 @@
+#include "config.h"
+#include "checks_parser.h"
+#include "defaults.h"
+#include "events.h"
+#include "logging.h"
+#include "nm_alloc.h"
+#include "lib/iobroker.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+/* results handed over but not yet applied, at most; a power of two */
+#define PARSER_RING_SIZE 4096
+#define PARSER_SLOT(seq) ((seq) & (PARSER_RING_SIZE - 1))
+/* unclaimed results that wake an idle thread right away */
+#define PARSER_WAKE_BATCH 32
+
+int check_result_parser_threads = DEFAULT_CHECK_RESULT_PARSER_THREADS;
+
+/*
+ * A result sits in the slot of its sequence number from the time it's
+ * handed over until it's applied. The main thread fills slots and
+ * publishes them, parser threads claim published slots one at a time
+ * and mark them done once the result in them is parsed, and the main
+ * thread applies and empties the done slots in order. None of it needs
+ * a lock; the lock is only there for threads to sleep when there's
+ * nothing to claim. Sequence numbers wrap around, which is fine as
+ * long as only differences between them are used.
+ */
+static check_result *results[PARSER_RING_SIZE];
+static gint done[PARSER_RING_SIZE];
+static gint published, claimed;
+static guint head_seq; /* main thread only */
+
+static GThread **threads;
+static int num_threads;
+static GMutex idle_lock;
+static GCond idle_cond;
+static gint idle_threads, stopping;
+static int wake_scheduled;
+
+/* written to by parser threads when there's something to apply */
+static int wake_pipe[2] = { -1, -1 };
+static gint wake_pending;
+
+static void parse_slot(unsigned int slot)
+{
+	check_result *cr = results[slot];
+
+	cr->parsed = nm_calloc(1, sizeof(*cr->parsed));
+	parse_check_output(cr->output, &cr->parsed->short_output, &cr->parsed->long_output, &cr->parsed->perf_data, TRUE, FALSE);
+	g_atomic_int_set(&done[slot], 1);
+
+	/* no need to wake the main loop more than once */
+	if (g_atomic_int_compare_and_exchange(&wake_pending, 0, 1)) {
+		while (write(wake_pipe[1], "", 1) < 0 && errno == EINTR)
+			;
+	}
+}
+
+static gpointer parser_thread(gpointer data)
+{
+	guint seq;
+
+	for (;;) {
+		seq = g_atomic_int_get(&claimed);
+		if (seq != (guint)g_atomic_int_get(&published)) {
+			if (g_atomic_int_compare_and_exchange(&claimed, seq, seq + 1))
+				parse_slot(PARSER_SLOT(seq));
+			continue;
+		}
+
+		g_mutex_lock(&idle_lock);
+		g_atomic_int_inc(&idle_threads);
+		while (!g_atomic_int_get(&stopping) && seq == (guint)g_atomic_int_get(&published))
+			g_cond_wait(&idle_cond, &idle_lock);
+		g_atomic_int_add(&idle_threads, -1);
+		g_mutex_unlock(&idle_lock);
+		if (g_atomic_int_get(&stopping))
+			return NULL;
+	}
+}
+
+static void wake_threads(void)
+{
+	if (!g_atomic_int_get(&idle_threads))
+		return;
+	g_mutex_lock(&idle_lock);
+	g_cond_broadcast(&idle_cond);
+	g_mutex_unlock(&idle_lock);
+}
+
+/*
+ * Results handed over during an event loop iteration are picked up
+ * by the threads that are busy anyway, or by idle ones woken up once
+ * per batch, or at the latest when the iteration runs its events.
+ */
+static void wake_threads_event(struct nm_event_execution_properties *evprop)
+{
+	wake_scheduled = FALSE;
+	if (evprop->execution_type == EVENT_EXEC_NORMAL)
+		wake_threads();
+}
+
+static void apply_result(check_result *cr)
+{
+	process_check_result(cr);
+	free_check_result(cr);
+	free(cr);
+}
+
+/* applies the parsed results, up to the oldest one that isn't parsed yet */
+static void apply_parsed(void)
+{
+	unsigned int slot;
+	check_result *cr;
+
+	while (head_seq != (guint)g_atomic_int_get(&published)) {
+		slot = PARSER_SLOT(head_seq);
+		if (!g_atomic_int_get(&done[slot]))
+			break;
+		cr = results[slot];
+		results[slot] = NULL;
+		g_atomic_int_set(&done[slot], 0);
+		head_seq++;
+		apply_result(cr);
+	}
+}
+
+static int handle_parsed(int fd, int events, void *arg)
+{
+	char buf[64];
+
+	/* results parsed from here on wake us up again */
+	g_atomic_int_set(&wake_pending, 0);
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	apply_parsed();
+	return 0;
+}
+
+void checks_parser_submit(check_result *cr)
+{
+	struct pollfd pfd = { wake_pipe[0], POLLIN, 0 };
+	guint seq;
+
+	/* the worker a source names may be gone before the result is applied */
+	if (cr->source)
+		cr->source = nm_strdup(cr->source);
+
+	if (!threads) {
+		apply_result(cr);
+		return;
+	}
+
+	/* with every slot taken, wait for the oldest result to be parsed */
+	seq = g_atomic_int_get(&published);
+	while (seq - head_seq == PARSER_RING_SIZE) {
+		wake_threads();
+		poll(&pfd, 1, 10);
+		handle_parsed(wake_pipe[0], POLLIN, NULL);
+	}
+
+	results[PARSER_SLOT(seq)] = cr;
+	g_atomic_int_set(&published, seq + 1);
+
+	if (seq + 1 - (guint)g_atomic_int_get(&claimed) >= PARSER_WAKE_BATCH)
+		wake_threads();
+	else if (!wake_scheduled) {
+		wake_scheduled = TRUE;
+		schedule_event(0, wake_threads_event, NULL);
+	}
+}
+
+int checks_parser_init(void)
+{
+	GError *error = NULL;
+	int i;
+
+	if (check_result_parser_threads <= 0)
+		return OK;
+
+	if (pipe(wake_pipe) < 0) {
+		nm_log(NSLOG_RUNTIME_ERROR, "Error: Failed to create check result parser pipe: %s\n", strerror(errno));
+		return ERROR;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	g_mutex_init(&idle_lock);
+	g_cond_init(&idle_cond);
+	threads = nm_calloc(check_result_parser_threads, sizeof(*threads));
+	for (num_threads = 0; num_threads < check_result_parser_threads; num_threads++) {
+		threads[num_threads] = g_thread_try_new("check parser", parser_thread, NULL, &error);
+		if (!threads[num_threads]) {
+			nm_log(NSLOG_RUNTIME_ERROR, "Error: Failed to start check result parser thread: %s\n", error ? error->message : "unknown error");
+			g_clear_error(&error);
+			checks_parser_deinit();
+			return ERROR;
+		}
+	}
+
+	iobroker_register(nagios_iobs, wake_pipe[0], NULL, handle_parsed);
+	event_loop_stats_name_handler(handle_parsed, "check result parser");
+	return OK;
+}
+
+void checks_parser_deinit(void)
+{
+	unsigned int slot;
+	check_result *cr;
+	int i;
+
+	if (!threads)
+		return;
+
+	/* let the threads finish what they're at, then drop the rest unapplied */
+	g_mutex_lock(&idle_lock);
+	g_atomic_int_set(&stopping, TRUE);
+	g_cond_broadcast(&idle_cond);
+	g_mutex_unlock(&idle_lock);
+	for (i = 0; i < num_threads; i++)
+		g_thread_join(threads[i]);
+	nm_free(threads);
+	num_threads = 0;
+	g_mutex_clear(&idle_lock);
+	g_cond_clear(&idle_cond);
+
+	for (; head_seq != (guint)published; head_seq++) {
+		slot = PARSER_SLOT(head_seq);
+		cr = results[slot];
+		results[slot] = NULL;
+		done[slot] = 0;
+		free_check_result(cr);
+		free(cr);
+	}
+	head_seq = published = claimed = 0;
+	stopping = wake_pending = 0;
+
+	/* a wakeup still scheduled finds no threads, and does nothing */
+	iobroker_close(nagios_iobs, wake_pipe[0]);
+	close(wake_pipe[1]);
+	wake_pipe[0] = wake_pipe[1] = -1;
+}
@@ -0,0 +1,35 @@
+#ifndef CHECKS_PARSER_H_
+#define CHECKS_PARSER_H_
+
+#if !defined (_NAEMON_H_INSIDE) && !defined (NAEMON_COMPILATION)
+#error "Only <naemon/naemon.h> can be included directly."
+#endif
+
+#include "lib/lnae-utils.h"
+#include "checks.h"
+
+NAGIOS_BEGIN_DECL
+
+/*
+ * With check_result_parser_threads set, the output of check results
+ * coming back from the workers is split into short output, long output
+ * and performance data by a pool of threads, and the main loop only
+ * applies the parsed results. Results are applied in the order they
+ * were handed over, whichever thread gets done with them first.
+ */
+extern int check_result_parser_threads;
+
+/*
+ * Hands over a check result from a worker, to be processed once its
+ * output is parsed, or right away without parser threads. The result
+ * and everything it points to is freed after, except its source, which
+ * is copied, so it can be borrowed from the worker or be a constant.
+ */
+void checks_parser_submit(check_result *cr);
+
+int checks_parser_init(void);
+void checks_parser_deinit(void);
+
+NAGIOS_END_DECL
+
+#endif
@@ -0,0 +1,254 @@
+#include "config.h"
+#include "checks_passive.h"
+#include "checks.h"
+#include "checks_parser.h"
+#include "logging.h"
+#include "nm_alloc.h"
+#include "objects_host.h"
+#include "objects_service.h"
+#include "query-handler.h"
+#include "shared.h"
+#include "lib/nsock.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <glib.h>
+
+/* what the results are said to come from, as the CHECKSOURCE macro */
+#define PASSIVE_RESULTS_SOURCE "results query handler"
+
+/*
+ * Passive check commands fall back to looking for a host with the given
+ * name as its address, one host at a time. Addresses don't change until
+ * the configuration is reloaded, so they're looked up once here. Hosts
+ * can share an address, in which case the first one gets the results,
+ * like it does with the commands.
+ */
+static GHashTable *hosts_by_address;
+
+/* parses "#<id>" as an index into an object array of the given size */
+static int parse_object_id(const char *str, unsigned int size, unsigned int *id)
+{
+	unsigned long val;
+	char *end;
+
+	if (*str != '#' || !str[1])
+		return ERROR;
+	val = strtoul(str + 1, &end, 10);
+	if (*end || val >= size)
+		return ERROR;
+	*id = val;
+	return OK;
+}
+
+static host *find_passive_host(const char *name)
+{
+	unsigned int id;
+	host *hst;
+
+	if (*name == '#')
+		return parse_object_id(name, num_objects.hosts, &id) == OK ? host_ary[id] : NULL;
+	if ((hst = find_host(name)))
+		return hst;
+
+	if (!hosts_by_address) {
+		hosts_by_address = g_hash_table_new(g_str_hash, g_str_equal);
+		for (hst = host_list; hst; hst = hst->next) {
+			if (hst->address && !g_hash_table_lookup(hosts_by_address, hst->address))
+				g_hash_table_insert(hosts_by_address, hst->address, hst);
+		}
+	}
+	return g_hash_table_lookup(hosts_by_address, name);
+}
+
+/* a service given by id needs no host, but if there is one, it must be the right one */
+static service *find_passive_service(host *hst, const char *description)
+{
+	unsigned int id;
+
+	if (*description == '#') {
+		if (parse_object_id(description, num_objects.services, &id) != OK)
+			return NULL;
+		if (hst && service_ary[id]->host_ptr != hst)
+			return NULL;
+		return service_ary[id];
+	}
+	return hst ? find_service(hst->name, description) : NULL;
+}
+
+/*
+ * Hands over a single result. Feeders tend to send the results for
+ * all services on a host together, so the last host looked up is kept
+ * around for the next line of the batch.
+ */
+static int submit_passive_result(char *line, const char **last_name, host **last_host, struct timeval *now)
+{
+	char *field[5], *end;
+	check_result *cr;
+	host *hst = NULL;
+	service *svc = NULL;
+	time_t check_time;
+	long return_code;
+	int i;
+
+	field[0] = line;
+	for (i = 1; i < 5; i++) {
+		if (!(field[i] = strchr(field[i - 1], ';')))
+			return ERROR;
+		*field[i]++ = 0;
+	}
+
+	if (!*field[0])
+		check_time = now->tv_sec;
+	else {
+		check_time = strtoul(field[0], &end, 10);
+		if (*end)
+			return ERROR;
+	}
+	return_code = strtol(field[3], &end, 10);
+	if (!*field[3] || *end)
+		return ERROR;
+
+	if (*field[1]) {
+		if (*last_name && !strcmp(field[1], *last_name))
+			hst = *last_host;
+		else {
+			hst = find_passive_host(field[1]);
+			*last_name = field[1];
+			*last_host = hst;
+		}
+		if (!hst) {
+			nm_log(NSLOG_RUNTIME_WARNING, "Warning:  Passive check result was received for host '%s', but the host could not be found!\n", field[1]);
+			return ERROR;
+		}
+	}
+
+	if (*field[2]) {
+		if (!(svc = find_passive_service(hst, field[2]))) {
+			nm_log(NSLOG_RUNTIME_WARNING, "Warning:  Passive check result was received for service '%s' on host '%s', but the service could not be found!\n", field[2], field[1]);
+			return ERROR;
+		}
+		if (accept_passive_service_checks == FALSE || svc->accept_passive_checks == FALSE)
+			return ERROR;
+		/* make sure the return code is sane */
+		if (return_code < 0 || return_code > 3)
+			return_code = STATE_UNKNOWN;
+	} else {
+		if (!hst || accept_passive_host_checks == FALSE || hst->accept_passive_checks == FALSE)
+			return ERROR;
+		/* make sure we have a reasonable return code */
+		if (return_code < 0 || return_code > 2)
+			return ERROR;
+	}
+
+	cr = nm_malloc(sizeof(*cr));
+	init_check_result(cr);
+	cr->check_type = CHECK_TYPE_PASSIVE;
+	if (svc) {
+		cr->object_check_type = SERVICE_CHECK;
+		cr->host_name = nm_strdup(svc->host_name);
+		cr->service_description = nm_strdup(svc->description);
+	} else {
+		cr->object_check_type = HOST_CHECK;
+		cr->host_name = nm_strdup(hst->name);
+	}
+	cr->output = nm_strdup(field[4]);
+	cr->return_code = return_code;
+	cr->start_time.tv_sec = cr->finish_time.tv_sec = check_time;
+	cr->source = (void *)PASSIVE_RESULTS_SOURCE;
+
+	/* calculate latency */
+	cr->latency = (double)((double)(now->tv_sec - check_time) + (double)(now->tv_usec / 1000.0) / 1000.0);
+	if (cr->latency < 0.0)
+		cr->latency = 0.0;
+
+	checks_parser_submit(cr);
+	return OK;
+}
+
+unsigned int checks_passive_submit(char *buf, size_t len, unsigned int *rejected)
+{
+	const char *last_name = NULL;
+	host *last_host = NULL;
+	unsigned int accepted = 0;
+	struct timeval now;
+	char *line, *eol, *end = buf + len;
+
+	*rejected = 0;
+	gettimeofday(&now, NULL);
+	for (line = buf; line < end; line = eol + 1) {
+		if (!(eol = memchr(line, '\n', end - line)))
+			eol = end;
+		*eol = 0;
+		if (!*line)
+			continue;
+		if (submit_passive_result(line, &last_name, &last_host, &now) == OK)
+			accepted++;
+		else
+			(*rejected)++;
+	}
+
+	log_debug_info(DEBUGL_CHECKS, 1, "Accepted %u and rejected %u passive check results from a batch\n", accepted, *rejected);
+	return accepted;
+}
+
+static int checks_passive_qh(int sd, char *buf, unsigned int len)
+{
+	unsigned int accepted, rejected;
+	host *hst;
+	service *svc;
+	char *sep;
+
+	if (!*buf || !strcmp(buf, "help")) {
+		nsock_printf_nul(sd, "Query handler for submitting passive check results in batches.\n"
+		                 "Available commands:\n"
+		                 "  submit\\n<results>       Process the results, one per line, and tell how many were accepted\n"
+		                 "  id <host>[;<service>]   Look up the id of a host or service\n"
+		                 "Results look like <check time>;<host>;<service>;<return code>;<plugin output>,\n"
+		                 "with an empty service for host results. Hosts and services can also be given\n"
+		                 "as #<id>, until the configuration is reloaded.\n"
+		                );
+		return 0;
+	}
+
+	if (!strcmp(buf, "submit") || !strncmp(buf, "submit\n", 7)) {
+		accepted = checks_passive_submit(buf + 6, len - 6, &rejected);
+		nsock_printf_nul(sd, "accepted=%u;rejected=%u\n", accepted, rejected);
+		return 0;
+	}
+
+	if (!strncmp(buf, "id ", 3)) {
+		buf += 3;
+		if ((sep = strchr(buf, ';')))
+			*sep++ = 0;
+		if (!(hst = find_host(buf)))
+			return 404;
+		if (!sep) {
+			nsock_printf_nul(sd, "%u\n", hst->id);
+			return 0;
+		}
+		if (!(svc = find_service(hst->name, sep)))
+			return 404;
+		nsock_printf_nul(sd, "%u\n", svc->id);
+		return 0;
+	}
+
+	return 404;
+}
+
+int checks_passive_init(void)
+{
+	if (qh_register_handler("results", "Passive check results in batches", 0, checks_passive_qh) < 0) {
+		nm_log(NSLOG_RUNTIME_ERROR, "Failed to register passive check results query handler\n");
+		return ERROR;
+	}
+	return OK;
+}
+
+void checks_passive_deinit(void)
+{
+	if (hosts_by_address) {
+		g_hash_table_destroy(hosts_by_address);
+		hosts_by_address = NULL;
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef CHECKS_PASSIVE_H_
+#define CHECKS_PASSIVE_H_
+
+#if !defined (_NAEMON_H_INSIDE) && !defined (NAEMON_COMPILATION)
+#error "Only <naemon/naemon.h> can be included directly."
+#endif
+
+#include <stddef.h>
+#include "lib/lnae-utils.h"
+
+NAGIOS_BEGIN_DECL
+
+/*
+ * The "results" query handler takes passive check results in batches,
+ * for feeders that send more of them than the external command path
+ * keeps up with. A batch is one query handler message, and each line
+ * in it is one result:
+ *
+ *   <check time>;<host>;<service>;<return code>;<plugin output>
+ *
+ * The service is left empty for host results, and an empty check time
+ * means now. Hosts are given by name or address, and services by their
+ * description, or either of them as "#<id>", with the id the handler
+ * looks up for them. Ids only hold until the configuration is reloaded.
+ */
+
+/*
+ * Hands over the results in a batch to be processed, and returns how
+ * many of them were accepted. Lines that aren't results, or are for
+ * objects that don't exist or don't take passive results, are counted
+ * in rejected. The batch is modified in the process.
+ */
+unsigned int checks_passive_submit(char *buf, size_t len, unsigned int *rejected);
+
+int checks_passive_init(void);
+void checks_passive_deinit(void);
+
+NAGIOS_END_DECL
+
+#endif
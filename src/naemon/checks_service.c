@@ -1,6 +1,9 @@
 #include "checks.h"
 #include "checks_service.h"
 #include "checks_host.h"
+#include "checks_leveling.h"
+#include "checks_parser.h"
+#include "wproc_usage.h"
 #include "config.h"
 #include "comments.h"
 #include "common.h"
@@ -35,10 +38,11 @@ static void handle_worker_service_check(wproc_result *wpres, void *arg, int flag
 
 /* Extra features */
 static void check_service_result_freshness(struct nm_event_execution_properties *evprop);
-static void check_for_orphaned_services_eventhandler(struct nm_event_execution_properties *evprop);
+static void handle_orphaned_service_check(service *svc);
 
 /* Status functions, immutable */
 static int is_service_result_fresh(service *, time_t, int);
+static time_t get_service_result_expiration(service *, int *);
 
 
 /******************************************************************************
@@ -59,16 +63,13 @@ void checks_init_services(void)
 
 		/* create a new service check event */
 		if (temp_service->check_interval != 0.0)
-			schedule_next_service_check(temp_service, ranged_urand(0, get_service_check_interval_s(temp_service)), 0);
-	}
+			schedule_next_service_check(temp_service, checks_leveling_initial_delay(get_service_check_interval_s(temp_service)), 0);
 
-	/* add a service result "freshness" check event */
-	if (check_service_freshness == TRUE) {
-		schedule_event(service_freshness_check_interval, check_service_result_freshness, NULL);
-	}
+		/* check the freshness of its results when they're due to go stale */
+		schedule_service_freshness_check(temp_service);
 
-	if(check_orphaned_services == TRUE) {
-		schedule_event(DEFAULT_ORPHAN_CHECK_INTERVAL, check_for_orphaned_services_eventhandler, NULL);
+		/* the state may have come from the retention data */
+		update_servicedependencies(temp_service);
 	}
 }
 
@@ -99,6 +100,8 @@ void schedule_next_service_check(service *svc, time_t delay, int options)
 	svc->check_options = options;
 	svc->next_check = delay + current_time;
 	svc->next_check_event = schedule_event(delay, handle_service_check_event, (void*)svc);
+	if (svc->next_check_event != NULL)
+		checks_leveling_add(svc->next_check);
 
 	/* update the status log, since next_check and check_options is updated */
 	update_service_status(svc, FALSE);
@@ -110,6 +113,28 @@ void schedule_service_check(service *svc, time_t check_time, int options)
 	schedule_next_service_check(svc, check_time - time(NULL), options);
 }
 
+void schedule_service_freshness_check(service *svc)
+{
+	time_t current_time, expiration_time;
+
+	if (svc->freshness_check_event != NULL) {
+		destroy_event(svc->freshness_check_event);
+		svc->freshness_check_event = NULL;
+	}
+
+	if (check_service_freshness == FALSE || svc->check_freshness == FALSE)
+		return;
+
+	/* don't check freshness of services without regular check intervals if we're using auto-freshness threshold */
+	if (svc->check_interval == 0 && svc->freshness_threshold == 0)
+		return;
+
+	/* results are stale once their expiration time is in the past */
+	time(&current_time);
+	expiration_time = get_service_result_expiration(svc, NULL);
+	svc->freshness_check_event = schedule_event(expiration_time < current_time ? 0 : expiration_time - current_time + 1, check_service_result_freshness, svc);
+}
+
 static void handle_service_check_event(struct nm_event_execution_properties *evprop)
 {
 	service *temp_service = (service *)evprop->user_data;
@@ -119,6 +144,9 @@ static void handle_service_check_event(struct nm_event_execution_properties *evp
 	struct timeval event_runtime;
 	int options = temp_service->check_options;
 
+	/* the check is no longer scheduled, whether it runs or not */
+	checks_leveling_remove(temp_service->next_check);
+
 	if(evprop->execution_type == EVENT_EXEC_NORMAL) {
 
 		/* get event latency */
@@ -132,7 +160,7 @@ static void handle_service_check_event(struct nm_event_execution_properties *evp
 
 		/* Reschedule next check directly, might be replaced later */
 		if (temp_service->check_interval != 0.0) {
-			schedule_next_service_check(temp_service, get_service_check_interval_s(temp_service), 0);
+			schedule_next_service_check(temp_service, checks_leveling_interval_delay(get_service_check_interval_s(temp_service)), 0);
 		}
 
 		/* forced checks override normal check logic */
@@ -192,6 +220,8 @@ static int run_scheduled_service_check(service *svc, int check_options, double l
 	nagios_macros mac;
 	char *raw_command = NULL;
 	char *processed_command = NULL;
+	char *argv = NULL;
+	size_t argv_len = 0;
 	struct timeval start_time, end_time;
 	host *temp_host = NULL;
 	check_result *cr;
@@ -246,7 +276,8 @@ static int run_scheduled_service_check(service *svc, int check_options, double l
 	}
 
 	/* process any macros contained in the argument */
-	process_macros_r(&mac, raw_command, &processed_command, macro_options);
+	if (expand_argv_template_r(&mac, svc->check_command_ptr->argv_template, &processed_command, &argv, &argv_len, macro_options) != OK)
+		process_macros_r(&mac, raw_command, &processed_command, macro_options);
 	nm_free(raw_command);
 	if (processed_command == NULL) {
 		clear_volatile_macros_r(&mac);
@@ -282,11 +313,12 @@ static int run_scheduled_service_check(service *svc, int check_options, double l
 		clear_volatile_macros_r(&mac);
 		free_check_result(cr);
 		nm_free(processed_command);
+		nm_free(argv);
 		return OK;
 	}
 
 	/* paw off the check to a worker to run */
-	runchk_result = wproc_run_callback(processed_command, service_check_timeout, handle_worker_service_check, (void*)cr, &mac);
+	runchk_result = wproc_run_check(processed_command, argv, argv_len, service_check_timeout, handle_worker_service_check, (void*)cr, &mac);
 	if (runchk_result == ERROR) {
 		nm_log(NSLOG_RUNTIME_ERROR,
 		       "Unable to send check for service '%s' on host '%s' to worker (ret=%d)\n", svc->description, svc->host_name, runchk_result);
@@ -298,6 +330,7 @@ static int run_scheduled_service_check(service *svc, int check_options, double l
 	}
 
 	nm_free(processed_command);
+	nm_free(argv);
 	clear_volatile_macros_r(&mac);
 
 	return OK;
@@ -312,7 +345,13 @@ static int run_scheduled_service_check(service *svc, int check_options, double l
 static void handle_worker_service_check(wproc_result *wpres, void *arg, int flags)
 {
 	check_result *cr = (check_result *)arg;
+	service *svc;
+
 	if(wpres) {
+		svc = find_service(cr->host_name, cr->service_description);
+		wproc_usage_add(WPROC_USAGE_HOSTS, cr->host_name, wpres);
+		if (svc && svc->check_command_ptr)
+			wproc_usage_add(WPROC_USAGE_COMMANDS, svc->check_command_ptr->name, wpres);
 		memcpy(&cr->rusage, &wpres->rusage, sizeof(wpres->rusage));
 		cr->start_time.tv_sec = wpres->start.tv_sec;
 		cr->start_time.tv_usec = wpres->start.tv_usec;
@@ -336,8 +375,11 @@ static void handle_worker_service_check(wproc_result *wpres, void *arg, int flag
 		cr->exited_ok = wpres->exited_ok;
 		cr->engine = NULL;
 		cr->source = wpres->source;
-		process_check_result(cr);
+		checks_parser_submit(cr);
+		return;
 	}
+	if ((flags & WPROC_ORPHANED) && (svc = find_service(cr->host_name, cr->service_description)))
+		handle_orphaned_service_check(svc);
 	free_check_result(cr);
 	free(cr);
 }
@@ -466,7 +508,7 @@ int handle_async_service_check_result(service *temp_service, check_result *queue
 	else {
 
 		/* parse check output to get: (1) short output, (2) long output, (3) perf data */
-		parse_check_output(queued_check_result->output, &temp_service->plugin_output, &temp_service->long_plugin_output, &temp_service->perf_data, TRUE, FALSE);
+		parse_check_result_output(queued_check_result, &temp_service->plugin_output, &temp_service->long_plugin_output, &temp_service->perf_data);
 
 		/* make sure the plugin output isn't null */
 		if (temp_service->plugin_output == NULL)
@@ -979,6 +1021,9 @@ int handle_async_service_check_result(service *temp_service, check_result *queue
 	/* set the checked flag */
 	temp_service->has_been_checked = TRUE;
 
+	/* the services depending on this one go by its new state */
+	update_servicedependencies(temp_service);
+
 	/* update the current service status log */
 	update_service_status(temp_service, FALSE);
 
@@ -991,6 +1036,9 @@ int handle_async_service_check_result(service *temp_service, check_result *queue
 	/* update service performance info */
 	update_service_performance_data(temp_service);
 
+	/* the results are fresh for a while now */
+	schedule_service_freshness_check(temp_service);
+
 	/* free allocated memory */
 	nm_free(old_plugin_output);
 	nm_free(old_long_plugin_output);
@@ -1004,118 +1052,88 @@ int handle_async_service_check_result(service *temp_service, check_result *queue
  ******************************************************************************/
 
 
-/* check for services that never returned from a check... */
-static void check_for_orphaned_services_eventhandler(struct nm_event_execution_properties *evprop)
+/* handles a service check whose results never came back from its worker... */
+static void handle_orphaned_service_check(service *svc)
 {
-	service *temp_service = NULL;
-	time_t current_time = 0L;
-	time_t expected_time = 0L;
-
-	if (evprop->execution_type == EVENT_EXEC_NORMAL) {
-
-		schedule_event(DEFAULT_ORPHAN_CHECK_INTERVAL, check_for_orphaned_services_eventhandler, evprop->user_data);
-
-		/* get the current time */
-		time(&current_time);
+	if (check_orphaned_services == FALSE || svc->is_executing == FALSE)
+		return;
 
-		/* check all services... */
-		for (temp_service = service_list; temp_service != NULL; temp_service = temp_service->next) {
+	/* log a warning */
+	nm_log(NSLOG_RUNTIME_WARNING,
+	       "Warning: The check of service '%s' on host '%s' looks like it was orphaned (results never came back; last_check=%lu; next_check=%lu).  I'm scheduling an immediate check of the service...\n", svc->description, svc->host_name, svc->last_check, svc->next_check);
 
-			/* skip services that are not currently executing */
-			if (temp_service->is_executing == FALSE)
-				continue;
+	log_debug_info(DEBUGL_CHECKS, 1, "Service '%s' on host '%s' was orphaned, so we're scheduling an immediate check...\n", svc->description, svc->host_name);
+	log_debug_info(DEBUGL_CHECKS, 1, "  next_check=%lu (%s); last_check=%lu (%s);\n",
+	               svc->next_check, ctime(&svc->next_check),
+	               svc->last_check, ctime(&svc->last_check));
 
-			/* determine the time at which the check results should have come in (allow 10 minutes slack time) */
-			expected_time = (time_t)(temp_service->next_check + temp_service->latency + service_check_timeout + check_reaper_interval + 600);
-
-			/* this service was supposed to have executed a while ago, but for some reason the results haven't come back in... */
-			if (expected_time < current_time) {
-
-				/* log a warning */
-				nm_log(NSLOG_RUNTIME_WARNING,
-				       "Warning: The check of service '%s' on host '%s' looks like it was orphaned (results never came back; last_check=%lu; next_check=%lu).  I'm scheduling an immediate check of the service...\n", temp_service->description, temp_service->host_name, temp_service->last_check, temp_service->next_check);
-
-				log_debug_info(DEBUGL_CHECKS, 1, "Service '%s' on host '%s' was orphaned, so we're scheduling an immediate check...\n", temp_service->description, temp_service->host_name);
-				log_debug_info(DEBUGL_CHECKS, 1, "  next_check=%lu (%s); last_check=%lu (%s);\n",
-							   temp_service->next_check, ctime(&temp_service->next_check),
-							   temp_service->last_check, ctime(&temp_service->last_check));
-
-				/* decrement the number of running service checks */
-				if (currently_running_service_checks > 0)
-					currently_running_service_checks--;
-
-				/* disable the executing flag */
-				temp_service->is_executing = FALSE;
+	/* decrement the number of running service checks */
+	if (currently_running_service_checks > 0)
+		currently_running_service_checks--;
 
-				/* schedule an immediate check of the service */
-				schedule_next_service_check(temp_service, 0, 0);
-			}
+	/* disable the executing flag */
+	svc->is_executing = FALSE;
 
-		}
-	}
+	/* schedule an immediate check of the service */
+	schedule_next_service_check(svc, 0, 0);
 }
 
 
-/* event handler for checking freshness of service results */
+/*
+ * event handler for checking the freshness of a service's results, run
+ * when they were due to go stale. services that can't be freshened
+ * right now are looked at again after the freshness check interval.
+ */
 static void check_service_result_freshness(struct nm_event_execution_properties *evprop)
 {
-	service *temp_service = NULL;
+	service *temp_service = (service *)evprop->user_data;
 	time_t current_time = 0L;
 
+	/* When the callback is called, the pointer to the timed event is invalid */
+	temp_service->freshness_check_event = NULL;
+
 	if (evprop->execution_type == EVENT_EXEC_NORMAL) {
 		/* get the current time */
 		time(&current_time);
 
-		schedule_event(service_freshness_check_interval, check_service_result_freshness, evprop->user_data);
-
+		log_debug_info(DEBUGL_CHECKS, 1, "Checking the freshness of service '%s' on host '%s'...\n", temp_service->description, temp_service->host_name);
 
-		log_debug_info(DEBUGL_CHECKS, 1, "Checking the freshness of service check results...\n");
-
-		/* bail out if we're not supposed to be checking freshness */
+		/* bail out if we're not supposed to be checking freshness, enabling it schedules this again */
 		if (check_service_freshness == FALSE) {
 			log_debug_info(DEBUGL_CHECKS, 1, "Service freshness checking is disabled.\n");
 			return;
 		}
 
-		/* check all services... */
-		for (temp_service = service_list; temp_service != NULL; temp_service = temp_service->next) {
-
-			/* skip services we shouldn't be checking for freshness */
-			if (temp_service->check_freshness == FALSE)
-				continue;
-
-			/* skip services that are currently executing (problems here will be caught by orphaned service check) */
-			if (temp_service->is_executing == TRUE)
-				continue;
-
-			/* skip services that have both active and passive checks disabled */
-			if (temp_service->checks_enabled == FALSE && temp_service->accept_passive_checks == FALSE)
-				continue;
-
-			/* skip services that are already being freshened */
-			if (temp_service->is_being_freshened == TRUE)
-				continue;
-
-			/* see if the time is right... */
-			if (check_time_against_period(current_time, temp_service->check_period_ptr) == ERROR)
-				continue;
-
-			/* EXCEPTION */
-			/* don't check freshness of services without regular check intervals if we're using auto-freshness threshold */
-			if (temp_service->check_interval == 0 && temp_service->freshness_threshold == 0)
-				continue;
+		/*
+		 * skip services that are currently executing (problems here will be
+		 * caught by orphaned service check), that have both active and passive
+		 * checks disabled, that are already being freshened or that are
+		 * outside of their check period, for now
+		 */
+		if (temp_service->is_executing == TRUE ||
+		    (temp_service->checks_enabled == FALSE && temp_service->accept_passive_checks == FALSE) ||
+		    temp_service->is_being_freshened == TRUE ||
+		    check_time_against_period(current_time, temp_service->check_period_ptr) == ERROR) {
+			temp_service->freshness_check_event = schedule_event(service_freshness_check_interval, check_service_result_freshness, temp_service);
+			return;
+		}
 
-			/* the results for the last check of this service are stale! */
-			if (is_service_result_fresh(temp_service, current_time, TRUE) == FALSE) {
+		/* the results for the last check of this service are stale! */
+		if (is_service_result_fresh(temp_service, current_time, TRUE) == FALSE) {
 
-				/* set the freshen flag */
-				temp_service->is_being_freshened = TRUE;
+			/* set the freshen flag */
+			temp_service->is_being_freshened = TRUE;
 
-				/* schedule an immediate forced check of the service */
-				schedule_next_service_check(temp_service, 0, CHECK_OPTION_FORCE_EXECUTION | CHECK_OPTION_FRESHNESS_CHECK);
-			}
+			/* schedule an immediate forced check of the service */
+			schedule_next_service_check(temp_service, 0, CHECK_OPTION_FORCE_EXECUTION | CHECK_OPTION_FRESHNESS_CHECK);
 
+			/* its result schedules this again, unless it never comes */
+			temp_service->freshness_check_event = schedule_event(service_freshness_check_interval, check_service_result_freshness, temp_service);
+			return;
 		}
+
+		/* the results got fresher since this was scheduled */
+		schedule_service_freshness_check(temp_service);
 	}
 }
 
@@ -1129,14 +1147,23 @@ static void check_service_result_freshness(struct nm_event_execution_properties
 int check_service_dependencies(service *svc, int dependency_type)
 {
 	objectlist *list;
-	int state = STATE_OK;
+	unsigned int failing, conditional;
 	time_t current_time = 0L;
 
 	/* only check dependencies of the desired type */
-	if (dependency_type == NOTIFICATION_DEPENDENCY)
+	if (dependency_type == NOTIFICATION_DEPENDENCY) {
 		list = svc->notify_deps;
-	else
+		failing = svc->failing_notify_deps;
+		conditional = svc->conditional_notify_deps;
+	} else {
 		list = svc->exec_deps;
+		failing = svc->failing_exec_deps;
+		conditional = svc->conditional_exec_deps;
+	}
+
+	/* without timeperiods or inherited dependencies, the failing ones are all that matter */
+	if (!conditional)
+		return failing ? DEPENDENCIES_FAILED : DEPENDENCIES_OK;
 
 	/* check all dependencies of the desired type... */
 	for (; list; list = list->next) {
@@ -1152,14 +1179,8 @@ int check_service_dependencies(service *svc, int dependency_type)
 		if (temp_dependency->dependency_period != NULL && check_time_against_period(current_time, temp_dependency->dependency_period_ptr) == ERROR)
 			return FALSE;
 
-		/* get the status to use (use last hard state if its currently in a soft state) */
-		if (temp_service->state_type == SOFT_STATE && soft_state_dependencies == FALSE)
-			state = temp_service->last_hard_state;
-		else
-			state = temp_service->current_state;
-
 		/* is the service we depend on in state that fails the dependency tests? */
-		if (flag_isset(temp_dependency->failure_options, 1 << state))
+		if (temp_dependency->failing)
 			return DEPENDENCIES_FAILED;
 
 		/* immediate dependencies ok at this point - check parent dependencies if necessary */
@@ -1172,21 +1193,11 @@ int check_service_dependencies(service *svc, int dependency_type)
 	return DEPENDENCIES_OK;
 }
 
-/* tests whether or not a service's check results are fresh */
-static int is_service_result_fresh(service *temp_service, time_t current_time, int log_this)
+/* gets the time a service's check results go stale after, and optionally the threshold used */
+static time_t get_service_result_expiration(service *temp_service, int *threshold)
 {
 	int freshness_threshold = 0;
 	time_t expiration_time = 0L;
-	int days = 0;
-	int hours = 0;
-	int minutes = 0;
-	int seconds = 0;
-	int tdays = 0;
-	int thours = 0;
-	int tminutes = 0;
-	int tseconds = 0;
-
-	log_debug_info(DEBUGL_CHECKS, 2, "Checking freshness of service '%s' on host '%s'...\n", temp_service->description, temp_service->host_name);
 
 	/* use user-supplied freshness threshold or auto-calculate a freshness threshold to use? */
 	if (temp_service->freshness_threshold == 0) {
@@ -1246,6 +1257,31 @@ static int is_service_result_fresh(service *temp_service, time_t current_time, i
 			expiration_time = event_start + freshness_threshold;
 		}
 	}
+
+	if (threshold != NULL)
+		*threshold = freshness_threshold;
+
+	return expiration_time;
+}
+
+/* tests whether or not a service's check results are fresh */
+static int is_service_result_fresh(service *temp_service, time_t current_time, int log_this)
+{
+	int freshness_threshold = 0;
+	time_t expiration_time = 0L;
+	int days = 0;
+	int hours = 0;
+	int minutes = 0;
+	int seconds = 0;
+	int tdays = 0;
+	int thours = 0;
+	int tminutes = 0;
+	int tseconds = 0;
+
+	log_debug_info(DEBUGL_CHECKS, 2, "Checking freshness of service '%s' on host '%s'...\n", temp_service->description, temp_service->host_name);
+
+	expiration_time = get_service_result_expiration(temp_service, &freshness_threshold);
+
 	log_debug_info(DEBUGL_CHECKS, 2, "HBC: %d, PS: %lu, ES: %lu, LC: %lu, CT: %lu, ET: %lu\n", temp_service->has_been_checked, (unsigned long)program_start, (unsigned long)event_start, (unsigned long)temp_service->last_check, (unsigned long)current_time, (unsigned long)expiration_time);
 
 	/* the results for the last check of this service are stale */
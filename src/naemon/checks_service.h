@@ -18,6 +18,9 @@ void schedule_next_service_check(service *svc, time_t delay, int options);
 /* Scheduling, reschedule service to be checked, DEPRECATED */
 void schedule_service_check(service *, time_t, int);
 
+/* Schedule the freshness check of a service for when its results go stale */
+void schedule_service_freshness_check(service *svc);
+
 /* Result handling, Update a service given a check result */
 int handle_async_service_check_result(service *, check_result *);
 
@@ -334,6 +334,8 @@ int launch_command_file_worker(void)
 	int ret, sv[2];
 	char *str;
 
+	event_loop_stats_name_handler(command_input_handler, "command file worker");
+
 	/*
 	 * if we're restarting, we may well already have a command
 	 * file worker process running, but disconnected. Reconnect if so.
@@ -2004,6 +2006,7 @@ static int host_command_handler(const struct external_command *ext_command, time
 
 			if (target_host->check_interval > 0)
 				schedule_next_host_check(target_host, check_window(target_host), CHECK_OPTION_NONE);
+			schedule_host_freshness_check(target_host);
 			return OK;
 		case CMD_CHANGE_MAX_HOST_CHECK_ATTEMPTS:
 			target_host->max_attempts = GV_INT("check_attempts");
@@ -2097,6 +2100,7 @@ static int host_command_handler(const struct external_command *ext_command, time
 		case CMD_CHANGE_RETRY_HOST_CHECK_INTERVAL:
 			target_host->retry_interval = GV_TIMESTAMP("check_interval");
 			target_host->modified_attributes |= MODATTR_RETRY_CHECK_INTERVAL;
+			schedule_host_freshness_check(target_host);
 			broker_adaptive_host_data(NEBTYPE_ADAPTIVEHOST_UPDATE, NEBFLAG_NONE, NEBATTR_NONE, target_host, ext_command->id, MODATTR_RETRY_CHECK_INTERVAL, target_host->modified_attributes);
 
 			/* update the status log with the host info */
@@ -2341,6 +2345,7 @@ static int service_command_handler(const struct external_command *ext_command, t
 
 			if (target_service->check_interval > 0)
 				schedule_next_service_check(target_service, check_window(target_service), CHECK_OPTION_NONE);
+			schedule_service_freshness_check(target_service);
 
 			broker_adaptive_service_data(NEBTYPE_ADAPTIVESERVICE_UPDATE, NEBFLAG_NONE, NEBATTR_NONE, target_service, ext_command->id, MODATTR_NORMAL_CHECK_INTERVAL, target_service->modified_attributes);
 
@@ -2351,6 +2356,7 @@ static int service_command_handler(const struct external_command *ext_command, t
 			target_service->retry_interval = GV_TIMESTAMP("check_interval");
 			/* set the modified service attribute */
 			target_service->modified_attributes |= MODATTR_RETRY_CHECK_INTERVAL;
+			schedule_service_freshness_check(target_service);
 
 			broker_adaptive_service_data(NEBTYPE_ADAPTIVESERVICE_UPDATE, NEBFLAG_NONE, NEBATTR_NONE, target_service, ext_command->id, MODATTR_RETRY_CHECK_INTERVAL, target_service->modified_attributes);
 
@@ -4672,6 +4678,7 @@ static void stop_obsessing_over_host_checks(void)
 static void enable_service_freshness_checks(void)
 {
 	unsigned long attr = MODATTR_FRESHNESS_CHECKS_ENABLED;
+	service *temp_service;
 
 	/* no change */
 	if (check_service_freshness == TRUE)
@@ -4683,6 +4690,10 @@ static void enable_service_freshness_checks(void)
 	/* set the freshness check flag */
 	check_service_freshness = TRUE;
 
+	/* check the freshness of services' results when they're due to go stale */
+	for (temp_service = service_list; temp_service != NULL; temp_service = temp_service->next)
+		schedule_service_freshness_check(temp_service);
+
 	broker_adaptive_program_data(NEBTYPE_ADAPTIVEPROGRAM_UPDATE, NEBFLAG_NONE, NEBATTR_NONE, CMD_NONE, MODATTR_NONE, modified_host_process_attributes, attr, modified_service_process_attributes);
 
 	/* update the status log with the program info */
@@ -4720,6 +4731,7 @@ static void disable_service_freshness_checks(void)
 static void enable_host_freshness_checks(void)
 {
 	unsigned long attr = MODATTR_FRESHNESS_CHECKS_ENABLED;
+	host *temp_host;
 
 	/* no change */
 	if (check_host_freshness == TRUE)
@@ -4731,6 +4743,10 @@ static void enable_host_freshness_checks(void)
 	/* set the freshness check flag */
 	check_host_freshness = TRUE;
 
+	/* check the freshness of hosts' results when they're due to go stale */
+	for (temp_host = host_list; temp_host != NULL; temp_host = temp_host->next)
+		schedule_host_freshness_check(temp_host);
+
 	broker_adaptive_program_data(NEBTYPE_ADAPTIVEPROGRAM_UPDATE, NEBFLAG_NONE, NEBATTR_NONE, CMD_NONE, attr, modified_host_process_attributes, MODATTR_NONE, modified_service_process_attributes);
 
 	/* update the status log with the program info */
@@ -13,6 +13,9 @@
 #include "utils.h"
 #include "configuration.h"
 #include "events.h"
+#include "checks_leveling.h"
+#include "checks_parser.h"
+#include "wproc_usage.h"
 #include "logging.h"
 #include "globals.h"
 #include "perfdata.h"
@@ -119,6 +122,73 @@ read_config_file(const char *main_config_file, nagios_macros *mac)
 
 		else if (!strcmp(variable, "check_workers"))
 			num_check_workers = atoi(value);
+		else if (!strcmp(variable, "min_check_workers")) {
+			min_check_workers = atoi(value);
+			if (min_check_workers < 0) {
+				nm_asprintf(&error_message, "Illegal value for min_check_workers");
+				error = TRUE;
+				break;
+			}
+		} else if (!strcmp(variable, "max_check_workers")) {
+			max_check_workers = atoi(value);
+			if (max_check_workers < 0) {
+				nm_asprintf(&error_message, "Illegal value for max_check_workers");
+				error = TRUE;
+				break;
+			}
+		} else if (!strcmp(variable, "persistent_plugins")) {
+			/* may be given more than once */
+			if (persistent_plugins) {
+				char *joined;
+				nm_asprintf(&joined, "%s,%s", persistent_plugins, value);
+				nm_free(persistent_plugins);
+				persistent_plugins = joined;
+			} else {
+				persistent_plugins = nm_strdup(value);
+			}
+		} else if (!strcmp(variable, "max_plugin_output_capture")) {
+			max_plugin_output_capture = atoi(value);
+			if (max_plugin_output_capture < 0) {
+				nm_asprintf(&error_message, "Illegal value for max_plugin_output_capture");
+				error = TRUE;
+				break;
+			}
+		} else if (!strcmp(variable, "worker_ring_size")) {
+			worker_ring_size = atoi(value);
+			if (worker_ring_size < 0) {
+				nm_asprintf(&error_message, "Illegal value for worker_ring_size");
+				error = TRUE;
+				break;
+			}
+		} else if (!strcmp(variable, "coalesce_checks")) {
+			if (strlen(value) != 1 || value[0] < '0' || value[0] > '1') {
+				nm_asprintf(&error_message, "Illegal value for coalesce_checks");
+				error = TRUE;
+				break;
+			}
+			coalesce_checks = (atoi(value) > 0) ? TRUE : FALSE;
+		} else if (!strcmp(variable, "coalesce_checks_ttl")) {
+			coalesce_checks_ttl = atoi(value);
+			if (coalesce_checks_ttl < 0) {
+				nm_asprintf(&error_message, "Illegal value for coalesce_checks_ttl");
+				error = TRUE;
+				break;
+			}
+		} else if (!strcmp(variable, "check_result_parser_threads")) {
+			check_result_parser_threads = atoi(value);
+			if (check_result_parser_threads < 0) {
+				nm_asprintf(&error_message, "Illegal value for check_result_parser_threads");
+				error = TRUE;
+				break;
+			}
+		} else if (!strcmp(variable, "usage_dump_interval")) {
+			usage_dump_interval = atoi(value);
+			if (usage_dump_interval < 0) {
+				nm_asprintf(&error_message, "Illegal value for usage_dump_interval");
+				error = TRUE;
+				break;
+			}
+		}
 		else if (!strcmp(variable, "query_socket")) {
 			nm_free(qh_socket_path);
 			qh_socket_path = nspath_absolute(value, config_file_dir);
@@ -680,6 +750,56 @@ read_config_file(const char *main_config_file, nagios_macros *mac)
 			}
 		}
 
+		else if (!strcmp(variable, "event_dispatch_max_events")) {
+			event_dispatch_max_events = atoi(value);
+			if (event_dispatch_max_events < 0) {
+				nm_asprintf(&error_message, "Illegal value for event_dispatch_max_events");
+				error = TRUE;
+				break;
+			}
+		}
+
+		else if (!strcmp(variable, "event_dispatch_max_time")) {
+			event_dispatch_max_time = atoi(value);
+			if (event_dispatch_max_time < 1) {
+				nm_asprintf(&error_message, "Illegal value for event_dispatch_max_time");
+				error = TRUE;
+				break;
+			}
+		}
+
+		else if (!strcmp(variable, "event_queue_backend")) {
+			if (!strcmp(value, "heap"))
+				event_queue_backend = EVENT_QUEUE_HEAP;
+			else if (!strcmp(value, "wheel"))
+				event_queue_backend = EVENT_QUEUE_WHEEL;
+			else {
+				nm_asprintf(&error_message, "Illegal value for event_queue_backend, must be 'heap' or 'wheel'");
+				error = TRUE;
+				break;
+			}
+		}
+
+		else if (!strcmp(variable, "check_load_leveling")) {
+
+			if (strlen(value) != 1 || value[0] < '0' || value[0] > '1') {
+				nm_asprintf(&error_message, "Illegal value for check_load_leveling");
+				error = TRUE;
+				break;
+			}
+
+			check_load_leveling = (atoi(value) > 0) ? TRUE : FALSE;
+		}
+
+		else if (!strcmp(variable, "check_load_leveling_window")) {
+			check_load_leveling_window = atoi(value);
+			if (check_load_leveling_window < 0 || check_load_leveling_window > 100) {
+				nm_asprintf(&error_message, "Illegal value for check_load_leveling_window, must be between 0 and 100");
+				error = TRUE;
+				break;
+			}
+		}
+
 		else if (!strcmp(variable, "sleep_time")) {
 			obsoleted_warning(variable, NULL);
 		}
@@ -26,7 +26,21 @@
 #define DEFAULT_RETENTION_SCHEDULING_HORIZON    		900     /* max seconds between program restarts that we will preserve scheduling information */
 #define DEFAULT_STATUS_UPDATE_INTERVAL				60	/* seconds between aggregated status data updates */
 #define DEFAULT_FRESHNESS_CHECK_INTERVAL        		60      /* seconds between service result freshness checks */
-#define DEFAULT_ORPHAN_CHECK_INTERVAL           		60      /* seconds between checks for orphaned hosts and services */
+#define DEFAULT_EVENT_DISPATCH_MAX_EVENTS			0	/* max due events to run per event loop iteration (0=unlimited) */
+#define DEFAULT_EVENT_DISPATCH_MAX_TIME				100	/* max milliseconds to spend running due events before polling for input again */
+#define DEFAULT_CHECK_LOAD_LEVELING				0	/* don't level check load, schedule checks at their exact interval */
+#define DEFAULT_CHECK_LOAD_LEVELING_WINDOW			10	/* percent of its interval a leveled check may be moved */
+#define DEFAULT_MIN_CHECK_WORKERS				0	/* an elastic worker pool keeps at least one worker */
+#define DEFAULT_MAX_CHECK_WORKERS				0	/* don't grow or shrink the worker pool at runtime */
+#define DEFAULT_MAX_PLUGIN_OUTPUT_CAPTURE			1048576	/* bytes of stdout and of stderr kept from each plugin run (0=unlimited) */
+#define DEFAULT_WORKER_RING_SIZE				0	/* bytes in each shared memory ring of a core worker (0=use the socket) */
+#define DEFAULT_COALESCE_CHECKS				0	/* run every check, even if another one with the same command line is running */
+#define DEFAULT_COALESCE_CHECKS_TTL				0	/* seconds a coalesced check result is handed out after its run is done */
+#define DEFAULT_CHECK_RESULT_PARSER_THREADS			0	/* parse check output in the main loop */
+#define DEFAULT_USAGE_DUMP_INTERVAL				0	/* don't log the resource usage of checks periodically */
+#ifndef DEFAULT_EVENT_QUEUE_BACKEND
+#define DEFAULT_EVENT_QUEUE_BACKEND				EVENT_QUEUE_HEAP	/* keep timed events in a binary heap, unless overridden at build time */
+#endif
 
 #define DEFAULT_INTERVAL_LENGTH  60 /* seconds per interval unit for check scheduling */
 
@@ -2,7 +2,9 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include "events.h"
+#include "defaults.h"
 #include "logging.h"
 #include "nm_alloc.h"
 #include "nm_arith.h"
@@ -10,11 +12,23 @@
 /* Which clock should be used for events? */
 #define EVENT_CLOCK_ID CLOCK_MONOTONIC
 #define EVENT_MAX_POLL_TIME_MS 1500
+
+/* Timing wheel geometry: 4 levels of 256 slots, with a 1ms tick */
+#define EVWHEEL_LEVELS 4
+#define EVWHEEL_BITS 8
+#define EVWHEEL_SLOTS (1 << EVWHEEL_BITS)
+#define EVWHEEL_MASK ((uint64_t)EVWHEEL_SLOTS - 1)
+#define EVWHEEL_OVERFLOW (EVWHEEL_LEVELS * EVWHEEL_SLOTS)
+#define EVWHEEL_NONE (EVWHEEL_OVERFLOW + 1)
+
 struct timed_event {
 	size_t pos;
 	struct timespec event_time;
 	event_callback callback;
+	const char *name; /* callback name, for the event loop statistics */
 	void *user_data;
+	unsigned int wheel_slot; /* EVWHEEL_NONE unless linked into a wheel slot */
+	struct timed_event *prev, *next;
 };
 
 struct timed_event_queue {
@@ -23,8 +37,50 @@ struct timed_event_queue {
 	size_t size;
 };
 
+struct evwheel_slot {
+	struct timed_event *head, *tail;
+	struct timed_event *min; /* earliest event, or NULL if not known */
+};
+
+/*
+ * A hierarchical timing wheel. Level 0 slots hold the events of a single
+ * tick, kept sorted on the exact event time. Higher levels hold 256 times
+ * the range of the level below, and are cascaded down as the wheel turns.
+ * Events too far ahead for the top level live in an overflow slot, and
+ * events scheduled before the wheel's current tick are kept in a small
+ * heap, so the ordering is exact no matter how coarse a slot is.
+ */
+struct timed_event_wheel {
+	uint64_t now; /* current tick, all linked events are at or after it */
+	size_t count; /* events linked into slots, including overflow */
+	struct evwheel_slot slots[EVWHEEL_OVERFLOW + 1];
+	uint64_t used[EVWHEEL_LEVELS][EVWHEEL_SLOTS / 64];
+	struct timed_event_queue *behind;
+};
+
 struct timed_event_queue *event_queue = NULL; /* our scheduling queue */
+static struct timed_event_wheel *event_wheel = NULL; /* ...or this one, if so configured */
 iobroker_set *nagios_iobs = NULL;
+int event_queue_backend = DEFAULT_EVENT_QUEUE_BACKEND;
+int event_dispatch_max_events = DEFAULT_EVENT_DISPATCH_MAX_EVENTS;
+int event_dispatch_max_time = DEFAULT_EVENT_DISPATCH_MAX_TIME;
+
+/* Event loop statistics, keyed on callback/handler function pointer */
+static GHashTable *event_callback_stats = NULL;
+static GHashTable *event_handler_stats = NULL;
+static unsigned long event_latency_histogram[EVENT_LATENCY_BUCKETS];
+static const struct {
+	double limit; /* upper bound, in seconds */
+	const char *name;
+} event_latency_buckets[EVENT_LATENCY_BUCKETS] = {
+	{ 0.001, "lt_1ms" },
+	{ 0.01, "lt_10ms" },
+	{ 0.1, "lt_100ms" },
+	{ 1.0, "lt_1s" },
+	{ 10.0, "lt_10s" },
+	{ 60.0, "lt_60s" },
+	{ -1, "ge_60s" },
+};
 
 /******************************************************************/
 /************************** TIME HELPERS *************************/
@@ -209,17 +265,448 @@ static void evheap_destroy(struct timed_event_queue *q) {
 }
 
 
+/******************************************************************/
+/************************* WHEEL METHODS **************************/
+/******************************************************************/
+
+/* Converts an event time to wheel ticks, clamping times outside the range */
+static inline uint64_t evwheel_tick(const struct timespec *ts)
+{
+	if (ts->tv_sec < 0)
+		return 0;
+	if ((uint64_t)ts->tv_sec >= UINT64_MAX / 1000 - 1)
+		return UINT64_MAX;
+	return (uint64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+static inline void evwheel_mark(struct timed_event_wheel *w, unsigned int slot, int used)
+{
+	uint64_t *word;
+	if (slot >= EVWHEEL_OVERFLOW)
+		return;
+	word = &w->used[slot / EVWHEEL_SLOTS][(slot % EVWHEEL_SLOTS) / 64];
+	if (used)
+		*word |= 1ULL << (slot % 64);
+	else
+		*word &= ~(1ULL << (slot % 64));
+}
+
+/* Returns the index of the first used slot >= from on the given level, or -1 */
+static int evwheel_next_used(struct timed_event_wheel *w, int level, unsigned int from)
+{
+	unsigned int word;
+	uint64_t bits;
+
+	if (from >= EVWHEEL_SLOTS)
+		return -1;
+	word = from / 64;
+	bits = w->used[level][word] & (~0ULL << (from % 64));
+	for (;;) {
+		if (bits)
+			return word * 64 + ffsll(bits) - 1;
+		if (++word >= EVWHEEL_SLOTS / 64)
+			return -1;
+		bits = w->used[level][word];
+	}
+}
+
+/* Which slot an event at the given tick belongs in, given the current tick */
+static unsigned int evwheel_slot_for(struct timed_event_wheel *w, uint64_t tick)
+{
+	int level, shift;
+	for (level = 0; level < EVWHEEL_LEVELS; level++) {
+		shift = EVWHEEL_BITS * (level + 1);
+		if ((tick >> shift) == (w->now >> shift))
+			return level * EVWHEEL_SLOTS + ((tick >> (EVWHEEL_BITS * level)) & EVWHEEL_MASK);
+	}
+	return EVWHEEL_OVERFLOW;
+}
+
+static void evwheel_link(struct timed_event_wheel *w, struct timed_event *ev, unsigned int slot)
+{
+	struct evwheel_slot *s = &w->slots[slot];
+	struct timed_event *after = s->tail;
+
+	/*
+	 * Level 0 slots are kept sorted. Events mostly arrive in order, so
+	 * search from the tail. Other slots are only sorted when cascaded.
+	 */
+	if (slot < EVWHEEL_SLOTS) {
+		while (after && evheap_compare(after, ev) > 0)
+			after = after->prev;
+	}
+
+	/* a slot's earliest event is only kept track of while it's known */
+	if (!s->head || (s->min && evheap_compare(ev, s->min) < 0))
+		s->min = ev;
+
+	ev->wheel_slot = slot;
+	ev->prev = after;
+	if (after) {
+		ev->next = after->next;
+		after->next = ev;
+	} else {
+		ev->next = s->head;
+		s->head = ev;
+	}
+	if (ev->next)
+		ev->next->prev = ev;
+	else
+		s->tail = ev;
+
+	evwheel_mark(w, slot, 1);
+	w->count++;
+}
+
+static void evwheel_unlink(struct timed_event_wheel *w, struct timed_event *ev)
+{
+	struct evwheel_slot *s = &w->slots[ev->wheel_slot];
+
+	if (ev->prev)
+		ev->prev->next = ev->next;
+	else
+		s->head = ev->next;
+	if (ev->next)
+		ev->next->prev = ev->prev;
+	else
+		s->tail = ev->prev;
+
+	if (s->min == ev)
+		s->min = NULL;
+	if (!s->head)
+		evwheel_mark(w, ev->wheel_slot, 0);
+	ev->prev = ev->next = NULL;
+	ev->wheel_slot = EVWHEEL_NONE;
+	w->count--;
+}
+
+static void evwheel_add(struct timed_event_wheel *w, struct timed_event *ev)
+{
+	uint64_t tick;
+	g_return_if_fail(w != NULL);
+	g_return_if_fail(ev != NULL);
+
+	tick = evwheel_tick(&ev->event_time);
+	if (tick < w->now) {
+		ev->wheel_slot = EVWHEEL_NONE;
+		evheap_add(w->behind, ev);
+		return;
+	}
+	evwheel_link(w, ev, evwheel_slot_for(w, tick));
+}
+
+static void evwheel_remove(struct timed_event_wheel *w, struct timed_event *ev)
+{
+	g_return_if_fail(w != NULL);
+	g_return_if_fail(ev != NULL);
+
+	if (ev->wheel_slot == EVWHEEL_NONE)
+		evheap_remove(w->behind, ev);
+	else
+		evwheel_unlink(w, ev);
+}
+
+/* Re-distributes the events of a slot, after the wheel has moved to it */
+static void evwheel_cascade(struct timed_event_wheel *w, unsigned int slot)
+{
+	struct timed_event *ev, *next;
+
+	ev = w->slots[slot].head;
+	w->slots[slot].head = w->slots[slot].tail = w->slots[slot].min = NULL;
+	evwheel_mark(w, slot, 0);
+	for (; ev; ev = next) {
+		next = ev->next;
+		w->count--;
+		evwheel_link(w, ev, evwheel_slot_for(w, evwheel_tick(&ev->event_time)));
+	}
+}
+
+/*
+ * Returns the earliest event of a slot that isn't kept sorted. Once
+ * found, it's kept until it's unlinked, so the slot is only scanned
+ * again after its earliest event is removed.
+ */
+static struct timed_event *evwheel_slot_first(struct evwheel_slot *s)
+{
+	struct timed_event *ev;
+
+	if (s->min)
+		return s->min;
+	for (s->min = ev = s->head; ev; ev = ev->next) {
+		if (evheap_compare(ev, s->min) < 0)
+			s->min = ev;
+	}
+	return s->min;
+}
+
+/*
+ * Turns the wheel forward to the tick of the earliest linked event, but
+ * no further than the given tick, and returns that event, or NULL if no
+ * event is linked. New events are scheduled at or after the current
+ * time, so with the wheel held back at the current time they go into
+ * its slots, rather than into the heap of events behind it. An event
+ * beyond the given tick is only looked up, without turning to it.
+ */
+static struct timed_event *evwheel_advance(struct timed_event_wheel *w, uint64_t limit)
+{
+	struct timed_event *ev;
+	uint64_t tick;
+	int level, idx, shift;
+
+	while (w->count > 0) {
+		idx = evwheel_next_used(w, 0, w->now & EVWHEEL_MASK);
+		if (idx >= 0) {
+			tick = (w->now & ~EVWHEEL_MASK) | (uint64_t)idx;
+			if (tick <= limit)
+				w->now = tick;
+			return w->slots[idx].head;
+		}
+
+		/*
+		 * Nothing left in this turn of level 0. The closest used slot on
+		 * the lowest level that has any holds the earliest events, so move
+		 * to the start of it and spread them out on the levels below.
+		 */
+		for (level = 1; level < EVWHEEL_LEVELS; level++) {
+			shift = EVWHEEL_BITS * level;
+			idx = evwheel_next_used(w, level, ((w->now >> shift) & EVWHEEL_MASK) + 1);
+			if (idx < 0)
+				continue;
+			tick = ((w->now >> (shift + EVWHEEL_BITS)) << (shift + EVWHEEL_BITS)) | ((uint64_t)idx << shift);
+			if (tick > limit)
+				return evwheel_slot_first(&w->slots[level * EVWHEEL_SLOTS + idx]);
+			w->now = tick;
+			evwheel_cascade(w, level * EVWHEEL_SLOTS + idx);
+			break;
+		}
+		if (level < EVWHEEL_LEVELS)
+			continue;
+
+		/* Only far future events remain */
+		ev = evwheel_slot_first(&w->slots[EVWHEEL_OVERFLOW]);
+		tick = evwheel_tick(&ev->event_time);
+		if (tick > limit)
+			return ev;
+		w->now = tick;
+		evwheel_cascade(w, EVWHEEL_OVERFLOW);
+	}
+	return NULL;
+}
+
+static struct timed_event *evwheel_head(struct timed_event_wheel *w)
+{
+	struct timed_event *ev, *behind;
+	struct timespec current_time;
+
+	if (!w)
+		return NULL;
+	clock_gettime(EVENT_CLOCK_ID, &current_time);
+	ev = evwheel_advance(w, evwheel_tick(&current_time));
+	behind = evheap_head(w->behind);
+	if (!ev || (behind && evheap_compare(behind, ev) <= 0))
+		return behind;
+	return ev;
+}
+
+static struct timed_event_wheel *evwheel_create(uint64_t now)
+{
+	struct timed_event_wheel *w;
+	w = nm_calloc(1, sizeof(struct timed_event_wheel));
+	w->now = now;
+	w->behind = evheap_create();
+	return w;
+}
+
+/*
+ * Aborts all events of the wheel, slot by slot, without turning it.
+ * Their callbacks may schedule new events, so go on until none are left.
+ */
+static void evwheel_clear(struct timed_event_wheel *w)
+{
+	struct timed_event *ev;
+	unsigned int slot;
+
+	while (w->count > 0 || evheap_head(w->behind)) {
+		for (slot = 0; slot <= EVWHEEL_OVERFLOW; slot++) {
+			while ((ev = w->slots[slot].head) != NULL)
+				destroy_event(ev);
+		}
+		while ((ev = evheap_head(w->behind)) != NULL)
+			destroy_event(ev);
+	}
+}
+
+static void evwheel_destroy(struct timed_event_wheel *w)
+{
+	if (w == NULL)
+		return;
+	evheap_destroy(w->behind);
+	nm_free(w);
+}
+
+
+/******************************************************************/
+/*********************** QUEUE DISPATCHERS ************************/
+/******************************************************************/
+
+static inline void evqueue_add(struct timed_event *ev)
+{
+	if (event_wheel)
+		evwheel_add(event_wheel, ev);
+	else
+		evheap_add(event_queue, ev);
+}
+
+static inline void evqueue_remove(struct timed_event *ev)
+{
+	if (event_wheel)
+		evwheel_remove(event_wheel, ev);
+	else
+		evheap_remove(event_queue, ev);
+}
+
+static inline struct timed_event *evqueue_head(void)
+{
+	if (event_wheel)
+		return evwheel_head(event_wheel);
+	return evheap_head(event_queue);
+}
+
+
+
+/******************************************************************/
+/********************* EVENT LOOP STATISTICS **********************/
+/******************************************************************/
+
+static void event_loop_stats_free(void *ptr)
+{
+	struct event_loop_stats *st = ptr;
+	nm_free(st->name);
+	nm_free(st);
+}
+
+static struct event_loop_stats *event_loop_stats_get(GHashTable **table, gpointer func, const char *name)
+{
+	struct event_loop_stats *st;
+
+	if (!*table)
+		*table = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, event_loop_stats_free);
+	else if ((st = g_hash_table_lookup(*table, func)) != NULL)
+		return st;
+
+	st = nm_calloc(1, sizeof(*st));
+	if (name)
+		st->name = nm_strdup(name);
+	else
+		nm_asprintf(&st->name, "%p", func);
+	g_hash_table_insert(*table, func, st);
+	return st;
+}
+
+static inline void event_loop_stats_add(struct event_loop_stats *st, double ms)
+{
+	st->count++;
+	st->total_ms += ms;
+	if (ms > st->max_ms)
+		st->max_ms = ms;
+}
+
+/* the event is freed once it has run, so this is done up front */
+static struct event_loop_stats *event_loop_record_latency(timed_event *evt, double latency)
+{
+	struct event_loop_stats *st;
+	int i;
+
+	st = event_loop_stats_get(&event_callback_stats, (gpointer)evt->callback, evt->name);
+	st->total_latency += latency;
+	if (latency > st->max_latency)
+		st->max_latency = latency;
+
+	for (i = 0; i < EVENT_LATENCY_BUCKETS - 1; i++) {
+		if (latency < event_latency_buckets[i].limit)
+			break;
+	}
+	event_latency_histogram[i]++;
+	return st;
+}
+
+static void event_loop_record_handler(int fd, int (*handler)(int, int, void *), unsigned long usec)
+{
+	event_loop_stats_add(event_loop_stats_get(&event_handler_stats, (gpointer)handler, NULL), usec / 1000.0);
+}
+
+void event_loop_stats_name_handler(int (*handler)(int, int, void *), const char *name)
+{
+	struct event_loop_stats *st = event_loop_stats_get(&event_handler_stats, (gpointer)handler, name);
+	if (strcmp(st->name, name)) {
+		nm_free(st->name);
+		st->name = nm_strdup(name);
+	}
+}
+
+void event_loop_stats_foreach(enum nm_event_stats_type type, void (*fn)(struct event_loop_stats *, void *), void *arg)
+{
+	GHashTable *table = type == EVENT_STATS_HANDLERS ? event_handler_stats : event_callback_stats;
+	GHashTableIter iter;
+	gpointer st;
+
+	if (!table)
+		return;
+	g_hash_table_iter_init(&iter, table);
+	while (g_hash_table_iter_next(&iter, NULL, &st))
+		fn(st, arg);
+}
+
+const char *event_latency_bucket(int bucket, unsigned long *count)
+{
+	if (bucket < 0 || bucket >= EVENT_LATENCY_BUCKETS)
+		return NULL;
+	if (count)
+		*count = event_latency_histogram[bucket];
+	return event_latency_buckets[bucket].name;
+}
+
+static void event_loop_stats_clear(GHashTable *table)
+{
+	GHashTableIter iter;
+	gpointer ptr;
+
+	if (!table)
+		return;
+	g_hash_table_iter_init(&iter, table);
+	while (g_hash_table_iter_next(&iter, NULL, &ptr)) {
+		struct event_loop_stats *st = ptr;
+		st->count = 0;
+		st->total_ms = st->max_ms = 0.0;
+		st->total_latency = st->max_latency = 0.0;
+	}
+}
+
+/* names are kept, since handlers are only named when they're registered */
+void event_loop_stats_reset(void)
+{
+	event_loop_stats_clear(event_callback_stats);
+	event_loop_stats_clear(event_handler_stats);
+	memset(event_latency_histogram, 0, sizeof(event_latency_histogram));
+}
+
+void event_loop_stats_deinit(void)
+{
+	if (event_handler_stats)
+		g_hash_table_destroy(event_handler_stats);
+	event_handler_stats = NULL;
+}
 
 /******************************************************************/
 /************ EVENT SCHEDULING/HANDLING FUNCTIONS *****************/
 /******************************************************************/
 
-timed_event *schedule_event(time_t delay, event_callback callback, void *user_data)
+timed_event *schedule_event_named(time_t delay, event_callback callback, const char *name, void *user_data)
 {
 
 	timed_event *event;
 
-	g_return_val_if_fail(event_queue != NULL, NULL);
+	g_return_val_if_fail(event_queue != NULL || event_wheel != NULL, NULL);
 	g_return_val_if_fail(callback != NULL, NULL);
 
 	event = nm_calloc(1, sizeof(struct timed_event));
@@ -228,13 +715,20 @@ timed_event *schedule_event(time_t delay, event_callback callback, void *user_da
 	event->event_time.tv_sec += delay;
 
 	event->callback = callback;
+	event->name = name;
 	event->user_data = user_data;
 
-	evheap_add(event_queue, event);
+	evqueue_add(event);
 
 	return event;
 }
 
+/* for modules built against headers without the schedule_event() macro */
+timed_event *(schedule_event)(time_t delay, event_callback callback, void *user_data)
+{
+	return schedule_event_named(delay, callback, NULL, user_data);
+}
+
 long get_timed_event_time_left_ms(timed_event *ev)
 {
 	struct timespec current_time;
@@ -245,7 +739,7 @@ long get_timed_event_time_left_ms(timed_event *ev)
 /* Unschedule, execute and destroy event, given parameters of evprop */
 static void execute_and_destroy_event(struct nm_event_execution_properties *evprop)
 {
-	evheap_remove(event_queue, evprop->attributes.timed.event);
+	evqueue_remove(evprop->attributes.timed.event);
 	(*evprop->attributes.timed.event->callback)(evprop);
 	nm_free(evprop->attributes.timed.event);
 }
@@ -264,6 +758,15 @@ void destroy_event(timed_event *event)
 
 void init_event_queue(void)
 {
+	struct timespec current_time;
+
+	iobroker_set_profiler(nagios_iobs, event_loop_record_handler);
+
+	if (event_queue_backend == EVENT_QUEUE_WHEEL) {
+		clock_gettime(EVENT_CLOCK_ID, &current_time);
+		event_wheel = evwheel_create(evwheel_tick(&current_time));
+		return;
+	}
 	event_queue = evheap_create();
 }
 
@@ -274,14 +777,31 @@ void destroy_event_queue(void)
 	 * Since naemon doesn't know if things is started, we can't trust that
 	 * destroy event queue actually means we have an event queue to destroy
 	 */
-	if(event_queue == NULL)
+	if(event_queue == NULL && event_wheel == NULL)
 		return;
 
-	while((ev = evheap_head(event_queue)) != NULL) {
-		destroy_event(ev);
+	if (event_wheel) {
+		evwheel_clear(event_wheel);
+	} else {
+		while((ev = evheap_head(event_queue)) != NULL) {
+			destroy_event(ev);
+		}
 	}
 	evheap_destroy(event_queue);
 	event_queue = NULL;
+	evwheel_destroy(event_wheel);
+	event_wheel = NULL;
+
+	iobroker_set_profiler(nagios_iobs, NULL);
+	if (event_callback_stats)
+		g_hash_table_destroy(event_callback_stats);
+	event_callback_stats = NULL;
+	/*
+	 * handlers are named once, when they're registered, and some of
+	 * them are kept across reloads, so only their counters go here
+	 */
+	event_loop_stats_clear(event_handler_stats);
+	memset(event_latency_histogram, 0, sizeof(event_latency_histogram));
 }
 
 /**
@@ -291,14 +811,15 @@ void destroy_event_queue(void)
 static int event_poll_full(iobroker_set *iobs, long int timeout_ms)
 {
 	timed_event *evt;
-	struct timespec current_time;
+	struct timespec current_time, dispatch_start, run_start;
 	int64_t time_diff;
 	struct nm_event_execution_properties evprop;
-	int inputs;
+	struct event_loop_stats *stats;
+	int inputs, executed = 0;
 	clock_gettime(EVENT_CLOCK_ID, &current_time);
 
 	/* get next scheduled event */
-	evt = evheap_head(event_queue);
+	evt = evqueue_head();
 
 	if (evt) {
 		time_diff = timespec_msdiff(&evt->event_time, &current_time);
@@ -333,38 +854,47 @@ static int event_poll_full(iobroker_set *iobs, long int timeout_ms)
 	}
 	else if (inputs > 0) {
 		log_debug_info(DEBUGL_IPC, 2, "## %d descriptors had input\n", inputs);
-		/*
-		* Since we got input on one of the file descriptors, this wakeup wasn't
-		* about a timed event, so start the main loop over.
-		*/
-		log_debug_info(DEBUGL_EVENTS, 0, "Event was cancelled by iobroker input\n");
-		return 0;
 	}
 
 	/*
-	 * There were no timed events, so don't try to run them.
+	 * Run every event that was due when we woke up, regardless of whether
+	 * the wakeup was caused by iobroker input or not. Events scheduled by the
+	 * callbacks themselves are left for the next iteration, and the budget
+	 * makes sure we get back to polling the sockets in a timely manner.
 	 */
-	if (!evt) {
-		return 0;
-	}
+	clock_gettime(EVENT_CLOCK_ID, &dispatch_start);
+	current_time = dispatch_start;
+	while ((evt = evqueue_head()) != NULL) {
+		if (evt->event_time.tv_sec > dispatch_start.tv_sec ||
+		    (evt->event_time.tv_sec == dispatch_start.tv_sec && evt->event_time.tv_nsec > dispatch_start.tv_nsec))
+			break;
 
-	/*
-	 * Might have been a timeout just because the max time of polling
-	 */
-	clock_gettime(EVENT_CLOCK_ID, &current_time);
-	time_diff = timespec_msdiff(&evt->event_time, &current_time);
-	if (time_diff > 0)
-		return 0;
+		if (event_dispatch_max_events > 0 && executed >= event_dispatch_max_events) {
+			log_debug_info(DEBUGL_EVENTS, 1, "Event dispatch budget of %d events exhausted\n", event_dispatch_max_events);
+			break;
+		}
+		if (executed > 0 && timespec_msdiff(&current_time, &dispatch_start) >= event_dispatch_max_time) {
+			log_debug_info(DEBUGL_EVENTS, 1, "Event dispatch budget of %dms exhausted after %d events\n", event_dispatch_max_time, executed);
+			break;
+		}
 
-	/*
-	 * It isn't any special cases, so it's time to run the event
-	 */
-	evprop.event_type = EVENT_TYPE_TIMED;
-	evprop.execution_type = EVENT_EXEC_NORMAL;
-	evprop.user_data = evt->user_data;
-	evprop.attributes.timed.event = evt;
-	evprop.attributes.timed.latency = -time_diff/1000.0;
-	execute_and_destroy_event(&evprop);
+		/*
+		 * It isn't any special cases, so it's time to run the event
+		 */
+		time_diff = timespec_msdiff(&evt->event_time, &current_time);
+		evprop.event_type = EVENT_TYPE_TIMED;
+		evprop.execution_type = EVENT_EXEC_NORMAL;
+		evprop.user_data = evt->user_data;
+		evprop.attributes.timed.event = evt;
+		evprop.attributes.timed.latency = -time_diff/1000.0;
+		stats = event_loop_record_latency(evt, evprop.attributes.timed.latency);
+		run_start = current_time;
+		execute_and_destroy_event(&evprop);
+		executed++;
+
+		clock_gettime(EVENT_CLOCK_ID, &current_time);
+		event_loop_stats_add(stats, (current_time.tv_sec - run_start.tv_sec) * 1000.0 + (current_time.tv_nsec - run_start.tv_nsec) / 1000000.0);
+	}
 
 	return 0;
 }
@@ -14,6 +14,23 @@ NAGIOS_BEGIN_DECL
 
 extern iobroker_set *nagios_iobs;
 
+/* Data structures available for keeping the timed events in order */
+enum nm_event_queue_backend {
+	EVENT_QUEUE_HEAP, /* binary heap, O(log n) insert and removal */
+	EVENT_QUEUE_WHEEL, /* hierarchical timing wheel, O(1) insert and removal */
+};
+
+/* The backend to use, read when init_event_queue() is called */
+extern int event_queue_backend;
+
+/*
+ * Upper bounds for how many due events, and for how many milliseconds,
+ * event_poll() may run before it goes back to polling for input.
+ * A max_events value of 0 means there is no limit on the count.
+ */
+extern int event_dispatch_max_events;
+extern int event_dispatch_max_time;
+
 /* Set if execution of the callback is done normally because of timed event */
 enum nm_exec_type {
 	EVENT_EXEC_NORMAL, /* Everything was fine, the event is a proper event */
@@ -42,9 +59,14 @@ struct nm_event_execution_properties {
 typedef void (*event_callback)(struct nm_event_execution_properties *);
 
 /**
- * Schedule a timed event. At the given time, the callback is executed
+ * Schedule a timed event. At the given time, the callback is executed.
+ * The name is only used to tell callbacks apart in the event loop
+ * statistics; schedule_event() passes the callback's name.
  */
+timed_event *schedule_event_named(time_t delay, event_callback callback, const char *name, void *user_data);
 timed_event *schedule_event(time_t delay, event_callback callback, void *user_data);
+#define schedule_event(delay, callback, user_data) \
+	schedule_event_named(delay, callback, #callback, user_data)
 void destroy_event(timed_event *event);
 
 /**
@@ -55,6 +77,31 @@ void destroy_event(timed_event *event);
  */
 long get_timed_event_time_left_ms(timed_event *ev);
 
+/* Number of buckets in the timed event latency histogram */
+#define EVENT_LATENCY_BUCKETS 7
+
+/* Accumulated cost of a timed event callback or an I/O handler */
+struct event_loop_stats {
+	char *name;
+	unsigned long count;
+	double total_ms, max_ms; /* wall time spent running it */
+	double total_latency, max_latency; /* seconds late, timed events only */
+};
+
+enum nm_event_stats_type {
+	EVENT_STATS_CALLBACKS,
+	EVENT_STATS_HANDLERS,
+};
+
+void event_loop_stats_foreach(enum nm_event_stats_type type, void (*fn)(struct event_loop_stats *, void *), void *arg);
+/* Returns the name of a latency bucket and stores its count, or NULL past the last one */
+const char *event_latency_bucket(int bucket, unsigned long *count);
+/* Give an iobroker input handler a readable name in the statistics */
+void event_loop_stats_name_handler(int (*handler)(int, int, void *), const char *name);
+void event_loop_stats_reset(void);
+/* Forget the handler names, which destroy_event_queue() keeps for the next run */
+void event_loop_stats_deinit(void);
+
 /* Main function */
 void init_event_queue(void); /* creates the queue nagios_squeue */
 int event_poll(void); /* main monitoring/event handler loop */
@@ -30,6 +30,13 @@ extern objectlist *objcfg_dirs;
 extern unsigned int nofile_limit, nproc_limit, max_apps;
 
 extern int num_check_workers;
+extern int min_check_workers;
+extern int max_check_workers;
+extern char *persistent_plugins;
+extern int max_plugin_output_capture;
+extern int worker_ring_size;
+extern int coalesce_checks;
+extern int coalesce_checks_ttl;
 extern char *qh_socket_path;
 
 extern char *macro_user[MAX_USER_MACROS];
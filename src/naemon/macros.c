@@ -2274,6 +2274,52 @@ static int grab_macro_value_r(nagios_macros *mac, char *macro_buffer, char **out
 }
 
 
+/*
+ * grabs the value of a single macro and encodes or cleans it the
+ * way the options say. *output is NULL if there's nothing to insert,
+ * and must be freed if *free_macro is set afterwards
+ */
+static int expand_macro_r(nagios_macros *mac, char *macro_name, int options, char **output, int *free_macro)
+{
+	char *selected_macro = NULL, *original_macro;
+	int macro_options = 0, result;
+
+	*output = NULL;
+	*free_macro = FALSE;
+	result = grab_macro_value_r(mac, macro_name, &selected_macro, &macro_options, free_macro);
+	if (result != OK) {
+		if (*free_macro == TRUE)
+			nm_free(selected_macro);
+		*free_macro = FALSE;
+		return result;
+	}
+	if (selected_macro == NULL)
+		return OK;
+
+	/* URL encode the macro if requested - this allocates new memory */
+	if (options & URL_ENCODE_MACRO_CHARS) {
+		original_macro = selected_macro;
+		selected_macro = get_url_encoded_string(selected_macro);
+		if (*free_macro == TRUE)
+			nm_free(original_macro);
+		*free_macro = TRUE;
+	}
+
+	/* some macros should sometimes be cleaned */
+	if (macro_options & options & (STRIP_ILLEGAL_MACRO_CHARS | ESCAPE_MACRO_CHARS)) {
+		original_macro = selected_macro;
+		selected_macro = clean_macro_chars(original_macro, options);
+		if (*free_macro == TRUE)
+			nm_free(original_macro);
+		/* clean_macro_chars() doesn't allocate empty strings */
+		*free_macro = selected_macro && *selected_macro;
+	}
+
+	*output = selected_macro;
+	return OK;
+}
+
+
 /*
  * replace macros in notification commands with their values,
  * the thread-safe version
@@ -2286,10 +2332,8 @@ int process_macros_r(nagios_macros *mac, char *input_buffer, char **output_buffe
 	char *delim_ptr = NULL;
 	int in_macro = FALSE;
 	char *selected_macro = NULL;
-	char *original_macro = NULL;
 	int result = OK;
 	int free_macro = FALSE;
-	int macro_options = 0;
 
 	if (output_buffer == NULL || input_buffer == NULL)
 		return ERROR;
@@ -2340,10 +2384,7 @@ int process_macros_r(nagios_macros *mac, char *input_buffer, char **output_buffe
 		}
 
 		/* looks like we're in a macro, so process it... */
-		/* grab the macro value */
-		free_macro = FALSE;
-		selected_macro = NULL;
-		result = grab_macro_value_r(mac, temp_buffer, &selected_macro, &macro_options, &free_macro);
+		result = expand_macro_r(mac, temp_buffer, options, &selected_macro, &free_macro);
 		log_debug_info(DEBUGL_MACROS, 2, "  Processed '%s', Free: %d\n", temp_buffer, free_macro);
 
 		/**
@@ -2351,9 +2392,6 @@ int process_macros_r(nagios_macros *mac, char *input_buffer, char **output_buffe
 		 * doesn't exist, so continue on
 		 */
 		if (result != OK) {
-			if (free_macro == TRUE)
-				nm_free(selected_macro);
-
 			/* add the plain text to the end of the already processed buffer */
 			*output_buffer = nm_realloc(*output_buffer, strlen(*output_buffer) + strlen(temp_buffer) + 3);
 			strcat(*output_buffer, "$");
@@ -2369,45 +2407,11 @@ int process_macros_r(nagios_macros *mac, char *input_buffer, char **output_buffe
 
 		/* insert macro */
 		if (selected_macro != NULL) {
-			log_debug_info(DEBUGL_MACROS, 2, "  Processed '%s', Free: %d,  Cleaning options: %d\n", temp_buffer, free_macro, options);
-
-			/* URL encode the macro if requested - this allocates new memory */
-			if (options & URL_ENCODE_MACRO_CHARS) {
-				original_macro = selected_macro;
-				selected_macro = get_url_encoded_string(selected_macro);
-				if (free_macro == TRUE) {
-					nm_free(original_macro);
-				}
-				free_macro = TRUE;
-			}
-
-			/* some macros should sometimes be cleaned */
-			if (macro_options & options & (STRIP_ILLEGAL_MACRO_CHARS | ESCAPE_MACRO_CHARS)) {
-				char *cleaned_macro = NULL;
-
-				/* add the (cleaned) processed macro to the end of the already processed buffer */
-				if (selected_macro != NULL && (cleaned_macro = clean_macro_chars(selected_macro, options)) != NULL) {
-					*output_buffer = nm_realloc(*output_buffer, strlen(*output_buffer) + strlen(cleaned_macro) + 1);
-					strcat(*output_buffer, cleaned_macro);
-					if (*cleaned_macro)
-						free(cleaned_macro);
-
-					log_debug_info(DEBUGL_MACROS, 2, "  Cleaned macro.  Running output (%lu): '%s'\n", (unsigned long)strlen(*output_buffer), *output_buffer);
-				}
-			}
-
-			/* others are not cleaned */
-			else {
-				/* add the processed macro to the end of the already processed buffer */
-				if (selected_macro != NULL) {
-					*output_buffer = nm_realloc(*output_buffer, strlen(*output_buffer) + strlen(selected_macro) + 1);
-					strcat(*output_buffer, selected_macro);
+			/* add the processed macro to the end of the already processed buffer */
+			*output_buffer = nm_realloc(*output_buffer, strlen(*output_buffer) + strlen(selected_macro) + 1);
+			strcat(*output_buffer, selected_macro);
 
-					log_debug_info(DEBUGL_MACROS, 2, "  Uncleaned macro.  Running output (%lu): '%s'\n", (unsigned long)strlen(*output_buffer), *output_buffer);
-				}
-			}
-
-			/* free memory if necessary (if we URL encoded the macro or we were told to do so by grab_macro_value()) */
+			/* free memory if necessary (if we URL encoded or cleaned the macro or we were told to do so by grab_macro_value()) */
 			if (free_macro == TRUE)
 				nm_free(selected_macro);
 
@@ -2432,6 +2436,325 @@ int process_macros(char *input_buffer, char **output_buffer, int options)
 }
 
 
+/******************************************************************/
+/************************ ARGV TEMPLATES **************************/
+/******************************************************************/
+
+/*
+ * An argv template is a command line that has been unquoted and split
+ * into arguments up front, the way runcmd_cmd2strv() would split it,
+ * with its macros left as placeholders. Only command lines that can
+ * be split without knowing the macro values get one: anything that
+ * needs a shell, escaped dollar signs or backslashes in front of a
+ * macro all mean the command is run the old way.
+ */
+#define ARGV_TEXT  0 /* literal text for the current argument */
+#define ARGV_BREAK 1 /* end of an argument */
+#define ARGV_MACRO 2 /* macro to fill in */
+
+/* the quoting a macro is inside of */
+#define ARGV_UNQUOTED 0
+#define ARGV_SQUOTED  1
+#define ARGV_DQUOTED  2
+
+struct argv_step {
+	int type;
+	int quoting; /* for macros */
+	char *str; /* text, or the macro name */
+	size_t len;
+	size_t raw_start, raw_end; /* where the macro sits in the command line */
+};
+
+struct argv_template {
+	char *command_line;
+	unsigned int num_steps;
+	struct argv_step *steps;
+};
+
+/* a growing buffer for building strings with */
+struct argv_buf {
+	char *buf;
+	size_t len, size;
+};
+
+static void argv_buf_add(struct argv_buf *b, const char *str, size_t len)
+{
+	if (b->len + len + 1 > b->size) {
+		b->size = (b->len + len + 1) * 2;
+		b->buf = nm_realloc(b->buf, b->size);
+	}
+	memcpy(b->buf + b->len, str, len);
+	b->len += len;
+	b->buf[b->len] = 0;
+}
+
+static void argv_template_add_step(struct argv_template *tpl, int type, int quoting, const char *str, size_t len)
+{
+	struct argv_step *step;
+
+	tpl->steps = nm_realloc(tpl->steps, (tpl->num_steps + 1) * sizeof(*step));
+	step = &tpl->steps[tpl->num_steps++];
+	memset(step, 0, sizeof(*step));
+	step->type = type;
+	step->quoting = quoting;
+	if (str) {
+		step->str = nm_malloc(len + 1);
+		memcpy(step->str, str, len);
+		step->str[len] = 0;
+		step->len = len;
+	}
+}
+
+/* adds the text collected so far for the current argument */
+static void argv_template_flush(struct argv_template *tpl, struct argv_buf *text, int *pending)
+{
+	if (!*pending && !text->len)
+		return;
+	argv_template_add_step(tpl, ARGV_TEXT, 0, text->buf ? text->buf : "", text->len);
+	text->len = 0;
+	*pending = 0;
+}
+
+void free_argv_template(struct argv_template *tpl)
+{
+	unsigned int i;
+
+	if (!tpl)
+		return;
+	for (i = 0; i < tpl->num_steps; i++)
+		nm_free(tpl->steps[i].str);
+	nm_free(tpl->steps);
+	nm_free(tpl->command_line);
+	nm_free(tpl);
+}
+
+struct argv_template *compile_argv_template(const char *command_line)
+{
+	struct argv_template *tpl;
+	struct argv_buf text = { NULL, 0, 0 };
+	int quoting = ARGV_UNQUOTED, in_arg = FALSE, pending = FALSE, first_word = TRUE;
+	int args = 0, ok = TRUE;
+	const char *p, *end;
+
+	if (!command_line)
+		return NULL;
+
+	tpl = nm_calloc(1, sizeof(*tpl));
+	tpl->command_line = nm_strdup(command_line);
+
+	for (p = command_line; *p && ok; p++) {
+		if (*p == '$') {
+			/* macros are replaced before the command is split, wherever they are */
+			if (!(end = strchr(p + 1, '$')) || end == p + 1) {
+				ok = FALSE;
+				break;
+			}
+			argv_template_flush(tpl, &text, &pending);
+			argv_template_add_step(tpl, ARGV_MACRO, quoting, p + 1, end - p - 1);
+			tpl->steps[tpl->num_steps - 1].raw_start = p - command_line;
+			tpl->steps[tpl->num_steps - 1].raw_end = end + 1 - command_line;
+			if (quoting == ARGV_UNQUOTED)
+				in_arg = TRUE;
+			p = end;
+			continue;
+		}
+
+		if (quoting == ARGV_SQUOTED) {
+			if (*p == '\'')
+				quoting = ARGV_UNQUOTED;
+			else
+				argv_buf_add(&text, p, 1);
+			continue;
+		}
+
+		if (quoting == ARGV_DQUOTED) {
+			switch (*p) {
+			case '"':
+				quoting = ARGV_UNQUOTED;
+				break;
+			case '`':
+				ok = FALSE;
+				break;
+			case '\\':
+				if (p[1] == '$') {
+					ok = FALSE;
+				} else if (p[1] == '"' || p[1] == '\\' || p[1] == '`') {
+					argv_buf_add(&text, ++p, 1);
+				} else {
+					argv_buf_add(&text, p, 1);
+				}
+				break;
+			default:
+				argv_buf_add(&text, p, 1);
+			}
+			continue;
+		}
+
+		switch (*p) {
+		case ' ': case '\t': case '\r': case '\n':
+			if (in_arg) {
+				argv_template_flush(tpl, &text, &pending);
+				argv_template_add_step(tpl, ARGV_BREAK, 0, NULL, 0);
+				in_arg = FALSE;
+				first_word = FALSE;
+				args++;
+			}
+			break;
+		case '\\':
+			if (!p[1] || p[1] == '$') {
+				ok = FALSE;
+				break;
+			}
+			argv_buf_add(&text, ++p, 1);
+			in_arg = TRUE;
+			break;
+		case '\'':
+			quoting = ARGV_SQUOTED;
+			in_arg = pending = TRUE;
+			break;
+		case '"':
+			quoting = ARGV_DQUOTED;
+			in_arg = pending = TRUE;
+			break;
+		case '|': case '&': case ';': case '`': case '(': case ')': case '*': case '?':
+			ok = FALSE;
+			break;
+		case '=':
+			/* "VAR=value command" needs a shell */
+			if (first_word) {
+				ok = FALSE;
+				break;
+			}
+			/* fallthrough */
+		default:
+			argv_buf_add(&text, p, 1);
+			in_arg = TRUE;
+		}
+	}
+
+	if (quoting != ARGV_UNQUOTED)
+		ok = FALSE;
+	if (ok && in_arg) {
+		argv_template_flush(tpl, &text, &pending);
+		argv_template_add_step(tpl, ARGV_BREAK, 0, NULL, 0);
+		args++;
+	}
+	nm_free(text.buf);
+
+	if (!ok || !args) {
+		log_debug_info(DEBUGL_COMMANDS, 2, "No argv template for command line '%s'\n", command_line);
+		free_argv_template(tpl);
+		return NULL;
+	}
+	return tpl;
+}
+
+/* ends the current argument, if there is one */
+static void argv_end_arg(struct argv_buf *argv, int *started, unsigned int *argc)
+{
+	if (!*started)
+		return;
+	argv_buf_add(argv, "", 1);
+	*started = FALSE;
+	(*argc)++;
+}
+
+/*
+ * adds a macro's value to the current argument, the way runcmd_cmd2strv()
+ * would treat it with the quoting around it. Values that would change
+ * the meaning of the rest of the command line can't be handled here.
+ */
+static int argv_add_value(struct argv_buf *argv, const char *value, int quoting, int *started, unsigned int *argc)
+{
+	const char *p;
+
+	switch (quoting) {
+	case ARGV_SQUOTED:
+		if (strchr(value, '\''))
+			return ERROR;
+		argv_buf_add(argv, value, strlen(value));
+		return OK;
+	case ARGV_DQUOTED:
+		if (strpbrk(value, "\"\\$`"))
+			return ERROR;
+		argv_buf_add(argv, value, strlen(value));
+		return OK;
+	}
+
+	for (p = value; *p; p++) {
+		switch (*p) {
+		case ' ': case '\t': case '\r': case '\n':
+			argv_end_arg(argv, started, argc);
+			continue;
+		case '\'': case '"': case '\\': case '$':
+		case '|': case '&': case ';': case '`': case '(': case ')': case '*': case '?':
+			return ERROR;
+		case '=':
+			if (!*argc)
+				return ERROR;
+			break;
+		}
+		argv_buf_add(argv, p, 1);
+		*started = TRUE;
+	}
+	return OK;
+}
+
+int expand_argv_template_r(nagios_macros *mac, const struct argv_template *tpl, char **command_line, char **argv, size_t *argv_len, int options)
+{
+	struct argv_buf cmd = { NULL, 0, 0 }, args = { NULL, 0, 0 };
+	unsigned int i, argc = 0;
+	size_t raw_pos = 0;
+	int started = FALSE, result = OK;
+
+	if (!tpl || !command_line || !argv || !argv_len)
+		return ERROR;
+
+	for (i = 0; i < tpl->num_steps && result == OK; i++) {
+		const struct argv_step *step = &tpl->steps[i];
+		char *value;
+		int free_macro;
+
+		switch (step->type) {
+		case ARGV_TEXT:
+			argv_buf_add(&args, step->str, step->len);
+			started = TRUE;
+			break;
+		case ARGV_BREAK:
+			argv_end_arg(&args, &started, &argc);
+			break;
+		case ARGV_MACRO:
+			result = expand_macro_r(mac, step->str, options, &value, &free_macro);
+			if (result != OK)
+				break;
+			argv_buf_add(&cmd, tpl->command_line + raw_pos, step->raw_start - raw_pos);
+			raw_pos = step->raw_end;
+			if (value) {
+				argv_buf_add(&cmd, value, strlen(value));
+				result = argv_add_value(&args, value, step->quoting, &started, &argc);
+			}
+			if (free_macro == TRUE)
+				nm_free(value);
+			break;
+		}
+	}
+
+	/* a command that expands to nothing can't be run either */
+	if (result != OK || !argc) {
+		nm_free(cmd.buf);
+		nm_free(args.buf);
+		return ERROR;
+	}
+
+	argv_buf_add(&cmd, tpl->command_line + raw_pos, strlen(tpl->command_line + raw_pos));
+	log_debug_info(DEBUGL_MACROS, 1, "Expanded argv template into %u arguments: '%s'\n", argc, cmd.buf);
+	*command_line = cmd.buf;
+	*argv = args.buf;
+	*argv_len = args.len;
+	return OK;
+}
+
+
 /******************************************************************/
 /***************** MACRO INITIALIZATION FUNCTIONS *****************/
 /******************************************************************/
@@ -226,6 +226,18 @@ int process_macros_r(nagios_macros *mac, char *, char **, int);
 /* given a raw command line, determine the actual command to run */
 int get_raw_command_line_r(nagios_macros *mac, command *, char *, char **, int);
 
+/*
+ * Command lines that can be split into arguments without knowing their
+ * macro values are compiled into argv templates when the command is
+ * defined. Expanding one gives both the command line process_macros_r()
+ * would have given and its arguments, as argv_len bytes of nul-terminated
+ * strings. ERROR means this particular expansion has to be run through
+ * process_macros_r() and a shell-like parser after all.
+ */
+struct argv_template *compile_argv_template(const char *command_line);
+void free_argv_template(struct argv_template *tpl);
+int expand_argv_template_r(nagios_macros *mac, const struct argv_template *tpl, char **command_line, char **argv, size_t *argv_len, int options);
+
 /*
  * These functions updates *mac with the values from
  * their respective object type.
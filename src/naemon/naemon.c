@@ -11,6 +11,7 @@
 #include "nebmods.h"
 #include "nebmodules.h"
 #include "workers.h"
+#include "wproc_usage.h"
 #include "nerd.h"
 #include "query-handler.h"
 #include "configuration.h"
@@ -22,6 +23,7 @@
 #include "logging.h"
 #include "nm_alloc.h"
 #include "checks.h"
+#include "checks_parser.h"
 
 #include "worker/worker.h"
 
@@ -132,7 +134,7 @@ int main(int argc, char **argv)
 	time_t now;
 	char datestring[256];
 	nagios_macros *mac;
-	const char *worker_socket = NULL;
+	const char *worker_socket = NULL, *worker_rings = NULL;
 	int i;
 
 #ifdef HAVE_GETOPT_H
@@ -147,6 +149,7 @@ int main(int argc, char **argv)
 		{"use-precached-objects", no_argument, 0, 'u'},
 		{"enable-timing-point", no_argument, 0, 'T'},
 		{"worker", required_argument, 0, 'W'},
+		{"worker-rings", required_argument, 0, 'w'}, /* only passed on by the core */
 		{"allow-root", no_argument, 0, 'R'},
 		{0, 0, 0, 0}
 	};
@@ -200,6 +203,9 @@ int main(int argc, char **argv)
 		case 'W':
 			worker_socket = optarg;
 			break;
+		case 'w':
+			worker_rings = optarg;
+			break;
 		case 'R':
 			allow_root = TRUE;
 			break;
@@ -228,7 +234,7 @@ int main(int argc, char **argv)
 
 	/* if we're a worker we can skip everything below */
 	if (worker_socket) {
-		exit(nm_core_worker(worker_socket));
+		exit(nm_core_worker(worker_socket, worker_rings));
 	}
 
 	if (daemon_mode == FALSE) {
@@ -655,6 +661,15 @@ int main(int argc, char **argv)
 		init_check_stats();
 		timing_point("Initialized check stats\n");
 
+		/* let the worker pool follow the check load */
+		init_worker_pool();
+
+		/* account for the resources used by worker jobs */
+		wproc_usage_init();
+
+		/* parse check results off the main loop, if asked to */
+		checks_parser_init();
+
 		/* update all status data (with retained information) */
 		timing_point("Updating status data\n");
 		update_all_status_data();
@@ -728,6 +743,8 @@ int main(int argc, char **argv)
 		cleanup_status_data(!sigrestart);
 
 		registered_commands_deinit();
+		checks_deinit();
+		checks_parser_deinit();
 		free_worker_memory(WPROC_FORCE);
 		/* shutdown stuff... */
 		if (sigshutdown == TRUE) {
@@ -747,6 +764,7 @@ int main(int argc, char **argv)
 	} while (sigrestart == TRUE && sigshutdown == FALSE);
 
 	shutdown_command_file_worker();
+	event_loop_stats_deinit();
 
 	if (daemon_mode == TRUE)
 		unlink(lock_file);
@@ -12,6 +12,9 @@
 #include "checks.h"
 #include "checks_service.h"
 #include "checks_host.h"
+#include "checks_leveling.h"
+#include "checks_parser.h"
+#include "checks_passive.h"
 #include "commands.h"
 #include "comments.h"
 #include "common.h"
@@ -54,6 +57,7 @@
 #include "statusdata.h"
 #include "utils.h"
 #include "workers.h"
+#include "wproc_usage.h"
 
 #undef _NAEMON_H_INSIDE
 
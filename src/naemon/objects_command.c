@@ -1,6 +1,7 @@
 #include "objects_command.h"
 #include "nm_alloc.h"
 #include "logging.h"
+#include "macros.h"
 #include <string.h>
 #include <glib.h>
 
@@ -52,6 +53,7 @@ command *create_command(const char *name, const char *value)
 	/* assign vars */
 	new_command->name = nm_strdup(name);
 	new_command->command_line = nm_strdup(value);
+	new_command->argv_template = compile_argv_template(value);
 
 	return new_command;
 }
@@ -85,6 +87,7 @@ void destroy_command(command *this_command)
 		return;
 	nm_free(this_command->name);
 	nm_free(this_command->command_line);
+	free_argv_template(this_command->argv_template);
 	nm_free(this_command);
 }
 
@@ -20,11 +20,14 @@ typedef struct commandsmember commandsmember;
 extern struct command *command_list;
 extern struct command **command_ary;
 
+struct argv_template;
+
 struct command {
 	unsigned int id;
 	char    *name;
 	char    *command_line;
 	struct command *next;
+	struct argv_template *argv_template; /* see macros.h */
 };
 
 struct commandsmember {
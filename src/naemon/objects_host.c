@@ -26,6 +26,11 @@ int init_objects_host(int elems)
 void destroy_objects_host()
 {
 	unsigned int i;
+	/* with every host going away, nobody needs to find children to unlink */
+	for (i = 0; i < num_objects.hosts; i++) {
+		nm_free(host_ary[i]->children);
+		host_ary[i]->num_children = 0;
+	}
 	for (i = 0; i < num_objects.hosts; i++) {
 		host *this_host = host_ary[i];
 		destroy_host(this_host);
@@ -182,7 +187,7 @@ int setup_host_variables(host *new_host, const char *display_name, const char *a
 	new_host->obsess = (obsess > 0) ? TRUE : FALSE;
 	new_host->retain_status_information = (retain_status_information > 0) ? TRUE : FALSE;
 	new_host->retain_nonstatus_information = (retain_nonstatus_information > 0) ? TRUE : FALSE;
-	new_host->current_state = initial_state;
+	set_host_current_state(new_host, initial_state);
 	new_host->last_state = initial_state;
 	new_host->last_hard_state = initial_state;
 	new_host->current_attempt = (initial_state == STATE_UP) ? 1 : max_attempts;
@@ -273,6 +278,9 @@ void destroy_host(host *this_host)
 	while (this_host->hostgroups_ptr)
 		remove_host_from_hostgroup(this_host->hostgroups_ptr->object_ptr, this_host);
 
+	/* its children are unlinked below, so there's no need to look them up in here */
+	nm_free(this_host->children);
+	this_host->num_children = 0;
 	if (this_host->child_hosts) {
 		struct host *curhost = NULL;
 		do {
@@ -311,6 +319,7 @@ void destroy_host(host *this_host)
 	free_objectlist(&this_host->hostgroups_ptr);
 	free_objectlist(&this_host->notify_deps);
 	free_objectlist(&this_host->exec_deps);
+	free_objectlist(&this_host->master_deps);
 	free_objectlist(&this_host->escalation_list);
 	nm_free(this_host->check_command);
 	nm_free(this_host->event_handler);
@@ -354,23 +363,62 @@ int add_parent_to_host(host *hst, host *parent)
 		return ERROR;
 	}
 
+	/* a parent listed twice still only counts once */
+	if (g_tree_lookup(hst->parent_hosts, parent->name))
+		return OK;
+
 	g_tree_insert(hst->parent_hosts, g_strdup(parent->name), parent);
 	g_tree_insert(parent->child_hosts, g_strdup(hst->name), hst);
+	if (parent->current_state == STATE_UP)
+		hst->up_parents++;
+
+	/* the array doubles whenever it's full, which is at powers of two */
+	if (!(parent->num_children & (parent->num_children - 1)))
+		parent->children = nm_realloc(parent->children, (parent->num_children ? parent->num_children * 2 : 1) * sizeof(*parent->children));
+	parent->children[parent->num_children++] = hst;
 
 	return OK;
 }
 
 int remove_parent_from_host(host *hst, host *parent)
 {
+	unsigned int i;
+
 	if (hst->parent_hosts) {
-		g_tree_remove(hst->parent_hosts, parent->name);
+		if (g_tree_remove(hst->parent_hosts, parent->name) && parent->current_state == STATE_UP)
+			hst->up_parents--;
 	}
 	if (parent->child_hosts) {
 		g_tree_remove(parent->child_hosts, hst->name);
 	}
+	for (i = 0; i < parent->num_children; i++) {
+		if (parent->children[i] == hst) {
+			parent->children[i] = parent->children[--parent->num_children];
+			break;
+		}
+	}
 	return 0;
 }
 
+/*
+ * Every host counts its parents that are UP, so telling whether it can
+ * be reached doesn't take looking at them. Only a change between UP and
+ * anything else touches the counts, and only those of the host's own
+ * children.
+ */
+void set_host_current_state(host *hst, int state)
+{
+	unsigned int i;
+	int delta;
+
+	if ((hst->current_state == STATE_UP) != (state == STATE_UP)) {
+		delta = state == STATE_UP ? 1 : -1;
+		for (i = 0; i < hst->num_children; i++)
+			hst->children[i]->up_parents += delta;
+	}
+	hst->current_state = state;
+}
+
 /* add a new contactgroup to a host */
 contactgroupsmember *add_contactgroup_to_host(host *hst, char *group_name)
 {
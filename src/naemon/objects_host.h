@@ -30,6 +30,9 @@ struct host {
 	char    *address;
 	GTree   *parent_hosts; /* char * => struct host * */
 	GTree   *child_hosts; /* char * => struct host * */
+	int     up_parents; /* parent_hosts that are UP, see set_host_current_state() */
+	struct host **children; /* child_hosts again, as an array that's quick to go through */
+	unsigned int num_children;
 	struct servicesmember *services;
 	char    *check_command;
 	int     initial_state;
@@ -128,9 +131,16 @@ struct host {
 	struct objectlist *hostgroups_ptr;
 	/* objects we depend upon */
 	struct objectlist *exec_deps, *notify_deps;
+	/* of those, the ones failing, and the ones with a dependency_period or inherits_parent */
+	unsigned int failing_exec_deps, failing_notify_deps;
+	unsigned int conditional_exec_deps, conditional_notify_deps;
+	/* dependencies on this host, and the state they were last updated for */
+	struct objectlist *master_deps;
+	int     dependency_state;
 	struct objectlist *escalation_list;
 	struct  host *next;
 	struct timed_event *next_check_event;
+	struct timed_event *freshness_check_event;
 };
 
 static const struct flag_map host_flag_map[] = {
@@ -154,6 +164,13 @@ void destroy_host(host *this_host);
 
 int add_parent_to_host(host *, host *);
 int remove_parent_from_host(host *hst, host *parent);
+
+/*
+ * Sets a host's current_state, keeping count of the UP parents of its
+ * children. Anything that changes current_state once the host has
+ * children must go through here.
+ */
+void set_host_current_state(host *hst, int state);
 struct contactgroupsmember *add_contactgroup_to_host(host *, char *);
 struct contactsmember *add_contact_to_host(host *, char *);
 struct customvariablesmember *add_custom_variable_to_host(host *, char *, char *);
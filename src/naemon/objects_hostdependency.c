@@ -1,9 +1,49 @@
 #include "objects_hostdependency.h"
 #include "objects_timeperiod.h"
+#include "globals.h"
 #include "objectlist.h"
 #include "nm_alloc.h"
 #include "logging.h"
 
+/* the state of a host its dependencies go by */
+static int get_dependency_state(host *hst)
+{
+	/* use the last hard state while it's in a soft state */
+	if (hst->state_type == SOFT_STATE && soft_state_dependencies == FALSE)
+		return hst->last_hard_state;
+	return hst->current_state;
+}
+
+static void set_hostdependency_failing(hostdependency *dep, int failing)
+{
+	host *child = dep->dependent_host_ptr;
+	unsigned int *count;
+
+	if (dep->failing == failing)
+		return;
+	dep->failing = failing;
+	count = dep->dependency_type == NOTIFICATION_DEPENDENCY ? &child->failing_notify_deps : &child->failing_exec_deps;
+	if (failing)
+		(*count)++;
+	else
+		(*count)--;
+}
+
+void update_hostdependencies(host *master)
+{
+	objectlist *list;
+	int state = get_dependency_state(master);
+
+	/* failure options only look at the state, so nothing else can change */
+	if (state == master->dependency_state)
+		return;
+	master->dependency_state = state;
+	for (list = master->master_deps; list; list = list->next) {
+		hostdependency *dep = (hostdependency *)list->object_ptr;
+		set_hostdependency_failing(dep, flag_isset(dep->failure_options, 1 << state) ? TRUE : FALSE);
+	}
+}
+
 hostdependency *add_host_dependency(char *dependent_host_name, char *host_name, int dependency_type, int inherits_parent, int failure_options, char *dependency_period)
 {
 	hostdependency *new_hostdependency = NULL;
@@ -57,6 +97,17 @@ hostdependency *add_host_dependency(char *dependent_host_name, char *host_name,
 		return result == OBJECTLIST_DUPE ? (void *)1 : NULL;
 	}
 
+	/* the master's dependencies are up to date with its state after this */
+	update_hostdependencies(parent);
+	prepend_object_to_objectlist(&parent->master_deps, new_hostdependency);
+	set_hostdependency_failing(new_hostdependency, flag_isset(failure_options, 1 << parent->dependency_state) ? TRUE : FALSE);
+	if (tp || new_hostdependency->inherits_parent == TRUE) {
+		if (new_hostdependency->dependency_type == NOTIFICATION_DEPENDENCY)
+			child->conditional_notify_deps++;
+		else
+			child->conditional_exec_deps++;
+	}
+
 	new_hostdependency->id = num_objects.hostdependencies++;
 	return new_hostdependency;
 }
@@ -24,6 +24,7 @@ struct hostdependency {
 	char    *dependency_period;
 	int     inherits_parent;
 	int     failure_options;
+	int     failing; /* the master is in one of the failure states */
 	struct host    *master_host_ptr;
 	struct host    *dependent_host_ptr;
 	struct timeperiod *dependency_period_ptr;
@@ -32,6 +33,13 @@ struct hostdependency {
 struct hostdependency *add_host_dependency(char *dependent_host_name, char *host_name, int dependency_type, int inherits_parent, int failure_options, char *dependency_period);
 void destroy_hostdependency(hostdependency *this_hostdependency);
 
+/*
+ * Updates which of the dependencies on a host are failing, and the
+ * counts of failing dependencies of the hosts that depend on it.
+ * This has to be called whenever the state of the host changes.
+ */
+void update_hostdependencies(struct host *master);
+
 void fcache_hostdependency(FILE *fp, const struct hostdependency *temp_hostdependency);
 
 NAGIOS_END_DECL
@@ -319,6 +319,7 @@ void destroy_service(service *this_service)
 	free_objectlist(&this_service->servicegroups_ptr);
 	free_objectlist(&this_service->notify_deps);
 	free_objectlist(&this_service->exec_deps);
+	free_objectlist(&this_service->master_deps);
 	free_objectlist(&this_service->escalation_list);
 	nm_free(this_service->event_handler);
 	nm_free(this_service->notes);
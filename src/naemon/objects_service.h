@@ -119,9 +119,16 @@ struct service {
 	struct timeperiod *notification_period_ptr;
 	struct objectlist *servicegroups_ptr;
 	struct objectlist *exec_deps, *notify_deps;
+	/* of those, the ones failing, and the ones with a dependency_period or inherits_parent */
+	unsigned int failing_exec_deps, failing_notify_deps;
+	unsigned int conditional_exec_deps, conditional_notify_deps;
+	/* dependencies on this service, and the state they were last updated for */
+	struct objectlist *master_deps;
+	int     dependency_state;
 	struct objectlist *escalation_list;
 	struct service *next;
 	struct timed_event *next_check_event;
+	struct timed_event *freshness_check_event;
 };
 
 struct servicesmember {
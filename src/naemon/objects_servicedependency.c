@@ -1,9 +1,49 @@
 #include "objects_servicedependency.h"
 #include "objects_timeperiod.h"
+#include "globals.h"
 #include "objectlist.h"
 #include "nm_alloc.h"
 #include "logging.h"
 
+/* the state of a service its dependencies go by */
+static int get_dependency_state(service *svc)
+{
+	/* use the last hard state while it's in a soft state */
+	if (svc->state_type == SOFT_STATE && soft_state_dependencies == FALSE)
+		return svc->last_hard_state;
+	return svc->current_state;
+}
+
+static void set_servicedependency_failing(servicedependency *dep, int failing)
+{
+	service *child = dep->dependent_service_ptr;
+	unsigned int *count;
+
+	if (dep->failing == failing)
+		return;
+	dep->failing = failing;
+	count = dep->dependency_type == NOTIFICATION_DEPENDENCY ? &child->failing_notify_deps : &child->failing_exec_deps;
+	if (failing)
+		(*count)++;
+	else
+		(*count)--;
+}
+
+void update_servicedependencies(service *master)
+{
+	objectlist *list;
+	int state = get_dependency_state(master);
+
+	/* failure options only look at the state, so nothing else can change */
+	if (state == master->dependency_state)
+		return;
+	master->dependency_state = state;
+	for (list = master->master_deps; list; list = list->next) {
+		servicedependency *dep = (servicedependency *)list->object_ptr;
+		set_servicedependency_failing(dep, flag_isset(dep->failure_options, 1 << state) ? TRUE : FALSE);
+	}
+}
+
 servicedependency *add_service_dependency(char *dependent_host_name, char *dependent_service_description, char *host_name, char *service_description, int dependency_type, int inherits_parent, int failure_options, char *dependency_period)
 {
 	servicedependency *new_servicedependency = NULL;
@@ -67,6 +107,17 @@ servicedependency *add_service_dependency(char *dependent_host_name, char *depen
 		return result == OBJECTLIST_DUPE ? (void *)1 : NULL;
 	}
 
+	/* the master's dependencies are up to date with its state after this */
+	update_servicedependencies(parent);
+	prepend_object_to_objectlist(&parent->master_deps, new_servicedependency);
+	set_servicedependency_failing(new_servicedependency, flag_isset(failure_options, 1 << parent->dependency_state) ? TRUE : FALSE);
+	if (tp || new_servicedependency->inherits_parent == TRUE) {
+		if (new_servicedependency->dependency_type == NOTIFICATION_DEPENDENCY)
+			child->conditional_notify_deps++;
+		else
+			child->conditional_exec_deps++;
+	}
+
 	new_servicedependency->id = num_objects.servicedependencies++;
 	return new_servicedependency;
 }
@@ -26,6 +26,7 @@ struct servicedependency {
 	char    *dependency_period;
 	int     inherits_parent;
 	int     failure_options;
+	int     failing; /* the master is in one of the failure states */
 	struct service *master_service_ptr;
 	struct service *dependent_service_ptr;
 	struct timeperiod *dependency_period_ptr;
@@ -34,6 +35,13 @@ struct servicedependency {
 struct servicedependency *add_service_dependency(char *dependent_host_name, char *dependent_service_description, char *host_name, char *service_description, int dependency_type, int inherits_parent, int failure_options, char *dependency_period);
 void destroy_servicedependency(servicedependency *this_servicedependency);
 
+/*
+ * Updates which of the dependencies on a service are failing, and the
+ * counts of failing dependencies of the services that depend on it.
+ * This has to be called whenever the state of the service changes.
+ */
+void update_servicedependencies(struct service *master);
+
 void fcache_servicedependency(FILE *fp, const struct servicedependency *temp_servicedependency);
 NAGIOS_END_DECL
 #endif
@@ -363,6 +363,53 @@ static int qh_command(int sd, char *buf, unsigned int len)
 	return 404;
 }
 
+static void qh_loopstats_print(struct event_loop_stats *st, void *sd_)
+{
+	int sd = *(int *)sd_;
+
+	nsock_printf(sd, "name=%s;count=%lu;total_ms=%.3f;avg_ms=%.3f;max_ms=%.3f",
+	             st->name, st->count, st->total_ms, st->count ? st->total_ms / st->count : 0.0, st->max_ms);
+	if (st->total_latency > 0.0 || st->max_latency > 0.0)
+		nsock_printf(sd, ";avg_latency=%.3f;max_latency=%.3f",
+		             st->count ? st->total_latency / st->count : 0.0, st->max_latency);
+	nsock_printf(sd, "\n");
+}
+
+static int qh_loopstats(int sd, char *buf, unsigned int len)
+{
+	const char *name;
+	unsigned long count;
+	int i;
+
+	if (!*buf || !strcmp(buf, "help")) {
+		nsock_printf_nul(sd, "Query handler for event loop statistics.\n"
+		                 "Available commands:\n"
+		                 "  callbacks   Runs, wall time (ms) and latency (s) per timed event callback\n"
+		                 "  handlers    Runs and wall time (ms) per I/O handler\n"
+		                 "  latency     Histogram of how late timed events were run\n"
+		                 "  reset       Reset all counters\n"
+		                );
+		return 0;
+	}
+
+	if (!strcmp(buf, "callbacks")) {
+		event_loop_stats_foreach(EVENT_STATS_CALLBACKS, qh_loopstats_print, &sd);
+	} else if (!strcmp(buf, "handlers")) {
+		event_loop_stats_foreach(EVENT_STATS_HANDLERS, qh_loopstats_print, &sd);
+	} else if (!strcmp(buf, "latency")) {
+		for (i = 0; (name = event_latency_bucket(i, &count)) != NULL; i++)
+			nsock_printf(sd, "%s%s=%lu", i ? ";" : "", name, count);
+		nsock_printf(sd, "\n");
+	} else if (!strcmp(buf, "reset")) {
+		event_loop_stats_reset();
+		return 200;
+	} else {
+		return 404;
+	}
+	nsock_printf(sd, "%c", 0);
+	return 0;
+}
+
 int qh_init(const char *path)
 {
 	int result, old_umask;
@@ -401,11 +448,14 @@ int qh_init(const char *path)
 	}
 
 	nm_log(NSLOG_INFO_MESSAGE, "qh: Socket '%s' successfully initialized\n", path);
+	event_loop_stats_name_handler(qh_registration_input, "qh listener");
+	event_loop_stats_name_handler(qh_input, "qh");
 
 	/* now register our the in-core handlers */
 	qh_register_handler("command", "Naemon external commands interface", 0, qh_command);
 	qh_register_handler("echo", "The Echo Service - What You Put Is What You Get", 0, qh_echo);
 	qh_register_handler("help", "Help for the query handler", 0, qh_help);
+	qh_register_handler("loopstats", "Event loop latency and callback cost", 0, qh_loopstats);
 
 	return 0;
 }
@@ -18,6 +18,9 @@
 #include "utils.h"
 #include "commands.h"
 #include "events.h"
+#include "checks_leveling.h"
+#include "checks_parser.h"
+#include "wproc_usage.h"
 #include "logging.h"
 #include "defaults.h"
 #include "globals.h"
@@ -47,6 +50,13 @@ objectlist *objcfg_dirs = NULL;
 int upipe_fd[2];
 
 int num_check_workers = 0; /* auto-decide */
+int min_check_workers = DEFAULT_MIN_CHECK_WORKERS;
+int max_check_workers = DEFAULT_MAX_CHECK_WORKERS; /* 0 means a fixed size pool */
+char *persistent_plugins = NULL;
+int max_plugin_output_capture = DEFAULT_MAX_PLUGIN_OUTPUT_CAPTURE;
+int worker_ring_size = DEFAULT_WORKER_RING_SIZE; /* 0 means core workers use their socket */
+int coalesce_checks = DEFAULT_COALESCE_CHECKS;
+int coalesce_checks_ttl = DEFAULT_COALESCE_CHECKS_TTL;
 char *qh_socket_path = NULL; /* disabled */
 
 char *ocsp_command = NULL;
@@ -935,6 +945,8 @@ void cleanup(void)
 {
 	/* free event queue data */
 	destroy_event_queue();
+	checks_leveling_deinit();
+	wproc_usage_deinit();
 
 	/* unload modules */
 	if (verify_config == FALSE) {
@@ -1008,6 +1020,8 @@ void free_memory(nagios_macros *mac)
 	nm_free(illegal_object_chars);
 	nm_free(illegal_output_chars);
 
+	nm_free(persistent_plugins);
+
 	/* free file/path variables */
 	nm_free(status_file);
 	nm_free(debug_file);
@@ -1107,6 +1121,19 @@ int reset_variables(void)
 
 	check_reaper_interval = DEFAULT_CHECK_REAPER_INTERVAL;
 	max_check_reaper_time = DEFAULT_MAX_REAPER_TIME;
+	event_dispatch_max_events = DEFAULT_EVENT_DISPATCH_MAX_EVENTS;
+	event_dispatch_max_time = DEFAULT_EVENT_DISPATCH_MAX_TIME;
+	event_queue_backend = DEFAULT_EVENT_QUEUE_BACKEND;
+	min_check_workers = DEFAULT_MIN_CHECK_WORKERS;
+	max_check_workers = DEFAULT_MAX_CHECK_WORKERS;
+	max_plugin_output_capture = DEFAULT_MAX_PLUGIN_OUTPUT_CAPTURE;
+	worker_ring_size = DEFAULT_WORKER_RING_SIZE;
+	coalesce_checks = DEFAULT_COALESCE_CHECKS;
+	coalesce_checks_ttl = DEFAULT_COALESCE_CHECKS_TTL;
+	check_load_leveling = DEFAULT_CHECK_LOAD_LEVELING;
+	check_load_leveling_window = DEFAULT_CHECK_LOAD_LEVELING_WINDOW;
+	usage_dump_interval = DEFAULT_USAGE_DUMP_INTERVAL;
+	check_result_parser_threads = DEFAULT_CHECK_RESULT_PARSER_THREADS;
 	max_check_result_file_age = DEFAULT_MAX_CHECK_RESULT_AGE;
 	service_freshness_check_interval = DEFAULT_FRESHNESS_CHECK_INTERVAL;
 	host_freshness_check_interval = DEFAULT_FRESHNESS_CHECK_INTERVAL;
@@ -8,8 +8,13 @@
  * code that can be reused for other things later.
  */
 #include "workers.h"
+#include "wproc_usage.h"
 #include "config.h"
 #include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
 #include "query-handler.h"
 #include "utils.h"
 #include "logging.h"
@@ -19,6 +24,7 @@
 #include "events.h"
 #include "lib/worker.h"
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
 /* perfect hash function for wproc response codes */
@@ -31,38 +37,147 @@ struct wproc_job {
 	unsigned int id;
 	unsigned int timeout;
 	char *command;
+	char *argv; /**< nul-terminated arguments for the command, or NULL */
+	size_t argv_len;
+	int persistent; /**< run by a persistent instance of argv[0] */
 	void (*callback)(struct wproc_result *, void *, int);
 	void *data;
-	struct wproc_worker *wp;
+	struct wproc_worker *wp; /**< NULL while the job waits for credits */
+	struct timeval due; /**< when the job was first handed to us */
+	unsigned long seq;  /**< orders jobs that came due at the same time */
+	time_t deadline;    /**< when its result is overdue, while on a worker */
+	unsigned int inflight_pos; /**< index into inflight.jobs, or NO_SLOT */
+};
+
+/*
+ * A worker's jobs live in an array of slots that grows as needed, up
+ * to max_jobs. A job's id is its slot number, with the generation of
+ * the slot in the bits above it. The generation is bumped whenever a
+ * job leaves its slot, so a late result for a job that's gone won't
+ * be taken for the one that has got the slot since. Free slots are
+ * reused oldest first.
+ */
+#define NO_SLOT UINT_MAX
+
+struct wproc_job_slot {
+	struct wproc_job *job;
+	unsigned int gen;
+	unsigned int next_free;
+};
+
+struct wproc_job_table {
+	struct wproc_job_slot *slots;
+	unsigned int size;    /**< slots allocated */
+	unsigned int max;     /**< slots we may allocate */
+	unsigned int running; /**< slots in use */
+	unsigned int bits;    /**< bits of a job id holding the slot number */
+	unsigned int free_head, free_tail; /**< oldest and newest free slot */
 };
 
 struct wproc_list;
 
+/* a worker's place in one of the lists it takes jobs from */
+struct wproc_membership {
+	struct wproc_list *list;
+	unsigned int pos; /**< index into list->wps */
+};
+
 struct wproc_worker {
 	char *name; /**< check-source name of this worker */
 	int sd;     /**< communication socket */
 	pid_t pid;  /**< pid */
-	int max_jobs; /**< Max number of jobs the worker can handle */
+	int max_jobs; /**< Max number of jobs the worker can handle, its credits */
 	int jobs_started; /**< jobs started */
-	int job_index; /**< round-robin slot allocator (this wraps) */
 	nm_bufferqueue *bq;  /**< bufferqueue for reading from worker */
-	GHashTable *jobs; /**< array of jobs */
-	struct wproc_list *wp_list;
+	struct wproc_job_table jobs; /**< jobs running on this worker */
+	double runtime_avg; /**< moving average of recent job runtimes, in ms */
+	struct wproc_membership *lists; /**< lists this worker is in */
+	unsigned int num_lists;
+	int binary;   /**< talks in binary frames rather than kvvecs */
+	int core;     /**< spawned by us, so we may retire it */
+	int retiring; /**< takes no new jobs, and leaves once drained */
+	struct worker_rings *rings; /**< shared memory rings, for core workers */
 };
 
+/*
+ * The workers in a list are kept as a binary min-heap ordered on load,
+ * so wps[0] is always the least loaded worker.
+ *
+ * Each worker has as many credits as the number of jobs it said it
+ * could take when it registered, and uses up one for every job it's
+ * running. Jobs that come due while every worker in their list is out
+ * of credits wait in the list's pending heap, ordered on when they
+ * came due, and are handed out oldest first as credits come back.
+ */
 struct wproc_list {
 	unsigned int len;
-	unsigned int idx;
 	struct wproc_worker **wps;
+	struct wproc_job **pending;
+	unsigned int num_pending, pending_size;
 };
 
-static struct wproc_list workers = {0, 0, NULL};
+static struct wproc_list workers = {0, NULL, NULL, 0, 0};
 
 static GHashTable *specialized_workers;
+/* pid -> struct worker_rings, for core workers that haven't registered yet */
+static GHashTable *pending_rings;
 static struct wproc_list *to_remove = NULL;
+/* command -> struct coalesced_run, the command being owned by the run */
+static GHashTable *coalesced_runs;
+/* runs that are done, oldest first, as they all expire after the same ttl */
+static GQueue coalesced_done = G_QUEUE_INIT;
+static unsigned long coalesce_hits, coalesce_misses;
 
 unsigned int wproc_num_workers_online = 0, wproc_num_workers_desired = 0;
 unsigned int wproc_num_workers_spawned = 0;
+unsigned int wproc_num_jobs_pending = 0;
+
+/*
+ * Each resize interval, the pool is sized after the number of jobs
+ * running, or the average number of jobs running during the interval
+ * if that's higher, aiming for WPROC_POOL_TARGET_JOBS per worker.
+ * Jobs no worker could take always grow the pool. Surplus workers are
+ * retired one at a time, and only once the pool has been too large
+ * for WPROC_POOL_SHRINK_INTERVALS intervals in a row.
+ */
+#define WPROC_POOL_RESIZE_INTERVAL 10
+#define WPROC_POOL_TARGET_JOBS 32
+#define WPROC_POOL_SHRINK_INTERVALS 6
+
+static struct {
+	pid_t *spawned;   /**< core workers that haven't registered yet */
+	unsigned int num_spawned;
+	pid_t *retired;   /**< retired workers we haven't reaped yet */
+	unsigned int num_retired;
+	unsigned long backlog; /**< jobs no worker could take */
+	double busy_ms;   /**< runtime of jobs done this interval */
+	struct timeval last_resize;
+	unsigned int surplus_intervals;
+	double demand;    /**< jobs running at the last resize */
+} pool;
+
+/*
+ * Jobs on a worker are also kept in a binary min-heap ordered on when
+ * their results are overdue: WPROC_ORPHAN_SLACK seconds after their
+ * timeout, which the worker enforces. A job still running then is an
+ * orphan, whose result is never coming back. One event fires at the
+ * earliest of those deadlines, so orphans are found as they come
+ * about, without looking at any of the jobs that aren't overdue.
+ */
+#define WPROC_ORPHAN_SLACK 600
+
+static struct {
+	struct wproc_job **jobs;
+	unsigned int len, size;
+	timed_event *event; /**< fires at event_at, if there is one */
+	time_t event_at;
+} inflight;
+
+static int spawn_core_worker(void);
+static void wproc_drain_pending(struct wproc_list *wpl);
+static void wproc_credits_returned(struct wproc_worker *wp);
+static void wproc_requeue_job(struct wproc_job *job);
+static void free_coalesced_runs(void);
 
 #define tv2float(tv) ((float)((tv)->tv_sec) + ((float)(tv)->tv_usec) / 1000000.0)
 
@@ -84,14 +199,96 @@ static void wproc_logdump_buffer(int debuglevel, int verbosity, const char *pref
 	}
 }
 
-static int get_job_id(struct wproc_worker *wp)
+static void job_table_init(struct wproc_job_table *jt, int max_jobs)
+{
+	memset(jt, 0, sizeof(*jt));
+	jt->max = max_jobs > 0 ? max_jobs : 0;
+	while (jt->bits < 31 && (1U << jt->bits) < jt->max)
+		jt->bits++;
+	jt->free_head = jt->free_tail = NO_SLOT;
+}
+
+static inline unsigned int job_slot(const struct wproc_job_table *jt, unsigned int job_id)
+{
+	return job_id & ((1U << jt->bits) - 1);
+}
+
+/* generations wrap so job ids stay positive ints */
+static inline unsigned int job_gen_mask(const struct wproc_job_table *jt)
+{
+	return jt->bits >= 31 ? 0 : (1U << (31 - jt->bits)) - 1;
+}
+
+static int job_table_grow(struct wproc_job_table *jt)
+{
+	unsigned int i, size = jt->size ? jt->size * 2 : 64;
+
+	if (size > jt->max)
+		size = jt->max;
+	if (size <= jt->size)
+		return -1;
+
+	jt->slots = nm_realloc(jt->slots, size * sizeof(*jt->slots));
+	for (i = jt->size; i < size; i++) {
+		jt->slots[i].job = NULL;
+		jt->slots[i].gen = 0;
+		jt->slots[i].next_free = i + 1;
+	}
+	jt->slots[size - 1].next_free = NO_SLOT;
+	/* we only grow once we're out of free slots */
+	jt->free_head = jt->size;
+	jt->free_tail = size - 1;
+	jt->size = size;
+	return 0;
+}
+
+/* puts the job in a free slot, which gives it its id */
+static int job_table_add(struct wproc_job_table *jt, struct wproc_job *job)
+{
+	struct wproc_job_slot *s;
+	unsigned int slot;
+
+	if (jt->free_head == NO_SLOT && job_table_grow(jt) < 0)
+		return -1;
+
+	slot = jt->free_head;
+	s = &jt->slots[slot];
+	jt->free_head = s->next_free;
+	if (jt->free_head == NO_SLOT)
+		jt->free_tail = NO_SLOT;
+	s->job = job;
+	job->id = (s->gen << jt->bits) | slot;
+	jt->running++;
+	return 0;
+}
+
+static void job_table_release(struct wproc_job_table *jt, unsigned int slot)
 {
-	return wp->job_index++;
+	struct wproc_job_slot *s = &jt->slots[slot];
+
+	s->job = NULL;
+	s->gen = (s->gen + 1) & job_gen_mask(jt);
+	s->next_free = NO_SLOT;
+	if (jt->free_tail == NO_SLOT)
+		jt->free_head = slot;
+	else
+		jt->slots[jt->free_tail].next_free = slot;
+	jt->free_tail = slot;
+	jt->running--;
 }
 
 static struct wproc_job *get_job(struct wproc_worker *wp, int job_id)
 {
-	return g_hash_table_lookup(wp->jobs, GINT_TO_POINTER(job_id));
+	struct wproc_job_table *jt = &wp->jobs;
+	struct wproc_job *job;
+	unsigned int slot = job_slot(jt, job_id);
+
+	if (job_id < 0 || slot >= jt->size)
+		return NULL;
+	job = jt->slots[slot].job;
+	if (!job || job->id != (unsigned int)job_id)
+		return NULL;
+	return job;
 }
 
 
@@ -127,33 +324,293 @@ static struct wproc_list *get_wproc_list(const char *cmd)
 	return wp_list ? wp_list : &workers;
 }
 
-static struct wproc_worker *get_worker(const char *cmd)
+/*
+ * A worker's load is how long we expect it to take to finish the jobs
+ * it has, judging by how long its recent jobs took. This keeps slow
+ * plugins from piling up on one worker, which the plain number of
+ * running jobs wouldn't. Full workers can't take any more jobs at all.
+ */
+static double wproc_load(const struct wproc_worker *wp)
 {
-	struct wproc_list *wp_list;
-	struct wproc_worker *worker = NULL;
-	size_t i, boundary;
+	unsigned int running = wp->jobs.running;
+
+	if (running >= (unsigned int)wp->max_jobs || wp->retiring)
+		return DBL_MAX;
+	return running * (wp->runtime_avg > 1.0 ? wp->runtime_avg : 1.0);
+}
+
+static int wproc_less_loaded(const struct wproc_worker *a, const struct wproc_worker *b)
+{
+	double la = wproc_load(a), lb = wproc_load(b);
+
+	if (la != lb)
+		return la < lb;
+	return a->jobs.running < b->jobs.running;
+}
+
+static struct wproc_membership *wproc_membership(struct wproc_worker *wp, struct wproc_list *wpl)
+{
+	unsigned int i;
+
+	for (i = 0; i < wp->num_lists; i++) {
+		if (wp->lists[i].list == wpl)
+			return &wp->lists[i];
+	}
+	return NULL;
+}
+
+static void wproc_list_swap(struct wproc_list *wpl, unsigned int a, unsigned int b)
+{
+	struct wproc_worker *tmp = wpl->wps[a];
 
+	wpl->wps[a] = wpl->wps[b];
+	wpl->wps[b] = tmp;
+	wproc_membership(wpl->wps[a], wpl)->pos = a;
+	wproc_membership(wpl->wps[b], wpl)->pos = b;
+}
+
+/* restore the heap order after the load of the worker at pos changed */
+static void wproc_list_sift(struct wproc_list *wpl, unsigned int pos)
+{
+	unsigned int child, best;
+
+	while (pos > 0 && wproc_less_loaded(wpl->wps[pos], wpl->wps[(pos - 1) / 2])) {
+		wproc_list_swap(wpl, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+
+	for (;;) {
+		best = pos;
+		child = 2 * pos + 1;
+		if (child < wpl->len && wproc_less_loaded(wpl->wps[child], wpl->wps[best]))
+			best = child;
+		if (child + 1 < wpl->len && wproc_less_loaded(wpl->wps[child + 1], wpl->wps[best]))
+			best = child + 1;
+		if (best == pos)
+			break;
+		wproc_list_swap(wpl, pos, best);
+		pos = best;
+	}
+}
+
+/* the worker is put last; call wproc_load_changed() once it's set up */
+static void wproc_list_add(struct wproc_list *wpl, struct wproc_worker *wp)
+{
+	wpl->wps = nm_realloc(wpl->wps, (wpl->len + 1) * sizeof(struct wproc_worker *));
+	wpl->wps[wpl->len] = wp;
+	wp->lists = nm_realloc(wp->lists, (wp->num_lists + 1) * sizeof(struct wproc_membership));
+	wp->lists[wp->num_lists].list = wpl;
+	wp->lists[wp->num_lists].pos = wpl->len;
+	wp->num_lists++;
+	wpl->len++;
+}
+
+static void wproc_list_remove(struct wproc_list *wpl, struct wproc_worker *wp)
+{
+	struct wproc_membership *m = wproc_membership(wp, wpl);
+	unsigned int pos;
+
+	if (!m)
+		return;
+	pos = m->pos;
+	*m = wp->lists[--wp->num_lists];
+
+	if (pos != --wpl->len) {
+		wpl->wps[pos] = wpl->wps[wpl->len];
+		wproc_membership(wpl->wps[pos], wpl)->pos = pos;
+		wproc_list_sift(wpl, pos);
+	}
+}
+
+/* call whenever a worker's jobs or runtime change */
+static void wproc_load_changed(struct wproc_worker *wp)
+{
+	unsigned int i;
+
+	for (i = 0; i < wp->num_lists; i++)
+		wproc_list_sift(wp->lists[i].list, wp->lists[i].pos);
+}
+
+/* the least loaded worker in a list, if it has credits left */
+static struct wproc_worker *list_worker(struct wproc_list *wp_list)
+{
+	struct wproc_worker *worker;
+
+	if (!wp_list || !wp_list->wps || !wp_list->len)
+		return NULL;
+
+	/* if the least loaded worker is full, they all are */
+	worker = wp_list->wps[0];
+	if (wproc_load(worker) == DBL_MAX)
+		return NULL;
+
+	return worker;
+}
+
+static struct wproc_worker *get_worker(const char *cmd)
+{
 	if (!cmd)
 		return NULL;
 
-	wp_list = get_wproc_list(cmd);
-	if (!wp_list || !wp_list->wps || !wp_list->len)
+	return list_worker(get_wproc_list(cmd));
+}
+
+static int job_due_before(const struct wproc_job *a, const struct wproc_job *b)
+{
+	if (a->due.tv_sec != b->due.tv_sec)
+		return a->due.tv_sec < b->due.tv_sec;
+	if (a->due.tv_usec != b->due.tv_usec)
+		return a->due.tv_usec < b->due.tv_usec;
+	return a->seq < b->seq;
+}
+
+static void pending_push(struct wproc_list *wpl, struct wproc_job *job)
+{
+	unsigned int pos = wpl->num_pending, parent;
+
+	if (pos == wpl->pending_size) {
+		wpl->pending_size = pos ? pos * 2 : 16;
+		wpl->pending = nm_realloc(wpl->pending, wpl->pending_size * sizeof(*wpl->pending));
+	}
+	for (; pos > 0; pos = parent) {
+		parent = (pos - 1) / 2;
+		if (!job_due_before(job, wpl->pending[parent]))
+			break;
+		wpl->pending[pos] = wpl->pending[parent];
+	}
+	wpl->pending[pos] = job;
+	wpl->num_pending++;
+	wproc_num_jobs_pending++;
+}
+
+static struct wproc_job *pending_pop(struct wproc_list *wpl)
+{
+	struct wproc_job *top, *last;
+	unsigned int pos = 0, child;
+
+	if (!wpl->num_pending)
 		return NULL;
+	top = wpl->pending[0];
+	last = wpl->pending[--wpl->num_pending];
+	wproc_num_jobs_pending--;
+	for (child = 1; child < wpl->num_pending; pos = child, child = 2 * pos + 1) {
+		if (child + 1 < wpl->num_pending && job_due_before(wpl->pending[child + 1], wpl->pending[child]))
+			child++;
+		if (!job_due_before(wpl->pending[child], last))
+			break;
+		wpl->pending[pos] = wpl->pending[child];
+	}
+	wpl->pending[pos] = last;
+	return top;
+}
 
-	/* Try to find a worker that is not overloaded. We go one lap around the
-	 * list before giving up. */
-	i = boundary = wp_list->idx % wp_list->len;
-	do {
-		i = (i + 1) % wp_list->len;
-		if (g_hash_table_size(wp_list->wps[i]->jobs) < (unsigned int) wp_list->wps[i]->max_jobs) {
-			/* We found one! */
-			wp_list->idx = i;
-			worker = wp_list->wps[i];
+static void oldest_pending(gpointer key, gpointer value, gpointer data)
+{
+	struct wproc_list *wpl = (struct wproc_list *)value;
+	struct wproc_job **oldest = (struct wproc_job **)data;
+
+	if (wpl->num_pending && (!*oldest || job_due_before(wpl->pending[0], *oldest)))
+		*oldest = wpl->pending[0];
+}
+
+/* how long the job that has waited the longest for a credit has waited, in seconds */
+static double wproc_pending_age(void)
+{
+	struct wproc_job *oldest = NULL;
+	struct timeval now;
+
+	oldest_pending(NULL, &workers, &oldest);
+	if (specialized_workers)
+		g_hash_table_foreach(specialized_workers, oldest_pending, &oldest);
+	if (!oldest)
+		return 0.0;
+	gettimeofday(&now, NULL);
+	return tv_delta_f(&oldest->due, &now);
+}
+
+static int inflight_before(const struct wproc_job *a, const struct wproc_job *b)
+{
+	if (a->deadline != b->deadline)
+		return a->deadline < b->deadline;
+	return a->seq < b->seq;
+}
+
+static inline void inflight_set(unsigned int pos, struct wproc_job *job)
+{
+	inflight.jobs[pos] = job;
+	job->inflight_pos = pos;
+}
+
+static void inflight_sift(unsigned int pos)
+{
+	struct wproc_job *job = inflight.jobs[pos];
+	unsigned int parent, child;
+
+	for (; pos > 0; pos = parent) {
+		parent = (pos - 1) / 2;
+		if (!inflight_before(job, inflight.jobs[parent]))
 			break;
-		}
-	} while (i != boundary);
+		inflight_set(pos, inflight.jobs[parent]);
+	}
+	for (child = 2 * pos + 1; child < inflight.len; pos = child, child = 2 * pos + 1) {
+		if (child + 1 < inflight.len && inflight_before(inflight.jobs[child + 1], inflight.jobs[child]))
+			child++;
+		if (!inflight_before(inflight.jobs[child], job))
+			break;
+		inflight_set(pos, inflight.jobs[child]);
+	}
+	inflight_set(pos, job);
+}
 
-	return worker;
+static void wproc_orphan_event(struct nm_event_execution_properties *evprop);
+
+/* makes sure the orphan event fires no later than the earliest deadline */
+static void inflight_arm(void)
+{
+	time_t now, deadline;
+
+	if (!inflight.len)
+		return;
+	deadline = inflight.jobs[0]->deadline;
+	if (inflight.event && inflight.event_at <= deadline)
+		return;
+	if (inflight.event)
+		destroy_event(inflight.event);
+	now = time(NULL);
+	inflight.event = schedule_event(deadline > now ? deadline - now : 0, wproc_orphan_event, NULL);
+	inflight.event_at = deadline;
+}
+
+/* jobs without a timeout can't be overdue, so they're left out */
+static void inflight_add(struct wproc_job *job)
+{
+	if (!job->timeout)
+		return;
+	if (inflight.len == inflight.size) {
+		inflight.size = inflight.size ? inflight.size * 2 : 64;
+		inflight.jobs = nm_realloc(inflight.jobs, inflight.size * sizeof(*inflight.jobs));
+	}
+	job->deadline = time(NULL) + job->timeout + WPROC_ORPHAN_SLACK;
+	inflight_set(inflight.len++, job);
+	inflight_sift(inflight.len - 1);
+	inflight_arm();
+}
+
+/*
+ * The orphan event is left alone; if it fires without anything being
+ * overdue, it just waits for the next deadline instead
+ */
+static void inflight_remove(struct wproc_job *job)
+{
+	unsigned int pos = job->inflight_pos;
+
+	if (pos == NO_SLOT)
+		return;
+	job->inflight_pos = NO_SLOT;
+	if (pos == --inflight.len)
+		return;
+	inflight_set(pos, inflight.jobs[inflight.len]);
+	inflight_sift(pos);
 }
 
 static void run_job_callback(struct wproc_job *job, struct wproc_result *wpres, int val)
@@ -175,9 +632,64 @@ static void destroy_job(gpointer job_)
 	run_job_callback(job, NULL, 0);
 
 	nm_free(job->command);
+	nm_free(job->argv);
 	free(job);
 }
 
+/* takes the job off its worker and destroys it */
+static void remove_job(struct wproc_worker *wp, struct wproc_job *job)
+{
+	inflight_remove(job);
+	job_table_release(&wp->jobs, job_slot(&wp->jobs, job->id));
+	destroy_job(job);
+}
+
+static void job_table_destroy(struct wproc_job_table *jt)
+{
+	unsigned int i;
+
+	for (i = 0; i < jt->size; i++) {
+		if (!jt->slots[i].job)
+			continue;
+		inflight_remove(jt->slots[i].job);
+		destroy_job(jt->slots[i].job);
+	}
+	nm_free(jt->slots);
+	jt->size = jt->running = 0;
+	jt->free_head = jt->free_tail = NO_SLOT;
+}
+
+/*
+ * Gives up on the jobs whose results are overdue. Their callbacks get
+ * a NULL result with WPROC_ORPHANED set, so whoever started them can
+ * start over right away, and their workers get the credits back. A
+ * result that does turn up after all is dropped, as the job's id is
+ * gone by then.
+ */
+static void wproc_orphan_event(struct nm_event_execution_properties *evprop)
+{
+	struct wproc_worker *wp;
+	struct wproc_job *job;
+	time_t now;
+
+	inflight.event = NULL;
+	if (evprop->execution_type != EVENT_EXEC_NORMAL)
+		return;
+
+	now = time(NULL);
+	while (inflight.len && inflight.jobs[0]->deadline <= now) {
+		job = inflight.jobs[0];
+		wp = job->wp;
+		nm_log(NSLOG_RUNTIME_WARNING, "wproc: Job %u on worker %s was due back %lus ago, giving up on it: %s\n",
+		       job->id, wp->name, (unsigned long)(now - job->deadline + WPROC_ORPHAN_SLACK), job->command);
+		run_job_callback(job, NULL, WPROC_ORPHANED);
+		remove_job(wp, job);
+		wproc_load_changed(wp);
+		wproc_credits_returned(wp);
+	}
+	inflight_arm();
+}
+
 static int wproc_is_alive(struct wproc_worker *wp)
 {
 	if (!wp || !wp->pid)
@@ -187,6 +699,22 @@ static int wproc_is_alive(struct wproc_worker *wp)
 	return 0;
 }
 
+/* the core's ends of a worker's rings; registered ones go through the iobroker */
+static void wproc_rings_free(gpointer data)
+{
+	struct worker_rings *wr = (struct worker_rings *)data;
+
+	if (!wr)
+		return;
+	if (nagios_iobs && iobroker_is_registered(nagios_iobs, wr->results.efd))
+		iobroker_close(nagios_iobs, wr->results.efd);
+	else
+		close(wr->results.efd);
+	close(wr->jobs.efd);
+	worker_rings_destroy(wr);
+	nm_free(wr);
+}
+
 static int wproc_destroy(struct wproc_worker *wp, int flags)
 {
 	int i = 0, force = 0, self;
@@ -205,8 +733,11 @@ static int wproc_destroy(struct wproc_worker *wp, int flags)
 	nm_bufferqueue_destroy(wp->bq);
 	wp->bq = NULL;
 	nm_free(wp->name);
-	g_hash_table_destroy(wp->jobs);
-	wp->jobs = NULL;
+	job_table_destroy(&wp->jobs);
+	nm_free(wp->lists);
+	wp->num_lists = 0;
+	wproc_rings_free(wp->rings);
+	wp->rings = NULL;
 
 	/* workers must never control other workers, so they return early */
 	if (self != nagios_pid)
@@ -237,25 +768,229 @@ static gboolean remove_specialized(gpointer key, gpointer value, gpointer data)
 	return value == data;
 }
 
-/* remove worker from job assignment list */
+/* remove worker from all job assignment lists it's in */
 static void remove_worker(struct wproc_worker *worker)
 {
-	unsigned int i, j = 0;
-	struct wproc_list *wpl = worker->wp_list;
-	for (i = 0; i < wpl->len; i++) {
-		if (wpl->wps[i] == worker)
+	struct wproc_list *wpl;
+
+	while (worker->num_lists) {
+		wpl = worker->lists[0].list;
+		wproc_list_remove(wpl, worker);
+
+		if (!specialized_workers || wpl->len || wpl == &workers)
+			continue;
+
+		to_remove = wpl;
+		g_hash_table_foreach_remove(specialized_workers, remove_specialized, to_remove);
+
+		/* with the list gone, its jobs are for the general workers */
+		while (wpl->num_pending)
+			pending_push(&workers, pending_pop(wpl));
+		nm_free(wpl->pending);
+		wpl->pending_size = 0;
+		wproc_drain_pending(&workers);
+	}
+}
+
+
+static void pool_add_pid(pid_t **pids, unsigned int *num, pid_t pid)
+{
+	if (pid <= 0)
+		return;
+	*pids = nm_realloc(*pids, (*num + 1) * sizeof(pid_t));
+	(*pids)[(*num)++] = pid;
+}
+
+static int pool_del_pid(pid_t *pids, unsigned int *num, pid_t pid)
+{
+	unsigned int i;
+
+	for (i = 0; i < *num; i++) {
+		if (pids[i] == pid) {
+			pids[i] = pids[--(*num)];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* forget about the processes that have exited */
+static void pool_reap(pid_t *pids, unsigned int *num)
+{
+	unsigned int i = 0;
+	pid_t ret;
+
+	while (i < *num) {
+		ret = waitpid(pids[i], NULL, WNOHANG);
+		if (ret == pids[i] || (ret < 0 && errno == ECHILD)) {
+			/* a core worker that died before it registered */
+			if (pending_rings)
+				g_hash_table_remove(pending_rings, GINT_TO_POINTER(pids[i]));
+			pids[i] = pids[--(*num)];
+		} else
+			i++;
+	}
+}
+
+/*
+ * Let a drained worker go. Closing its socket makes it exit on its
+ * own; it's reaped on a later resize, so we never block waiting for it.
+ */
+static void wproc_retire(struct wproc_worker *wp)
+{
+	log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: Retiring worker %s\n", wp->name);
+	remove_worker(wp);
+	iobroker_close(nagios_iobs, wp->sd);
+	wproc_rings_free(wp->rings);
+	pool_add_pid(&pool.retired, &pool.num_retired, wp->pid);
+	wproc_num_workers_online--;
+
+	nm_bufferqueue_destroy(wp->bq);
+	nm_free(wp->name);
+	job_table_destroy(&wp->jobs);
+	nm_free(wp->lists);
+	free(wp);
+}
+
+/* workers that aren't retiring, and how many jobs they're running */
+static unsigned int pool_active(unsigned int *running)
+{
+	unsigned int i, active = 0;
+
+	*running = 0;
+	for (i = 0; i < workers.len; i++) {
+		if (workers.wps[i]->retiring)
 			continue;
-		wpl->wps[j++] = wpl->wps[i];
+		active++;
+		*running += workers.wps[i]->jobs.running;
+	}
+	return active;
+}
+
+/* how many workers we'd like, given the demand for them */
+static unsigned int wproc_pool_want(double demand, unsigned long backlog, unsigned int active)
+{
+	unsigned int want, min = min_check_workers > 1 ? min_check_workers : 1;
+
+	want = (unsigned int)ceil(demand / WPROC_POOL_TARGET_JOBS);
+	if (backlog && want <= active)
+		want = active + 1;
+	if (want < min)
+		want = min;
+	if (max_check_workers > 0 && want > (unsigned int)max_check_workers)
+		want = max_check_workers;
+	return want;
+}
+
+/*
+ * Spawns or retires core workers until there are want of them that
+ * take jobs. Retiring workers are taken back before new ones are
+ * spawned, and the ones with the fewest jobs are retired first.
+ */
+static void wproc_pool_resize(unsigned int want)
+{
+	struct wproc_worker *wp;
+	unsigned int i, running, active;
+
+	wproc_num_workers_desired = want;
+	active = pool_active(&running);
+
+	while (active < want) {
+		for (i = 0; i < workers.len && !workers.wps[i]->retiring; i++)
+			;
+		if (i == workers.len)
+			break;
+		wp = workers.wps[i];
+		wp->retiring = FALSE;
+		wproc_load_changed(wp);
+		wproc_credits_returned(wp);
+		active++;
+	}
+	for (i = active + pool.num_spawned; i < want; i++) {
+		if (spawn_core_worker() < 0)
+			break;
+	}
+
+	while (active > want) {
+		struct wproc_worker *victim = NULL;
+
+		for (i = 0; i < workers.len; i++) {
+			wp = workers.wps[i];
+			if (!wp->core || wp->retiring)
+				continue;
+			if (!victim || wp->jobs.running < victim->jobs.running)
+				victim = wp;
+		}
+		if (!victim)
+			break;
+		victim->retiring = TRUE;
+		wproc_load_changed(victim);
+		if (!victim->jobs.running)
+			wproc_retire(victim);
+		active--;
 	}
-	wpl->len = j;
+}
 
-	if (!specialized_workers || wpl->len)
+static void wproc_pool_event(struct nm_event_execution_properties *evprop)
+{
+	struct timeval now;
+	double elapsed_ms;
+	unsigned int running, active, want;
+
+	if (evprop->execution_type != EVENT_EXEC_NORMAL)
 		return;
+	schedule_event(WPROC_POOL_RESIZE_INTERVAL, wproc_pool_event, NULL);
+
+	pool_reap(pool.spawned, &pool.num_spawned);
+	pool_reap(pool.retired, &pool.num_retired);
+
+	gettimeofday(&now, NULL);
+	elapsed_ms = tv_delta_msec(&pool.last_resize, &now);
+	active = pool_active(&running);
+	pool.demand = running;
+	if (elapsed_ms > 0 && pool.busy_ms / elapsed_ms > pool.demand)
+		pool.demand = pool.busy_ms / elapsed_ms;
+
+	if (wproc_num_jobs_pending) {
+		nm_log(NSLOG_RUNTIME_WARNING, "wproc: %u jobs are waiting for a free worker, the oldest one for %.2fs\n",
+		       wproc_num_jobs_pending, wproc_pending_age());
+	}
 
-	to_remove = wpl;
-	g_hash_table_foreach_remove(specialized_workers, remove_specialized, to_remove);
+	if (max_check_workers > 0) {
+		want = wproc_pool_want(pool.demand, pool.backlog + wproc_num_jobs_pending, active);
+		if (want < active && ++pool.surplus_intervals < WPROC_POOL_SHRINK_INTERVALS)
+			want = active;
+		else if (want < active)
+			want = active - 1;
+		if (want >= active)
+			pool.surplus_intervals = 0;
+		if (want != active) {
+			log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: Resizing pool from %u to %u workers (%.2f jobs running, %lu backlog)\n",
+			               active, want, pool.demand, pool.backlog);
+			wproc_pool_resize(want);
+		}
+	}
+
+	pool.backlog = 0;
+	pool.busy_ms = 0;
+	pool.last_resize = now;
 }
 
+void init_worker_pool(void)
+{
+	gettimeofday(&pool.last_resize, NULL);
+	schedule_event(WPROC_POOL_RESIZE_INTERVAL, wproc_pool_event, NULL);
+}
+
+static void destroy_pending(gpointer key, gpointer value, gpointer data)
+{
+	struct wproc_list *wpl = (struct wproc_list *)value;
+
+	while (wpl->num_pending)
+		destroy_job(pending_pop(wpl));
+	nm_free(wpl->pending);
+	wpl->pending_size = 0;
+}
 
 /*
  * This gets called from both parent and worker process, so
@@ -263,6 +998,10 @@ static void remove_worker(struct wproc_worker *worker)
  */
 void free_worker_memory(int flags)
 {
+	destroy_pending(NULL, &workers, NULL);
+	if (specialized_workers)
+		g_hash_table_foreach(specialized_workers, destroy_pending, NULL);
+
 	if (workers.wps) {
 		unsigned int i;
 
@@ -278,9 +1017,19 @@ void free_worker_memory(int flags)
 	}
 	g_hash_table_foreach_remove(specialized_workers, remove_specialized, NULL);
 	g_hash_table_destroy(specialized_workers);
+	if (pending_rings)
+		g_hash_table_destroy(pending_rings);
+	pending_rings = NULL;
 	workers.wps = NULL;
 	workers.len = 0;
-	workers.idx = 0;
+	nm_free(pool.spawned);
+	nm_free(pool.retired);
+	memset(&pool, 0, sizeof(pool));
+	/* the orphan event, if any, is aborted along with the event queue */
+	nm_free(inflight.jobs);
+	inflight.len = inflight.size = 0;
+	/* after the workers, as their jobs hand their runs a NULL result */
+	free_coalesced_runs();
 }
 
 static int str2timeval(char *str, struct timeval *tv)
@@ -367,6 +1116,9 @@ static int parse_worker_result(wproc_result *wpres, struct kvvec *kvv)
 		case WPRES_ru_stime:
 			str2timeval(value, &wpres->rusage.ru_stime);
 			break;
+		case WPRES_ru_maxrss:
+			wpres->rusage.ru_maxrss = atol(value);
+			break;
 		case WPRES_ru_minflt:
 			wpres->rusage.ru_minflt = atoi(value);
 			break;
@@ -406,12 +1158,176 @@ static int parse_worker_result(wproc_result *wpres, struct kvvec *kvv)
 	return 0;
 }
 
-static struct wproc_job *create_job(void (*callback)(struct wproc_result *, void *, int), void *data, time_t timeout, const char *cmd);
+/*
+ * parses a binary result frame. Like parse_worker_result(), this
+ * points into the frame, so it must outlive wpres. Returns 0 for
+ * results, 1 for frames that have been dealt with here, and < 0
+ * for broken ones.
+ */
+static int parse_worker_frame(struct wproc_worker *wp, wproc_result *wpres, char *buf, size_t size)
+{
+	struct worker_result_frame *res = (struct worker_result_frame *)buf;
+	char *str;
+
+	if (size < sizeof(struct worker_frame))
+		return -1;
+	if (res->hdr.type == WORKER_FRAME_LOG) {
+		/* log lines aren't terminated in the frame */
+		log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: %s: %.*s\n", wp->name,
+		               (int)(size - sizeof(struct worker_frame)), buf + sizeof(struct worker_frame));
+		return 1;
+	}
+	if (res->hdr.type != WORKER_FRAME_RESULT) {
+		nm_log(NSLOG_RUNTIME_WARNING, "wproc: Unrecognized frame type %u from %s\n", res->hdr.type, wp->name);
+		return 1;
+	}
+	if (size < sizeof(*res) ||
+	    size - sizeof(*res) < (size_t)res->outstd_len + res->outerr_len + res->error_msg_len + 3)
+		return -1;
+
+	/* each of the strings must end where its length says it does */
+	str = buf + sizeof(*res);
+	if (str[res->outstd_len] ||
+	    str[(size_t)res->outstd_len + res->outerr_len + 1] ||
+	    str[(size_t)res->outstd_len + res->outerr_len + res->error_msg_len + 2])
+		return -1;
+
+	wpres->job_id = res->job_id;
+	wpres->wait_status = res->wait_status;
+	wpres->error_code = res->error_code;
+	wpres->exited_ok = !!(res->hdr.flags & WORKER_RESULT_EXITED_OK);
+	wpres->start.tv_sec = res->start_sec;
+	wpres->start.tv_usec = res->start_usec;
+	wpres->stop.tv_sec = res->stop_sec;
+	wpres->stop.tv_usec = res->stop_usec;
+	wpres->rusage.ru_utime.tv_sec = res->ru_utime_sec;
+	wpres->rusage.ru_utime.tv_usec = res->ru_utime_usec;
+	wpres->rusage.ru_stime.tv_sec = res->ru_stime_sec;
+	wpres->rusage.ru_stime.tv_usec = res->ru_stime_usec;
+	wpres->rusage.ru_minflt = res->ru_minflt;
+	wpres->rusage.ru_majflt = res->ru_majflt;
+	wpres->rusage.ru_inblock = res->ru_inblock;
+	wpres->rusage.ru_oublock = res->ru_oublock;
+	wpres->rusage.ru_maxrss = res->ru_maxrss;
+
+	str = buf + sizeof(*res);
+	wpres->outstd = str;
+	str += res->outstd_len + 1;
+	wpres->outerr = str;
+	str += res->outerr_len + 1;
+	if (res->error_msg_len) {
+		wpres->exited_ok = FALSE;
+		wpres->error_msg = str;
+	}
+	return 0;
+}
+
+static struct wproc_job *create_job(void (*callback)(struct wproc_result *, void *, int), void *data, time_t timeout, const char *cmd, const char *argv, size_t argv_len);
 static int wproc_run_job(struct wproc_job *job, nagios_macros *mac);
 
+/* hands a parsed result to whoever started the job */
+static void wproc_handle_result(struct wproc_worker *wp, wproc_result *wpres)
+{
+	struct wproc_job *job;
+	char *error_reason = NULL;
+	double runtime_ms;
+
+	job = get_job(wp, wpres->job_id);
+	if (!job) {
+		nm_log(NSLOG_RUNTIME_WARNING, "wproc: Job with id '%d' doesn't exist on %s.\n", wpres->job_id, wp->name);
+		return;
+	}
+	/* binary results don't echo the command back to us */
+	if (!wpres->command)
+		wpres->command = job->command;
+
+	/*
+	 * ETIME ("Timer expired") doesn't really happen
+	 * on any modern systems, so we reuse it to mean
+	 * "program timed out"
+	 */
+	if (wpres->error_code == ETIME) {
+		wpres->early_timeout = TRUE;
+	}
+
+	if (wpres->early_timeout) {
+		nm_asprintf(&error_reason, "timed out after %.2fs", tv_delta_f(&wpres->start, &wpres->stop));
+	} else if (WIFSIGNALED(wpres->wait_status)) {
+		nm_asprintf(&error_reason, "died by signal %d%s after %.2f seconds",
+		         WTERMSIG(wpres->wait_status),
+		         WCOREDUMP(wpres->wait_status) ? " (core dumped)" : "",
+		         tv_delta_f(&wpres->start, &wpres->stop));
+	}
+	if (error_reason) {
+		log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: job %d from worker %s %s",
+				job->id, wp->name, error_reason);
+		log_debug_info(DEBUGL_IPC, DEBUGV_MORE, "wproc:   command: %s\n", job->command);
+		log_debug_info(DEBUGL_IPC, DEBUGV_MORE, "wproc:   early_timeout=%d; exited_ok=%d; wait_status=%d; error_code=%d;\n",
+		      wpres->early_timeout, wpres->exited_ok, wpres->wait_status, wpres->error_code);
+		wproc_logdump_buffer(DEBUGL_IPC, DEBUGV_MORE, "wproc:   stderr", wpres->outerr);
+		wproc_logdump_buffer(DEBUGL_IPC, DEBUGV_MORE, "wproc:   stdout", wpres->outstd);
+	}
+	nm_free(error_reason);
+
+	/* weigh in the runtime of this job, smoothed over the last few */
+	runtime_ms = tv_delta_f(&wpres->start, &wpres->stop) * 1000;
+	wp->runtime_avg += (runtime_ms - wp->runtime_avg) / 8;
+	pool.busy_ms += runtime_ms;
+	wproc_usage_add(WPROC_USAGE_WORKERS, wp->name, wpres);
+
+	run_job_callback(job, wpres, 0);
+	remove_job(wp, job);
+	wproc_load_changed(wp);
+	wproc_credits_returned(wp);
+}
+
+/*
+ * Handles the frames in a worker's result ring where they are, and
+ * returns < 0 if the ring is broken
+ */
+static int wproc_drain_ring(struct wproc_worker *wp)
+{
+	char *buf;
+	size_t size;
+	int ret;
+
+	worker_ring_clear(&wp->rings->results);
+	while (!(ret = worker_ring_peek(&wp->rings->results, &buf, &size))) {
+		wproc_result wpres;
+
+		memset(&wpres, 0, sizeof(wpres));
+		wpres.job_id = -1;
+		wpres.source = wp->name;
+		if ((ret = parse_worker_frame(wp, &wpres, buf, size)) < 0)
+			break;
+		if (!ret)
+			wproc_handle_result(wp, &wpres);
+		worker_ring_consume(&wp->rings->results, size);
+	}
+	return ret < 0 ? -1 : 0;
+}
+
+static int handle_worker_ring(int fd, int events, void *arg)
+{
+	struct wproc_worker *wp = (struct wproc_worker *)arg;
+
+	if (wproc_drain_ring(wp) < 0) {
+		/* the socket going away takes care of the rest */
+		nm_log(NSLOG_RUNTIME_ERROR, "wproc: Broken frame in the result ring of worker %s, disconnecting it\n", wp->name);
+		iobroker_unregister(nagios_iobs, fd);
+		shutdown(wp->sd, SHUT_RDWR);
+		return 0;
+	}
+
+	if (wp->retiring && !wp->jobs.running)
+		wproc_retire(wp);
+
+	return 0;
+}
+
 static int handle_worker_result(int sd, int events, void *arg)
 {
-	char *buf, *error_reason = NULL;
+	char *buf;
 	size_t size;
 	int ret;
 	struct wproc_worker *wp = (struct wproc_worker *)arg;
@@ -423,8 +1339,7 @@ static int handle_worker_result(int sd, int events, void *arg)
 		       wp->name, ret, strerror(errno));
 		return 0;
 	} else if (ret == 0) {
-		GHashTableIter iter;
-		gpointer job_;
+		unsigned int i;
 		nm_log(NSLOG_INFO_MESSAGE, "wproc: Socket to worker %s broken, removing", wp->name);
 		wproc_num_workers_online--;
 		iobroker_unregister(nagios_iobs, sd);
@@ -439,86 +1354,83 @@ static int handle_worker_result(int sd, int events, void *arg)
 		 * its jobs back to itself*/
 		remove_worker(wp);
 
-		/* reassign this dead worker's jobs */
-		g_hash_table_iter_init(&iter, wp->jobs);
-		while (g_hash_table_iter_next(&iter, NULL, &job_)) {
-			struct wproc_job *job = job_;
-			wproc_run_job(
-					create_job(job->callback, job->data, job->timeout, job->command),
-					NULL
-					);
+		/* results the worker got out before it went away still count */
+		if (wp->rings) {
+			if (iobroker_is_registered(nagios_iobs, wp->rings->results.efd))
+				wproc_drain_ring(wp);
+			wproc_rings_free(wp->rings);
+			wp->rings = NULL;
+		}
+
+		/* reassign this dead worker's jobs, ahead of the ones that came due after them */
+		for (i = 0; i < wp->jobs.size; i++) {
+			struct wproc_job *job = wp->jobs.slots[i].job;
+			if (!job)
+				continue;
+			wproc_requeue_job(job);
 		}
 
+		/* it's ours to reap, and the pool will replace it */
+		if (wp->core)
+			pool_add_pid(&pool.retired, &pool.num_retired, wp->pid);
 		wproc_destroy(wp, 0);
 		return 0;
 	}
-	while ((buf = worker_ioc2msg(wp->bq, &size, 0))) {
+	for (;;) {
 		static struct kvvec kvv = KVVEC_INITIALIZER;
-		struct wproc_job *job;
 		wproc_result wpres;
 
-		/* log messages are handled first */
-		if (size > 5 && !memcmp(buf, "log=", 4)) {
-			log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: %s: %s\n", wp->name, buf + 4);
-			nm_free(buf);
-			continue;
-		}
-
-		/* for everything else we need to actually parse */
-		if (buf2kvvec_prealloc(&kvv, buf, size, '=', '\0', KVVEC_ASSIGN) <= 0) {
-			nm_log(NSLOG_RUNTIME_ERROR,
-			       "wproc: Failed to parse key/value vector from worker response with len %zd. First kv=%s",
-			       size, buf ? buf : "(NULL)");
-			nm_free(buf);
-			continue;
-		}
-
 		memset(&wpres, 0, sizeof(wpres));
 		wpres.job_id = -1;
-		wpres.response = &kvv;
 		wpres.source = wp->name;
-		parse_worker_result(&wpres, &kvv);
 
-		job = get_job(wp, wpres.job_id);
-		if (!job) {
-			nm_log(NSLOG_RUNTIME_WARNING, "wproc: Job with id '%d' doesn't exist on %s.\n", wpres.job_id, wp->name);
-			nm_free(buf);
-			continue;
-		}
+		if (wp->binary) {
+			ret = worker_bq2frame(wp->bq, &buf, &size);
+			if (ret > 0)
+				break;
+			if (!ret && (ret = parse_worker_frame(wp, &wpres, buf, size)) < 0)
+				nm_free(buf);
+			if (ret < 0) {
+				/* we can't tell where the next frame starts, so let it go */
+				nm_log(NSLOG_RUNTIME_ERROR, "wproc: Broken frame from worker %s, disconnecting it\n", wp->name);
+				shutdown(wp->sd, SHUT_RDWR);
+				break;
+			}
+			if (ret > 0) {
+				nm_free(buf);
+				continue;
+			}
+		} else {
+			if (!(buf = worker_ioc2msg(wp->bq, &size, 0)))
+				break;
+
+			/* log messages are handled first */
+			if (size > 5 && !memcmp(buf, "log=", 4)) {
+				log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: %s: %s\n", wp->name, buf + 4);
+				nm_free(buf);
+				continue;
+			}
 
-		/*
-		 * ETIME ("Timer expired") doesn't really happen
-		 * on any modern systems, so we reuse it to mean
-		 * "program timed out"
-		 */
-		if (wpres.error_code == ETIME) {
-			wpres.early_timeout = TRUE;
-		}
+			/* for everything else we need to actually parse */
+			if (buf2kvvec_prealloc(&kvv, buf, size, '=', '\0', KVVEC_ASSIGN) <= 0) {
+				nm_log(NSLOG_RUNTIME_ERROR,
+				       "wproc: Failed to parse key/value vector from worker response with len %zd. First kv=%s",
+				       size, buf ? buf : "(NULL)");
+				nm_free(buf);
+				continue;
+			}
 
-		if (wpres.early_timeout) {
-			nm_asprintf(&error_reason, "timed out after %.2fs", tv_delta_f(&wpres.start, &wpres.stop));
-		} else if (WIFSIGNALED(wpres.wait_status)) {
-			nm_asprintf(&error_reason, "died by signal %d%s after %.2f seconds",
-			         WTERMSIG(wpres.wait_status),
-			         WCOREDUMP(wpres.wait_status) ? " (core dumped)" : "",
-			         tv_delta_f(&wpres.start, &wpres.stop));
-		}
-		if (error_reason) {
-			log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: job %d from worker %s %s",
-					job->id, wp->name, error_reason);
-			log_debug_info(DEBUGL_IPC, DEBUGV_MORE, "wproc:   command: %s\n", job->command);
-			log_debug_info(DEBUGL_IPC, DEBUGV_MORE, "wproc:   early_timeout=%d; exited_ok=%d; wait_status=%d; error_code=%d;\n",
-			      wpres.early_timeout, wpres.exited_ok, wpres.wait_status, wpres.error_code);
-			wproc_logdump_buffer(DEBUGL_IPC, DEBUGV_MORE, "wproc:   stderr", wpres.outerr);
-			wproc_logdump_buffer(DEBUGL_IPC, DEBUGV_MORE, "wproc:   stdout", wpres.outstd);
+			wpres.response = &kvv;
+			parse_worker_result(&wpres, &kvv);
 		}
-		nm_free(error_reason);
 
-		run_job_callback(job, &wpres, 0);
-		g_hash_table_remove(wp->jobs, GINT_TO_POINTER(job->id));
+		wproc_handle_result(wp, &wpres);
 		nm_free(buf);
 	}
 
+	if (wp->retiring && !wp->jobs.running)
+		wproc_retire(wp);
+
 	return 0;
 }
 
@@ -538,9 +1450,10 @@ int workers_alive(void)
 /* a service for registering workers */
 static int register_worker(int sd, char *buf, unsigned int len)
 {
-	int i, is_global = 1;
+	int i, is_global = 1, use_rings = 0;
 	struct kvvec *info;
 	struct wproc_worker *worker;
+	struct worker_rings *rings = NULL;
 
 	g_return_val_if_fail(specialized_workers != NULL, ERROR);
 
@@ -558,6 +1471,7 @@ static int register_worker(int sd, char *buf, unsigned int len)
 
 	iobroker_unregister(nagios_iobs, sd);
 	iobroker_register(nagios_iobs, sd, worker, handle_worker_result);
+	event_loop_stats_name_handler(handle_worker_result, "worker");
 
 	for (i = 0; i < info->kv_pairs; i++) {
 		struct key_value *kv = &info->kv[i];
@@ -565,23 +1479,22 @@ static int register_worker(int sd, char *buf, unsigned int len)
 			worker->name = nm_strdup(kv->value);
 		} else if (!strcmp(kv->key, "pid")) {
 			worker->pid = atoi(kv->value);
+			worker->core = pool_del_pid(pool.spawned, &pool.num_spawned, worker->pid);
 		} else if (!strcmp(kv->key, "max_jobs")) {
 			worker->max_jobs = atoi(kv->value);
+		} else if (!strcmp(kv->key, "framing")) {
+			worker->binary = !strcmp(kv->value, WORKER_FRAMING_BINARY);
+		} else if (!strcmp(kv->key, "rings")) {
+			use_rings = atoi(kv->value);
 		} else if (!strcmp(kv->key, "plugin")) {
 			struct wproc_list *command_handlers;
 			is_global = 0;
 			if (!(command_handlers = g_hash_table_lookup(specialized_workers, kv->value))) {
 				command_handlers = nm_calloc(1, sizeof(struct wproc_list));
-				command_handlers->wps = nm_calloc(1, sizeof(struct wproc_worker **));
-				command_handlers->len = 1;
-				command_handlers->wps[0] = worker;
 				g_hash_table_insert(specialized_workers, nm_strdup(kv->value), command_handlers);
-			} else {
-				command_handlers->len++;
-				command_handlers->wps = nm_realloc(command_handlers->wps, command_handlers->len * sizeof(struct wproc_worker **));
-				command_handlers->wps[command_handlers->len - 1] = worker;
 			}
-			worker->wp_list = command_handlers;
+			if (!wproc_membership(worker, command_handlers))
+				wproc_list_add(command_handlers, worker);
 		}
 	}
 
@@ -594,25 +1507,71 @@ static int register_worker(int sd, char *buf, unsigned int len)
 		 */
 		worker->max_jobs = (iobroker_max_usable_fds() / 2) - 50;
 	}
+	job_table_init(&worker->jobs, worker->max_jobs);
 
-	worker->jobs = g_hash_table_new_full(
-			g_direct_hash, g_direct_equal,
-			NULL, destroy_job);
-
-	if (is_global) {
-		workers.len++;
-		workers.wps = nm_realloc(workers.wps, workers.len * sizeof(struct wproc_worker *));
-		workers.wps[workers.len - 1] = worker;
-		worker->wp_list = &workers;
+	/* the rings we created when we spawned it, which it may not want */
+	if (worker->pid > 0 && pending_rings) {
+		rings = g_hash_table_lookup(pending_rings, GINT_TO_POINTER(worker->pid));
+		g_hash_table_steal(pending_rings, GINT_TO_POINTER(worker->pid));
+	}
+	if (rings && use_rings && worker->binary) {
+		worker->rings = rings;
+		iobroker_register(nagios_iobs, rings->results.efd, worker, handle_worker_ring);
+		event_loop_stats_name_handler(handle_worker_ring, "worker ring");
+	} else {
+		wproc_rings_free(rings);
 	}
+
+	if (is_global)
+		wproc_list_add(&workers, worker);
+	wproc_load_changed(worker);
 	wproc_num_workers_online++;
 	kvvec_destroy(info, 0);
-	nsock_printf_nul(sd, "OK");
+	if (worker->rings)
+		nsock_printf_nul(sd, "OK framing=%s rings=1", WORKER_FRAMING_BINARY);
+	else if (worker->binary)
+		nsock_printf_nul(sd, "OK framing=%s", WORKER_FRAMING_BINARY);
+	else
+		nsock_printf_nul(sd, "OK");
+
+	/* jobs may have been waiting for someone to run them */
+	wproc_credits_returned(worker);
 
 	/* signal query handler to release its bufferqueue for this one */
 	return QH_TAKEOVER;
 }
 
+static int wproc_pool_query(int sd, char *args)
+{
+	unsigned int i, running, active, retiring = 0;
+	int min, max;
+
+	if (args && !strncmp(args, "limits ", 7)) {
+		if (sscanf(args + 7, "%d %d", &min, &max) != 2 || min < 0 || max < min || (max && !min))
+			return 400;
+		min_check_workers = min;
+		max_check_workers = max;
+		if (max) {
+			active = pool_active(&running);
+			if (active < (unsigned int)min)
+				wproc_pool_resize(min);
+			else if (active > (unsigned int)max)
+				wproc_pool_resize(max);
+		}
+	} else if (args) {
+		return 400;
+	}
+
+	active = pool_active(&running);
+	for (i = 0; i < workers.len; i++)
+		retiring += workers.wps[i]->retiring;
+	nsock_printf_nul(sd, "elastic=%d;min=%d;max=%d;desired=%u;workers=%u;spawning=%u;retiring=%u;jobs_running=%u;demand=%.2f;backlog=%lu;jobs_pending=%u;pending_age=%.3f\n",
+	                 max_check_workers > 0, min_check_workers, max_check_workers, wproc_num_workers_desired,
+	                 active, pool.num_spawned, retiring, running, pool.demand, pool.backlog,
+	                 wproc_num_jobs_pending, wproc_pending_age());
+	return 0;
+}
+
 static int wproc_query_handler(int sd, char *buf, unsigned int len)
 {
 	char *space, *rbuf = NULL;
@@ -622,8 +1581,15 @@ static int wproc_query_handler(int sd, char *buf, unsigned int len)
 		                 "Valid commands:\n"
 		                 "  wpstats              Print general job information\n"
 		                 "  register <options>   Register a new worker\n"
-		                 "                       <options> can be name, pid, max_jobs and/or plugin.\n"
-		                 "                       There can be many plugin args.");
+		                 "                       <options> can be name, pid, max_jobs, framing, rings and/or plugin.\n"
+		                 "                       There can be many plugin args.\n"
+		                 "  pool                 Print worker pool size and demand, and how many jobs\n"
+		                 "                       are waiting for a worker with credits\n"
+		                 "  pool limits <min> <max>\n"
+		                 "                       Let the pool grow and shrink between <min> and <max>\n"
+		                 "                       workers, or keep it as it is with 0 0.\n"
+		                 "  coalesce             Print how many checks shared a run of the same\n"
+		                 "                       command line with another check");
 		return 0;
 	}
 
@@ -635,14 +1601,24 @@ static int wproc_query_handler(int sd, char *buf, unsigned int len)
 
 	if (!strcmp(buf, "register"))
 		return register_worker(sd, rbuf, len);
+	if (!strcmp(buf, "pool"))
+		return wproc_pool_query(sd, space ? rbuf : NULL);
+	if (!strcmp(buf, "coalesce")) {
+		nsock_printf_nul(sd, "enabled=%d;ttl=%d;hits=%lu;misses=%lu;running=%u;cached=%u\n",
+		                 coalesce_checks, coalesce_checks_ttl, coalesce_hits, coalesce_misses,
+		                 (coalesced_runs ? g_hash_table_size(coalesced_runs) : 0) - g_queue_get_length(&coalesced_done),
+		                 g_queue_get_length(&coalesced_done));
+		return 0;
+	}
 	if (!strcmp(buf, "wpstats")) {
 		unsigned int i;
 
 		for (i = 0; i < workers.len; i++) {
 			struct wproc_worker *wp = workers.wps[i];
-			nsock_printf(sd, "name=%s;pid=%d;jobs_running=%u;jobs_started=%u\n",
+			nsock_printf(sd, "name=%s;pid=%d;jobs_running=%u;jobs_started=%u;runtime_avg=%.3f;retiring=%d;rings=%d;credits=%u\n",
 			             wp->name, wp->pid,
-			             g_hash_table_size(wp->jobs), wp->jobs_started);
+			             wp->jobs.running, wp->jobs_started, wp->runtime_avg / 1000, wp->retiring, !!wp->rings,
+			             wp->max_jobs - wp->jobs.running);
 		}
 		return 0;
 	}
@@ -650,15 +1626,50 @@ static int wproc_query_handler(int sd, char *buf, unsigned int len)
 	return 400;
 }
 
+/*
+ * With worker_ring_size set, core workers also get a pair of shared
+ * memory rings, which they inherit as open file descriptors. The core
+ * keeps its ends around until the worker registers.
+ */
 static int spawn_core_worker(void)
 {
-	char * argvec[] = {naemon_binary_path, "--worker", qh_socket_path, NULL};
-	int ret;
+	char * argvec[] = {naemon_binary_path, "--worker", qh_socket_path, NULL, NULL, NULL};
+	struct worker_rings *rings = NULL;
+	char fdspec[64];
+	int ret, fds[3];
+
+	if (worker_ring_size > 0) {
+		rings = nm_calloc(1, sizeof(*rings));
+		if (worker_rings_create(rings, worker_ring_size, fds) < 0) {
+			nm_log(NSLOG_RUNTIME_WARNING, "wproc: Failed to create shared memory rings, core worker will use its socket: %s\n", strerror(errno));
+			nm_free(rings);
+		} else {
+			snprintf(fdspec, sizeof(fdspec), "%d,%d,%d", fds[0], fds[1], fds[2]);
+			argvec[3] = "--worker-rings";
+			argvec[4] = fdspec;
+		}
+	}
 
-	if ((ret = spawn_helper(argvec)) < 0)
+	if ((ret = spawn_helper(argvec)) < 0) {
 		nm_log(NSLOG_RUNTIME_ERROR, "wproc: Failed to launch core worker: %s\n", strerror(errno));
-	else
+	} else {
 		wproc_num_workers_spawned++;
+		pool_add_pid(&pool.spawned, &pool.num_spawned, ret);
+	}
+
+	if (rings) {
+		/* our ends of the eventfds mustn't leak into other children */
+		close(fds[0]);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[2], F_SETFD, FD_CLOEXEC);
+		if (ret > 0) {
+			if (!pending_rings)
+				pending_rings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, wproc_rings_free);
+			g_hash_table_insert(pending_rings, GINT_TO_POINTER(ret), rings);
+		} else {
+			wproc_rings_free(rings);
+		}
+	}
 
 	return ret;
 }
@@ -666,8 +1677,6 @@ static int spawn_core_worker(void)
 
 int init_workers(int desired_workers)
 {
-	int i;
-
 	/*
 	 * we register our query handler before launching workers,
 	 * so other workers can join us whenever they're ready
@@ -699,87 +1708,486 @@ int init_workers(int desired_workers)
 			}
 		}
 	}
-	wproc_num_workers_desired = desired_workers;
-
-	if (workers_alive() == desired_workers)
-		return 0;
 
-	/* can't shrink the number of workers (yet) */
-	if (desired_workers < (int)workers.len)
-		return -1;
+	if (max_check_workers > 0) {
+		if (max_check_workers < min_check_workers) {
+			nm_log(NSLOG_CONFIG_WARNING, "wproc: max_check_workers is less than min_check_workers, using %d\n", min_check_workers);
+			max_check_workers = min_check_workers;
+		}
+		/* start out within the bounds of the elastic pool */
+		if (desired_workers < min_check_workers)
+			desired_workers = min_check_workers;
+		if (desired_workers > max_check_workers)
+			desired_workers = max_check_workers;
+	}
 
-	for (i = 0; i < desired_workers; i++)
-		spawn_core_worker();
+	wproc_pool_resize(desired_workers);
 
 	return 0;
 }
 
 
-static struct wproc_job *create_job(void (*callback)(struct wproc_result *, void *, int), void *data, time_t timeout, const char *cmd)
+/* whether a program is listed in the persistent_plugins option */
+static int is_persistent_plugin(const char *path)
 {
-	struct wproc_job *job;
-	struct wproc_worker *wp;
+	const char *p;
+	size_t len;
+
+	if (!persistent_plugins)
+		return FALSE;
+
+	len = strlen(path);
+	for (p = persistent_plugins; *p; p++) {
+		size_t entry_len;
+
+		p += strspn(p, " \t,");
+		entry_len = strcspn(p, ",");
+		while (entry_len && (p[entry_len - 1] == ' ' || p[entry_len - 1] == '\t'))
+			entry_len--;
+		if (entry_len == len && !strncmp(p, path, len))
+			return TRUE;
+		p += strcspn(p, ",");
+		if (!*p)
+			break;
+	}
+	return FALSE;
+}
 
-	wp = get_worker(cmd);
-	if (!wp)
-		return NULL;
+static struct wproc_job *new_job(void (*callback)(struct wproc_result *, void *, int), void *data, time_t timeout, const char *cmd, const char *argv, size_t argv_len)
+{
+	static unsigned long seq;
+	struct wproc_job *job;
 
 	job = nm_calloc(1, sizeof(*job));
-	job->wp = wp;
-	job->id = get_job_id(wp);
 	job->callback = callback;
 	job->data = data;
 	job->timeout = timeout;
 	job->command = nm_strdup(cmd);
-	g_hash_table_insert(wp->jobs, GINT_TO_POINTER(job->id), job);
+	if (argv && argv_len) {
+		job->argv = nm_malloc(argv_len);
+		memcpy(job->argv, argv, argv_len);
+		job->argv_len = argv_len;
+		job->persistent = is_persistent_plugin(argv);
+	}
+	gettimeofday(&job->due, NULL);
+	job->seq = seq++;
+	job->inflight_pos = NO_SLOT;
+	return job;
+}
+
+/* frees a job nobody has been told about, so without running its callback */
+static void free_job(struct wproc_job *job)
+{
+	nm_free(job->command);
+	nm_free(job->argv);
+	free(job);
+}
+
+/* spends one of the worker's credits on the job */
+static int assign_job(struct wproc_worker *wp, struct wproc_job *job)
+{
+	if (job_table_add(&wp->jobs, job) < 0)
+		return -1;
+	job->wp = wp;
+	inflight_add(job);
+	wproc_load_changed(wp);
+	return 0;
+}
+
+/* gives the job's credit back, without destroying the job */
+static void unassign_job(struct wproc_job *job)
+{
+	struct wproc_worker *wp = job->wp;
+
+	inflight_remove(job);
+	job_table_release(&wp->jobs, job_slot(&wp->jobs, job->id));
+	job->wp = NULL;
+	wproc_load_changed(wp);
+}
+
+static struct wproc_job *create_job(void (*callback)(struct wproc_result *, void *, int), void *data, time_t timeout, const char *cmd, const char *argv, size_t argv_len)
+{
+	struct wproc_job *job;
+	struct wproc_worker *wp;
+
+	wp = get_worker(cmd);
+	if (!wp) {
+		pool.backlog++;
+		return NULL;
+	}
+
+	job = new_job(callback, data, timeout, cmd, argv, argv_len);
+	if (assign_job(wp, job) < 0) {
+		free_job(job);
+		pool.backlog++;
+		return NULL;
+	}
 	return job;
 }
 
 /*
- * Handles adding the command and macros to the kvvec,
- * as well as shipping the command off to a designated
- * worker
+ * Formats a job request as a binary frame for workers that asked for
+ * it, and otherwise the way build_kvvec_buf() would, but straight
+ * into a single buffer, without going through a kvvec
  */
-static int wproc_run_job(struct wproc_job *job, nagios_macros *mac)
+static size_t wproc_job_frame_len(struct wproc_job *job)
+{
+	return sizeof(struct worker_job_frame) + strlen(job->command) + 1 + job->argv_len;
+}
+
+/* writes the binary frame for a job, of wproc_job_frame_len() bytes, to buf */
+static void wproc_fill_job_frame(struct wproc_job *job, char *buf, size_t len)
+{
+	struct worker_job_frame *frame = (struct worker_job_frame *)buf;
+	size_t size = len - sizeof(*frame) - 1 - job->argv_len;
+
+	frame->hdr.len = len;
+	frame->hdr.type = WORKER_FRAME_JOB;
+	frame->hdr.flags = job->argv ? WORKER_JOB_ARGV : 0;
+	if (job->persistent)
+		frame->hdr.flags |= WORKER_JOB_PERSISTENT;
+	frame->job_id = job->id;
+	frame->timeout = job->timeout;
+	frame->output_limit = max_plugin_output_capture;
+	frame->command_len = size;
+	memcpy(buf + sizeof(*frame), job->command, size + 1);
+	if (job->argv)
+		memcpy(buf + sizeof(*frame) + size + 1, job->argv, job->argv_len);
+}
+
+static char *wproc_job_frame(struct wproc_job *job, size_t *len)
+{
+	char *buf;
+	int size;
+
+	if (job->wp->binary) {
+		*len = wproc_job_frame_len(job);
+		buf = nm_malloc(*len);
+		wproc_fill_job_frame(job, buf, *len);
+		return buf;
+	}
+
+	size = snprintf(NULL, 0, "job_id=%u%ctype=0%ccommand=%s%ctimeout=%u%coutput_limit=%d%c",
+	                job->id, 0, 0, job->command, 0, job->timeout, 0, max_plugin_output_capture, 0);
+	buf = nm_malloc(size + MSG_DELIM_LEN + 1);
+	snprintf(buf, size + 1, "job_id=%u%ctype=0%ccommand=%s%ctimeout=%u%coutput_limit=%d%c",
+	         job->id, 0, 0, job->command, 0, job->timeout, 0, max_plugin_output_capture, 0);
+	memcpy(buf + size, MSG_DELIM, MSG_DELIM_LEN);
+	*len = size + MSG_DELIM_LEN;
+	return buf;
+}
+
+/*
+ * Ships the command off to a designated worker. Workers with rings
+ * get the job written straight into their job ring. Otherwise the job
+ * is only queued here; all jobs queued for a worker during one event
+ * loop iteration are sent together when the event loop pushes pending
+ * output, right before it polls for input again. A job that can't be
+ * sent is taken off the worker again, but not destroyed.
+ */
+static int wproc_send_job(struct wproc_job *job)
+{
+	struct wproc_worker *wp = job->wp;
+	size_t len;
+	char *buf;
+	int ret;
+
+	if (wp->rings) {
+		len = wproc_job_frame_len(job);
+		if ((buf = worker_ring_reserve(&wp->rings->jobs, len))) {
+			wproc_fill_job_frame(job, buf, len);
+			worker_ring_commit(&wp->rings->jobs, len);
+			wp->jobs_started++;
+			return OK;
+		}
+		/* a full ring, or a job too big for it, goes by the socket */
+	}
+
+	buf = wproc_job_frame(job, &len);
+	ret = iobroker_queue_packet(nagios_iobs, wp->sd, buf, len);
+	if (ret < 0) {
+		nm_log(NSLOG_RUNTIME_ERROR, "wproc: Failed to queue job for '%s'. ret = %d; bufsize = %zu: %s\n",
+		       wp->name, ret, len, iobroker_strerror(ret));
+		nm_free(buf);
+		unassign_job(job);
+		return ERROR;
+	}
+	wp->jobs_started++;
+
+	return OK;
+}
+
+/*
+ * Hands out the list's pending jobs, oldest first, for as long as its
+ * workers have credits. A job that can't be sent goes back to wait for
+ * the next credit, so we don't spin on a worker that's going away.
+ */
+static void wproc_drain_pending(struct wproc_list *wpl)
+{
+	struct wproc_worker *wp;
+	struct wproc_job *job;
+
+	while (wpl->num_pending && (wp = list_worker(wpl))) {
+		job = pending_pop(wpl);
+		if (assign_job(wp, job) < 0 || wproc_send_job(job) != OK) {
+			pending_push(wpl, job);
+			break;
+		}
+	}
+}
+
+/* call whenever a worker may have got credits back */
+static void wproc_credits_returned(struct wproc_worker *wp)
 {
-	static struct kvvec kvv = KVVEC_INITIALIZER;
-	struct kvvec_buf *kvvb;
+	unsigned int i;
+
+	for (i = 0; i < wp->num_lists; i++)
+		wproc_drain_pending(wp->lists[i].list);
+}
+
+/* puts a job that has lost its worker back in line, keeping its due time */
+static void wproc_requeue_job(struct wproc_job *job)
+{
+	struct wproc_list *wpl = get_wproc_list(job->command);
+
+	if (job->wp)
+		unassign_job(job);
+	pending_push(wpl, job);
+	wproc_drain_pending(wpl);
+}
+
+/*
+ * Sends a job to a worker with credits left, or has it wait for one.
+ * Jobs only wait if there are workers that could run them; if there
+ * are none at all, the caller is told so and the job is gone.
+ */
+static int wproc_dispatch(struct wproc_job *job)
+{
+	struct wproc_list *wpl = get_wproc_list(job->command);
 	struct wproc_worker *wp;
-	int ret, result = OK;
 
+	if (!wpl->len) {
+		free_job(job);
+		pool.backlog++;
+		return ERROR;
+	}
+
+	if (!wpl->num_pending && (wp = list_worker(wpl)) && !assign_job(wp, job) && wproc_send_job(job) == OK)
+		return OK;
+
+	if (!wpl->num_pending)
+		log_debug_info(DEBUGL_IPC, DEBUGV_BASIC, "wproc: No worker has credits left for '%s', jobs will wait\n", job->command);
+	pool.backlog++;
+	pending_push(wpl, job);
+	wproc_drain_pending(wpl);
+	return OK;
+}
+
+/* runs a job create_job() gave to a worker */
+static int wproc_run_job(struct wproc_job *job, nagios_macros *mac)
+{
 	if (!job || !job->wp)
 		return ERROR;
 
-	wp = job->wp;
+	if (wproc_send_job(job) != OK)
+		wproc_requeue_job(job);
+	return OK;
+}
+
+int wproc_run_callback(char *cmd, int timeout,
+                       void (*cb)(struct wproc_result *, void *, int), void *data,
+                       nagios_macros *mac)
+{
+	return wproc_run_callback_argv(cmd, NULL, 0, timeout, cb, data, mac);
+}
 
-	if (!kvvec_init(&kvv, 4))	/* job_id, command and timeout */
+int wproc_run_callback_argv(char *cmd, const char *argv, size_t argv_len, int timeout,
+                            void (*cb)(struct wproc_result *, void *, int), void *data,
+                            nagios_macros *mac)
+{
+	if (!cmd)
 		return ERROR;
+	return wproc_dispatch(new_job(cb, data, timeout, cmd, argv, argv_len));
+}
 
-	kvvec_addkv_str(&kvv, "job_id", (char *)mkstr("%d", job->id));
-	kvvec_addkv_str(&kvv, "type", "0");
-	kvvec_addkv_str(&kvv, "command", job->command);
-	kvvec_addkv_str(&kvv, "timeout", (char *)mkstr("%u", job->timeout));
-	kvvb = build_kvvec_buf(&kvv);
-	ret = iobroker_write_packet(nagios_iobs, wp->sd, kvvb->buf, kvvb->bufsize);
-	if (ret < 0) {
-		nm_log(NSLOG_RUNTIME_ERROR, "wproc: '%s' seems to be choked. ret = %d; bufsize = %lu: errno = %d (%s)\n",
-		       wp->name, ret, kvvb->bufsize, errno, strerror(errno));
-		g_hash_table_remove(wp->jobs, GINT_TO_POINTER(job->id));
-		result = ERROR;
+/*
+ * With coalesce_checks set, checks whose command lines come out the
+ * same share one run. A check started while such a run is in flight
+ * waits for it, and with coalesce_checks_ttl set, one started within
+ * that many seconds of the run finishing gets a copy of its result
+ * without running anything. Checks that only wait for someone else's
+ * run get the result with its resource usage zeroed, so it's only
+ * accounted once.
+ */
+struct coalesce_waiter {
+	void (*callback)(struct wproc_result *, void *, int);
+	void *data;
+	struct coalesce_waiter *next;
+};
+
+struct coalesced_run {
+	char *command;
+	struct coalesce_waiter *waiters; /**< the one that started the run first */
+	struct coalesce_waiter **last;
+	wproc_result *result; /**< a copy of the result, once the run is done */
+	time_t expires;
+};
+
+struct coalesce_delivery {
+	struct coalesce_waiter waiter;
+	wproc_result *result;
+};
+
+static wproc_result *copy_result(const wproc_result *wpres)
+{
+	wproc_result *copy = nm_malloc(sizeof(*copy));
+
+	*copy = *wpres;
+	copy->command = nm_strdup(wpres->command ? wpres->command : "");
+	copy->outstd = wpres->outstd ? nm_strdup(wpres->outstd) : NULL;
+	copy->outerr = wpres->outerr ? nm_strdup(wpres->outerr) : NULL;
+	copy->error_msg = wpres->error_msg ? nm_strdup(wpres->error_msg) : NULL;
+	/* the worker may be gone by the time the copy is handed out */
+	copy->source = wpres->source ? nm_strdup(wpres->source) : NULL;
+	copy->response = NULL;
+	return copy;
+}
+
+static void free_result_copy(wproc_result *wpres)
+{
+	if (!wpres)
+		return;
+	nm_free(wpres->command);
+	nm_free(wpres->outstd);
+	nm_free(wpres->outerr);
+	nm_free(wpres->error_msg);
+	nm_free(wpres->source);
+	nm_free(wpres);
+}
+
+static void free_coalesced_run(gpointer data)
+{
+	struct coalesced_run *run = (struct coalesced_run *)data;
+	struct coalesce_waiter *w, *next;
+
+	for (w = run->waiters; w; w = next) {
+		next = w->next;
+		nm_free(w);
+	}
+	free_result_copy(run->result);
+	nm_free(run->command);
+	nm_free(run);
+}
+
+static void expire_coalesced_runs(time_t now)
+{
+	struct coalesced_run *run;
+
+	while ((run = g_queue_peek_head(&coalesced_done)) && run->expires <= now) {
+		g_queue_pop_head(&coalesced_done);
+		g_hash_table_remove(coalesced_runs, run->command);
+	}
+}
+
+static void deliver_coalesced_result(struct nm_event_execution_properties *evprop)
+{
+	struct coalesce_delivery *d = (struct coalesce_delivery *)evprop->user_data;
+
+	/* an aborted delivery still lets the check clean up after itself */
+	(*d->waiter.callback)(evprop->execution_type == EVENT_EXEC_NORMAL ? d->result : NULL, d->waiter.data, 0);
+	free_result_copy(d->result);
+	nm_free(d);
+}
+
+/* hands the result of a run to everyone waiting for it */
+static void coalesced_run_done(struct wproc_result *wpres, void *arg, int val)
+{
+	struct coalesced_run *run = (struct coalesced_run *)arg;
+	struct coalesce_waiter *w, *next;
+	wproc_result shared;
+
+	/*
+	 * Take the waiters off the run before running any callbacks, so
+	 * checks they start for the same command don't end up on a list
+	 * we're walking, and drop or cache the run right away.
+	 */
+	w = run->waiters;
+	run->waiters = NULL;
+	run->last = &run->waiters;
+	if (wpres && coalesce_checks_ttl > 0) {
+		run->result = copy_result(wpres);
+		run->expires = time(NULL) + coalesce_checks_ttl;
+		g_queue_push_tail(&coalesced_done, run);
 	} else {
-		wp->jobs_started++;
+		g_hash_table_remove(coalesced_runs, run->command);
 	}
-	nm_free(kvvb->buf);
-	nm_free(kvvb);
 
-	return result;
+	if (wpres) {
+		shared = *wpres;
+		memset(&shared.rusage, 0, sizeof(shared.rusage));
+	}
+	for (; w; w = next) {
+		next = w->next;
+		(*w->callback)(wpres, w->data, val);
+		nm_free(w);
+		wpres = wpres ? &shared : NULL;
+	}
 }
 
-int wproc_run_callback(char *cmd, int timeout,
-                       void (*cb)(struct wproc_result *, void *, int), void *data,
-                       nagios_macros *mac)
+int wproc_run_check(char *cmd, const char *argv, size_t argv_len, int timeout,
+                    void (*cb)(struct wproc_result *, void *, int), void *data,
+                    nagios_macros *mac)
 {
-	struct wproc_job *job;
-	job = create_job(cb, data, timeout, cmd);
-	return wproc_run_job(job, mac);
+	struct coalesced_run *run;
+	struct coalesce_waiter *w;
+	struct coalesce_delivery *d;
+
+	if (!coalesce_checks || !cmd)
+		return wproc_run_callback_argv(cmd, argv, argv_len, timeout, cb, data, mac);
+
+	if (!coalesced_runs)
+		coalesced_runs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_coalesced_run);
+	expire_coalesced_runs(time(NULL));
+
+	if ((run = g_hash_table_lookup(coalesced_runs, cmd))) {
+		coalesce_hits++;
+		if (run->result) {
+			/* callers expect results to come back after they return */
+			d = nm_calloc(1, sizeof(*d));
+			d->waiter.callback = cb;
+			d->waiter.data = data;
+			d->result = copy_result(run->result);
+			memset(&d->result->rusage, 0, sizeof(d->result->rusage));
+			schedule_event(0, deliver_coalesced_result, d);
+			return OK;
+		}
+		w = nm_calloc(1, sizeof(*w));
+		w->callback = cb;
+		w->data = data;
+		*run->last = w;
+		run->last = &w->next;
+		return OK;
+	}
+
+	coalesce_misses++;
+	run = nm_calloc(1, sizeof(*run));
+	run->command = nm_strdup(cmd);
+	run->waiters = nm_calloc(1, sizeof(*run->waiters));
+	run->waiters->callback = cb;
+	run->waiters->data = data;
+	run->last = &run->waiters->next;
+	g_hash_table_insert(coalesced_runs, run->command, run);
+	if (wproc_run_callback_argv(cmd, argv, argv_len, timeout, coalesced_run_done, run, mac) == ERROR) {
+		g_hash_table_remove(coalesced_runs, cmd);
+		return ERROR;
+	}
+	return OK;
+}
+
+static void free_coalesced_runs(void)
+{
+	g_queue_clear(&coalesced_done);
+	if (coalesced_runs)
+		g_hash_table_destroy(coalesced_runs);
+	coalesced_runs = NULL;
 }
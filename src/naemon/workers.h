@@ -12,6 +12,13 @@
 
 #define WPROC_FORCE  (1 << 0)
 
+/*
+ * Passed to job callbacks, along with a NULL result, for jobs whose
+ * results are overdue and no longer waited for. A NULL result without
+ * it means the job is being torn down, on shutdown.
+ */
+#define WPROC_ORPHANED (1 << 0)
+
 NAGIOS_BEGIN_DECL;
 
 typedef struct wproc_result {
@@ -36,14 +43,32 @@ typedef struct wproc_result {
 extern unsigned int wproc_num_workers_spawned;
 extern unsigned int wproc_num_workers_online;
 extern unsigned int wproc_num_workers_desired;
+extern unsigned int wproc_num_jobs_pending; /* jobs waiting for a worker with credits */
 
 struct load_control; /* TODO: load_control is ugly */
 
 void free_worker_memory(int flags);
 int workers_alive(void);
 int init_workers(int desired_workers);
+void init_worker_pool(void);
 
 int wproc_run_callback(char *cmt, int timeout, void (*cb)(struct wproc_result *, void *, int), void *data, nagios_macros *mac);
 
+/*
+ * Like wproc_run_callback(), but workers that speak binary framing get
+ * the command as argv, a series of nul-terminated arguments that are
+ * argv_len bytes in all, and run it without parsing cmd
+ */
+int wproc_run_callback_argv(char *cmd, const char *argv, size_t argv_len, int timeout, void (*cb)(struct wproc_result *, void *, int), void *data, nagios_macros *mac);
+
+/*
+ * Like wproc_run_callback_argv(), for host and service checks. With
+ * coalesce_checks set, a check whose command is already running, or
+ * finished less than coalesce_checks_ttl seconds ago, gets a copy of
+ * that run's result instead of running the command again. The result
+ * always comes back after this returns.
+ */
+int wproc_run_check(char *cmd, const char *argv, size_t argv_len, int timeout, void (*cb)(struct wproc_result *, void *, int), void *data, nagios_macros *mac);
+
 NAGIOS_END_DECL;
 #endif
@@ -0,0 +1,252 @@
+#include "config.h"
+#include "wproc_usage.h"
+#include "defaults.h"
+#include "events.h"
+#include "logging.h"
+#include "nm_alloc.h"
+#include "query-handler.h"
+#include "lib/nsock.h"
+#include "lib/nsutils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+/* how many entries of each table a periodic dump logs */
+#define WPROC_USAGE_DUMP_ENTRIES 10
+
+enum {
+	USAGE_KEY_CPU,
+	USAGE_KEY_RUNTIME,
+	USAGE_KEY_RSS,
+	USAGE_KEY_JOBS,
+	USAGE_KEY_TIMEOUTS,
+	USAGE_KEY_SIGNALED,
+};
+
+static const char *sort_keys[] = { "cpu", "runtime", "rss", "jobs", "timeouts", "signaled", NULL };
+static const char *table_names[WPROC_USAGE_TABLES] = { "commands", "hosts", "workers" };
+
+int usage_dump_interval = DEFAULT_USAGE_DUMP_INTERVAL;
+
+/* name -> struct wproc_usage, the name being owned by the entry */
+static GHashTable *tables[WPROC_USAGE_TABLES];
+static int sort_by;
+
+static void free_usage(gpointer data)
+{
+	struct wproc_usage *u = (struct wproc_usage *)data;
+
+	nm_free(u->name);
+	nm_free(u);
+}
+
+static double tv2f(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+void wproc_usage_add(enum wproc_usage_table table, const char *name, const struct wproc_result *wpres)
+{
+	struct wproc_usage *u;
+
+	if (table >= WPROC_USAGE_TABLES || !name || !wpres)
+		return;
+
+	if (!tables[table])
+		tables[table] = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_usage);
+	if (!(u = g_hash_table_lookup(tables[table], name))) {
+		u = nm_calloc(1, sizeof(*u));
+		u->name = nm_strdup(name);
+		g_hash_table_insert(tables[table], u->name, u);
+	}
+
+	u->jobs++;
+	if (wpres->early_timeout)
+		u->timeouts++;
+	else if (WIFSIGNALED(wpres->wait_status))
+		u->signaled++;
+	u->runtime += tv_delta_f(&wpres->start, &wpres->stop);
+	u->utime += tv2f(&wpres->rusage.ru_utime);
+	u->stime += tv2f(&wpres->rusage.ru_stime);
+	if (wpres->rusage.ru_maxrss > u->maxrss)
+		u->maxrss = wpres->rusage.ru_maxrss;
+}
+
+static double usage_key(const struct wproc_usage *u)
+{
+	switch (sort_by) {
+	case USAGE_KEY_RUNTIME:
+		return u->runtime;
+	case USAGE_KEY_RSS:
+		return u->maxrss;
+	case USAGE_KEY_JOBS:
+		return u->jobs;
+	case USAGE_KEY_TIMEOUTS:
+		return u->timeouts;
+	case USAGE_KEY_SIGNALED:
+		return u->signaled;
+	}
+	return u->utime + u->stime;
+}
+
+static int usage_cmp(const void *a_, const void *b_)
+{
+	const struct wproc_usage *a = *(const struct wproc_usage **)a_;
+	const struct wproc_usage *b = *(const struct wproc_usage **)b_;
+	double ka = usage_key(a), kb = usage_key(b);
+
+	if (ka != kb)
+		return ka < kb ? 1 : -1;
+	return strcmp(a->name, b->name);
+}
+
+int wproc_usage_top(enum wproc_usage_table table, const char *sort_key, struct wproc_usage **top, unsigned int n)
+{
+	GHashTableIter iter;
+	gpointer value;
+	struct wproc_usage **all;
+	unsigned int i, size;
+	int key;
+
+	for (key = 0; sort_keys[key]; key++) {
+		if (!strcmp(sort_key, sort_keys[key]))
+			break;
+	}
+	if (!sort_keys[key] || table >= WPROC_USAGE_TABLES)
+		return -1;
+	if (!tables[table] || !(size = g_hash_table_size(tables[table])))
+		return 0;
+
+	all = nm_malloc(size * sizeof(*all));
+	i = 0;
+	g_hash_table_iter_init(&iter, tables[table]);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		all[i++] = value;
+	sort_by = key;
+	qsort(all, size, sizeof(*all), usage_cmp);
+
+	if (n > size)
+		n = size;
+	memcpy(top, all, n * sizeof(*top));
+	nm_free(all);
+	return n;
+}
+
+void wproc_usage_reset(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < WPROC_USAGE_TABLES; i++) {
+		if (tables[i])
+			g_hash_table_remove_all(tables[i]);
+	}
+}
+
+static void wproc_usage_dump(struct nm_event_execution_properties *evprop)
+{
+	struct wproc_usage *top[WPROC_USAGE_DUMP_ENTRIES];
+	unsigned int table;
+	int i, n;
+
+	if (evprop->execution_type != EVENT_EXEC_NORMAL)
+		return;
+	if (usage_dump_interval > 0)
+		schedule_event(usage_dump_interval, wproc_usage_dump, NULL);
+
+	for (table = 0; table < WPROC_USAGE_TABLES; table++) {
+		n = wproc_usage_top(table, "cpu", top, WPROC_USAGE_DUMP_ENTRIES);
+		for (i = 0; i < n; i++) {
+			nm_log(NSLOG_INFO_MESSAGE, "USAGE: %s #%d: name=%s;jobs=%lu;runtime=%.3f;utime=%.3f;stime=%.3f;maxrss=%ld;timeouts=%lu;signaled=%lu\n",
+			       table_names[table], i + 1, top[i]->name, top[i]->jobs, top[i]->runtime,
+			       top[i]->utime, top[i]->stime, top[i]->maxrss, top[i]->timeouts, top[i]->signaled);
+		}
+	}
+}
+
+static int wproc_usage_qh(int sd, char *buf, unsigned int len)
+{
+	struct wproc_usage **top;
+	const char *sort_key = "cpu";
+	unsigned int table, count = 10;
+	char *space;
+	int i, n;
+
+	if (!*buf || !strcmp(buf, "help")) {
+		nsock_printf_nul(sd, "Query handler for the resources used by worker jobs.\n"
+		                 "Available commands:\n"
+		                 "  commands [key [count]]   The 10 or [count] heaviest check commands\n"
+		                 "  hosts [key [count]]      The 10 or [count] heaviest hosts\n"
+		                 "  workers [key [count]]    The 10 or [count] heaviest workers\n"
+		                 "  reset                    Forget the usage accounted so far\n"
+		                 "Entries are sorted by [key], which is one of cpu (the default),\n"
+		                 "runtime, rss, jobs, timeouts or signaled.\n"
+		                );
+		return 0;
+	}
+
+	if (!strcmp(buf, "reset")) {
+		wproc_usage_reset();
+		nsock_printf_nul(sd, "OK\n");
+		return 0;
+	}
+
+	if ((space = strchr(buf, ' '))) {
+		*space++ = 0;
+		sort_key = space;
+		if ((space = strchr(space, ' '))) {
+			*space++ = 0;
+			count = strtoul(space, NULL, 10);
+			if (!count)
+				return 400;
+		}
+	}
+
+	for (table = 0; table < WPROC_USAGE_TABLES; table++) {
+		if (!strcmp(buf, table_names[table]))
+			break;
+	}
+	if (table == WPROC_USAGE_TABLES)
+		return 404;
+
+	if (!tables[table] || !g_hash_table_size(tables[table]))
+		count = 1;
+	else if (count > g_hash_table_size(tables[table]))
+		count = g_hash_table_size(tables[table]);
+	top = nm_malloc(count * sizeof(*top));
+	if ((n = wproc_usage_top(table, sort_key, top, count)) < 0) {
+		nm_free(top);
+		return 400;
+	}
+	for (i = 0; i < n; i++) {
+		nsock_printf(sd, "name=%s;jobs=%lu;runtime=%.3f;utime=%.3f;stime=%.3f;maxrss=%ld;timeouts=%lu;signaled=%lu\n",
+		             top[i]->name, top[i]->jobs, top[i]->runtime, top[i]->utime, top[i]->stime,
+		             top[i]->maxrss, top[i]->timeouts, top[i]->signaled);
+	}
+	nsock_printf(sd, "%c", 0);
+	nm_free(top);
+	return 0;
+}
+
+int wproc_usage_init(void)
+{
+	if (qh_register_handler("usage", "Resource usage of worker jobs", 0, wproc_usage_qh) < 0) {
+		nm_log(NSLOG_RUNTIME_ERROR, "Failed to register resource usage query handler\n");
+		return ERROR;
+	}
+
+	if (usage_dump_interval > 0)
+		schedule_event(usage_dump_interval, wproc_usage_dump, NULL);
+	return OK;
+}
+
+void wproc_usage_deinit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < WPROC_USAGE_TABLES; i++) {
+		if (tables[i])
+			g_hash_table_destroy(tables[i]);
+		tables[i] = NULL;
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef WPROC_USAGE_H_
+#define WPROC_USAGE_H_
+
+#if !defined (_NAEMON_H_INSIDE) && !defined (NAEMON_COMPILATION)
+#error "Only <naemon/naemon.h> can be included directly."
+#endif
+
+#include "lib/lnae-utils.h"
+#include "workers.h"
+
+NAGIOS_BEGIN_DECL
+
+/*
+ * Resource usage of the jobs run by the workers, as reported back in
+ * their results, summed up per check command, per host and per worker.
+ */
+enum wproc_usage_table {
+	WPROC_USAGE_COMMANDS,
+	WPROC_USAGE_HOSTS,
+	WPROC_USAGE_WORKERS,
+	WPROC_USAGE_TABLES
+};
+
+/* how often to log the heaviest commands, hosts and workers, 0 to never */
+extern int usage_dump_interval;
+
+struct wproc_usage {
+	char *name;
+	unsigned long jobs;
+	unsigned long timeouts; /* jobs killed for running past their timeout */
+	unsigned long signaled; /* jobs that died by a signal of their own */
+	double runtime; /* wall clock seconds */
+	double utime, stime; /* cpu seconds */
+	long maxrss; /* largest resident set of any one job, in kilobytes */
+};
+
+/* Account for a finished job in one of the tables */
+void wproc_usage_add(enum wproc_usage_table table, const char *name, const struct wproc_result *wpres);
+
+/*
+ * Fills top with at most n entries of a table, heaviest first by sort_key,
+ * which is one of "cpu", "runtime", "rss", "jobs", "timeouts" or
+ * "signaled". Returns the number of entries, or -1 for an unknown key.
+ * The entries stay valid until the usage is reset.
+ */
+int wproc_usage_top(enum wproc_usage_table table, const char *sort_key, struct wproc_usage **top, unsigned int n);
+
+void wproc_usage_reset(void);
+int wproc_usage_init(void);
+void wproc_usage_deinit(void);
+
+NAGIOS_END_DECL
+
+#endif
@@ -991,7 +991,7 @@ int xrddefault_read_state_information(void)
 						else if (!strcmp(var, "check_type"))
 							temp_host->check_type = atoi(val);
 						else if (!strcmp(var, "current_state"))
-							temp_host->current_state = atoi(val);
+							set_host_current_state(temp_host, atoi(val));
 						else if (!strcmp(var, "last_state"))
 							temp_host->last_state = atoi(val);
 						else if (!strcmp(var, "last_hard_state"))
@@ -9,7 +9,11 @@
 
 static unsigned int started, running_jobs, timeouts, reapable;
 static int master_sd;
+static int binary_framing; /* negotiated when registering with the core */
+static struct worker_rings rings; /* shared memory rings, if the core gave us any */
+static int use_rings;
 static GHashTable *ptab;
+static GHashTable *persistent_tab; /* path -> struct persistent_plugin */
 
 struct execution_information {
 	timed_event *timed_event;
@@ -21,11 +25,43 @@ struct execution_information {
 	struct rusage rusage;
 };
 
+/*
+ * Persistent plugins are started once and then fed one job at a time
+ * through their stdin, which saves starting an interpreter per check.
+ * The plugin is started without arguments. A request is the length of
+ * the job's arguments (argv[1] and on, each nul-terminated) on a line
+ * of its own, followed by the arguments:
+ *
+ *   <length>\n<arg1>\0<arg2>\0...
+ *
+ * The plugin answers on its stdout with the exit code and the lengths
+ * of its output, followed by the output for stdout and for stderr:
+ *
+ *   <exit code> <stdout length> <stderr length>\n<stdout><stderr>
+ *
+ * What the plugin itself writes to stderr is logged. A plugin that
+ * exits, breaks the protocol or runs past the timeout of a job is
+ * killed, and started again for the next job.
+ */
+struct persistent_plugin {
+	char *path;
+	pid_t pid;
+	int in_fd, out_fd, err_fd;
+	nm_bufferqueue *bq; /* response to the current job */
+	int have_header, exit_code;
+	size_t outstd_len, outerr_len; /* what's still to come of each stream */
+	child_process *cp; /* the job the plugin is working on */
+	GQueue *queue; /* jobs waiting for the plugin */
+	unsigned int starts;
+};
+
 static nm_bufferqueue *bq;
 
 static void exit_worker(int code, const char *msg)
 {
 	int discard;
+	GHashTableIter iter;
+	struct persistent_plugin *pp;
 
 	if (msg) {
 		perror(msg);
@@ -39,6 +75,13 @@ static void exit_worker(int code, const char *msg)
 	 */
 	signal(SIGTERM, SIG_IGN);
 	kill(0, SIGTERM);
+	if (persistent_tab) {
+		g_hash_table_iter_init(&iter, persistent_tab);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&pp)) {
+			if (pp->pid > 0)
+				kill(-pp->pid, SIGTERM);
+		}
+	}
 	while (waitpid(-1, &discard, WNOHANG) > 0)
 		; /* do nothing */
 	sleep(1);
@@ -63,19 +106,31 @@ static void wlog(const char *fmt, ...)
 	static char lmsg[8192] = "log=";
 	int len = 4;
 	size_t to_send;
+	struct worker_frame hdr = { 0, WORKER_FRAME_LOG, 0 };
+
+	/* binary frames have their header where kvvecs have "log=" */
+	if (binary_framing)
+		len = sizeof(hdr);
 
 	va_start(ap, fmt);
-	len = vsnprintf(&lmsg[len], sizeof(lmsg) - 7, fmt, ap);
+	len = vsnprintf(&lmsg[len], sizeof(lmsg) - sizeof(hdr) - MSG_DELIM_LEN - 1, fmt, ap);
 	va_end(ap);
-	if (len < 0 || len + 7 >= (int)sizeof(lmsg))
+	if (len < 0 || len + sizeof(hdr) + MSG_DELIM_LEN + 1 >= sizeof(lmsg))
 		return;
 
-	len += 4; /* log= */
+	if (binary_framing) {
+		to_send = hdr.len = sizeof(hdr) + len + 1;
+		memcpy(lmsg, &hdr, sizeof(hdr));
+	} else {
+		len += 4; /* log= */
 
-	/* add delimiter and send it. 1 extra as kv pair separator */
-	to_send = len + MSG_DELIM_LEN + 1;
-	lmsg[len] = 0;
-	memcpy(&lmsg[len + 1], MSG_DELIM, MSG_DELIM_LEN);
+		/* add delimiter and send it. 1 extra as kv pair separator */
+		to_send = len + MSG_DELIM_LEN + 1;
+		lmsg[len] = 0;
+		memcpy(&lmsg[len + 1], MSG_DELIM, MSG_DELIM_LEN);
+	}
+	if (use_rings && !worker_ring_write(&rings.results, lmsg, to_send))
+		return;
 	if (iobroker_write_packet(nagios_iobs, master_sd, lmsg, to_send) < 0) {
 		if (errno == EPIPE) {
 			/* master has died or abandoned us, so exit */
@@ -101,6 +156,72 @@ static int worker_send_kvvec(int sd, struct kvvec *kvv)
 	return ret;
 }
 
+/*
+ * Sends a result as a binary frame. The core already knows the job's
+ * command, so unlike the kvvec result, the request isn't echoed back.
+ * The frame is built right in the result ring when there's room.
+ */
+static int worker_send_result(child_process *cp, int reason, const char *outstd, size_t outstd_len,
+                              const char *outerr, size_t outerr_len, const char *error_msg, size_t error_msg_len)
+{
+	struct worker_result_frame res;
+	struct rusage *ru = &cp->ei->rusage;
+	char *buf, *p;
+	int ret, in_ring = 0;
+
+	memset(&res, 0, sizeof(res));
+	res.hdr.len = sizeof(res) + outstd_len + outerr_len + error_msg_len + 3;
+	res.hdr.type = WORKER_FRAME_RESULT;
+	res.job_id = cp->id;
+	res.wait_status = cp->ret;
+	res.error_code = reason;
+	res.outstd_len = outstd_len;
+	res.outerr_len = outerr_len;
+	res.error_msg_len = error_msg_len;
+	res.start_sec = cp->ei->start.tv_sec;
+	res.start_usec = cp->ei->start.tv_usec;
+	res.stop_sec = cp->ei->stop.tv_sec;
+	res.stop_usec = cp->ei->stop.tv_usec;
+	if (!reason && !error_msg_len) {
+		/* child exited nicely (or with a signal, so check wait_status) */
+		res.hdr.flags = WORKER_RESULT_EXITED_OK;
+		res.ru_utime_sec = ru->ru_utime.tv_sec;
+		res.ru_utime_usec = ru->ru_utime.tv_usec;
+		res.ru_stime_sec = ru->ru_stime.tv_sec;
+		res.ru_stime_usec = ru->ru_stime.tv_usec;
+		res.ru_minflt = ru->ru_minflt;
+		res.ru_majflt = ru->ru_majflt;
+		res.ru_inblock = ru->ru_inblock;
+		res.ru_oublock = ru->ru_oublock;
+		res.ru_maxrss = ru->ru_maxrss;
+	}
+
+	buf = use_rings ? worker_ring_reserve(&rings.results, res.hdr.len) : NULL;
+	if (buf) {
+		in_ring = 1;
+	} else if (!(buf = malloc(res.hdr.len))) {
+		return -1;
+	}
+	memcpy(buf, &res, sizeof(res));
+	p = buf + sizeof(res);
+	memcpy(p, outstd, outstd_len);
+	p[outstd_len] = 0;
+	p += outstd_len + 1;
+	memcpy(p, outerr, outerr_len);
+	p[outerr_len] = 0;
+	p += outerr_len + 1;
+	memcpy(p, error_msg, error_msg_len);
+	p[error_msg_len] = 0;
+
+	if (in_ring) {
+		worker_ring_commit(&rings.results, res.hdr.len);
+		return 0;
+	}
+	ret = iobroker_write_packet(nagios_iobs, master_sd, buf, res.hdr.len);
+	free(buf);
+	return ret;
+}
+
 static void job_error(child_process *cp, struct kvvec *kvv, const char *fmt, ...)
 {
 	char msg[4096];
@@ -111,6 +232,18 @@ static void job_error(child_process *cp, struct kvvec *kvv, const char *fmt, ...
 	va_start(ap, fmt);
 	len = vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
 	va_end(ap);
+	if (binary_framing) {
+		if (!cp) {
+			wlog("%s", msg);
+			return;
+		}
+		if (len >= (int)sizeof(msg))
+			len = sizeof(msg) - 1;
+		ret = worker_send_result(cp, 0, "", 0, "", 0, msg, len);
+		if (ret < 0 && errno == EPIPE)
+			exit_worker(1, "Failed to send job error to master");
+		return;
+	}
 	if (cp) {
 		kvvec_addkv_str(kvv, "job_id", mkstr("%d", cp->id));
 	}
@@ -121,8 +254,10 @@ static void job_error(child_process *cp, struct kvvec *kvv, const char *fmt, ...
 	kvvec_destroy(kvv, 0);
 }
 
-/* forward declaration */
+/* forward declarations */
 static void gather_output(child_process *cp, iobuf *io, int final);
+static void persistent_timeout(child_process *cp, int aborted);
+static void persistent_next(struct persistent_plugin *pp);
 
 static void destroy_job(child_process *cp)
 {
@@ -142,19 +277,33 @@ static void destroy_job(child_process *cp)
 	kvvec_destroy(cp->request, KVVEC_FREE_ALL);
 	free(cp->cmd);
 	cp->cmd = NULL;
+	free(cp->argv);
+	cp->argv = NULL;
 
 	free(cp->ei);
 	cp->ei = NULL;
 	free(cp);
 }
 
+/* tells whoever reads the output that there was more of it */
+static void mark_truncated(iobuf *io)
+{
+	char marker[64];
+	int len;
+
+	if (!io->truncated)
+		return;
+	len = snprintf(marker, sizeof(marker), "\n[%zu bytes of output truncated]\n", io->truncated);
+	nm_bufferqueue_push(io->buf, marker, len);
+}
+
 static int finish_job(child_process *cp, int reason)
 {
 	static struct kvvec resp = KVVEC_INITIALIZER;
 	struct rusage *ru = &cp->ei->rusage;
 	char *bufout, *buferr, *nul;
 	int i, ret;
-	size_t buflen;
+	size_t buflen, errlen;
 
 	/*
 	 * When a job is fininshed, the state is sent to the master, and the job
@@ -175,16 +324,39 @@ static int finish_job(child_process *cp, int reason)
 		cp->outerr.fd = -1;
 	}
 
+	mark_truncated(&cp->outstd);
+	mark_truncated(&cp->outerr);
+
+	gettimeofday(&cp->ei->stop, NULL);
+
+	cp->ei->runtime = tv_delta_f(&cp->ei->start, &cp->ei->stop);
+
+	if (binary_framing) {
+		buflen = nm_bufferqueue_get_available(cp->outerr.buf);
+		buferr = malloc(buflen);
+		nm_bufferqueue_unshift(cp->outerr.buf, buflen, buferr);
+		if ((nul = memchr(buferr, 0, buflen)))
+			buflen = (unsigned long)nul - (unsigned long)buferr;
+		errlen = buflen;
+		buflen = nm_bufferqueue_get_available(cp->outstd.buf);
+		bufout = malloc(buflen);
+		nm_bufferqueue_unshift(cp->outstd.buf, buflen, bufout);
+		if ((nul = memchr(bufout, 0, buflen)))
+			buflen = (unsigned long)nul - (unsigned long)bufout;
+		ret = worker_send_result(cp, reason, bufout, buflen, buferr, errlen, "", 0);
+		free(buferr);
+		free(bufout);
+		if (ret < 0 && errno == EPIPE)
+			exit_worker(1, "Failed to send result to master");
+		return 0;
+	}
+
 	/* how many key/value pairs do we need? */
 	if (kvvec_init(&resp, 12 + cp->request->kv_pairs) == NULL) {
 		/* what the hell do we do now? */
 		exit_worker(1, "Failed to init response key/value vector");
 	}
 
-	gettimeofday(&cp->ei->stop, NULL);
-
-	cp->ei->runtime = tv_delta_f(&cp->ei->start, &cp->ei->stop);
-
 	/*
 	 * Now build the return message.
 	 * First comes the request, minus environment variables
@@ -210,6 +382,7 @@ static int finish_job(child_process *cp, int reason)
 		kvvec_addkv_long(&resp, "ru_majflt", ru->ru_majflt);
 		kvvec_addkv_long(&resp, "ru_inblock", ru->ru_inblock);
 		kvvec_addkv_long(&resp, "ru_oublock", ru->ru_oublock);
+		kvvec_addkv_long(&resp, "ru_maxrss", ru->ru_maxrss);
 	} else {
 		/* some error happened */
 		kvvec_addkv_str(&resp, "exited_ok", "0");
@@ -257,6 +430,11 @@ static void kill_job(struct nm_event_execution_properties *event)
 	g_return_if_fail(cp != NULL);
 	g_return_if_fail(cp->ei != NULL);
 
+	if (cp->persistent) {
+		persistent_timeout(cp, event->execution_type == EVENT_EXEC_ABORTED);
+		return;
+	}
+
 	pid = cp->ei->pid;
 	id = cp->id;
 	if (event->execution_type == EVENT_EXEC_ABORTED) {
@@ -322,12 +500,44 @@ static void kill_job(struct nm_event_execution_properties *event)
 	}
 }
 
+/*
+ * Reads what the child has written so far. With an output limit, only
+ * that much is kept, and the rest is read into a scratch buffer and
+ * thrown away, so a child that writes lots of output can't make us
+ * hold on to more than the limit.
+ */
+static int read_output(child_process *cp, iobuf *io)
+{
+	static char scratch[65536];
+	size_t have, keep;
+	ssize_t rd;
+	int total = 0;
+
+	if (!cp->output_limit)
+		return nm_bufferqueue_read(io->buf, io->fd);
+
+	do {
+		rd = read(io->fd, scratch, sizeof(scratch));
+		if (rd <= 0)
+			return total ? total : rd;
+		have = nm_bufferqueue_get_available(io->buf);
+		keep = have >= cp->output_limit ? 0 : cp->output_limit - have;
+		if (keep > (size_t)rd)
+			keep = rd;
+		if (keep)
+			nm_bufferqueue_push(io->buf, scratch, keep);
+		io->truncated += rd - keep;
+		total += rd;
+	} while (rd == sizeof(scratch));
+	return total;
+}
+
 static void gather_output(child_process *cp, iobuf *io, int final)
 {
 	for (;;) {
 		int rd;
 
-		rd = nm_bufferqueue_read(io->buf, io->fd);
+		rd = read_output(cp, io);
 		if (rd < 0) {
 			if (errno == EINTR) {
 				/* signal caught before we read anything */
@@ -415,7 +625,10 @@ static int start_cmd(child_process *cp)
 {
 	int pfd[2] = { -1, -1}, pfderr[2] = { -1, -1};
 
-	cp->outstd.fd = runcmd_open(cp->cmd, pfd, pfderr, NULL);
+	if (cp->argv)
+		cp->outstd.fd = runcmd_open_argv(cp->argv, pfd, pfderr, NULL);
+	else
+		cp->outstd.fd = runcmd_open(cp->cmd, pfd, pfderr, NULL);
 	if (cp->outstd.fd < 0) {
 		return -1;
 	}
@@ -439,6 +652,295 @@ static int start_cmd(child_process *cp)
 	return 0;
 }
 
+/* stops the plugin, if running. It's reaped as a lost child later */
+static void persistent_stop(struct persistent_plugin *pp)
+{
+	if (pp->pid > 0)
+		kill(-pp->pid, SIGKILL);
+	pp->pid = 0;
+	if (pp->in_fd >= 0)
+		close(pp->in_fd);
+	if (pp->out_fd >= 0)
+		iobroker_close(nagios_iobs, pp->out_fd);
+	if (pp->err_fd >= 0)
+		iobroker_close(nagios_iobs, pp->err_fd);
+	pp->in_fd = pp->out_fd = pp->err_fd = -1;
+	nm_bufferqueue_drop(pp->bq, nm_bufferqueue_get_available(pp->bq));
+	pp->have_header = 0;
+}
+
+/* the current job failed, and the plugin with it */
+static void persistent_failed(struct persistent_plugin *pp, const char *why)
+{
+	child_process *cp = pp->cp;
+
+	wlog("Persistent plugin %s (pid %d) %s", pp->path, pp->pid, why);
+	persistent_stop(pp);
+	pp->cp = NULL;
+	if (cp) {
+		destroy_event(cp->ei->timed_event);
+		finish_job(cp, EPIPE);
+		destroy_job(cp);
+	}
+}
+
+/*
+ * Moves what has arrived so far of one stream of a response to the job,
+ * as it arrives. Past the job's output limit it's thrown away right
+ * away, so a plugin that sends lots of output can't make us hold on to
+ * more than the limit. Returns how much of the stream is still to come.
+ */
+static size_t persistent_output(child_process *cp, iobuf *io, nm_bufferqueue *from, size_t left)
+{
+	size_t len, have, keep;
+	char *buf;
+
+	len = nm_bufferqueue_get_available(from);
+	if (len > left)
+		len = left;
+	keep = len;
+	if (cp->output_limit) {
+		have = nm_bufferqueue_get_available(io->buf);
+		keep = have >= cp->output_limit ? 0 : cp->output_limit - have;
+		if (keep > len)
+			keep = len;
+	}
+	if (keep && (buf = malloc(keep))) {
+		nm_bufferqueue_unshift(from, keep, buf);
+		nm_bufferqueue_push_block(io->buf, buf, keep);
+	} else {
+		keep = 0;
+	}
+	nm_bufferqueue_drop(from, len - keep);
+	io->truncated += len - keep;
+	return left - len;
+}
+
+static int persistent_stdout_handler(int fd, int events, void *pp_)
+{
+	struct persistent_plugin *pp = (struct persistent_plugin *)pp_;
+	child_process *cp;
+	char *buf;
+	size_t size;
+	int rd;
+
+	rd = nm_bufferqueue_read(pp->bq, fd);
+	if (rd < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (rd <= 0) {
+		persistent_failed(pp, "exited");
+		persistent_next(pp);
+		return 0;
+	}
+
+	if (!pp->cp) {
+		persistent_failed(pp, "sent output while idle");
+		return 0;
+	}
+
+	if (!pp->have_header) {
+		if (nm_bufferqueue_unshift_to_delim(pp->bq, "\n", 1, &size, (void **)&buf)) {
+			/* no line yet, but a valid header is short */
+			if (nm_bufferqueue_get_available(pp->bq) > 64) {
+				persistent_failed(pp, "sent a malformed response");
+				persistent_next(pp);
+			}
+			return 0;
+		}
+		buf[size - 1] = 0;
+		rd = sscanf(buf, "%d %zu %zu", &pp->exit_code, &pp->outstd_len, &pp->outerr_len);
+		free(buf);
+		if (rd != 3 || pp->exit_code < 0 || pp->exit_code > 255) {
+			persistent_failed(pp, "sent a malformed response");
+			persistent_next(pp);
+			return 0;
+		}
+		pp->have_header = 1;
+	}
+
+	cp = pp->cp;
+	if (pp->outstd_len)
+		pp->outstd_len = persistent_output(cp, &cp->outstd, pp->bq, pp->outstd_len);
+	if (!pp->outstd_len && pp->outerr_len)
+		pp->outerr_len = persistent_output(cp, &cp->outerr, pp->bq, pp->outerr_len);
+	if (pp->outstd_len || pp->outerr_len)
+		return 0;
+
+	pp->cp = NULL;
+	pp->have_header = 0;
+	/* anything past the response mustn't end up in the next one */
+	nm_bufferqueue_drop(pp->bq, nm_bufferqueue_get_available(pp->bq));
+	cp->ret = pp->exit_code << 8;
+
+	destroy_event(cp->ei->timed_event);
+	finish_job(cp, 0);
+	destroy_job(cp);
+	persistent_next(pp);
+	return 0;
+}
+
+static int persistent_stderr_handler(int fd, int events, void *pp_)
+{
+	struct persistent_plugin *pp = (struct persistent_plugin *)pp_;
+	char buf[1024];
+	ssize_t len;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (len <= 0) {
+		iobroker_close(nagios_iobs, fd);
+		pp->err_fd = -1;
+		return 0;
+	}
+	if (buf[len - 1] == '\n')
+		len--;
+	wlog("Persistent plugin %s (pid %d): %.*s", pp->path, pp->pid, (int)len, buf);
+	return 0;
+}
+
+static int persistent_start(struct persistent_plugin *pp)
+{
+	char *argv[] = { pp->path, NULL };
+	int pfdin[2] = { -1, -1}, pfd[2] = { -1, -1}, pfderr[2] = { -1, -1};
+	int fd;
+
+	fd = runcmd_open_argv_stdin(argv, pfdin, pfd, pfderr, NULL);
+	if (fd < 0)
+		return fd;
+
+	pp->pid = runcmd_pid(fd);
+	pp->in_fd = pfdin[1];
+	pp->out_fd = fd;
+	pp->err_fd = pfderr[0];
+	fcntl(pp->in_fd, F_SETFL, O_NONBLOCK);
+	fcntl(pp->out_fd, F_SETFL, O_NONBLOCK);
+	fcntl(pp->err_fd, F_SETFL, O_NONBLOCK);
+	if (iobroker_register(nagios_iobs, pp->out_fd, pp, persistent_stdout_handler))
+		wlog("Failed to register iobroker for persistent plugin stdout");
+	if (iobroker_register(nagios_iobs, pp->err_fd, pp, persistent_stderr_handler))
+		wlog("Failed to register iobroker for persistent plugin stderr");
+
+	if (pp->starts++)
+		wlog("Restarted persistent plugin %s with pid %d. starts=%u", pp->path, pp->pid, pp->starts);
+	return 0;
+}
+
+/*
+ * Hands a job to the plugin. The pipe is empty between jobs, so the
+ * request is written in one go; one that doesn't fit is an error.
+ */
+static int persistent_send(struct persistent_plugin *pp, child_process *cp)
+{
+	struct sigaction sa, old_sa;
+	char *buf;
+	size_t len = 0, hdr_len;
+	ssize_t wr;
+	int i, ret;
+
+	if (!pp->pid && (ret = persistent_start(pp)) < 0) {
+		job_error(cp, NULL, "Failed to start persistent plugin %s: %s: %s", pp->path, runcmd_strerror(ret), strerror(errno));
+		destroy_event(cp->ei->timed_event);
+		destroy_job(cp);
+		return -1;
+	}
+
+	for (i = 1; cp->argv[i]; i++)
+		len += strlen(cp->argv[i]) + 1;
+	buf = malloc(len + 24);
+	if (!buf) {
+		job_error(cp, NULL, "Failed to allocate request for persistent plugin %s", pp->path);
+		destroy_event(cp->ei->timed_event);
+		destroy_job(cp);
+		return -1;
+	}
+	hdr_len = sprintf(buf, "%zu\n", len);
+	for (i = 1, len = hdr_len; cp->argv[i]; i++) {
+		size_t arg_len = strlen(cp->argv[i]) + 1;
+		memcpy(buf + len, cp->argv[i], arg_len);
+		len += arg_len;
+	}
+
+	/* a plugin that has died mustn't take us with it */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, &old_sa);
+	wr = write(pp->in_fd, buf, len);
+	sigaction(SIGPIPE, &old_sa, NULL);
+	free(buf);
+
+	pp->cp = cp;
+	cp->ei->pid = pp->pid;
+	if (wr < 0 || (size_t)wr != len) {
+		persistent_failed(pp, wr < 0 ? "couldn't be written to" : "was sent a request too large for its pipe");
+		return -1;
+	}
+	return 0;
+}
+
+/* hands the next waiting job, if any, to an idle plugin */
+static void persistent_next(struct persistent_plugin *pp)
+{
+	child_process *cp;
+
+	while (!pp->cp && (cp = g_queue_pop_head(pp->queue)))
+		persistent_send(pp, cp);
+}
+
+static void persistent_timeout(child_process *cp, int aborted)
+{
+	struct persistent_plugin *pp = cp->persistent;
+
+	if (aborted)
+		return;
+
+	timeouts++;
+	if (pp->cp == cp) {
+		wlog("Killing persistent plugin %s with pid %d due to timeout of job %d. timeouts=%u; started=%u",
+		     pp->path, pp->pid, cp->id, timeouts, started);
+		persistent_stop(pp);
+		pp->cp = NULL;
+	} else {
+		wlog("Job %d timed out waiting for persistent plugin %s. timeouts=%u; started=%u",
+		     cp->id, pp->path, timeouts, started);
+		g_queue_remove(pp->queue, cp);
+	}
+	/* the event is done with once we return */
+	cp->ei->timed_event = NULL;
+	finish_job(cp, ETIME);
+	destroy_job(cp);
+	persistent_next(pp);
+}
+
+static struct persistent_plugin *get_persistent_plugin(const char *path)
+{
+	struct persistent_plugin *pp;
+
+	if (!persistent_tab)
+		persistent_tab = g_hash_table_new(g_str_hash, g_str_equal);
+	if ((pp = g_hash_table_lookup(persistent_tab, path)))
+		return pp;
+
+	pp = calloc(1, sizeof(*pp));
+	if (!pp)
+		return NULL;
+	pp->path = strdup(path);
+	pp->bq = nm_bufferqueue_create();
+	pp->queue = g_queue_new();
+	if (!pp->path || !pp->bq || !pp->queue) {
+		free(pp->path);
+		if (pp->bq)
+			nm_bufferqueue_destroy(pp->bq);
+		if (pp->queue)
+			g_queue_free(pp->queue);
+		free(pp);
+		return NULL;
+	}
+	pp->in_fd = pp->out_fd = pp->err_fd = -1;
+	g_hash_table_insert(persistent_tab, pp->path, pp);
+	return pp;
+}
+
 static child_process *parse_command_kvvec(struct kvvec *kvv)
 {
 	int i;
@@ -453,6 +955,7 @@ static child_process *parse_command_kvvec(struct kvvec *kvv)
 	cp->ei = calloc(1, sizeof(*cp->ei));
 	if (!cp->ei) {
 		wlog("Failed to calloc() a execution_information struct");
+		free(cp);
 		return NULL;
 	}
 
@@ -474,6 +977,10 @@ static child_process *parse_command_kvvec(struct kvvec *kvv)
 			cp->timeout = (unsigned int)strtoul(value, &endptr, 0);
 			continue;
 		}
+		if (!strcmp(key, "output_limit")) {
+			cp->output_limit = (unsigned int)strtoul(value, &endptr, 0);
+			continue;
+		}
 	}
 
 	/* jobs without a timeout get a default of 60 seconds. */
@@ -484,21 +991,84 @@ static child_process *parse_command_kvvec(struct kvvec *kvv)
 	return cp;
 }
 
-static void spawn_job(struct kvvec *kvv)
+/*
+ * Copies the nul-terminated arguments at the end of a job frame into a
+ * vector that holds both the pointers and the strings in one chunk
+ */
+static char **parse_frame_argv(const char *args, size_t len)
 {
-	int result;
+	unsigned int argc = 0, i;
+	size_t off;
+	char **argv, *strings;
+
+	if (!len || args[len - 1])
+		return NULL;
+	for (off = 0; off < len; off++)
+		argc += !args[off];
+
+	argv = malloc((argc + 1) * sizeof(char *) + len);
+	if (!argv)
+		return NULL;
+	strings = (char *)(argv + argc + 1);
+	memcpy(strings, args, len);
+	for (i = 0, off = 0; i < argc; i++) {
+		argv[i] = strings + off;
+		off += strlen(strings + off) + 1;
+	}
+	argv[argc] = NULL;
+	return argv;
+}
+
+static child_process *parse_command_frame(char *buf, size_t size)
+{
+	struct worker_job_frame *job = (struct worker_job_frame *)buf;
 	child_process *cp;
 
-	if (!kvv) {
-		wlog("Received NULL command key/value vector. Bug in iocache.c or kvvec.c?");
-		return;
+	/* the frame readers make sure there's a header */
+	if (job->hdr.type != WORKER_FRAME_JOB || size < sizeof(*job) ||
+	    size - sizeof(*job) < (size_t)job->command_len + 1) {
+		wlog("Ignoring unrecognized frame of type %u and length %zu", job->hdr.type, size);
+		return NULL;
+	}
+	/* the command is passed on as a string, so it must end where it says */
+	if (buf[sizeof(*job) + job->command_len]) {
+		wlog("Ignoring job frame with an unterminated command");
+		return NULL;
 	}
 
-	cp = parse_command_kvvec(kvv);
+	cp = calloc(1, sizeof(*cp));
 	if (!cp) {
-		job_error(NULL, kvv, "Failed to parse worker-command");
-		return;
+		wlog("Failed to calloc() a child_process struct");
+		return NULL;
+	}
+	cp->ei = calloc(1, sizeof(*cp->ei));
+	if (!cp->ei) {
+		wlog("Failed to calloc() a execution_information struct");
+		free(cp);
+		return NULL;
 	}
+	cp->id = job->job_id;
+	cp->timeout = job->timeout;
+	cp->output_limit = job->output_limit;
+	cp->cmd = strdup(buf + sizeof(*job));
+	if (job->hdr.flags & WORKER_JOB_ARGV)
+		cp->argv = parse_frame_argv(buf + sizeof(*job) + job->command_len + 1,
+		                            size - sizeof(*job) - job->command_len - 1);
+	if ((job->hdr.flags & WORKER_JOB_PERSISTENT) && cp->argv)
+		cp->persistent = get_persistent_plugin(cp->argv[0]);
+
+	/* jobs without a timeout get a default of 60 seconds. */
+	if (!cp->timeout) {
+		cp->timeout = 60;
+	}
+
+	return cp;
+}
+
+static void spawn_job(child_process *cp, struct kvvec *kvv)
+{
+	int result;
+
 	if (!cp->cmd) {
 		job_error(cp, kvv, "Failed to parse commandline. Ignoring job %u", cp->id);
 		return;
@@ -511,6 +1081,12 @@ static void spawn_job(struct kvvec *kvv)
 	cp->outerr.buf = nm_bufferqueue_create();
 	started++;
 	running_jobs++;
+	if (cp->persistent) {
+		cp->outstd.fd = cp->outerr.fd = -1;
+		g_queue_push_tail(cp->persistent->queue, cp);
+		persistent_next(cp->persistent);
+		return;
+	}
 	result = start_cmd(cp);
 	if (result < 0) {
 		job_error(cp, kvv, "Failed to start child: %s: %s", runcmd_strerror(result), strerror(errno));
@@ -521,7 +1097,7 @@ static void spawn_job(struct kvvec *kvv)
 
 static int receive_command(int sd, int events, void *arg)
 {
-	int ioc_ret;
+	int ioc_ret, ret = 0;
 	char *buf;
 	size_t size;
 
@@ -544,17 +1120,58 @@ static int receive_command(int sd, int events, void *arg)
 	 * loop over all inbound messages in the iocache.
 	 * Since KV_TERMINATOR is a nul-byte, they're separated by 3 nuls
 	 */
-	while (!nm_bufferqueue_unshift_to_delim(bq, MSG_DELIM, MSG_DELIM_LEN, &size, (void **)&buf)) {
+	while (binary_framing && !(ret = worker_bq2frame(bq, &buf, &size))) {
+		child_process *cp = parse_command_frame(buf, size);
+		if (cp)
+			spawn_job(cp, NULL);
+		free(buf);
+	}
+	if (binary_framing && ret < 0) {
+		/* without a valid header, there's no telling where the next frame starts */
+		iobroker_close(nagios_iobs, sd);
+		exit_worker(1, "Received a broken frame from master");
+	}
+
+	while (!binary_framing && !nm_bufferqueue_unshift_to_delim(bq, MSG_DELIM, MSG_DELIM_LEN, &size, (void **)&buf)) {
 		struct kvvec *kvv;
+		child_process *cp;
 		/* we must copy vars here, as we preserve them for the response */
 		kvv = buf2kvvec(buf, (unsigned int)size - MSG_DELIM_LEN, KV_SEP, PAIR_SEP, KVVEC_COPY);
-		if (kvv)
-			spawn_job(kvv);
 		free(buf);
+		if (!kvv) {
+			wlog("Received NULL command key/value vector. Bug in iocache.c or kvvec.c?");
+			continue;
+		}
+		cp = parse_command_kvvec(kvv);
+		if (!cp) {
+			job_error(NULL, kvv, "Failed to parse worker-command");
+			continue;
+		}
+		spawn_job(cp, kvv);
 	}
 	return 0;
 }
 
+/* jobs in the job ring are read where they are */
+static int receive_ring(int fd, int events, void *arg)
+{
+	child_process *cp;
+	char *buf;
+	size_t size;
+	int ret;
+
+	worker_ring_clear(&rings.jobs);
+	while (!(ret = worker_ring_peek(&rings.jobs, &buf, &size))) {
+		cp = parse_command_frame(buf, size);
+		worker_ring_consume(&rings.jobs, size);
+		if (cp)
+			spawn_job(cp, NULL);
+	}
+	if (ret < 0)
+		exit_worker(1, "Received a broken frame from master");
+	return 0;
+}
+
 static void enter_worker(int sd)
 {
 	/* created with socketpair(), usually */
@@ -582,15 +1199,18 @@ static void enter_worker(int sd)
 	worker_set_sockopts(master_sd, 256 * 1024);
 
 	iobroker_register(nagios_iobs, master_sd, NULL, receive_command);
+	if (use_rings)
+		iobroker_register(nagios_iobs, rings.jobs.efd, NULL, receive_ring);
 	for (;;) {
 		event_poll();
 		reap_jobs();
 	}
 }
 
-int nm_core_worker(const char *path)
+int nm_core_worker(const char *path, const char *ring_fds)
 {
-	int sd, ret;
+	int sd, ret, max_jobs, fds[3] = { -1, -1, -1 };
+	size_t len = 0;
 	char response[128];
 
 	sd = nsock_unix(path, NSOCK_TCP | NSOCK_CONNECT);
@@ -600,26 +1220,54 @@ int nm_core_worker(const char *path)
 		return 1;
 	}
 
-	ret = nsock_printf_nul(sd, "@wproc register name=Core Worker %d;pid=%d", getpid(), getpid());
+	/* the rings are only any use if we can map them */
+	if (ring_fds && sscanf(ring_fds, "%d,%d,%d", &fds[0], &fds[1], &fds[2]) == 3)
+		use_rings = !worker_rings_attach(&rings, fds);
+	if (use_rings) {
+		/* plugins have no business with them */
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[2], F_SETFD, FD_CLOEXEC);
+	}
+
+	/*
+	 * the core never has more of our jobs running than we say we can
+	 * take. A job takes a pipe each for stdout and stderr, and we keep
+	 * some descriptors for ourselves.
+	 */
+	max_jobs = (iobroker_max_usable_fds() - 64) / 2;
+	if (max_jobs < 1)
+		max_jobs = 1;
+	ret = nsock_printf_nul(sd, "@wproc register name=Core Worker %d;pid=%d;max_jobs=%d;framing=%s;rings=%d",
+	                       getpid(), getpid(), max_jobs, WORKER_FRAMING_BINARY, use_rings);
 	if (ret < 0) {
 		printf("Failed to register as worker.\n");
 		return 1;
 	}
 
-	ret = read(sd, response, 3);
-	if (ret != 3) {
+	/*
+	 * The response is nul-terminated, and jobs may follow right
+	 * behind it, so we mustn't read any further than that
+	 */
+	do {
+		ret = read(sd, response + len, 1);
+	} while (ret == 1 && response[len] && ++len < sizeof(response) - 1);
+	if (ret != 1) {
 		printf("Failed to read response from wproc manager\n");
 		return 1;
 	}
-	if (memcmp(response, "OK", 3)) {
-		if (read(sd, response + 3, sizeof(response) - 4) < 0) {
-			printf("Failed to register with wproc manager: %s\n", strerror(errno));
-		} else {
-			response[sizeof(response) - 2] = 0;
-			printf("Failed to register with wproc manager: %s\n", response);
-		}
+	response[len] = 0;
+	if (strncmp(response, "OK", 2) || (response[2] && response[2] != ' ')) {
+		printf("Failed to register with wproc manager: %s\n", response);
 		return 1;
 	}
+	binary_framing = !strncmp(response, "OK framing=" WORKER_FRAMING_BINARY, 17) &&
+	                 (!response[17] || response[17] == ' ');
+	use_rings = use_rings && binary_framing && !strcmp(response + 17, " rings=1");
+	if (!use_rings && rings.map) {
+		worker_rings_destroy(&rings);
+		close(fds[1]);
+		close(fds[2]);
+	}
 
 	enter_worker(sd);
 	return 0;
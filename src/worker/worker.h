@@ -34,13 +34,19 @@ NAGIOS_BEGIN_DECL
 typedef struct iobuf {
 	int fd;
 	nm_bufferqueue *buf;
+	size_t truncated; /* bytes read past the output limit and thrown away */
 } iobuf;
 
 typedef struct execution_information execution_information;
 
+struct persistent_plugin;
+
 typedef struct child_process {
 	unsigned int id, timeout;
+	unsigned int output_limit; /* bytes of output to keep per stream, 0 for all */
 	char *cmd;
+	char **argv; /* run without parsing cmd, if set */
+	struct persistent_plugin *persistent; /* hand argv to this, if set */
 	int ret;
 	struct kvvec *request;
 	iobuf outstd;
@@ -51,9 +57,11 @@ typedef struct child_process {
 /**
  * Core worker entry point
  * @param path The path to the query socket this worker should connect to
+ * @param rings The shared memory rings to use, as "<segment>,<job eventfd>,<result eventfd>"
+ *              file descriptors inherited from the core, or NULL to only use the socket
  * @return EXIT_SUCCESS or EXIT_FAILURE
  */
-extern int nm_core_worker(const char *path);
+extern int nm_core_worker(const char *path, const char *rings);
 
 NAGIOS_END_DECL
 
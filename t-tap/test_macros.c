@@ -207,6 +207,63 @@ static void test_ondemand_macros(nagios_macros *mac)
 	RUN_MACRO_TEST("$SERVICESTATEID:" TEST_HOSTNAME ":service description$", "2", 0);
 }
 
+static void test_argv_template(nagios_macros *mac, const char *command_line, const char *expect, size_t expect_len)
+{
+	struct argv_template *tpl;
+	char *cmd = NULL, *argv = NULL, *processed = NULL;
+	size_t argv_len = 0;
+
+	tpl = compile_argv_template(command_line);
+	if (!tpl) {
+		fail("'%s' should compile into an argv template", command_line);
+		return;
+	}
+	if (expect) {
+		ok(OK == expand_argv_template_r(mac, tpl, &cmd, &argv, &argv_len, STRIP_ILLEGAL_MACRO_CHARS) &&
+		   argv_len == expect_len && !memcmp(argv, expect, expect_len),
+		   "'%s' expands to the expected arguments", command_line);
+		process_macros_r(mac, (char *)command_line, &processed, STRIP_ILLEGAL_MACRO_CHARS);
+		ok(cmd && !strcmp(cmd, processed), "'%s' expands to the same command line as with process_macros_r()", command_line);
+	} else {
+		ok(ERROR == expand_argv_template_r(mac, tpl, &cmd, &argv, &argv_len, STRIP_ILLEGAL_MACRO_CHARS),
+		   "'%s' can't be run from its argv template", command_line);
+	}
+	nm_free(cmd);
+	nm_free(argv);
+	nm_free(processed);
+	free_argv_template(tpl);
+}
+
+#define TEST_ARGV(_CMD, _EXPECT) test_argv_template(mac, (_CMD), (_EXPECT), sizeof(_EXPECT))
+
+static void test_argv_templates(nagios_macros *mac)
+{
+	/* these need a shell, or can't be split before the macros are known */
+	ok(NULL == compile_argv_template("/bin/foo | /bin/bar"), "Pipes need a shell");
+	ok(NULL == compile_argv_template("VAR=value /bin/foo"), "Variable assignments need a shell");
+	ok(NULL == compile_argv_template("/bin/echo $$"), "Escaped dollar signs are left to the shell");
+	ok(NULL == compile_argv_template("/bin/echo \\$HOSTNAME$"), "A backslash in front of a macro can't be resolved up front");
+	ok(NULL == compile_argv_template("/bin/echo 'unbalanced"), "Unbalanced quotes need a shell");
+	ok(NULL == compile_argv_template("/bin/echo $HOSTNAME"), "Unterminated macros can't be compiled");
+
+	mac->argv[0] = "-w a   -c b";
+	mac->argv[1] = "";
+
+	TEST_ARGV("/bin/check -s $SERVICESTATEID$ -d '$SERVICEDESC$' $ARG1$",
+	          "/bin/check\0-s\0" "2\0-d\0service description\0-w\0a\0-c\0b");
+	TEST_ARGV("/bin/check --desc=$SERVICEDESC$ \"x $SERVICEDESC$\"",
+	          "/bin/check\0--desc=service\0description\0x service description");
+	TEST_ARGV("  /bin/echo $ARG2$ 'it'\\''s'  \"\\\"\" $ARG2$ ",
+	          "/bin/echo\0it's\0\"");
+	TEST_ARGV("/bin/echo '$ARG2$'", "/bin/echo\0");
+
+	/* values that would change how the rest of the command is split */
+	test_argv_template(mac, "/bin/echo $HOSTNAME$", NULL, 0);
+	test_argv_template(mac, "/bin/echo $IDONOTEXIST$", NULL, 0);
+
+	mac->argv[0] = mac->argv[1] = NULL;
+}
+
 /*****************************************************************************/
 /*                             Main function                                 */
 /*****************************************************************************/
@@ -215,7 +272,7 @@ int main(void)
 {
 	nagios_macros *mac;
 
-	plan_tests(24);
+	plan_tests(40);
 
 	reset_variables();
 	init_environment();
@@ -225,6 +282,7 @@ int main(void)
 
 	test_escaping(mac);
 	test_ondemand_macros(mac);
+	test_argv_templates(mac);
 
 	free(mac);
 
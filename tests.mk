@@ -147,6 +147,11 @@ tests_test_worker_LDADD = $(TESTSLDADD)
 tests_test_worker_LDFLAGS = $(TESTSLDADD)
 tests_test_worker_CPPFLAGS = $(TESTSCPPFLAGS)
 
+tests_test_wproc_SOURCES = tests/test-wproc.c
+tests_test_wproc_LDADD = $(TESTSLDADD)
+tests_test_wproc_LDFLAGS = $(TESTSLDADD)
+tests_test_wproc_CPPFLAGS = $(TESTSCPPFLAGS)
+
 tests_test_retention_SOURCES = tests/test-retention.c
 tests_test_retention_LDADD = $(TESTSLDADD)
 tests_test_retention_LDFLAGS = $(TESTSLDADD)
@@ -174,6 +179,7 @@ check_PROGRAMS += \
 	tests/test-objects \
 	tests/test-kvvec-ekvstr \
 	tests/test-worker \
+	tests/test-wproc \
 	tests/test-retention \
 	tests/test-arith \
 	tests/test-arith-builtins
@@ -189,5 +195,28 @@ check_PROGRAMS += test-bitmap test-iobroker test-bufferqueue \
 
 
 endif
+
+# Benchmarks aren't run as part of "make check", use "make bench"
+tests_bench_event_queue_SOURCES = tests/bench-event-queue.c
+tests_bench_event_queue_CPPFLAGS = $(AM_CPPFLAGS) -Isrc
+tests_bench_worker_dispatch_SOURCES = tests/bench-worker-dispatch.c
+tests_bench_worker_dispatch_CPPFLAGS = $(AM_CPPFLAGS) -Isrc
+tests_bench_job_table_SOURCES = tests/bench-job-table.c
+tests_bench_job_table_CPPFLAGS = $(AM_CPPFLAGS) -Isrc
+tests_bench_worker_ring_SOURCES = tests/bench-worker-ring.c
+tests_bench_worker_ring_CPPFLAGS = $(AM_CPPFLAGS) -Isrc
+tests_bench_check_parser_SOURCES = tests/bench-check-parser.c
+tests_bench_check_parser_CPPFLAGS = $(AM_CPPFLAGS) -Isrc
+tests_bench_host_reachability_SOURCES = tests/bench-host-reachability.c
+tests_bench_host_reachability_CPPFLAGS = $(AM_CPPFLAGS) -Isrc
+
+BENCHMARKS = tests/bench-event-queue tests/bench-worker-dispatch tests/bench-job-table tests/bench-worker-ring \
+	tests/bench-check-parser tests/bench-host-reachability
+EXTRA_PROGRAMS = $(BENCHMARKS)
+CLEANFILES += $(BENCHMARKS)
+
+bench: $(BENCHMARKS)
+	@for b in $(BENCHMARKS); do echo "### $$b"; ./$$b || exit 1; done
+
 TEST_LOG_DRIVER = env AM_TAP_AWK='$(AWK)' $(SHELL) \
 	build-aux/tap-driver.sh
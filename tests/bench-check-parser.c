@@ -0,0 +1,107 @@
+/*
+ * Measures how many check results per second the main loop gets
+ * through, and how much of its own cpu it spends per 100k of them,
+ * with the output parsed in the main loop or by parser threads.
+ * Applying a result is reduced to taking over its parsed output, so
+ * this is what the main loop saves, not what a whole result costs.
+ *
+ * Usage: bench-check-parser [number of results [parser threads]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "naemon/checks.h"
+
+static int apply_check_result(check_result *cr);
+#define process_check_result apply_check_result
+/* yes, include C file, we need to replace what applying a result does */
+#include "naemon/checks_parser.c"
+#undef process_check_result
+
+#define BENCH_OUTPUT "DISK OK - free space: / 3326 MB (56%%); /boot 68 MB (69%%); /home 69357 MB (27%%);" \
+	"| /=2643MB;5948;5958;0;5968 /boot=68MB;88;93;0;98 /home=69357MB;253404;253409;0;253414\n" \
+	"/ 3326 MB (56%%) inode=60%%\\n/boot 68 MB (69%%) inode=99%%\\n/home 69357 MB (27%%) inode=91%%\n" \
+	"| /var=7890MB;12345;12350;0;12355 /tmp=12MB;950;980;0;1000\n"
+
+static unsigned int applied;
+
+static int apply_check_result(check_result *cr)
+{
+	char *short_output, *long_output, *perf_data;
+
+	parse_check_result_output(cr, &short_output, &long_output, &perf_data);
+	free(short_output);
+	free(long_output);
+	free(perf_data);
+	applied++;
+	return OK;
+}
+
+static double main_cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void bench_parser(int threads, unsigned int count)
+{
+	struct timespec start, stop;
+	check_result *cr;
+	double cpu, elapsed;
+	unsigned int i;
+
+	check_result_parser_threads = threads;
+	if (checks_parser_init() != OK) {
+		printf("%u threads not available\n", threads);
+		return;
+	}
+
+	applied = 0;
+	cpu = main_cpu_seconds();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		cr = nm_malloc(sizeof(*cr));
+		init_check_result(cr);
+		cr->host_name = nm_strdup("bench");
+		nm_asprintf(&cr->output, BENCH_OUTPUT);
+		checks_parser_submit(cr);
+		/* a busy event loop goes around every so many results */
+		if (threads && i % 64 == 63)
+			event_poll();
+	}
+	while (applied < count)
+		event_poll();
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	cpu = main_cpu_seconds() - cpu;
+	elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%u threads %10.0f results/sec %8.3f main loop cpu seconds per 100k results\n",
+	       threads, count / elapsed, cpu * 100000 / count);
+	checks_parser_deinit();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 500000, threads = 4;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		threads = strtoul(argv[2], NULL, 10);
+	if (!count) {
+		fprintf(stderr, "Usage: %s [number of results [parser threads]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	nagios_iobs = iobroker_create();
+	init_event_queue();
+	printf("%u results\n", count);
+	bench_parser(0, count);
+	bench_parser(threads, count);
+	destroy_event_queue();
+	iobroker_destroy(nagios_iobs, 0);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/*
+ * Compares the timed event queue backends under a check-like load:
+ * schedule every event, then repeatedly run the earliest one and
+ * reschedule it one interval later, cancel and reschedule random events
+ * (as when a check is rescheduled), and finally drain the queue.
+ *
+ * Usage: bench-event-queue [number of events...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+/* yes, include C file, we need the static queue functions */
+#include "naemon/events.c"
+
+static void bench_callback(struct nm_event_execution_properties *evprop)
+{
+}
+
+static double elapsed_ns(struct timespec *start)
+{
+	struct timespec stop;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return (stop.tv_sec - start->tv_sec) * 1e9 + (stop.tv_nsec - start->tv_nsec);
+}
+
+/* A check interval somewhere between one and ten minutes */
+static void reschedule(struct timed_event *ev)
+{
+	ev->event_time.tv_sec += 60 + rand() % 540;
+	ev->event_time.tv_nsec = rand() % 1000000000;
+}
+
+static void bench_backend(int backend, size_t count)
+{
+	struct timed_event **events;
+	struct timed_event *ev;
+	struct timespec start;
+	double add_ns, run_ns, resched_ns, drain_ns;
+	size_t i;
+
+	srand(4711);
+	event_queue_backend = backend;
+	init_event_queue();
+
+	events = nm_calloc(count, sizeof(*events));
+	for (i = 0; i < count; i++) {
+		events[i] = nm_calloc(1, sizeof(struct timed_event));
+		events[i]->callback = bench_callback;
+		/* spread the initial events over an hour from now, like startup does */
+		clock_gettime(EVENT_CLOCK_ID, &events[i]->event_time);
+		events[i]->event_time.tv_sec += rand() % 3600;
+		events[i]->event_time.tv_nsec = rand() % 1000000000;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		evqueue_add(events[i]);
+	add_ns = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		ev = evqueue_head();
+		evqueue_remove(ev);
+		reschedule(ev);
+		evqueue_add(ev);
+	}
+	run_ns = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		ev = events[rand() % count];
+		evqueue_remove(ev);
+		reschedule(ev);
+		evqueue_add(ev);
+	}
+	resched_ns = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((ev = evqueue_head()) != NULL)
+		evqueue_remove(ev);
+	drain_ns = elapsed_ns(&start);
+
+	printf("%-6s %9zu %14.1f %14.1f %14.1f %14.1f\n",
+	       backend == EVENT_QUEUE_WHEEL ? "wheel" : "heap", count,
+	       add_ns / count, run_ns / count, resched_ns / count, drain_ns / count);
+
+	for (i = 0; i < count; i++)
+		nm_free(events[i]);
+	nm_free(events);
+	destroy_event_queue();
+}
+
+int main(int argc, char **argv)
+{
+	size_t default_counts[] = { 100000, 1000000, 5000000 };
+	size_t i, count;
+	int n = argc > 1 ? argc - 1 : (int)ARRAY_SIZE(default_counts);
+
+	printf("%-6s %9s %14s %14s %14s %14s\n", "queue", "events",
+	       "add ns/op", "run ns/op", "resched ns/op", "drain ns/op");
+	for (i = 0; i < (size_t)n; i++) {
+		count = argc > 1 ? strtoul(argv[i + 1], NULL, 10) : default_counts[i];
+		if (!count)
+			continue;
+		bench_backend(EVENT_QUEUE_HEAP, count);
+		bench_backend(EVENT_QUEUE_WHEEL, count);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/*
+ * Measures what telling DOWN from UNREACHABLE costs during a core
+ * outage. The network has five levels under a single core host, and
+ * every host below the first level has two uplinks. The core goes down
+ * and every host under it is found down in turn, top to bottom, once
+ * for every check attempt, and then everything comes back up the same
+ * way. The "walk" mode looks for an UP parent among each host's parents
+ * on every result, the way it used to be done, and the "counter" mode
+ * keeps each host's count of UP parents instead, which only changes
+ * when a parent goes down or comes back up.
+ *
+ * Usage: bench-host-reachability [rounds [check attempts [hosts per leaf switch]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+/* yes, include C file, we need the static reachability function */
+#include "naemon/checks_host.c"
+
+#define LEVELS 5
+
+static unsigned int level_size[LEVELS] = { 1, 8, 8 * 8, 8 * 8 * 16, 0 };
+static host **hosts;
+static unsigned int num_hosts;
+
+static double elapsed_ns(struct timespec *start)
+{
+	struct timespec stop;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return (stop.tv_sec - start->tv_sec) * 1e9 + (stop.tv_nsec - start->tv_nsec);
+}
+
+static gboolean walk_is_host_up(gpointer _name, gpointer _hst, gpointer user_data)
+{
+	host *hst = (host *)_hst;
+	gboolean *retval = (gboolean *)user_data;
+	if (hst->current_state == STATE_UP) {
+		*retval = TRUE;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static int walk_reachability(host *hst)
+{
+	gboolean is_up = FALSE;
+
+	if (hst->current_state == STATE_UP)
+		return STATE_UP;
+	if (g_tree_nnodes(hst->parent_hosts) == 0)
+		return STATE_DOWN;
+	g_tree_foreach(hst->parent_hosts, walk_is_host_up, &is_up);
+	return is_up ? STATE_DOWN : STATE_UNREACHABLE;
+}
+
+/* what processing a check result does to the host's state */
+static void apply_result(host *hst, int state, int counter)
+{
+	if (counter) {
+		set_host_current_state(hst, state);
+		set_host_current_state(hst, determine_host_reachability(hst));
+	} else {
+		hst->current_state = state;
+		hst->current_state = walk_reachability(hst);
+	}
+}
+
+static void build_network(void)
+{
+	unsigned int level, i, first = 0, prev_first = 0, prev_size = 0, parent;
+	char name[32];
+
+	for (level = 0; level < LEVELS; level++)
+		num_hosts += level_size[level];
+	init_objects_host(num_hosts);
+	hosts = nm_calloc(num_hosts, sizeof(*hosts));
+
+	for (level = 0; level < LEVELS; level++) {
+		for (i = 0; i < level_size[level]; i++) {
+			snprintf(name, sizeof(name), "host-%u-%u", level, i);
+			hosts[first + i] = create_host(name);
+			register_host(hosts[first + i]);
+			if (!level)
+				continue;
+			/* an uplink to its own switch, and one to the next one over */
+			parent = i * prev_size / level_size[level];
+			add_parent_to_host(hosts[first + i], hosts[prev_first + parent]);
+			if (prev_size > 1)
+				add_parent_to_host(hosts[first + i], hosts[prev_first + (parent + 1) % prev_size]);
+		}
+		prev_first = first;
+		prev_size = level_size[level];
+		first += level_size[level];
+	}
+}
+
+static double bench_outage(int counter, unsigned int rounds, unsigned int attempts, unsigned int *unreachable)
+{
+	struct timespec start;
+	unsigned int round, attempt, i;
+
+	*unreachable = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < rounds; round++) {
+		for (attempt = 0; attempt < attempts; attempt++) {
+			for (i = 0; i < num_hosts; i++)
+				apply_result(hosts[i], STATE_DOWN, counter);
+		}
+		if (!round) {
+			for (i = 0; i < num_hosts; i++)
+				*unreachable += hosts[i]->current_state == STATE_UNREACHABLE;
+		}
+		for (i = 0; i < num_hosts; i++)
+			apply_result(hosts[i], STATE_UP, counter);
+	}
+	return elapsed_ns(&start) / ((double)rounds * num_hosts * (attempts + 1));
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rounds = 20, attempts = 3, unreachable;
+
+	level_size[LEVELS - 1] = level_size[LEVELS - 2] * 40;
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		attempts = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		level_size[LEVELS - 1] = level_size[LEVELS - 2] * strtoul(argv[3], NULL, 10);
+	if (!rounds || !attempts || !level_size[LEVELS - 1]) {
+		fprintf(stderr, "Usage: %s [rounds [check attempts [hosts per leaf switch]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	build_network();
+	printf("%u hosts in %d levels, %u outages of %u check attempts\n", num_hosts, LEVELS, rounds, attempts);
+	printf("%-8s %8.1f ns per host result", "walk", bench_outage(0, rounds, attempts, &unreachable));
+	printf(", %u unreachable\n", unreachable);
+	printf("%-8s %8.1f ns per host result", "counter", bench_outage(1, rounds, attempts, &unreachable));
+	printf(", %u unreachable\n", unreachable);
+
+	destroy_objects_host();
+	nm_free(hosts);
+	return EXIT_SUCCESS;
+}
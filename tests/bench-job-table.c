@@ -0,0 +1,110 @@
+/*
+ * Measures a worker's job table under churn. With a number of jobs in
+ * flight, a random one of them finishes, which means looking it up by
+ * its id and removing it, and a new job takes its place. The "hash"
+ * mode does the same with a GHashTable keyed by job id, which is what
+ * the jobs were kept in before.
+ *
+ * Usage: bench-job-table [jobs in flight [rounds]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+/* yes, include C file, we need the static job functions */
+#include "naemon/workers.c"
+
+static unsigned int rnd_state = 2463534242U;
+
+static unsigned int rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return (stop.tv_sec - start->tv_sec) + (stop.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double bench_slots(struct wproc_job *jobs, unsigned int inflight, unsigned int rounds)
+{
+	struct wproc_worker wp;
+	struct timespec start;
+	unsigned int i, missing = 0;
+
+	memset(&wp, 0, sizeof(wp));
+	wp.max_jobs = inflight;
+	job_table_init(&wp.jobs, wp.max_jobs);
+	for (i = 0; i < inflight; i++)
+		job_table_add(&wp.jobs, &jobs[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++) {
+		struct wproc_job *job = &jobs[rnd() % inflight];
+
+		if (get_job(&wp, job->id) != job || wp.jobs.running != inflight)
+			missing++;
+		job_table_release(&wp.jobs, job_slot(&wp.jobs, job->id));
+		job_table_add(&wp.jobs, job);
+	}
+	if (missing)
+		printf("slots: %u jobs weren't found\n", missing);
+
+	/* the jobs aren't ours to destroy */
+	nm_free(wp.jobs.slots);
+	return rounds / elapsed(&start);
+}
+
+static double bench_hash(struct wproc_job *jobs, unsigned int inflight, unsigned int rounds)
+{
+	GHashTable *ht = g_hash_table_new(g_direct_hash, g_direct_equal);
+	struct timespec start;
+	unsigned int i, missing = 0, next_id = 0;
+
+	for (i = 0; i < inflight; i++) {
+		jobs[i].id = next_id++;
+		g_hash_table_insert(ht, GINT_TO_POINTER(jobs[i].id), &jobs[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++) {
+		struct wproc_job *job = &jobs[rnd() % inflight];
+
+		if (g_hash_table_lookup(ht, GINT_TO_POINTER(job->id)) != job || g_hash_table_size(ht) != inflight)
+			missing++;
+		g_hash_table_remove(ht, GINT_TO_POINTER(job->id));
+		job->id = next_id++;
+		g_hash_table_insert(ht, GINT_TO_POINTER(job->id), job);
+	}
+	if (missing)
+		printf("hash: %u jobs weren't found\n", missing);
+
+	g_hash_table_destroy(ht);
+	return rounds / elapsed(&start);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int inflight = 50000, rounds = 5000000;
+	struct wproc_job *jobs;
+
+	if (argc > 1)
+		inflight = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		rounds = strtoul(argv[2], NULL, 10);
+	if (!inflight || !rounds) {
+		fprintf(stderr, "Usage: %s [jobs in flight [rounds]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	jobs = nm_calloc(inflight, sizeof(*jobs));
+	printf("%u jobs in flight, %u rounds\n", inflight, rounds);
+	printf("%-10s %12.0f jobs/sec\n", "hash", bench_hash(jobs, inflight, rounds));
+	printf("%-10s %12.0f jobs/sec\n", "slots", bench_slots(jobs, inflight, rounds));
+	nm_free(jobs);
+	return EXIT_SUCCESS;
+}
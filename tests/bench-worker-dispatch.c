@@ -0,0 +1,128 @@
+/*
+ * Measures how many jobs per second the core can hand to a worker.
+ * A child process stands in for the worker and just drains the
+ * socket. Jobs are dispatched in bursts, like checks coming due in
+ * the same event loop iteration, and each burst is pushed out before
+ * the next one starts. The "per-job" mode sends every job the way
+ * wproc_run_job() used to: through a kvvec, with a write per job.
+ *
+ * Usage: bench-worker-dispatch [number of jobs [burst size]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+/* yes, include C file, we need the static job functions */
+#include "naemon/workers.c"
+
+static struct wproc_worker bench_wp;
+static struct wproc_worker *bench_wps[1] = { &bench_wp };
+
+static int ignore_input(int sd, int events, void *arg)
+{
+	return 0;
+}
+
+/* the job dispatch as it was before jobs were batched */
+static int run_job_per_write(struct wproc_job *job)
+{
+	static struct kvvec kvv = KVVEC_INITIALIZER;
+	struct kvvec_buf *kvvb;
+	int ret;
+
+	if (!kvvec_init(&kvv, 4))
+		return ERROR;
+	kvvec_addkv_str(&kvv, "job_id", (char *)mkstr("%d", job->id));
+	kvvec_addkv_str(&kvv, "type", "0");
+	kvvec_addkv_str(&kvv, "command", job->command);
+	kvvec_addkv_str(&kvv, "timeout", (char *)mkstr("%u", job->timeout));
+	kvvb = build_kvvec_buf(&kvv);
+	ret = iobroker_write_packet(nagios_iobs, job->wp->sd, kvvb->buf, kvvb->bufsize);
+	nm_free(kvvb->buf);
+	nm_free(kvvb);
+	return ret < 0 ? ERROR : OK;
+}
+
+static void push_all(int sd)
+{
+	struct pollfd pfd = { sd, POLLOUT, 0 };
+
+	while (!iobroker_push(nagios_iobs))
+		poll(&pfd, 1, 100);
+}
+
+static double bench_dispatch(int batched, unsigned int count, unsigned int burst)
+{
+	struct timespec start, stop;
+	unsigned int i;
+	int sv[2], status;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+	pid = fork();
+	if (!pid) {
+		char buf[65536];
+		close(sv[0]);
+		while (read(sv[1], buf, sizeof(buf)) > 0)
+			;
+		_exit(0);
+	}
+	close(sv[1]);
+
+	worker_set_sockopts(sv[0], 256 * 1024);
+	iobroker_register(nagios_iobs, sv[0], &bench_wp, ignore_input);
+	bench_wp.sd = sv[0];
+	bench_wp.max_jobs = burst + 1;
+	job_table_init(&bench_wp.jobs, bench_wp.max_jobs);
+	workers.wps = bench_wps;
+	workers.len = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		struct wproc_job *job = create_job(NULL, NULL, 60, "/usr/lib/nagios/plugins/check_ping -H 10.0.0.1 -w 100,20% -c 500,60%", NULL, 0);
+		if (batched)
+			wproc_run_job(job, NULL);
+		else
+			run_job_per_write(job);
+
+		if ((i + 1) % burst == 0 || i + 1 == count) {
+			/* what the event loop does before it polls again */
+			push_all(sv[0]);
+			/* pretend the results came back */
+			job_table_destroy(&bench_wp.jobs);
+			job_table_init(&bench_wp.jobs, bench_wp.max_jobs);
+		}
+	}
+	iobroker_close(nagios_iobs, sv[0]);
+	waitpid(pid, &status, 0);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	job_table_destroy(&bench_wp.jobs);
+	return count / ((stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 200000, burst = 100;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		burst = strtoul(argv[2], NULL, 10);
+	if (!count || !burst) {
+		fprintf(stderr, "Usage: %s [number of jobs [burst size]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	nagios_iobs = iobroker_create();
+	/* jobs on workers are given up on from an event */
+	init_event_queue();
+	printf("%u jobs in bursts of %u\n", count, burst);
+	printf("%-10s %12.0f jobs/sec\n", "per-job", bench_dispatch(0, count, burst));
+	printf("%-10s %12.0f jobs/sec\n", "batched", bench_dispatch(1, count, burst));
+	destroy_event_queue();
+	iobroker_destroy(nagios_iobs, 0);
+	return EXIT_SUCCESS;
+}
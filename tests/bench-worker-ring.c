@@ -0,0 +1,195 @@
+/*
+ * Measures how many results per second come back from a worker, and
+ * how much cpu the core spends per 100k of them, with jobs and results
+ * going through the socket or through shared memory rings. A child
+ * process stands in for the worker and answers every job right away
+ * with a result carrying a typical plugin output. The core keeps a
+ * fixed number of jobs in flight, like a busy scheduler does.
+ *
+ * Usage: bench-worker-ring [number of results [jobs in flight]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/resource.h>
+/* yes, include C file, we need the static job functions */
+#include "naemon/workers.c"
+
+#define BENCH_OUTPUT "PING OK - Packet loss = 0%, RTA = 0.52 ms|rta=0.520000ms;100.000000;500.000000;0.000000 pl=0%;20;60;0\n"
+
+static struct wproc_worker bench_wp;
+static struct wproc_worker *bench_wps[1] = { &bench_wp };
+static unsigned int results;
+
+static void count_result(struct wproc_result *wpres, void *data, int flags)
+{
+	if (wpres)
+		results++;
+}
+
+static void run_bench_job(void)
+{
+	wproc_run_job(create_job(count_result, NULL, 60, "/usr/lib/nagios/plugins/check_ping -H 10.0.0.1 -w 100,20% -c 500,60%", NULL, 0), NULL);
+}
+
+static int answer_job(int sd, struct worker_rings *wr, char *frame)
+{
+	static char buf[sizeof(struct worker_result_frame) + sizeof(BENCH_OUTPUT) + 2];
+	struct worker_job_frame *job = (struct worker_job_frame *)frame;
+	struct worker_result_frame *res = (struct worker_result_frame *)buf;
+
+	memset(res, 0, sizeof(*res));
+	res->hdr.len = sizeof(buf);
+	res->hdr.type = WORKER_FRAME_RESULT;
+	res->hdr.flags = WORKER_RESULT_EXITED_OK;
+	res->job_id = job->job_id;
+	res->outstd_len = sizeof(BENCH_OUTPUT) - 1;
+	memcpy(buf + sizeof(*res), BENCH_OUTPUT, sizeof(BENCH_OUTPUT));
+	if (wr && !worker_ring_write(&wr->results, buf, sizeof(buf)))
+		return 0;
+	return write(sd, buf, sizeof(buf)) == sizeof(buf) ? 0 : -1;
+}
+
+/* the worker: answers jobs until the core hangs up */
+static void echo_worker(int sd, struct worker_rings *wr)
+{
+	nm_bufferqueue *bq = nm_bufferqueue_create();
+	struct pollfd pfd[2] = { { sd, POLLIN, 0 }, { wr ? wr->jobs.efd : -1, POLLIN, 0 } };
+	char *frame;
+	size_t size;
+
+	for (;;) {
+		poll(pfd, 2, -1);
+		if (pfd[0].revents) {
+			if (nm_bufferqueue_read(bq, sd) <= 0)
+				_exit(0);
+			while (!worker_bq2frame(bq, &frame, &size)) {
+				answer_job(sd, wr, frame);
+				free(frame);
+			}
+		}
+		if (wr && pfd[1].revents) {
+			worker_ring_clear(&wr->jobs);
+			while (!worker_ring_peek(&wr->jobs, &frame, &size)) {
+				answer_job(sd, wr, frame);
+				worker_ring_consume(&wr->jobs, size);
+			}
+		}
+	}
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void bench_results(int use_rings, unsigned int count, unsigned int in_flight)
+{
+	struct timespec start, stop;
+	struct worker_rings *wr = NULL;
+	double cpu, elapsed;
+	unsigned int i, done, sent;
+	int sv[2], fds[3], status;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+	if (use_rings) {
+		wr = nm_calloc(1, sizeof(*wr));
+		if (worker_rings_create(wr, 1024 * 1024, fds) < 0) {
+			printf("%-8s not available: %s\n", "rings", strerror(errno));
+			nm_free(wr);
+			close(sv[0]);
+			close(sv[1]);
+			return;
+		}
+	}
+	pid = fork();
+	if (!pid) {
+		struct worker_rings theirs;
+		close(sv[0]);
+		if (wr) {
+			worker_rings_destroy(wr);
+			if (worker_rings_attach(&theirs, fds) < 0)
+				_exit(1);
+		}
+		echo_worker(sv[1], wr ? &theirs : NULL);
+	}
+	close(sv[1]);
+	if (wr)
+		close(fds[0]);
+
+	memset(&bench_wp, 0, sizeof(bench_wp));
+	worker_set_sockopts(sv[0], 256 * 1024);
+	iobroker_register(nagios_iobs, sv[0], &bench_wp, handle_worker_result);
+	bench_wp.name = nm_strdup("bench");
+	bench_wp.sd = sv[0];
+	bench_wp.binary = 1;
+	bench_wp.bq = nm_bufferqueue_create();
+	bench_wp.max_jobs = in_flight + 1;
+	bench_wp.rings = wr;
+	if (wr)
+		iobroker_register(nagios_iobs, wr->results.efd, &bench_wp, handle_worker_ring);
+	job_table_init(&bench_wp.jobs, bench_wp.max_jobs);
+	workers.wps = bench_wps;
+	workers.len = 1;
+
+	results = 0;
+	cpu = cpu_seconds();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (sent = 0; sent < in_flight && sent < count; sent++)
+		run_bench_job();
+	while (results < count) {
+		done = results;
+		iobroker_push(nagios_iobs);
+		iobroker_poll(nagios_iobs, 1000);
+		/* every result frees up a slot for the next check */
+		for (i = done; i < results && sent < count; i++, sent++)
+			run_bench_job();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	cpu = cpu_seconds() - cpu;
+	elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%-8s %10.0f results/sec %8.3f cpu seconds per 100k results\n",
+	       use_rings ? "rings" : "socket", count / elapsed, cpu * 100000 / count);
+
+	iobroker_close(nagios_iobs, sv[0]);
+	waitpid(pid, &status, 0);
+	if (wr) {
+		wproc_rings_free(wr);
+		bench_wp.rings = NULL;
+	}
+	nm_bufferqueue_destroy(bench_wp.bq);
+	nm_free(bench_wp.name);
+	job_table_destroy(&bench_wp.jobs);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 500000, in_flight = 256;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		in_flight = strtoul(argv[2], NULL, 10);
+	if (!count || !in_flight) {
+		fprintf(stderr, "Usage: %s [number of results [jobs in flight]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	nagios_iobs = iobroker_create();
+	/* jobs on workers are given up on from an event */
+	init_event_queue();
+	printf("%u results, %u jobs in flight\n", count, in_flight);
+	bench_results(0, count, in_flight);
+	bench_results(1, count, in_flight);
+	destroy_event_queue();
+	iobroker_destroy(nagios_iobs, 0);
+	return EXIT_SUCCESS;
+}
@@ -1,9 +1,18 @@
 #include <check.h>
-#include "naemon/checks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+/* yes, include C file, we should access static functions */
+#include "naemon/checks.c"
 #include "naemon/checks_host.h"
 #include "naemon/checks_service.h"
+#include "naemon/checks_passive.h"
 #include "naemon/globals.h"
 #include "naemon/logging.h"
+#include "naemon/events.h"
+#include "naemon/objects_host.h"
+#include "naemon/objects_service.h"
 
 START_TEST(host_soft_to_hard)
 {
@@ -29,12 +38,242 @@ START_TEST(host_soft_to_hard)
 }
 END_TEST
 
+static host *spool_hst;
+#define SPOOL_DIR_TEMPLATE "/tmp/test-check-result-processing.XXXXXX"
+static char spool_dir[sizeof(SPOOL_DIR_TEMPLATE)];
+static char spool_file[sizeof(SPOOL_DIR_TEMPLATE) + 8];
+
+void setup_spool(void)
+{
+	init_event_queue();
+	init_objects_host(1);
+	spool_hst = create_host("spooled host");
+	ck_assert(spool_hst != NULL);
+	spool_hst->check_command = nm_strdup("dummy_command required");
+	spool_hst->max_attempts = 1;
+	spool_hst->accept_passive_checks = TRUE;
+	register_host(spool_hst);
+
+	strcpy(spool_dir, SPOOL_DIR_TEMPLATE);
+	ck_assert(mkdtemp(spool_dir) != NULL);
+	snprintf(spool_file, sizeof(spool_file), "%s/cABCDEF", spool_dir);
+}
+
+void teardown_spool(void)
+{
+	rmdir(spool_dir);
+	destroy_objects_host();
+	destroy_event_queue();
+}
+
+static void write_spool_file(const char *contents)
+{
+	FILE *fp = fopen(spool_file, "w");
+	ck_assert(fp != NULL);
+	fputs(contents, fp);
+	fclose(fp);
+}
+
+START_TEST(batch_file_results_are_processed)
+{
+	write_spool_file("### Naemon check result batch ###\n"
+	                 "host_name=spooled host\n"
+	                 "output=first\n"
+	                 "return_code=0\n"
+	                 "\n"
+	                 "host_name=spooled host\n"
+	                 "check_type=1\n"
+	                 "output=second\n"
+	                 "return_code=1\n"
+	                 "\n"
+	                 "end_of_batch=2\n");
+	ck_assert_int_eq(OK, process_check_result_file(spool_file));
+	ck_assert_int_eq(1, spool_hst->has_been_checked);
+	ck_assert_str_eq("second", spool_hst->plugin_output);
+	ck_assert_int_eq(STATE_DOWN, spool_hst->current_state);
+	ck_assert_int_ne(0, access(spool_file, F_OK));
+}
+END_TEST
+
+START_TEST(incomplete_batch_file_is_dropped)
+{
+	write_spool_file("### Naemon check result batch ###\n"
+	                 "host_name=spooled host\n"
+	                 "output=first\n"
+	                 "return_code=0\n"
+	                 "\n"
+	                 "host_name=spooled host\n"
+	                 "outp");
+	process_check_result_file(spool_file);
+	ck_assert_int_eq(0, spool_hst->has_been_checked);
+	ck_assert_int_ne(0, access(spool_file, F_OK));
+}
+END_TEST
+
+static const char *single_result = "### Naemon check result batch ###\n"
+                                   "host_name=spooled host\n"
+                                   "output=reaped\n"
+                                   "return_code=0\n"
+                                   "\n"
+                                   "end_of_batch=1\n";
+
+/* writes a result file and its ok-to-go file */
+static void spool_result(const char *name, const char *contents)
+{
+	char path[sizeof(spool_dir) + 16];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", spool_dir, name);
+	ck_assert((fp = fopen(path, "w")) != NULL);
+	fputs(contents, fp);
+	fclose(fp);
+	strcat(path, ".ok");
+	ck_assert((fp = fopen(path, "w")) != NULL);
+	fclose(fp);
+}
+
+void setup_reaping(void)
+{
+	setup_spool();
+	check_result_path = spool_dir;
+	watch_check_result_spool();
+	/* the first run reads the directory, like at startup */
+	ck_assert_int_eq(0, reap_check_result_spool(spool_dir));
+	ck_assert_int_eq(FALSE, spool_rescan);
+}
+
+void teardown_reaping(void)
+{
+	checks_deinit();
+	check_result_path = NULL;
+	teardown_spool();
+}
+
+START_TEST(watched_results_are_reaped)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	ck_assert_int_ne(-1, spool_watch_fd);
+#endif
+	spool_result("cABCDEF", single_result);
+	ck_assert_int_eq(1, reap_check_result_spool(spool_dir));
+	ck_assert_str_eq("reaped", spool_hst->plugin_output);
+	ck_assert_int_eq(FALSE, spool_rescan);
+	ck_assert_int_ne(0, access(spool_file, F_OK));
+}
+END_TEST
+
+START_TEST(missing_results_are_skipped)
+{
+	/* the watch tells about files that have been reaped already */
+	g_queue_push_tail(&spool_ready, nm_strdup("cGHIJKL"));
+	ck_assert_int_eq(0, reap_check_result_spool(spool_dir));
+	ck_assert_int_eq(0, g_queue_get_length(&spool_ready));
+	ck_assert_int_eq(FALSE, spool_rescan);
+	ck_assert_int_eq(0, spool_hst->has_been_checked);
+}
+END_TEST
+
+START_TEST(lost_watch_falls_back_to_rescans)
+{
+	/* the directory is replaced, and the watch goes with the old one */
+	ck_assert_int_eq(0, rmdir(spool_dir));
+	ck_assert_int_eq(0, mkdir(spool_dir, 0700));
+	spool_result("cABCDEF", single_result);
+	ck_assert_int_eq(1, reap_check_result_spool(spool_dir));
+	ck_assert_str_eq("reaped", spool_hst->plugin_output);
+	ck_assert_int_eq(-1, spool_watch_fd);
+
+	/* and the directory is read every time from then on */
+	spool_result("cABCDEF", single_result);
+	ck_assert_int_eq(1, reap_check_result_spool(spool_dir));
+	ck_assert_int_eq(-1, spool_watch_fd);
+}
+END_TEST
+
+static host *passive_hst;
+static service *passive_svc;
+
+void setup_passive(void)
+{
+	init_event_queue();
+	init_objects_host(1);
+	init_objects_service(1);
+	passive_hst = create_host("passive host");
+	ck_assert(passive_hst != NULL);
+	passive_hst->address = nm_strdup("10.0.0.1");
+	passive_hst->check_command = nm_strdup("dummy_command required");
+	passive_hst->max_attempts = 1;
+	passive_hst->accept_passive_checks = TRUE;
+	register_host(passive_hst);
+	passive_svc = create_service(passive_hst, "disk");
+	ck_assert(passive_svc != NULL);
+	passive_svc->max_attempts = 1;
+	passive_svc->accept_passive_checks = TRUE;
+	register_service(passive_svc);
+	accept_passive_host_checks = TRUE;
+	accept_passive_service_checks = TRUE;
+}
+
+void teardown_passive(void)
+{
+	checks_passive_deinit();
+	/* the results schedule checks, which are aborted with the objects still there */
+	destroy_event_queue();
+	destroy_objects_service();
+	destroy_objects_host();
+}
+
+START_TEST(passive_batch_results_are_processed)
+{
+	char batch[] = ";10.0.0.1;disk;2;DISK CRITICAL - / 98%; /var 51%\n"
+	               "1700000000;passive host;;1;first\n"
+	               "\n"
+	               "1700000000;no such host;;0;lost\n"
+	               "not a result\n"
+	               ";#0;;0;back up\n"
+	               ";#0;;7;no such host state";
+	unsigned int rejected;
+
+	ck_assert_int_eq(3, checks_passive_submit(batch, strlen(batch), &rejected));
+	ck_assert_int_eq(3, rejected);
+	ck_assert_int_eq(STATE_CRITICAL, passive_svc->current_state);
+	ck_assert_str_eq("DISK CRITICAL - / 98%: /var 51%", passive_svc->plugin_output);
+	ck_assert_int_eq(STATE_UP, passive_hst->current_state);
+	ck_assert_str_eq("back up", passive_hst->plugin_output);
+	/* the result, and its copy of the source, is gone by now */
+	ck_assert_str_eq("results query handler", passive_hst->check_source);
+}
+END_TEST
+
+START_TEST(passive_batch_ids_must_match)
+{
+	char batch[] = ";;#0;0;by id alone\n"
+	               ";passive host;#0;1;by host and id\n"
+	               ";;#1;0;no such service\n"
+	               ";;disk;0;no host to look in";
+	unsigned int rejected;
+
+	ck_assert_int_eq(2, checks_passive_submit(batch, strlen(batch), &rejected));
+	ck_assert_int_eq(2, rejected);
+	ck_assert_int_eq(STATE_WARNING, passive_svc->current_state);
+
+	/* hosts that don't take passive results reject them */
+	passive_hst->accept_passive_checks = FALSE;
+	strcpy(batch, ";passive host;;1;ignored");
+	ck_assert_int_eq(0, checks_passive_submit(batch, strlen(batch), &rejected));
+	ck_assert_int_eq(1, rejected);
+}
+END_TEST
+
 int main(int argc, char **argv)
 {
 	int number_failed = 0;
 	Suite *s;
 	SRunner *sr;
 	TCase *tc_process = tcase_create("Result processing");
+	TCase *tc_spool = tcase_create("Spool files");
+	TCase *tc_reaping = tcase_create("Spool reaping");
+	TCase *tc_passive = tcase_create("Passive result batches");
 
 	debug_level = -1;
 	debug_verbosity = 5;
@@ -46,6 +285,22 @@ int main(int argc, char **argv)
 	tcase_add_test(tc_process, host_soft_to_hard);
 	suite_add_tcase(s, tc_process);
 
+	tcase_add_checked_fixture(tc_spool, setup_spool, teardown_spool);
+	tcase_add_test(tc_spool, batch_file_results_are_processed);
+	tcase_add_test(tc_spool, incomplete_batch_file_is_dropped);
+	suite_add_tcase(s, tc_spool);
+
+	tcase_add_checked_fixture(tc_reaping, setup_reaping, teardown_reaping);
+	tcase_add_test(tc_reaping, watched_results_are_reaped);
+	tcase_add_test(tc_reaping, missing_results_are_skipped);
+	tcase_add_test(tc_reaping, lost_watch_falls_back_to_rescans);
+	suite_add_tcase(s, tc_reaping);
+
+	tcase_add_checked_fixture(tc_passive, setup_passive, teardown_passive);
+	tcase_add_test(tc_passive, passive_batch_results_are_processed);
+	tcase_add_test(tc_passive, passive_batch_ids_must_match);
+	suite_add_tcase(s, tc_passive);
+
 	sr = srunner_create(s);
 	srunner_run_all(sr, CK_ENV);
 	number_failed = srunner_ntests_failed(sr);
@@ -347,6 +347,291 @@ START_TEST(host_check_interval_OK_states)
 }
 END_TEST
 
+START_TEST(service_result_schedules_freshness_check)
+{
+	check_result cr;
+
+	svc->checks_enabled = TRUE;
+	svc->check_freshness = TRUE;
+	svc->check_interval = 5.0;
+	svc->freshness_threshold = 60;
+
+	init_check_result(&cr);
+	cr.object_check_type = SERVICE_CHECK;
+	cr.check_type = CHECK_TYPE_ACTIVE;
+	cr.start_time.tv_sec = time(NULL);
+	cr.return_code = STATE_OK;
+	handle_async_service_check_result(svc, &cr);
+
+	ck_assert(svc->freshness_check_event != NULL);
+	assert_approximately_equal(61000L, get_timed_event_time_left_ms(svc->freshness_check_event), (long)APPROXIMATION_TOLERANCE_MS);
+
+	/* without freshness checking, nothing is left scheduled */
+	svc->check_freshness = FALSE;
+	schedule_service_freshness_check(svc);
+	ck_assert(svc->freshness_check_event == NULL);
+}
+END_TEST
+
+START_TEST(stale_service_is_freshened_at_its_deadline)
+{
+	struct nm_event_execution_properties ep = {
+		.execution_type = EVENT_EXEC_NORMAL,
+		.event_type = EVENT_TYPE_TIMED,
+		.user_data = svc
+	};
+
+	svc->checks_enabled = TRUE;
+	svc->check_freshness = TRUE;
+	svc->check_interval = 5.0;
+	svc->freshness_threshold = 60;
+	svc->has_been_checked = TRUE;
+	svc->last_check = time(NULL) - 120;
+
+	check_service_result_freshness(&ep);
+	ck_assert_int_eq(TRUE, svc->is_being_freshened);
+	ck_assert(svc->next_check_event != NULL);
+	ck_assert_int_eq(CHECK_OPTION_FORCE_EXECUTION | CHECK_OPTION_FRESHNESS_CHECK, svc->check_options);
+	/* looked at again in case the forced check never returns */
+	ck_assert(svc->freshness_check_event != NULL);
+	assert_approximately_equal((long)service_freshness_check_interval * 1000, get_timed_event_time_left_ms(svc->freshness_check_event), (long)APPROXIMATION_TOLERANCE_MS);
+}
+END_TEST
+
+START_TEST(fresh_service_moves_its_deadline)
+{
+	struct nm_event_execution_properties ep = {
+		.execution_type = EVENT_EXEC_NORMAL,
+		.event_type = EVENT_TYPE_TIMED,
+		.user_data = svc
+	};
+
+	svc->checks_enabled = TRUE;
+	svc->check_freshness = TRUE;
+	svc->check_interval = 5.0;
+	svc->freshness_threshold = 60;
+	svc->has_been_checked = TRUE;
+	svc->last_check = time(NULL) - 30;
+
+	check_service_result_freshness(&ep);
+	ck_assert_int_eq(FALSE, svc->is_being_freshened);
+	ck_assert(svc->freshness_check_event != NULL);
+	assert_approximately_equal(31000L, get_timed_event_time_left_ms(svc->freshness_check_event), (long)APPROXIMATION_TOLERANCE_MS);
+}
+END_TEST
+
+START_TEST(stale_host_is_freshened_at_its_deadline)
+{
+	struct nm_event_execution_properties ep = {
+		.execution_type = EVENT_EXEC_NORMAL,
+		.event_type = EVENT_TYPE_TIMED,
+		.user_data = hst
+	};
+
+	check_host_freshness = TRUE;
+	hst->checks_enabled = TRUE;
+	hst->check_freshness = TRUE;
+	hst->check_interval = 5.0;
+	hst->freshness_threshold = 60;
+	hst->has_been_checked = TRUE;
+	hst->last_check = time(NULL) - 120;
+
+	check_host_result_freshness(&ep);
+	ck_assert_int_eq(TRUE, hst->is_being_freshened);
+	ck_assert_int_eq(CHECK_OPTION_FORCE_EXECUTION | CHECK_OPTION_FRESHNESS_CHECK, hst->check_options);
+	ck_assert(hst->freshness_check_event != NULL);
+	check_host_freshness = DEFAULT_CHECK_HOST_FRESHNESS;
+}
+END_TEST
+
+START_TEST(orphaned_service_check_is_rescheduled)
+{
+	check_result *cr = nm_malloc(sizeof(*cr));
+
+	init_check_result(cr);
+	cr->object_check_type = SERVICE_CHECK;
+	cr->host_name = nm_strdup(TARGET_HOST_NAME);
+	cr->service_description = nm_strdup(TARGET_SERVICE_NAME);
+	svc->is_executing = TRUE;
+	currently_running_service_checks = 1;
+
+	/* the worker layer gave up waiting for its result */
+	handle_worker_service_check(NULL, cr, WPROC_ORPHANED);
+	ck_assert_int_eq(FALSE, svc->is_executing);
+	ck_assert_int_eq(0, currently_running_service_checks);
+	ck_assert(svc->next_check_event != NULL);
+	assert_approximately_equal(0L, get_timed_event_time_left_ms(svc->next_check_event), (long)APPROXIMATION_TOLERANCE_MS);
+}
+END_TEST
+
+static host *parents[2];
+
+static void setup_reachability(void)
+{
+	int i;
+
+	init_event_queue();
+	init_objects_host(3);
+	hst = create_host(TARGET_HOST_NAME);
+	ck_assert(hst != NULL);
+	register_host(hst);
+	for (i = 0; i < 2; i++) {
+		parents[i] = create_host(i ? "parent-2" : "parent-1");
+		ck_assert(parents[i] != NULL);
+		register_host(parents[i]);
+		ck_assert_int_eq(OK, add_parent_to_host(hst, parents[i]));
+	}
+}
+
+static void teardown_reachability(void)
+{
+	destroy_event_queue();
+	destroy_objects_host();
+}
+
+START_TEST(up_parents_are_counted)
+{
+	ck_assert_int_eq(2, hst->up_parents);
+
+	/* a parent listed twice is only counted once */
+	ck_assert_int_eq(OK, add_parent_to_host(hst, parents[0]));
+	ck_assert_int_eq(2, hst->up_parents);
+
+	set_host_current_state(parents[0], STATE_DOWN);
+	ck_assert_int_eq(1, hst->up_parents);
+	/* going from one problem state to another changes nothing */
+	set_host_current_state(parents[0], STATE_UNREACHABLE);
+	ck_assert_int_eq(1, hst->up_parents);
+	set_host_current_state(parents[1], STATE_DOWN);
+	ck_assert_int_eq(0, hst->up_parents);
+	set_host_current_state(parents[0], STATE_UP);
+	ck_assert_int_eq(1, hst->up_parents);
+
+	remove_parent_from_host(hst, parents[0]);
+	ck_assert_int_eq(0, hst->up_parents);
+	ck_assert_int_eq(0, parents[0]->num_children);
+	ck_assert_int_eq(1, parents[1]->num_children);
+}
+END_TEST
+
+START_TEST(reachability_follows_parents)
+{
+	set_host_current_state(hst, STATE_DOWN);
+	set_host_current_state(parents[0], STATE_DOWN);
+	ck_assert_int_eq(STATE_DOWN, determine_host_reachability(hst));
+	set_host_current_state(parents[1], STATE_UNREACHABLE);
+	ck_assert_int_eq(STATE_UNREACHABLE, determine_host_reachability(hst));
+	set_host_current_state(parents[1], STATE_UP);
+	ck_assert_int_eq(STATE_DOWN, determine_host_reachability(hst));
+
+	/* without parents, there's nothing to be unreachable behind */
+	ck_assert_int_eq(STATE_DOWN, determine_host_reachability(parents[0]));
+}
+END_TEST
+
+static service *masters[2];
+
+static void setup_dependencies(void)
+{
+	init_event_queue();
+	init_objects_host(1);
+	init_objects_service(3);
+	hst = create_host(TARGET_HOST_NAME);
+	ck_assert(hst != NULL);
+	register_host(hst);
+	svc = create_service(hst, TARGET_SERVICE_NAME);
+	ck_assert(svc != NULL);
+	register_service(svc);
+	masters[0] = create_service(hst, "master");
+	ck_assert(masters[0] != NULL);
+	register_service(masters[0]);
+	masters[1] = create_service(hst, "grandmaster");
+	ck_assert(masters[1] != NULL);
+	register_service(masters[1]);
+}
+
+static void teardown_dependencies(void)
+{
+	destroy_event_queue();
+	destroy_objects_service();
+	destroy_objects_host();
+}
+
+static void set_service_state(service *temp_service, int state, int state_type)
+{
+	temp_service->current_state = state;
+	temp_service->state_type = state_type;
+	if (state_type == HARD_STATE)
+		temp_service->last_hard_state = state;
+	update_servicedependencies(temp_service);
+}
+
+START_TEST(failing_dependencies_are_counted)
+{
+	ck_assert(add_service_dependency(TARGET_HOST_NAME, TARGET_SERVICE_NAME, TARGET_HOST_NAME, "master", NOTIFICATION_DEPENDENCY, FALSE, OPT_CRITICAL, NULL) != NULL);
+	ck_assert_int_eq(0, svc->failing_notify_deps);
+	ck_assert_int_eq(0, svc->conditional_notify_deps);
+	ck_assert_int_eq(DEPENDENCIES_OK, check_service_dependencies(svc, NOTIFICATION_DEPENDENCY));
+
+	set_service_state(masters[0], STATE_CRITICAL, HARD_STATE);
+	ck_assert_int_eq(1, svc->failing_notify_deps);
+	ck_assert_int_eq(DEPENDENCIES_FAILED, check_service_dependencies(svc, NOTIFICATION_DEPENDENCY));
+	ck_assert_int_eq(DEPENDENCIES_OK, check_service_dependencies(svc, EXECUTION_DEPENDENCY));
+
+	/* a state that isn't among the failure options doesn't fail it */
+	set_service_state(masters[0], STATE_WARNING, HARD_STATE);
+	ck_assert_int_eq(0, svc->failing_notify_deps);
+
+	/* soft states don't count, unless soft_state_dependencies says so */
+	set_service_state(masters[0], STATE_CRITICAL, SOFT_STATE);
+	ck_assert_int_eq(0, svc->failing_notify_deps);
+	set_service_state(masters[0], STATE_OK, HARD_STATE);
+	ck_assert_int_eq(DEPENDENCIES_OK, check_service_dependencies(svc, NOTIFICATION_DEPENDENCY));
+
+	/* a dependency added on a failing master starts out failing */
+	set_service_state(masters[1], STATE_CRITICAL, HARD_STATE);
+	ck_assert(add_service_dependency(TARGET_HOST_NAME, TARGET_SERVICE_NAME, TARGET_HOST_NAME, "grandmaster", EXECUTION_DEPENDENCY, FALSE, OPT_CRITICAL, NULL) != NULL);
+	ck_assert_int_eq(1, svc->failing_exec_deps);
+	ck_assert_int_eq(DEPENDENCIES_FAILED, check_service_dependencies(svc, EXECUTION_DEPENDENCY));
+}
+END_TEST
+
+START_TEST(check_result_updates_dependencies)
+{
+	check_result cr;
+
+	ck_assert(add_service_dependency(TARGET_HOST_NAME, TARGET_SERVICE_NAME, TARGET_HOST_NAME, "master", EXECUTION_DEPENDENCY, FALSE, OPT_CRITICAL, NULL) != NULL);
+	masters[0]->max_attempts = 1;
+	masters[0]->current_attempt = 1;
+
+	init_check_result(&cr);
+	cr.object_check_type = SERVICE_CHECK;
+	cr.check_type = CHECK_TYPE_ACTIVE;
+	cr.start_time.tv_sec = time(NULL);
+	cr.return_code = STATE_CRITICAL;
+	handle_async_service_check_result(masters[0], &cr);
+	ck_assert_int_eq(HARD_STATE, masters[0]->state_type);
+	ck_assert_int_eq(DEPENDENCIES_FAILED, check_service_dependencies(svc, EXECUTION_DEPENDENCY));
+
+	cr.return_code = STATE_OK;
+	handle_async_service_check_result(masters[0], &cr);
+	ck_assert_int_eq(DEPENDENCIES_OK, check_service_dependencies(svc, EXECUTION_DEPENDENCY));
+}
+END_TEST
+
+START_TEST(inherited_dependencies_are_followed)
+{
+	ck_assert(add_service_dependency(TARGET_HOST_NAME, TARGET_SERVICE_NAME, TARGET_HOST_NAME, "master", NOTIFICATION_DEPENDENCY, TRUE, OPT_CRITICAL, NULL) != NULL);
+	ck_assert(add_service_dependency(TARGET_HOST_NAME, "master", TARGET_HOST_NAME, "grandmaster", NOTIFICATION_DEPENDENCY, FALSE, OPT_CRITICAL, NULL) != NULL);
+	ck_assert_int_eq(1, svc->conditional_notify_deps);
+	ck_assert_int_eq(DEPENDENCIES_OK, check_service_dependencies(svc, NOTIFICATION_DEPENDENCY));
+
+	set_service_state(masters[1], STATE_CRITICAL, HARD_STATE);
+	ck_assert_int_eq(0, svc->failing_notify_deps);
+	ck_assert_int_eq(DEPENDENCIES_FAILED, check_service_dependencies(svc, NOTIFICATION_DEPENDENCY));
+}
+END_TEST
+
 START_TEST(test_check_window)
 {
 	time_t expected_window, actual_window;
@@ -380,6 +665,116 @@ START_TEST(test_check_window)
 }
 END_TEST
 
+void leveling_teardown (void) {
+	check_load_leveling = DEFAULT_CHECK_LOAD_LEVELING;
+	check_load_leveling_window = DEFAULT_CHECK_LOAD_LEVELING_WINDOW;
+	checks_leveling_deinit();
+}
+
+START_TEST(load_leveling_prefers_ideal_slot)
+{
+	time_t now = time(NULL);
+
+	ck_assert_int_eq(now + 50, checks_leveling_place(now + 50, now, now + 99));
+	checks_leveling_add(now + 50);
+	/* the ideal second is taken, so the next free one after it wins */
+	ck_assert_int_eq(now + 51, checks_leveling_place(now + 50, now, now + 99));
+	checks_leveling_add(now + 51);
+	/* ...or the first one before it, if none is free after it */
+	ck_assert_int_eq(now + 49, checks_leveling_place(now + 51, now + 49, now + 51));
+	checks_leveling_remove(now + 50);
+	ck_assert_int_eq(now + 50, checks_leveling_place(now + 50, now, now + 99));
+}
+END_TEST
+
+START_TEST(load_leveling_flattens_bursts)
+{
+	struct check_leveling_stats st;
+	time_t now = time(NULL), when;
+	int i;
+
+	/* 1000 checks that all want the same second, spread over 100 */
+	for (i = 0; i < 1000; i++) {
+		when = checks_leveling_place(now + 10, now, now + 99);
+		ck_assert(when >= now && when <= now + 99);
+		checks_leveling_add(when);
+	}
+	checks_leveling_stats(now, 100, &st);
+	ck_assert_int_eq(1000, st.checks);
+	ck_assert_int_eq(10, st.min);
+	ck_assert_int_eq(10, st.max);
+	ck_assert(st.stddev < 0.001);
+	ck_assert_int_eq(1000, st.placed);
+	/* every 100th check finds all seconds equally loaded, and stays put */
+	ck_assert_int_eq(990, st.moved);
+}
+END_TEST
+
+START_TEST(load_leveling_wraps_around)
+{
+	struct check_leveling_stats st;
+	/* a window that crosses the end of the occupancy ring */
+	time_t start = ((time(NULL) >> 17) << 17) + (1 << 17) - 5;
+	int i;
+
+	for (i = 0; i < 10; i++)
+		checks_leveling_add(checks_leveling_place(start + 8, start, start + 9));
+	checks_leveling_stats(start, 10, &st);
+	ck_assert_int_eq(10, st.checks);
+	ck_assert_int_eq(1, st.min);
+	ck_assert_int_eq(1, st.max);
+}
+END_TEST
+
+START_TEST(load_leveling_initial_placement)
+{
+	struct check_leveling_stats st;
+	time_t now, delay;
+	int i;
+
+	check_load_leveling = TRUE;
+	now = time(NULL);
+	for (i = 0; i < 3000; i++) {
+		delay = checks_leveling_initial_delay(300);
+		ck_assert(delay >= 0 && delay < 300);
+		checks_leveling_add(now + delay);
+	}
+	/* allow for the clock ticking over while we were at it */
+	checks_leveling_stats(now + 2, 297, &st);
+	ck_assert(st.max - st.min <= 1);
+
+	check_load_leveling_window = 20;
+	for (i = 0; i < 100; i++) {
+		delay = checks_leveling_interval_delay(300);
+		ck_assert(delay >= 270 && delay <= 330);
+	}
+}
+END_TEST
+
+START_TEST(load_leveling_tracks_scheduled_checks)
+{
+	struct check_leveling_stats st;
+	time_t now = time(NULL);
+
+	svc->check_interval = 5.0;
+	schedule_next_service_check(svc, 10, 0);
+	checks_leveling_stats(now, 20, &st);
+	ck_assert_int_eq(1, st.checks);
+
+	/* rescheduling moves the check rather than adding one */
+	schedule_next_service_check(svc, 3, CHECK_OPTION_FORCE_EXECUTION);
+	checks_leveling_stats(now, 20, &st);
+	ck_assert_int_eq(1, st.checks);
+	checks_leveling_stats(svc->next_check, 1, &st);
+	ck_assert_int_eq(1, st.checks);
+
+	destroy_event(svc->next_check_event);
+	svc->next_check_event = NULL;
+	checks_leveling_stats(now, 20, &st);
+	ck_assert_int_eq(0, st.checks);
+}
+END_TEST
+
 Suite*
 check_scheduling_suite(void)
 {
@@ -387,9 +782,16 @@ check_scheduling_suite(void)
 	TCase *tc_intervals = tcase_create("Check & retry intervals");
 	TCase *tc_freshness_checking = tcase_create("Freshness checking");
 	TCase *tc_miscellaneous = tcase_create("Miscellaneous tests");
+	TCase *tc_leveling = tcase_create("Load leveling");
+	TCase *tc_reachability = tcase_create("Host reachability");
+	TCase *tc_dependencies = tcase_create("Dependencies");
 	tcase_add_checked_fixture(tc_freshness_checking, setup, teardown);
 	tcase_add_test(tc_freshness_checking, service_freshness_checking);
 	tcase_add_test(tc_freshness_checking, host_freshness_checking);
+	tcase_add_test(tc_freshness_checking, service_result_schedules_freshness_check);
+	tcase_add_test(tc_freshness_checking, stale_service_is_freshened_at_its_deadline);
+	tcase_add_test(tc_freshness_checking, fresh_service_moves_its_deadline);
+	tcase_add_test(tc_freshness_checking, stale_host_is_freshened_at_its_deadline);
 	suite_add_tcase(s, tc_freshness_checking);
 
 	tcase_add_checked_fixture(tc_intervals, setup, teardown);
@@ -404,8 +806,29 @@ check_scheduling_suite(void)
 
 	tcase_add_checked_fixture(tc_miscellaneous, setup, teardown);
 	tcase_add_test(tc_miscellaneous, test_check_window);
+	tcase_add_test(tc_miscellaneous, orphaned_service_check_is_rescheduled);
 	suite_add_tcase(s, tc_miscellaneous);
 
+	tcase_add_checked_fixture(tc_reachability, setup_reachability, teardown_reachability);
+	tcase_add_test(tc_reachability, up_parents_are_counted);
+	tcase_add_test(tc_reachability, reachability_follows_parents);
+	suite_add_tcase(s, tc_reachability);
+
+	tcase_add_checked_fixture(tc_dependencies, setup_dependencies, teardown_dependencies);
+	tcase_add_test(tc_dependencies, failing_dependencies_are_counted);
+	tcase_add_test(tc_dependencies, check_result_updates_dependencies);
+	tcase_add_test(tc_dependencies, inherited_dependencies_are_followed);
+	suite_add_tcase(s, tc_dependencies);
+
+	tcase_add_checked_fixture(tc_leveling, setup, teardown);
+	tcase_add_checked_fixture(tc_leveling, NULL, leveling_teardown);
+	tcase_add_test(tc_leveling, load_leveling_prefers_ideal_slot);
+	tcase_add_test(tc_leveling, load_leveling_flattens_bursts);
+	tcase_add_test(tc_leveling, load_leveling_wraps_around);
+	tcase_add_test(tc_leveling, load_leveling_initial_placement);
+	tcase_add_test(tc_leveling, load_leveling_tracks_scheduled_checks);
+	suite_add_tcase(s, tc_leveling);
+
 	return s;
 }
 
@@ -1,6 +1,14 @@
 #include <check.h>
+#include <stdio.h>
 #include "naemon/checks.h"
 
+/* results the parser threads are done with end up here instead */
+static int record_check_result(check_result *cr);
+#define process_check_result record_check_result
+/* yes, include C file, we need the parser's internals */
+#include "naemon/checks_parser.c"
+#undef process_check_result
+
 char *full_output;
 char *short_output;
 char *long_output;
@@ -176,11 +184,99 @@ START_TEST(multiple_line_output_newline_escaping)
 }
 END_TEST
 
+#define PARSER_TEST_RESULTS (3 * PARSER_RING_SIZE)
+
+static int applied, out_of_order, unparsed;
+
+static int record_check_result(check_result *cr)
+{
+	char expect[64];
+
+	if (!cr->parsed)
+		unparsed++;
+	parse_check_result_output(cr, &short_output, &long_output, &perf_data);
+	snprintf(expect, sizeof(expect), "TEST OK - result %d", applied);
+	if (strcmp(expect, short_output) || strcmp("seq=1;", perf_data))
+		out_of_order++;
+	applied++;
+	free(short_output);
+	free(long_output);
+	free(perf_data);
+	short_output = long_output = perf_data = NULL;
+	return OK;
+}
+
+static check_result *fake_result(int i)
+{
+	check_result *cr = calloc(1, sizeof(*cr));
+
+	init_check_result(cr);
+	cr->host_name = strdup(i % 2 ? "odd" : "even");
+	nm_asprintf(&cr->output, "TEST OK - result %d|seq=1;\nmore output", i);
+	return cr;
+}
+
+START_TEST(pre_parsed_output_is_taken_over)
+{
+	check_result cr;
+
+	init_check_result(&cr);
+	cr.output = "not this | no=perfdata;";
+	cr.parsed = calloc(1, sizeof(*cr.parsed));
+	cr.parsed->short_output = strdup("already");
+	cr.parsed->perf_data = strdup("parsed=1;");
+	parse_check_result_output(&cr, &short_output, &long_output, &perf_data);
+	ck_assert(NULL == cr.parsed);
+	ck_assert_str_eq("already", short_output);
+	ck_assert_str_eq("parsed=1;", perf_data);
+	ck_assert(NULL == long_output);
+}
+END_TEST
+
+START_TEST(parser_threads_keep_results_in_order)
+{
+	int i;
+
+	applied = out_of_order = unparsed = 0;
+	nagios_iobs = iobroker_create();
+	init_event_queue();
+	check_result_parser_threads = 4;
+	ck_assert_int_eq(OK, checks_parser_init());
+
+	/* more results than slots, so handing over has to wait at times */
+	for (i = 0; i < PARSER_TEST_RESULTS; i++)
+		checks_parser_submit(fake_result(i));
+	while (applied < PARSER_TEST_RESULTS)
+		ck_assert_int_eq(0, event_poll());
+	ck_assert_int_eq(0, out_of_order);
+	ck_assert_int_eq(0, unparsed);
+
+	checks_parser_deinit();
+	check_result_parser_threads = 0;
+	destroy_event_queue();
+	iobroker_destroy(nagios_iobs, 0);
+	nagios_iobs = NULL;
+}
+END_TEST
+
+START_TEST(without_threads_results_are_applied_right_away)
+{
+	applied = out_of_order = unparsed = 0;
+	ck_assert_int_eq(OK, checks_parser_init());
+	checks_parser_submit(fake_result(0));
+	ck_assert_int_eq(1, applied);
+	ck_assert_int_eq(1, unparsed);
+	ck_assert_int_eq(0, out_of_order);
+	checks_parser_deinit();
+}
+END_TEST
+
 Suite*
 checks_suite(void)
 {
 	Suite *s = suite_create("Checks");
 	TCase *tc_output = tcase_create("Output parsing");
+	TCase *tc_parser = tcase_create("Parser threads");
 	tcase_add_checked_fixture(tc_output, setup, teardown);
 	tcase_add_test(tc_output, one_line_no_perfdata);
 	tcase_add_test(tc_output, one_line_with_perfdata);
@@ -196,6 +292,12 @@ checks_suite(void)
 	tcase_add_test(tc_output, empty_plugin_output);
 	tcase_add_test(tc_output, multiple_line_output_newline_escaping);
 	suite_add_tcase(s, tc_output);
+
+	tcase_add_checked_fixture(tc_parser, setup, teardown);
+	tcase_add_test(tc_parser, pre_parsed_output_is_taken_over);
+	tcase_add_test(tc_parser, parser_threads_keep_results_in_order);
+	tcase_add_test(tc_parser, without_threads_results_are_applied_right_away);
+	suite_add_tcase(s, tc_parser);
 	return s;
 }
 
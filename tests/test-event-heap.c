@@ -194,6 +194,212 @@ START_TEST(event_heap_count_random_removal)
 }
 END_TEST
 
+static struct timed_event *new_test_event(time_t sec, long nsec)
+{
+	struct timed_event *ev = nm_calloc(1, sizeof(struct timed_event));
+	ev->callback = func_a;
+	ev->event_time.tv_sec = sec;
+	ev->event_time.tv_nsec = nsec;
+	return ev;
+}
+
+/* Drain the wheel, verifying events come out in order */
+static void drain_wheel_ordered(struct timed_event_wheel *w, size_t expected)
+{
+	struct timed_event *ev, *last = NULL;
+	size_t i;
+
+	for (i = 0; i < expected; i++) {
+		ev = evwheel_head(w);
+		ck_assert(ev != NULL);
+		if (last) {
+			ck_assert_int_le(evheap_compare(last, ev), 0);
+			free(last);
+		}
+		evwheel_remove(w, ev);
+		last = ev;
+	}
+	free(last);
+	ck_assert(evwheel_head(w) == NULL);
+	ck_assert_int_eq(w->count, 0);
+	ck_assert_int_eq(w->behind->count, 0);
+}
+
+START_TEST(event_wheel_count_ordered)
+{
+	struct timed_event_wheel *w;
+	struct timed_event *ev;
+	size_t i;
+	size_t test_size = 10000;
+
+	w = evwheel_create(0);
+	for (i = 0; i < test_size; i++)
+		evwheel_add(w, new_test_event(i, i));
+	ck_assert_int_eq(w->count, test_size);
+
+	for (i = 0; i < test_size; i++) {
+		ev = evwheel_head(w);
+		ck_assert(ev != NULL);
+		ck_assert_int_eq(i, (size_t)ev->event_time.tv_nsec);
+		evwheel_remove(w, ev);
+		free(ev);
+	}
+	ck_assert(evwheel_head(w) == NULL);
+	evwheel_destroy(w);
+}
+END_TEST
+
+START_TEST(event_wheel_count_random_order)
+{
+	struct timed_event_wheel *w;
+	struct timed_event *ev;
+	size_t i;
+	size_t test_size = 10000;
+
+	w = evwheel_create(0);
+	/* plenty of events within the same second, and the same tick */
+	for (i = 0; i < test_size; i++)
+		evwheel_add(w, new_test_event(rand() % 1000, (rand() % 4) * 100000));
+	/* ...and some that needs to be cascaded from the upper levels */
+	for (i = 0; i < test_size; i++)
+		evwheel_add(w, new_test_event(rand() % (60 * 60 * 24 * 7), rand() % 1000000000));
+
+	/* Turn the wheel a bit, then add events behind it */
+	for (i = 0; i < test_size / 2; i++) {
+		ev = evwheel_head(w);
+		evwheel_remove(w, ev);
+		free(ev);
+	}
+	for (i = 0; i < test_size / 2; i++)
+		evwheel_add(w, new_test_event(rand() % 1000, rand() % 1000000000));
+	ck_assert_int_ne(w->behind->count, 0);
+
+	drain_wheel_ordered(w, test_size * 2);
+	evwheel_destroy(w);
+}
+END_TEST
+
+START_TEST(event_wheel_count_random_removal)
+{
+	struct timed_event_wheel *w;
+	struct timed_event **events;
+	size_t i, n, test_size = 10000;
+
+	w = evwheel_create(0);
+	events = nm_calloc(test_size, sizeof(*events));
+	for (i = 0; i < test_size; i++) {
+		events[i] = new_test_event(rand() % (60 * 60 * 24), rand() % 1000000000);
+		evwheel_add(w, events[i]);
+	}
+
+	for (n = test_size; n > test_size / 2; n--) {
+		i = rand() % n;
+		evwheel_remove(w, events[i]);
+		free(events[i]);
+		events[i] = events[n - 1];
+	}
+	ck_assert_int_eq(w->count, test_size / 2);
+
+	drain_wheel_ordered(w, test_size / 2);
+	nm_free(events);
+	evwheel_destroy(w);
+}
+END_TEST
+
+START_TEST(event_wheel_far_future)
+{
+	struct timed_event_wheel *w;
+	struct timed_event *ev;
+
+	w = evwheel_create(1000);
+	evwheel_add(w, new_test_event(9999999999, 0));
+	evwheel_add(w, new_test_event(60 * 60 * 24 * 365, 0));
+	evwheel_add(w, new_test_event(LONG_MAX / 10, 0));
+	evwheel_add(w, new_test_event(1, 500000000));
+	evwheel_add(w, new_test_event(-14, 0));
+	ck_assert_int_eq(w->behind->count, 1);
+
+	ev = evwheel_head(w);
+	ck_assert_int_eq(-14, ev->event_time.tv_sec);
+	evwheel_remove(w, ev);
+	free(ev);
+	ev = evwheel_head(w);
+	ck_assert_int_eq(1, ev->event_time.tv_sec);
+
+	drain_wheel_ordered(w, 4);
+	evwheel_destroy(w);
+}
+END_TEST
+
+START_TEST(event_wheel_stays_at_current_time)
+{
+	struct timed_event_wheel *w;
+	struct timed_event *ev, *soon, *later;
+	struct timespec current_time;
+	uint64_t now;
+
+	clock_gettime(EVENT_CLOCK_ID, &current_time);
+	now = evwheel_tick(&current_time);
+	w = evwheel_create(now);
+	later = new_test_event(current_time.tv_sec + 600, current_time.tv_nsec);
+	evwheel_add(w, later);
+
+	/* looking up an event far ahead doesn't turn the wheel to it */
+	ev = evwheel_head(w);
+	ck_assert(ev == later);
+	clock_gettime(EVENT_CLOCK_ID, &current_time);
+	ck_assert(w->now <= evwheel_tick(&current_time));
+
+	/* so an event scheduled before it still goes on the wheel */
+	soon = new_test_event(current_time.tv_sec + 1, current_time.tv_nsec);
+	evwheel_add(w, soon);
+	ck_assert(soon->wheel_slot != EVWHEEL_NONE);
+	ck_assert_int_eq(w->behind->count, 0);
+	ev = evwheel_head(w);
+	ck_assert(ev == soon);
+
+	drain_wheel_ordered(w, 2);
+	evwheel_destroy(w);
+}
+END_TEST
+
+START_TEST(event_wheel_earliest_in_slot_is_kept)
+{
+	struct timed_event_wheel *w;
+	struct timed_event *ev, *events[100];
+	struct timespec current_time;
+	size_t i;
+
+	clock_gettime(EVENT_CLOCK_ID, &current_time);
+	w = evwheel_create(evwheel_tick(&current_time));
+	/* all in one slot of an upper level, out of order */
+	for (i = 0; i < ARRAY_SIZE(events); i++) {
+		events[i] = new_test_event(current_time.tv_sec + 600, (i * 37 % ARRAY_SIZE(events)) * 1000);
+		evwheel_add(w, events[i]);
+	}
+	ck_assert_int_ge(events[0]->wheel_slot, EVWHEEL_SLOTS);
+
+	ev = evwheel_head(w);
+	ck_assert_int_eq(0, ev->event_time.tv_nsec);
+	ck_assert(w->slots[ev->wheel_slot].min == ev);
+
+	/* removing some other event leaves the earliest one known */
+	evwheel_remove(w, events[1]);
+	free(events[1]);
+	ck_assert(w->slots[ev->wheel_slot].min == ev);
+
+	/* removing the earliest one makes the slot look for the next */
+	evwheel_remove(w, ev);
+	free(ev);
+	ev = evwheel_head(w);
+	ck_assert_int_eq(1000, ev->event_time.tv_nsec);
+	ck_assert(w->slots[ev->wheel_slot].min == ev);
+
+	drain_wheel_ordered(w, ARRAY_SIZE(events) - 2);
+	evwheel_destroy(w);
+}
+END_TEST
+
 static struct nm_event_execution_properties *cb_props_param;
 static iobroker_set *iobs;
 void test_event_callback(struct nm_event_execution_properties *props)
@@ -216,6 +422,19 @@ void event_polling_teardown(void)
 	nm_free(cb_props_param);
 }
 
+void event_polling_wheel_setup(void)
+{
+	event_queue_backend = EVENT_QUEUE_WHEEL;
+	event_polling_setup();
+	ck_assert(event_wheel != NULL);
+}
+
+void event_polling_wheel_teardown(void)
+{
+	event_polling_teardown();
+	event_queue_backend = EVENT_QUEUE_HEAP;
+}
+
 static time_t runnable_delays[] = {
 	-14, /*a few seconds in the past*/
 	0, /*right now*/
@@ -255,6 +474,178 @@ START_TEST(event_polling_scheduling_future)
 }
 END_TEST
 
+static int dispatched_events;
+static double max_dispatch_latency;
+static void count_event_callback(struct nm_event_execution_properties *props)
+{
+	if (props->execution_type != EVENT_EXEC_NORMAL)
+		return;
+	dispatched_events++;
+	if (props->attributes.timed.latency > max_dispatch_latency)
+		max_dispatch_latency = props->attributes.timed.latency;
+}
+
+static int input_reads;
+static int busy_input_handler(int fd, int events, void *arg)
+{
+	char c;
+	/* read a single byte, so the descriptor stays readable */
+	if (read(fd, &c, 1) == 1)
+		input_reads++;
+	return 0;
+}
+
+START_TEST(event_polling_due_events_with_input)
+{
+	int pfd[2], round, i;
+	char buf[4096];
+
+	ck_assert_int_eq(0, pipe(pfd));
+	memset(buf, 'x', sizeof(buf));
+	ck_assert_int_eq(sizeof(buf), write(pfd[1], buf, sizeof(buf)));
+	ck_assert_int_eq(0, iobroker_register(iobs, pfd[0], NULL, busy_input_handler));
+
+	dispatched_events = 0;
+	max_dispatch_latency = 0.0;
+	input_reads = 0;
+
+	/*
+	 * The pipe has input on every poll, yet every event that is due must
+	 * be run in the same iteration, so latency doesn't pile up
+	 */
+	for (round = 0; round < 20; round++) {
+		for (i = 0; i < 50; i++)
+			ck_assert(schedule_event(0, count_event_callback, NULL) != NULL);
+		ck_assert_int_eq(0, event_poll_full(iobs, EVENT_MAX_POLL_TIME_MS));
+		ck_assert_int_eq((round + 1) * 50, dispatched_events);
+	}
+	ck_assert_int_eq(20, input_reads);
+	ck_assert_msg(max_dispatch_latency < 0.5, "Event latency grew to %f seconds under input load", max_dispatch_latency);
+
+	iobroker_close(iobs, pfd[0]);
+	close(pfd[1]);
+}
+END_TEST
+
+START_TEST(event_polling_dispatch_budget)
+{
+	int i, saved_max_events = event_dispatch_max_events;
+
+	dispatched_events = 0;
+	event_dispatch_max_events = 10;
+	for (i = 0; i < 25; i++)
+		ck_assert(schedule_event(-1, count_event_callback, NULL) != NULL);
+
+	ck_assert_int_eq(0, event_poll_full(iobs, 10));
+	ck_assert_int_eq(10, dispatched_events);
+	ck_assert_int_eq(0, event_poll_full(iobs, 10));
+	ck_assert_int_eq(20, dispatched_events);
+	ck_assert_int_eq(0, event_poll_full(iobs, 10));
+	ck_assert_int_eq(25, dispatched_events);
+
+	event_dispatch_max_events = saved_max_events;
+}
+END_TEST
+
+static int aborted_events;
+static void count_aborted_callback(struct nm_event_execution_properties *props)
+{
+	if (props->execution_type == EVENT_EXEC_ABORTED)
+		aborted_events++;
+}
+
+START_TEST(event_polling_destroy_aborts_all)
+{
+	int i;
+
+	aborted_events = 0;
+	for (i = 0; i < 1000; i++)
+		ck_assert(schedule_event(i * 97 % 100000 - 100, count_aborted_callback, NULL) != NULL);
+	ck_assert(schedule_event(9999999999, count_aborted_callback, NULL) != NULL);
+
+	destroy_event_queue();
+	ck_assert_int_eq(1001, aborted_events);
+}
+END_TEST
+
+static void find_loop_stats(struct event_loop_stats *st, void *arg)
+{
+	struct event_loop_stats *match = arg;
+	if (!strcmp(st->name, match->name))
+		*match = *st;
+}
+
+START_TEST(event_polling_loop_stats)
+{
+	struct event_loop_stats match;
+	unsigned long count, total = 0;
+	int pfd[2], i;
+
+	event_loop_stats_reset();
+	ck_assert_int_eq(0, pipe(pfd));
+	ck_assert_int_eq(1, write(pfd[1], "x", 1));
+	ck_assert_int_eq(0, iobroker_register(iobs, pfd[0], NULL, busy_input_handler));
+	event_loop_stats_name_handler(busy_input_handler, "busy input");
+	iobroker_set_profiler(iobs, event_loop_record_handler);
+
+	for (i = 0; i < 5; i++)
+		ck_assert(schedule_event(-1, count_event_callback, NULL) != NULL);
+	ck_assert_int_eq(0, event_poll_full(iobs, 10));
+
+	memset(&match, 0, sizeof(match));
+	match.name = (char *)"count_event_callback";
+	event_loop_stats_foreach(EVENT_STATS_CALLBACKS, find_loop_stats, &match);
+	ck_assert_int_eq(5, match.count);
+	ck_assert(match.max_latency >= 1.0);
+	ck_assert(match.total_ms >= match.max_ms);
+
+	memset(&match, 0, sizeof(match));
+	match.name = (char *)"busy input";
+	event_loop_stats_foreach(EVENT_STATS_HANDLERS, find_loop_stats, &match);
+	ck_assert_int_eq(1, match.count);
+
+	for (i = 0; event_latency_bucket(i, &count) != NULL; i++)
+		total += count;
+	ck_assert_int_eq(EVENT_LATENCY_BUCKETS, i);
+	ck_assert_int_eq(5, total);
+
+	event_loop_stats_reset();
+	memset(&match, 0, sizeof(match));
+	match.name = (char *)"count_event_callback";
+	event_loop_stats_foreach(EVENT_STATS_CALLBACKS, find_loop_stats, &match);
+	ck_assert_int_eq(0, match.count);
+
+	iobroker_set_profiler(iobs, NULL);
+	iobroker_close(iobs, pfd[0]);
+	close(pfd[1]);
+}
+END_TEST
+
+START_TEST(event_polling_handler_names_kept)
+{
+	struct event_loop_stats match;
+	char *name = (char *)"busy input";
+
+	event_loop_stats_name_handler(busy_input_handler, name);
+	event_loop_record_handler(0, busy_input_handler, 1000);
+
+	/* a reload starts the counts over, but keeps the names */
+	destroy_event_queue();
+	init_event_queue();
+	memset(&match, 0, sizeof(match));
+	match.name = name;
+	event_loop_stats_foreach(EVENT_STATS_HANDLERS, find_loop_stats, &match);
+	ck_assert(match.name != name);
+	ck_assert_int_eq(0, match.count);
+
+	event_loop_stats_deinit();
+	memset(&match, 0, sizeof(match));
+	match.name = name;
+	event_loop_stats_foreach(EVENT_STATS_HANDLERS, find_loop_stats, &match);
+	ck_assert(match.name == name);
+}
+END_TEST
+
 START_TEST(event_timespec_msdiff)
 {
 	int64_t diff_s = 0, expected = 0;
@@ -289,7 +680,7 @@ END_TEST
 Suite *event_heap_suite(void)
 {
 	Suite *s = suite_create("Events");
-	TCase *tc_event_heap, *tc_event_polling;
+	TCase *tc_event_heap, *tc_event_wheel, *tc_event_polling, *tc_event_polling_wheel;
 
 	tc_event_heap = tcase_create("Event heap");
 	tcase_add_test(tc_event_heap, event_heap_count_ordered);
@@ -298,12 +689,35 @@ Suite *event_heap_suite(void)
 	tcase_add_test(tc_event_heap, event_timespec_msdiff);
 	suite_add_tcase(s, tc_event_heap);
 
+	tc_event_wheel = tcase_create("Event wheel");
+	tcase_add_test(tc_event_wheel, event_wheel_count_ordered);
+	tcase_add_test(tc_event_wheel, event_wheel_count_random_order);
+	tcase_add_test(tc_event_wheel, event_wheel_count_random_removal);
+	tcase_add_test(tc_event_wheel, event_wheel_far_future);
+	tcase_add_test(tc_event_wheel, event_wheel_stays_at_current_time);
+	tcase_add_test(tc_event_wheel, event_wheel_earliest_in_slot_is_kept);
+	suite_add_tcase(s, tc_event_wheel);
+
 	tc_event_polling = tcase_create("Event polling");
 	tcase_add_loop_test(tc_event_polling, event_polling_scheduling_past, 0, ARRAY_SIZE(runnable_delays));
 	tcase_add_loop_test(tc_event_polling, event_polling_scheduling_future, 0, ARRAY_SIZE(unrunnable_delays));
+	tcase_add_test(tc_event_polling, event_polling_due_events_with_input);
+	tcase_add_test(tc_event_polling, event_polling_dispatch_budget);
+	tcase_add_test(tc_event_polling, event_polling_destroy_aborts_all);
+	tcase_add_test(tc_event_polling, event_polling_loop_stats);
+	tcase_add_test(tc_event_polling, event_polling_handler_names_kept);
 	tcase_add_checked_fixture(tc_event_polling, event_polling_setup, event_polling_teardown);
 	suite_add_tcase(s, tc_event_polling);
 
+	tc_event_polling_wheel = tcase_create("Event polling, timing wheel");
+	tcase_add_loop_test(tc_event_polling_wheel, event_polling_scheduling_past, 0, ARRAY_SIZE(runnable_delays));
+	tcase_add_loop_test(tc_event_polling_wheel, event_polling_scheduling_future, 0, ARRAY_SIZE(unrunnable_delays));
+	tcase_add_test(tc_event_polling_wheel, event_polling_due_events_with_input);
+	tcase_add_test(tc_event_polling_wheel, event_polling_dispatch_budget);
+	tcase_add_test(tc_event_polling_wheel, event_polling_destroy_aborts_all);
+	tcase_add_checked_fixture(tc_event_polling_wheel, event_polling_wheel_setup, event_polling_wheel_teardown);
+	suite_add_tcase(s, tc_event_polling_wheel);
+
 	return s;
 }
 
@@ -4,10 +4,12 @@
 #include "naemon/workers.h"
 #include "naemon/commands.h"
 #include "naemon/logging.h"
+#include "naemon/defaults.h"
 #include "worker/worker.h"
 #include "lib/libnaemon.h"
 #include <check.h>
 #include <string.h>
+#include <sys/stat.h>
 
 /*
  * A note about worker tests:
@@ -68,6 +70,8 @@ static void run_main_loop(time_t runtime) {
 	n = s = time(NULL);
 
 	while (((runtime - (n - s)) > 0) && completed_jobs == 0) {
+		/* jobs are queued until the event loop pushes them out */
+		iobroker_push(nagios_iobs);
 		iobroker_poll(nagios_iobs, 250);
 		n = time(NULL);
 	}
@@ -202,6 +206,72 @@ START_TEST(worker_test_output_stdout_and_timeout)
 }
 END_TEST
 
+/*
+ * A plugin dumping 100MB of output only gets to keep as much of it as
+ * max_plugin_output_capture allows, and the rest is thrown away.
+ */
+START_TEST(worker_test_output_capture_limit)
+{
+	char expected[1024 + 64];
+	struct wrk_test j = {
+		"/bin/sh -c 'head -c 104857600 /dev/zero | tr \"\\0\" x'",
+		expected,
+		"",
+		0, 0, 30,
+	};
+
+	memset(expected, 'x', 1024);
+	sprintf(expected + 1024, "\n[%d bytes of output truncated]\n", 104857600 - 1024);
+	max_plugin_output_capture = 1024;
+	run_worker_test(&j);
+	max_plugin_output_capture = DEFAULT_MAX_PLUGIN_OUTPUT_CAPTURE;
+}
+END_TEST
+
+/*
+ * The same goes for persistent plugins, whose output is cut down to the
+ * limit while it's read, rather than once all of it has come in.
+ */
+START_TEST(worker_test_persistent_output_capture_limit)
+{
+	char path[] = "/tmp/naemon-persistent-test-XXXXXX";
+	char expected[1024 + 64], argv[sizeof(path) + 4];
+	const char *script =
+	    "#!/bin/sh\n"
+	    "while read len; do\n"
+	    "  head -c $len >/dev/null\n"
+	    "  echo '0 104857600 3'\n"
+	    "  head -c 104857600 /dev/zero | tr '\\0' x\n"
+	    "  printf err\n"
+	    "done\n";
+	struct wrk_test j = {
+		path,
+		expected,
+		"err",
+		0, 0, 30,
+	};
+	int fd;
+
+	fd = mkstemp(path);
+	ck_assert_int_eq(strlen(script), write(fd, script, strlen(script)));
+	fchmod(fd, 0700);
+	close(fd);
+	memcpy(argv, path, sizeof(path));
+	memcpy(argv + sizeof(path), "foo", 4);
+
+	memset(expected, 'x', 1024);
+	sprintf(expected + 1024, "\n[%d bytes of output truncated]\n", 104857600 - 1024);
+	max_plugin_output_capture = 1024;
+	persistent_plugins = path;
+	ck_assert_int_eq(0, wproc_run_callback_argv(path, argv, sizeof(argv), j.timeout, wrk_test_cb, &j, NULL));
+	run_main_loop(j.timeout + 10);
+	ck_assert_int_eq(1, completed_jobs);
+	persistent_plugins = NULL;
+	max_plugin_output_capture = DEFAULT_MAX_PLUGIN_OUTPUT_CAPTURE;
+	unlink(path);
+}
+END_TEST
+
 START_TEST(worker_test_child_remains_to_cause_sideeffects)
 {
 	char filepath[] = "/tmp/XXXXX-naemon-worker-test";
@@ -227,6 +297,25 @@ START_TEST(worker_test_child_remains_to_cause_sideeffects)
 END_TEST
 
 
+/*
+ * With shared memory rings, results too big for the result ring
+ * still make it back through the socket.
+ */
+START_TEST(worker_test_ring_oversize_result)
+{
+	char expected[WORKER_RING_MIN_SIZE + 1];
+	struct wrk_test j = {
+		"/bin/sh -c 'head -c 65536 /dev/zero | tr \"\\0\" x'",
+		expected,
+		"",
+		0, 0, 10,
+	};
+
+	memset(expected, 'x', WORKER_RING_MIN_SIZE);
+	expected[WORKER_RING_MIN_SIZE] = 0;
+	run_worker_test(&j);
+}
+END_TEST
 
 /*
  * Make sure that the lifecycle of the command worker is deterministic w.r.t
@@ -286,6 +375,12 @@ void worker_test_setup(void)
 	ck_assert_int_eq(wproc_num_workers_spawned, wproc_num_workers_online);
 }
 
+void worker_ring_test_setup(void)
+{
+	worker_ring_size = WORKER_RING_MIN_SIZE;
+	worker_test_setup();
+}
+
 void worker_test_teardown(void)
 {
 	free_worker_memory(WPROC_FORCE);
@@ -306,12 +401,14 @@ void worker_test_teardown(void)
 	wproc_num_workers_online = 0;
 	wproc_num_workers_spawned = 0;
 	wproc_num_workers_desired = 0;
+	worker_ring_size = DEFAULT_WORKER_RING_SIZE;
 }
 
 Suite *worker_suite(void)
 {
 	Suite *s;
 	TCase *tc_worker_output;
+	TCase *tc_worker_rings;
 	TCase *tc_command_worker;
 
 	s = suite_create("worker tests");
@@ -325,9 +422,20 @@ Suite *worker_suite(void)
 	tcase_add_test(tc_worker_output, worker_test_timeout);
 	tcase_add_test(tc_worker_output, worker_test_no_timeout_log);
 	tcase_add_test(tc_worker_output, worker_test_output_stdout_and_timeout);
+	tcase_add_test(tc_worker_output, worker_test_output_capture_limit);
+	tcase_add_test(tc_worker_output, worker_test_persistent_output_capture_limit);
 	tcase_add_test(tc_worker_output, worker_test_child_remains_to_cause_sideeffects);
 	suite_add_tcase(s, tc_worker_output);
 
+	tc_worker_rings = tcase_create("worker ring tests");
+	tcase_add_checked_fixture(tc_worker_rings, worker_ring_test_setup, worker_test_teardown);
+	tcase_add_test(tc_worker_rings, worker_test_output_stdout);
+	tcase_add_test(tc_worker_rings, worker_test_output_mixed_stdout_and_stderr);
+	tcase_add_test(tc_worker_rings, worker_test_output_stdout_and_timeout);
+	tcase_add_test(tc_worker_rings, worker_test_output_capture_limit);
+	tcase_add_test(tc_worker_rings, worker_test_ring_oversize_result);
+	suite_add_tcase(s, tc_worker_rings);
+
 	tc_command_worker = tcase_create("command worker tests");
 	tcase_add_checked_fixture(tc_command_worker, init_iobroker, deinit_iobroker);
 	tcase_add_test(tc_command_worker, command_worker_launch_shutdown_test);
@@ -351,7 +459,9 @@ int main(int argc, char **argv)
 	naemon_binary_path = argv[0];
 	if (argc > 1) {
 		if (!strcmp(argv[1], "--worker")) {
-			return nm_core_worker(argv[2]);
+			if (argc > 4 && !strcmp(argv[3], "--worker-rings"))
+				return nm_core_worker(argv[2], argv[4]);
+			return nm_core_worker(argv[2], NULL);
 		}
 	}
 	srunner_run_all(sr, CK_ENV);
@@ -0,0 +1,1185 @@
+#include <check.h>
+#include <stdio.h>
+#include <sys/socket.h>
+/* yes, include C file, we need the static worker functions */
+#include "naemon/workers.c"
+
+#define NUM_FAKE_WORKERS 4
+
+static struct wproc_worker *fake[NUM_FAKE_WORKERS];
+static int peer[NUM_FAKE_WORKERS];
+
+static struct wproc_worker *find_in_list(struct wproc_list *wpl, int sd)
+{
+	unsigned int i;
+
+	for (i = 0; wpl && i < wpl->len; i++) {
+		if (wpl->wps[i]->sd == sd)
+			return wpl->wps[i];
+	}
+	return NULL;
+}
+
+static gboolean find_specialized(gpointer key, gpointer value, gpointer data)
+{
+	return find_in_list(value, GPOINTER_TO_INT(data)) != NULL;
+}
+
+/* register a worker the way a real one would, but without a process behind it */
+static struct wproc_worker *add_fake_worker(int i, const char *options)
+{
+	char buf[256];
+	int sv[2];
+
+	ck_assert_int_eq(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	peer[i] = sv[1];
+	snprintf(buf, sizeof(buf), "name=fake%d;pid=0;%s", i, options);
+	ck_assert_int_eq(QH_TAKEOVER, register_worker(sv[0], buf, strlen(buf)));
+	fake[i] = find_in_list(&workers, sv[0]);
+	if (!fake[i])
+		fake[i] = find_in_list(g_hash_table_find(specialized_workers, find_specialized, GINT_TO_POINTER(sv[0])), sv[0]);
+	ck_assert(fake[i] != NULL);
+	return fake[i];
+}
+
+static void finish_job(struct wproc_job *job)
+{
+	struct wproc_worker *wp = job->wp;
+
+	remove_job(wp, job);
+	wproc_load_changed(wp);
+}
+
+/* every worker must be where its membership says, and less loaded than its children */
+static void verify_list(struct wproc_list *wpl)
+{
+	unsigned int i, child;
+
+	for (i = 0; i < wpl->len; i++) {
+		ck_assert_int_eq(i, wproc_membership(wpl->wps[i], wpl)->pos);
+		for (child = 2 * i + 1; child <= 2 * i + 2 && child < wpl->len; child++)
+			ck_assert(!wproc_less_loaded(wpl->wps[child], wpl->wps[i]));
+	}
+}
+
+static void setup(void)
+{
+	nagios_iobs = iobroker_create();
+	init_event_queue();
+	specialized_workers = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	memset(fake, 0, sizeof(fake));
+}
+
+static void teardown(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_FAKE_WORKERS; i++) {
+		if (fake[i])
+			close(peer[i]);
+	}
+	free_worker_memory(WPROC_FORCE);
+	wproc_usage_deinit();
+	specialized_workers = NULL;
+	destroy_event_queue();
+	iobroker_destroy(nagios_iobs, IOBROKER_CLOSE_SOCKETS);
+	nagios_iobs = NULL;
+}
+
+START_TEST(least_loaded_worker_is_picked)
+{
+	struct wproc_job *job;
+	int i;
+
+	for (i = 0; i < NUM_FAKE_WORKERS; i++)
+		add_fake_worker(i, "max_jobs=100");
+
+	/* with equal runtimes, jobs are spread evenly */
+	for (i = 0; i < 4 * NUM_FAKE_WORKERS; i++) {
+		ck_assert(create_job(NULL, NULL, 10, "/bin/true", NULL, 0) != NULL);
+		verify_list(&workers);
+	}
+	for (i = 0; i < NUM_FAKE_WORKERS; i++)
+		ck_assert_int_eq(4, fake[i]->jobs.running);
+
+	/* a worker that gets done first gets the next job */
+	job = get_job(fake[2], 0);
+	ck_assert(job != NULL);
+	finish_job(job);
+	verify_list(&workers);
+	ck_assert(get_worker("/bin/true") == fake[2]);
+}
+END_TEST
+
+START_TEST(slow_workers_get_fewer_jobs)
+{
+	int i;
+
+	add_fake_worker(0, "max_jobs=100");
+	add_fake_worker(1, "max_jobs=100");
+
+	/* jobs on fake0 have been taking ten times as long */
+	fake[0]->runtime_avg = 1000.0;
+	fake[1]->runtime_avg = 100.0;
+	wproc_load_changed(fake[0]);
+	wproc_load_changed(fake[1]);
+
+	for (i = 0; i < 22; i++)
+		ck_assert(create_job(NULL, NULL, 10, "/bin/true", NULL, 0) != NULL);
+	verify_list(&workers);
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+	ck_assert_int_eq(20, fake[1]->jobs.running);
+}
+END_TEST
+
+START_TEST(full_workers_are_skipped)
+{
+	int i;
+
+	add_fake_worker(0, "max_jobs=1");
+	add_fake_worker(1, "max_jobs=3");
+
+	for (i = 0; i < 4; i++)
+		ck_assert(create_job(NULL, NULL, 10, "/bin/true", NULL, 0) != NULL);
+	verify_list(&workers);
+	ck_assert_int_eq(1, fake[0]->jobs.running);
+	ck_assert_int_eq(3, fake[1]->jobs.running);
+
+	/* everyone is busy */
+	ck_assert(get_worker("/bin/true") == NULL);
+	ck_assert(create_job(NULL, NULL, 10, "/bin/true", NULL, 0) == NULL);
+}
+END_TEST
+
+START_TEST(stale_job_ids_are_not_found)
+{
+	struct wproc_job *a, *b, *c;
+	unsigned int a_id;
+
+	add_fake_worker(0, "max_jobs=2");
+
+	a = create_job(NULL, NULL, 10, "/bin/true", NULL, 0);
+	b = create_job(NULL, NULL, 10, "/bin/true", NULL, 0);
+	ck_assert(a != NULL && b != NULL);
+	ck_assert(a->id != b->id);
+	ck_assert(get_job(fake[0], a->id) == a);
+	ck_assert(get_job(fake[0], b->id) == b);
+
+	/* the new job gets a's slot, but not its id */
+	a_id = a->id;
+	finish_job(a);
+	ck_assert(get_job(fake[0], a_id) == NULL);
+	c = create_job(NULL, NULL, 10, "/bin/true", NULL, 0);
+	ck_assert(c != NULL);
+	ck_assert(c->id != a_id);
+	ck_assert(get_job(fake[0], a_id) == NULL);
+	ck_assert(get_job(fake[0], c->id) == c);
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+
+	/* made up ids don't match anything */
+	ck_assert(get_job(fake[0], -1) == NULL);
+	ck_assert(get_job(fake[0], 12345) == NULL);
+}
+END_TEST
+
+START_TEST(specialized_workers_are_used)
+{
+	struct wproc_list *wpl;
+	int i;
+
+	add_fake_worker(0, "max_jobs=100");
+	add_fake_worker(1, "max_jobs=100;plugin=check_ping;plugin=check_icmp");
+	add_fake_worker(2, "max_jobs=100;plugin=check_ping");
+
+	ck_assert_int_eq(1, workers.len);
+	wpl = g_hash_table_lookup(specialized_workers, "check_ping");
+	ck_assert(wpl != NULL);
+	ck_assert_int_eq(2, wpl->len);
+	ck_assert_int_eq(2, fake[1]->num_lists);
+
+	for (i = 0; i < 6; i++)
+		ck_assert(create_job(NULL, NULL, 10, "/usr/lib/plugins/check_ping -H localhost", NULL, 0) != NULL);
+	verify_list(wpl);
+	ck_assert_int_eq(0, fake[0]->jobs.running);
+	ck_assert_int_eq(3, fake[1]->jobs.running);
+	ck_assert_int_eq(3, fake[2]->jobs.running);
+
+	/* fake1 is the only one for check_icmp, however busy it is */
+	ck_assert(get_worker("check_icmp") == fake[1]);
+	ck_assert(get_worker("/bin/true") == fake[0]);
+
+	/* losing a worker takes it out of all its lists */
+	remove_worker(fake[1]);
+	ck_assert_int_eq(0, fake[1]->num_lists);
+	ck_assert_int_eq(1, wpl->len);
+	verify_list(wpl);
+	ck_assert(get_worker("check_ping") == fake[2]);
+	ck_assert(g_hash_table_lookup(specialized_workers, "check_icmp") == NULL);
+	ck_assert(get_worker("check_icmp") == fake[0]);
+	wproc_destroy(fake[1], WPROC_FORCE);
+	fake[1] = NULL;
+	close(peer[1]);
+}
+END_TEST
+
+START_TEST(pool_follows_demand)
+{
+	min_check_workers = 2;
+	max_check_workers = 8;
+
+	ck_assert_int_eq(2, wproc_pool_want(0, 0, 0));
+	ck_assert_int_eq(2, wproc_pool_want(WPROC_POOL_TARGET_JOBS, 0, 4));
+	ck_assert_int_eq(4, wproc_pool_want(3.5 * WPROC_POOL_TARGET_JOBS, 0, 2));
+	ck_assert_int_eq(8, wproc_pool_want(100 * WPROC_POOL_TARGET_JOBS, 0, 2));
+
+	/* jobs that couldn't be started call for another worker */
+	ck_assert_int_eq(4, wproc_pool_want(WPROC_POOL_TARGET_JOBS, 1, 3));
+	ck_assert_int_eq(8, wproc_pool_want(WPROC_POOL_TARGET_JOBS, 1, 8));
+
+	/* the pool never goes empty */
+	min_check_workers = 0;
+	ck_assert_int_eq(1, wproc_pool_want(0, 0, 3));
+	min_check_workers = max_check_workers = 0;
+}
+END_TEST
+
+START_TEST(pool_retires_drained_workers)
+{
+	unsigned int running;
+	int i;
+
+	add_fake_worker(0, "max_jobs=100");
+	add_fake_worker(1, "max_jobs=100");
+	fake[0]->core = fake[1]->core = TRUE;
+	for (i = 0; i < 3; i++)
+		ck_assert(create_job(NULL, NULL, 10, "/bin/true", NULL, 0) != NULL);
+	ck_assert_int_eq(1, fake[0]->jobs.running);
+	ck_assert_int_eq(2, fake[1]->jobs.running);
+
+	/* the worker with the fewest jobs is retired, but finishes them first */
+	wproc_pool_resize(1);
+	ck_assert(fake[0]->retiring);
+	ck_assert_int_eq(2, workers.len);
+	ck_assert_int_eq(1, pool_active(&running));
+	ck_assert(get_worker("/bin/true") == fake[1]);
+
+	/* and is taken back if the pool grows again */
+	wproc_pool_resize(2);
+	ck_assert(!fake[0]->retiring);
+	ck_assert_int_eq(0, pool.num_spawned);
+	ck_assert(get_worker("/bin/true") == fake[0]);
+
+	/* drained workers leave right away */
+	finish_job(get_job(fake[0], 0));
+	wproc_pool_resize(1);
+	ck_assert_int_eq(1, workers.len);
+	ck_assert(workers.wps[0] == fake[1]);
+	fake[0] = NULL;
+	close(peer[0]);
+}
+END_TEST
+
+START_TEST(pool_keeps_foreign_workers)
+{
+	unsigned int running;
+
+	add_fake_worker(0, "max_jobs=100");
+	add_fake_worker(1, "max_jobs=100");
+	fake[0]->core = TRUE;
+
+	/* only workers we spawned ourselves are ours to retire */
+	wproc_pool_resize(0);
+	ck_assert_int_eq(1, workers.len);
+	ck_assert(workers.wps[0] == fake[1]);
+	ck_assert_int_eq(1, pool_active(&running));
+	fake[0] = NULL;
+	close(peer[0]);
+}
+END_TEST
+
+static struct {
+	int calls;
+	unsigned int job_id;
+	int wait_status, exited_ok;
+	struct timeval start, stop;
+	char command[64], outstd[64], outerr[64], source[64];
+} result;
+
+static void save_result(struct wproc_result *wpres, void *data, int flags)
+{
+	/* jobs being destroyed call us without a result */
+	if (!wpres)
+		return;
+	result.calls++;
+	result.job_id = wpres->job_id;
+	result.wait_status = wpres->wait_status;
+	result.exited_ok = wpres->exited_ok;
+	result.start = wpres->start;
+	result.stop = wpres->stop;
+	snprintf(result.command, sizeof(result.command), "%s", wpres->command);
+	snprintf(result.outstd, sizeof(result.outstd), "%s", wpres->outstd);
+	snprintf(result.outerr, sizeof(result.outerr), "%s", wpres->outerr);
+	snprintf(result.source, sizeof(result.source), "%s", wpres->source);
+}
+
+static void send_to_core(int i, const void *buf, size_t len)
+{
+	ck_assert_int_eq(len, write(peer[i], buf, len));
+	handle_worker_result(fake[i]->sd, 0, fake[i]);
+}
+
+static void setup_framing(void)
+{
+	setup();
+	memset(&result, 0, sizeof(result));
+}
+
+START_TEST(binary_framing_is_negotiated)
+{
+	add_fake_worker(0, "max_jobs=100");
+	add_fake_worker(1, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	add_fake_worker(2, "max_jobs=100;framing=json");
+	ck_assert(!fake[0]->binary);
+	ck_assert(fake[1]->binary);
+	ck_assert(!fake[2]->binary);
+}
+END_TEST
+
+START_TEST(binary_job_frames)
+{
+	struct wproc_job *job;
+	struct worker_job_frame *frame;
+	size_t len;
+	char *buf;
+
+	add_fake_worker(0, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	job = create_job(NULL, NULL, 17, "/bin/echo hello", NULL, 0);
+	ck_assert(job != NULL);
+
+	buf = wproc_job_frame(job, &len);
+	frame = (struct worker_job_frame *)buf;
+	ck_assert_int_eq(len, sizeof(*frame) + strlen("/bin/echo hello") + 1);
+	ck_assert_int_eq(len, frame->hdr.len);
+	ck_assert_int_eq(WORKER_FRAME_JOB, frame->hdr.type);
+	ck_assert_int_eq(job->id, frame->job_id);
+	ck_assert_int_eq(17, frame->timeout);
+	ck_assert_int_eq(strlen("/bin/echo hello"), frame->command_len);
+	ck_assert_str_eq("/bin/echo hello", buf + sizeof(*frame));
+	free(buf);
+}
+END_TEST
+
+START_TEST(argv_job_frames)
+{
+	static const char argv[] = "/bin/echo\0hello world";
+	struct wproc_job *job;
+	struct worker_job_frame *frame;
+	size_t len;
+	char *buf;
+
+	add_fake_worker(0, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	add_fake_worker(1, "max_jobs=100");
+
+	job = create_job(NULL, NULL, 17, "/bin/echo 'hello world'", argv, sizeof(argv));
+	ck_assert(job != NULL);
+	job->wp = fake[0];
+	buf = wproc_job_frame(job, &len);
+	frame = (struct worker_job_frame *)buf;
+	ck_assert_int_eq(len, sizeof(*frame) + frame->command_len + 1 + sizeof(argv));
+	ck_assert_int_eq(len, frame->hdr.len);
+	ck_assert_int_eq(WORKER_JOB_ARGV, frame->hdr.flags);
+	ck_assert_str_eq("/bin/echo 'hello world'", buf + sizeof(*frame));
+	ck_assert(!memcmp(argv, buf + sizeof(*frame) + frame->command_len + 1, sizeof(argv)));
+	free(buf);
+
+	/* key/value workers only ever get the command */
+	job->wp = fake[1];
+	buf = wproc_job_frame(job, &len);
+	ck_assert(memmem(buf, len, "command=/bin/echo 'hello world'", 31) != NULL);
+	ck_assert(memmem(buf, len, "hello world\0", 12) == NULL);
+	free(buf);
+}
+END_TEST
+
+START_TEST(persistent_job_frames)
+{
+	static const char argv[] = "/usr/lib/plugins/check_foo.pl\0-H\0localhost";
+	struct wproc_job *job;
+	struct worker_job_frame *frame;
+	size_t len;
+	char *buf;
+
+	add_fake_worker(0, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	persistent_plugins = nm_strdup("/usr/lib/plugins/check_bar.py, /usr/lib/plugins/check_foo.pl");
+
+	job = create_job(NULL, NULL, 17, "/usr/lib/plugins/check_foo.pl -H localhost", argv, sizeof(argv));
+	ck_assert(job != NULL);
+	buf = wproc_job_frame(job, &len);
+	frame = (struct worker_job_frame *)buf;
+	ck_assert_int_eq(WORKER_JOB_ARGV | WORKER_JOB_PERSISTENT, frame->hdr.flags);
+	free(buf);
+
+	/* a prefix of a listed plugin isn't the plugin */
+	job = create_job(NULL, NULL, 17, "/usr/lib/plugins/check_foo -H localhost", "/usr/lib/plugins/check_foo", 27);
+	ck_assert(job != NULL);
+	buf = wproc_job_frame(job, &len);
+	frame = (struct worker_job_frame *)buf;
+	ck_assert_int_eq(WORKER_JOB_ARGV, frame->hdr.flags);
+	free(buf);
+
+	/* commands that need a shell can't be handed to a running plugin */
+	job = create_job(NULL, NULL, 17, "/usr/lib/plugins/check_foo.pl | cat", NULL, 0);
+	ck_assert(job != NULL);
+	buf = wproc_job_frame(job, &len);
+	frame = (struct worker_job_frame *)buf;
+	ck_assert_int_eq(0, frame->hdr.flags);
+	free(buf);
+
+	nm_free(persistent_plugins);
+}
+END_TEST
+
+START_TEST(binary_result_frames)
+{
+	struct worker_result_frame res;
+	struct worker_frame log = { sizeof(log) + 4, WORKER_FRAME_LOG, 0 };
+	struct wproc_job *job;
+	char buf[256];
+
+	add_fake_worker(0, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	job = create_job(save_result, NULL, 10, "/bin/echo hello", NULL, 0);
+	ck_assert(job != NULL);
+
+	memset(&res, 0, sizeof(res));
+	res.hdr.type = WORKER_FRAME_RESULT;
+	res.hdr.flags = WORKER_RESULT_EXITED_OK;
+	res.job_id = job->id;
+	res.wait_status = 2 << 8;
+	res.start_sec = 1000;
+	res.stop_sec = 1001;
+	res.stop_usec = 500000;
+	res.outstd_len = 6;
+	res.outerr_len = 4;
+	res.hdr.len = sizeof(res) + 6 + 4 + 0 + 3;
+	memcpy(buf, &res, sizeof(res));
+	memcpy(buf + sizeof(res), "hello\n\0oops\0\0", 13);
+
+	/* a log message first, and the result in two pieces */
+	memcpy(buf + res.hdr.len, &log, sizeof(log));
+	memcpy(buf + res.hdr.len + sizeof(log), "hey", 4);
+	send_to_core(0, buf + res.hdr.len, log.len);
+	send_to_core(0, buf, 20);
+	ck_assert_int_eq(0, result.calls);
+	send_to_core(0, buf + 20, res.hdr.len - 20);
+
+	ck_assert_int_eq(1, result.calls);
+	ck_assert_int_eq(res.job_id, result.job_id);
+	ck_assert_int_eq(2 << 8, result.wait_status);
+	ck_assert_int_eq(1, result.exited_ok);
+	ck_assert_int_eq(1000, result.start.tv_sec);
+	ck_assert_int_eq(500000, result.stop.tv_usec);
+	ck_assert_str_eq("/bin/echo hello", result.command);
+	ck_assert_str_eq("hello\n", result.outstd);
+	ck_assert_str_eq("oops", result.outerr);
+	ck_assert_int_eq(0, fake[0]->jobs.running);
+}
+END_TEST
+
+START_TEST(kvvec_results_still_work)
+{
+	struct kvvec *kvv;
+	struct kvvec_buf *kvvb;
+	struct wproc_job *job;
+
+	add_fake_worker(0, "max_jobs=100");
+	job = create_job(save_result, NULL, 10, "/bin/echo hello", NULL, 0);
+	ck_assert(job != NULL);
+
+	kvv = kvvec_create(8);
+	kvvec_addkv_str(kvv, "job_id", "0");
+	kvvec_addkv_str(kvv, "command", "/bin/echo hello");
+	kvvec_addkv_str(kvv, "wait_status", "512");
+	kvvec_addkv_str(kvv, "start", "1000.0");
+	kvvec_addkv_str(kvv, "stop", "1001.500000");
+	kvvec_addkv_str(kvv, "exited_ok", "1");
+	kvvec_addkv_str(kvv, "outstd", "hello\n");
+	kvvec_addkv_str(kvv, "outerr", "oops");
+	kvvb = build_kvvec_buf(kvv);
+	send_to_core(0, kvvb->buf, kvvb->bufsize);
+	free(kvvb->buf);
+	free(kvvb);
+	kvvec_destroy(kvv, 0);
+
+	ck_assert_int_eq(1, result.calls);
+	ck_assert_int_eq(0, result.job_id);
+	ck_assert_int_eq(512, result.wait_status);
+	ck_assert_int_eq(500000, result.stop.tv_usec);
+	ck_assert_str_eq("hello\n", result.outstd);
+	ck_assert_str_eq("oops", result.outerr);
+}
+END_TEST
+
+START_TEST(resource_usage_is_accounted)
+{
+	struct worker_result_frame res;
+	struct wproc_usage *top[4];
+	struct wproc_job *job;
+	wproc_result wpres;
+	char buf[256];
+	int i;
+
+	add_fake_worker(0, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 3; i++) {
+		job = create_job(save_result, NULL, 10, "/bin/true", NULL, 0);
+		ck_assert(job != NULL);
+		memset(&res, 0, sizeof(res));
+		res.hdr.type = WORKER_FRAME_RESULT;
+		res.hdr.flags = WORKER_RESULT_EXITED_OK;
+		res.hdr.len = sizeof(res) + 3;
+		res.job_id = job->id;
+		res.stop_sec = 2;
+		res.ru_utime_sec = 1;
+		res.ru_stime_usec = 250000;
+		res.ru_maxrss = 1000 * (i + 1);
+		if (i == 2) {
+			res.hdr.flags = 0;
+			res.error_code = ETIME;
+		}
+		memcpy(buf, &res, sizeof(res));
+		memset(buf + sizeof(res), 0, 3);
+		send_to_core(0, buf, res.hdr.len);
+	}
+	ck_assert_int_eq(3, result.calls);
+
+	ck_assert_int_eq(1, wproc_usage_top(WPROC_USAGE_WORKERS, "cpu", top, 4));
+	ck_assert_str_eq("fake0", top[0]->name);
+	ck_assert_int_eq(3, top[0]->jobs);
+	ck_assert_int_eq(1, top[0]->timeouts);
+	ck_assert_int_eq(0, top[0]->signaled);
+	ck_assert(top[0]->runtime > 5.99 && top[0]->runtime < 6.01);
+	ck_assert(top[0]->utime > 2.99 && top[0]->utime < 3.01);
+	ck_assert(top[0]->stime > 0.74 && top[0]->stime < 0.76);
+	ck_assert_int_eq(3000, top[0]->maxrss);
+
+	/* the heaviest entries come first, by whichever key is asked for */
+	memset(&wpres, 0, sizeof(wpres));
+	wpres.rusage.ru_utime.tv_sec = 5;
+	wpres.rusage.ru_maxrss = 10;
+	wproc_usage_add(WPROC_USAGE_COMMANDS, "check_cpu", &wpres);
+	wpres.rusage.ru_utime.tv_sec = 1;
+	wpres.rusage.ru_maxrss = 5000;
+	wproc_usage_add(WPROC_USAGE_COMMANDS, "check_rss", &wpres);
+	wproc_usage_add(WPROC_USAGE_COMMANDS, "check_rss", &wpres);
+	ck_assert_int_eq(2, wproc_usage_top(WPROC_USAGE_COMMANDS, "cpu", top, 4));
+	ck_assert_str_eq("check_cpu", top[0]->name);
+	ck_assert_int_eq(1, wproc_usage_top(WPROC_USAGE_COMMANDS, "rss", top, 1));
+	ck_assert_str_eq("check_rss", top[0]->name);
+	ck_assert_int_eq(2, wproc_usage_top(WPROC_USAGE_COMMANDS, "jobs", top, 4));
+	ck_assert_str_eq("check_rss", top[0]->name);
+	ck_assert_int_eq(-1, wproc_usage_top(WPROC_USAGE_COMMANDS, "bogus", top, 4));
+	ck_assert_int_eq(0, wproc_usage_top(WPROC_USAGE_HOSTS, "cpu", top, 4));
+
+	wproc_usage_reset();
+	ck_assert_int_eq(0, wproc_usage_top(WPROC_USAGE_WORKERS, "cpu", top, 4));
+}
+END_TEST
+
+START_TEST(broken_frames_disconnect)
+{
+	struct worker_frame hdr = { 2, WORKER_FRAME_RESULT, 0 };
+	char buf[64];
+	ssize_t len;
+
+	add_fake_worker(0, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	send_to_core(0, &hdr, sizeof(hdr));
+	/* past the registration reply, the socket is closed */
+	while ((len = read(peer[0], buf, sizeof(buf))) > 0)
+		;
+	ck_assert_int_eq(0, len);
+}
+END_TEST
+
+START_TEST(unterminated_results_disconnect)
+{
+	struct worker_result_frame res;
+	struct wproc_job *job;
+	char buf[sizeof(res) + 8];
+	ssize_t len;
+
+	add_fake_worker(0, "max_jobs=100;framing=" WORKER_FRAMING_BINARY);
+	job = create_job(save_result, NULL, 10, "/bin/echo hello", NULL, 0);
+	ck_assert(job != NULL);
+
+	/* long enough for its strings, but stdout runs into stderr */
+	memset(&res, 0, sizeof(res));
+	res.hdr.type = WORKER_FRAME_RESULT;
+	res.hdr.len = sizeof(buf);
+	res.job_id = job->id;
+	res.outstd_len = 5;
+	memcpy(buf, &res, sizeof(res));
+	memcpy(buf + sizeof(res), "hello\n\0\0", 8);
+	send_to_core(0, buf, sizeof(buf));
+	ck_assert_int_eq(0, result.calls);
+	while ((len = read(peer[0], buf, sizeof(buf))) > 0)
+		;
+	ck_assert_int_eq(0, len);
+}
+END_TEST
+
+/* what a binary worker sends back when a job is done */
+static void send_result(int i, unsigned int job_id)
+{
+	struct worker_result_frame res;
+	char buf[sizeof(res) + 3];
+
+	memset(&res, 0, sizeof(res));
+	res.hdr.type = WORKER_FRAME_RESULT;
+	res.hdr.flags = WORKER_RESULT_EXITED_OK;
+	res.hdr.len = sizeof(buf);
+	res.job_id = job_id;
+	memcpy(buf, &res, sizeof(res));
+	memset(buf + sizeof(res), 0, 3);
+	send_to_core(i, buf, sizeof(buf));
+}
+
+static struct wproc_job *find_job_by_data(struct wproc_worker *wp, void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < wp->jobs.size; i++) {
+		if (wp->jobs.slots[i].job && wp->jobs.slots[i].job->data == data)
+			return wp->jobs.slots[i].job;
+	}
+	return NULL;
+}
+
+START_TEST(jobs_wait_for_credits)
+{
+	static int data[5];
+	struct wproc_job *job;
+	int i;
+
+	add_fake_worker(0, "max_jobs=2;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 5; i++)
+		ck_assert_int_eq(OK, wproc_run_callback("/bin/true", 10, save_result, &data[i], NULL));
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+	ck_assert_int_eq(3, wproc_num_jobs_pending);
+
+	/* every result hands the credit to the job that came due first */
+	for (i = 0; i < 5; i++) {
+		job = find_job_by_data(fake[0], &data[i]);
+		ck_assert(job != NULL);
+		send_result(0, job->id);
+		ck_assert_int_eq(i + 1, result.calls);
+		ck_assert_int_eq(i < 3 ? 2 : 4 - i, fake[0]->jobs.running);
+		ck_assert_int_eq(i < 3 ? 2 - i : 0, wproc_num_jobs_pending);
+	}
+}
+END_TEST
+
+START_TEST(pending_jobs_go_to_new_workers)
+{
+	static int data[3];
+	int i;
+
+	/* without any workers at all, there's nothing to wait for */
+	ck_assert_int_eq(ERROR, wproc_run_callback("/bin/true", 10, save_result, &data[0], NULL));
+	ck_assert_int_eq(0, wproc_num_jobs_pending);
+
+	add_fake_worker(0, "max_jobs=1;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 3; i++)
+		ck_assert_int_eq(OK, wproc_run_callback("/bin/true", 10, save_result, &data[i], NULL));
+	ck_assert_int_eq(2, wproc_num_jobs_pending);
+	add_fake_worker(1, "max_jobs=10;framing=" WORKER_FRAMING_BINARY);
+	ck_assert_int_eq(0, wproc_num_jobs_pending);
+	ck_assert_int_eq(2, fake[1]->jobs.running);
+}
+END_TEST
+
+START_TEST(jobs_of_dead_workers_go_first)
+{
+	static int data[3];
+	char buf[1024];
+	int i;
+
+	add_fake_worker(0, "max_jobs=2;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 3; i++)
+		ck_assert_int_eq(OK, wproc_run_callback("/bin/true", 10, save_result, &data[i], NULL));
+	ck_assert_int_eq(1, wproc_num_jobs_pending);
+
+	/* the worker dies having read everything we sent it */
+	iobroker_push(nagios_iobs);
+	while (recv(peer[0], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	close(peer[0]);
+	handle_worker_result(fake[0]->sd, 0, fake[0]);
+	fake[0] = NULL;
+	ck_assert_int_eq(3, wproc_num_jobs_pending);
+	ck_assert_int_eq(0, result.calls);
+
+	add_fake_worker(1, "max_jobs=1;framing=" WORKER_FRAMING_BINARY);
+	ck_assert(find_job_by_data(fake[1], &data[0]) != NULL);
+	ck_assert_int_eq(2, wproc_num_jobs_pending);
+}
+END_TEST
+
+static struct {
+	int calls;
+	void *data;
+} orphaned;
+
+static void save_orphan(struct wproc_result *wpres, void *data, int flags)
+{
+	if (wpres) {
+		save_result(wpres, data, flags);
+	} else if (flags & WPROC_ORPHANED) {
+		orphaned.calls++;
+		orphaned.data = data;
+	}
+}
+
+static void setup_orphans(void)
+{
+	setup_framing();
+	memset(&orphaned, 0, sizeof(orphaned));
+}
+
+/* every job on a worker must be where it says, and due no earlier than its parent */
+static void verify_inflight(unsigned int expected)
+{
+	unsigned int i;
+
+	ck_assert_int_eq(expected, inflight.len);
+	for (i = 0; i < inflight.len; i++) {
+		ck_assert_int_eq(i, inflight.jobs[i]->inflight_pos);
+		ck_assert(inflight.jobs[i]->wp != NULL);
+		if (i)
+			ck_assert(!inflight_before(inflight.jobs[i], inflight.jobs[(i - 1) / 2]));
+	}
+}
+
+/* makes a job overdue, as if its worker had lost track of it */
+static void make_overdue(struct wproc_job *job)
+{
+	job->deadline = time(NULL) - 1;
+	inflight_sift(job->inflight_pos);
+	inflight_arm();
+}
+
+START_TEST(jobs_are_indexed_by_deadline)
+{
+	static int data[4];
+	struct wproc_job *job;
+	int i;
+
+	add_fake_worker(0, "max_jobs=3;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 4; i++)
+		ck_assert_int_eq(OK, wproc_run_callback("/bin/true", 40 - i * 10, save_orphan, &data[i], NULL));
+	verify_inflight(3);
+	ck_assert(inflight.jobs[0]->data == &data[2]);
+	ck_assert(inflight.event != NULL);
+	ck_assert_int_eq(inflight.jobs[0]->deadline, inflight.event_at);
+	ck_assert(inflight.event_at > time(NULL) + 20);
+
+	/* jobs leave as their results come in, and waiting ones join */
+	job = find_job_by_data(fake[0], &data[1]);
+	send_result(0, job->id);
+	verify_inflight(3);
+	ck_assert(inflight.jobs[0]->data == &data[3]);
+	send_result(0, find_job_by_data(fake[0], &data[0])->id);
+	verify_inflight(2);
+
+	/* jobs without a timeout are never overdue */
+	ck_assert_int_eq(OK, wproc_run_callback("/bin/true", 0, save_orphan, &data[0], NULL));
+	ck_assert_int_eq(3, fake[0]->jobs.running);
+	verify_inflight(2);
+}
+END_TEST
+
+START_TEST(overdue_jobs_are_orphaned)
+{
+	static int data[3];
+	struct wproc_job *job;
+	unsigned int job_id;
+	int i;
+
+	add_fake_worker(0, "max_jobs=2;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 3; i++)
+		ck_assert_int_eq(OK, wproc_run_callback("/bin/true", 10, save_orphan, &data[i], NULL));
+	ck_assert_int_eq(1, wproc_num_jobs_pending);
+
+	job = find_job_by_data(fake[0], &data[1]);
+	job_id = job->id;
+	make_overdue(job);
+	event_poll();
+	ck_assert_int_eq(1, orphaned.calls);
+	ck_assert(orphaned.data == &data[1]);
+
+	/* its credit goes to the job that was waiting */
+	ck_assert_int_eq(0, wproc_num_jobs_pending);
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+	ck_assert(find_job_by_data(fake[0], &data[2]) != NULL);
+	verify_inflight(2);
+
+	/* and if its result turns up after all, nobody gets it */
+	send_result(0, job_id);
+	ck_assert_int_eq(0, result.calls);
+	ck_assert_int_eq(1, orphaned.calls);
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+}
+END_TEST
+
+START_TEST(jobs_of_dead_workers_are_indexed_again)
+{
+	static int data[2];
+	char buf[1024];
+	int i;
+
+	add_fake_worker(0, "max_jobs=2;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 2; i++)
+		ck_assert_int_eq(OK, wproc_run_callback("/bin/true", 10, save_orphan, &data[i], NULL));
+	verify_inflight(2);
+
+	iobroker_push(nagios_iobs);
+	while (recv(peer[0], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	close(peer[0]);
+	handle_worker_result(fake[0]->sd, 0, fake[0]);
+	fake[0] = NULL;
+	verify_inflight(0);
+
+	add_fake_worker(1, "max_jobs=2;framing=" WORKER_FRAMING_BINARY);
+	verify_inflight(2);
+	ck_assert_int_eq(0, orphaned.calls);
+}
+END_TEST
+
+static struct wproc_job *find_job_by_command(struct wproc_worker *wp, const char *cmd)
+{
+	unsigned int i;
+
+	for (i = 0; i < wp->jobs.size; i++) {
+		if (wp->jobs.slots[i].job && !strcmp(wp->jobs.slots[i].job->command, cmd))
+			return wp->jobs.slots[i].job;
+	}
+	return NULL;
+}
+
+static void setup_coalescing(void)
+{
+	setup_framing();
+	coalesce_checks = TRUE;
+	coalesce_hits = coalesce_misses = 0;
+}
+
+static void teardown_coalescing(void)
+{
+	teardown();
+	coalesce_checks = FALSE;
+	coalesce_checks_ttl = 0;
+}
+
+START_TEST(identical_checks_share_a_run)
+{
+	static int data[4];
+	int i;
+
+	add_fake_worker(0, "max_jobs=10;framing=" WORKER_FRAMING_BINARY);
+	for (i = 0; i < 3; i++)
+		ck_assert_int_eq(OK, wproc_run_check("/bin/true", NULL, 0, 10, save_result, &data[i], NULL));
+	ck_assert_int_eq(OK, wproc_run_check("/bin/false", NULL, 0, 10, save_result, &data[3], NULL));
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+	ck_assert_int_eq(2, coalesce_hits);
+	ck_assert_int_eq(2, coalesce_misses);
+
+	/* one result is handed to all three */
+	send_result(0, find_job_by_command(fake[0], "/bin/true")->id);
+	ck_assert_int_eq(3, result.calls);
+	ck_assert_str_eq("/bin/true", result.command);
+	ck_assert_int_eq(1, fake[0]->jobs.running);
+
+	/* without a ttl, the next one runs again */
+	ck_assert_int_eq(OK, wproc_run_check("/bin/true", NULL, 0, 10, save_result, &data[0], NULL));
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+	ck_assert_int_eq(3, coalesce_misses);
+}
+END_TEST
+
+START_TEST(recent_results_are_reused)
+{
+	static int data[3];
+	struct coalesced_run *run;
+	char buf[1024];
+
+	coalesce_checks_ttl = 60;
+	add_fake_worker(0, "max_jobs=10;framing=" WORKER_FRAMING_BINARY);
+	ck_assert_int_eq(OK, wproc_run_check("/bin/true", NULL, 0, 10, save_result, &data[0], NULL));
+	send_result(0, find_job_by_command(fake[0], "/bin/true")->id);
+	ck_assert_int_eq(1, result.calls);
+
+	/* the copy comes from the event loop, not from under the caller */
+	ck_assert_int_eq(OK, wproc_run_check("/bin/true", NULL, 0, 10, save_result, &data[1], NULL));
+	ck_assert_int_eq(0, fake[0]->jobs.running);
+	ck_assert_int_eq(1, result.calls);
+
+	/* and it outlives the worker that ran the command */
+	iobroker_push(nagios_iobs);
+	while (recv(peer[0], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	close(peer[0]);
+	handle_worker_result(fake[0]->sd, 0, fake[0]);
+	fake[0] = NULL;
+	event_poll();
+	ck_assert_int_eq(2, result.calls);
+	ck_assert_str_eq("/bin/true", result.command);
+	ck_assert_str_eq("fake0", result.source);
+	ck_assert_int_eq(1, coalesce_hits);
+
+	/* and once the result is too old, the command runs again */
+	run = g_queue_peek_head(&coalesced_done);
+	ck_assert(run != NULL);
+	run->expires = time(NULL) - 1;
+	add_fake_worker(1, "max_jobs=10;framing=" WORKER_FRAMING_BINARY);
+	ck_assert_int_eq(OK, wproc_run_check("/bin/true", NULL, 0, 10, save_result, &data[2], NULL));
+	ck_assert_int_eq(1, fake[1]->jobs.running);
+	ck_assert_int_eq(2, coalesce_misses);
+	ck_assert_int_eq(0, g_queue_get_length(&coalesced_done));
+}
+END_TEST
+
+START_TEST(coalescing_is_opt_in)
+{
+	static int data[2];
+
+	coalesce_checks = FALSE;
+	add_fake_worker(0, "max_jobs=10;framing=" WORKER_FRAMING_BINARY);
+	ck_assert_int_eq(OK, wproc_run_check("/bin/true", NULL, 0, 10, save_result, &data[0], NULL));
+	ck_assert_int_eq(OK, wproc_run_check("/bin/true", NULL, 0, 10, save_result, &data[1], NULL));
+	ck_assert_int_eq(2, fake[0]->jobs.running);
+	ck_assert_int_eq(0, coalesce_hits + coalesce_misses);
+}
+END_TEST
+
+/*
+ * Registers a fake core worker with the given pid, which has rings
+ * waiting for it if we spawned it, and returns the core's reply.
+ * theirs is the worker's end of those rings.
+ */
+static const char *add_ring_worker(int i, int pid, int spawned, struct worker_rings *theirs)
+{
+	static char reply[64];
+	struct worker_rings *ours = nm_calloc(1, sizeof(*ours));
+	char options[64];
+	int fds[3];
+	ssize_t len;
+
+	ck_assert_int_eq(0, worker_rings_create(ours, WORKER_RING_MIN_SIZE, fds));
+	ck_assert_int_eq(0, worker_rings_attach(theirs, fds));
+	if (!pending_rings)
+		pending_rings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, wproc_rings_free);
+	g_hash_table_insert(pending_rings, GINT_TO_POINTER(spawned), ours);
+
+	snprintf(options, sizeof(options), "pid=%d;max_jobs=100;framing=%s;rings=1", pid, WORKER_FRAMING_BINARY);
+	add_fake_worker(i, options);
+	len = read(peer[i], reply, sizeof(reply) - 1);
+	ck_assert(len > 0);
+	reply[len] = 0;
+	return reply;
+}
+
+START_TEST(rings_pass_frames_around)
+{
+	struct worker_rings a, b;
+	struct worker_frame hdr = { 0, WORKER_FRAME_LOG, 0 };
+	char frame[4096], *p;
+	uint64_t signals;
+	size_t size;
+	int fds[3], i;
+
+	ck_assert_int_eq(0, worker_rings_create(&a, WORKER_RING_MIN_SIZE, fds));
+	ck_assert_int_eq(0, worker_rings_attach(&b, fds));
+	ck_assert_int_eq(1, worker_ring_peek(&b.jobs, &p, &size));
+
+	/* frames too big to ever fit are refused right away */
+	ck_assert(worker_ring_reserve(&a.jobs, WORKER_RING_MIN_SIZE / 2 + 1) == NULL);
+
+	/* the consumer is only woken up when there was nothing to read */
+	memset(frame, 'x', sizeof(frame));
+	for (i = 0; i < 3; i++) {
+		hdr.len = 1000 + i;
+		memcpy(frame, &hdr, sizeof(hdr));
+		ck_assert_int_eq(0, worker_ring_write(&a.jobs, frame, hdr.len));
+	}
+	ck_assert_int_eq(sizeof(signals), read(b.jobs.efd, &signals, sizeof(signals)));
+	ck_assert_int_eq(1, signals);
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_eq(0, worker_ring_peek(&b.jobs, &p, &size));
+		ck_assert_int_eq(1000 + i, size);
+		ck_assert_int_eq('x', p[size - 1]);
+		worker_ring_consume(&b.jobs, size);
+	}
+	ck_assert_int_eq(1, worker_ring_peek(&b.jobs, &p, &size));
+
+	/* a full ring turns writers away until there's room, and frames wrap around */
+	hdr.len = sizeof(frame);
+	memcpy(frame, &hdr, sizeof(hdr));
+	for (i = 0; !worker_ring_write(&a.jobs, frame, hdr.len); i++)
+		;
+	ck_assert(i >= WORKER_RING_MIN_SIZE / (int)sizeof(frame) - 1);
+	for (i = 0; i < 1000; i++) {
+		ck_assert_int_eq(0, worker_ring_peek(&b.jobs, &p, &size));
+		ck_assert_int_eq(sizeof(frame), size);
+		ck_assert(!memcmp(p, frame, size));
+		worker_ring_consume(&b.jobs, size);
+		ck_assert_int_eq(0, worker_ring_write(&a.jobs, frame, hdr.len));
+	}
+
+	/* garbage in a frame header means nothing after it can be trusted */
+	hdr.len = 2;
+	ck_assert(worker_ring_reserve(&b.results, sizeof(hdr)) != NULL);
+	memcpy(b.results.shm->data + (b.results.pos & (b.results.shm->size - 1)), &hdr, sizeof(hdr));
+	worker_ring_commit(&b.results, sizeof(hdr));
+	ck_assert_int_lt(worker_ring_peek(&a.results, &p, &size), 0);
+
+	worker_rings_destroy(&a);
+	worker_rings_destroy(&b);
+	for (i = 1; i < 3; i++)
+		close(fds[i]);
+}
+END_TEST
+
+START_TEST(ring_workers_get_jobs_and_send_results)
+{
+	struct worker_rings theirs;
+	struct worker_job_frame *frame;
+	struct worker_result_frame res;
+	struct wproc_job *job;
+	char buf[256], *p;
+	size_t size;
+
+	ck_assert_str_eq("OK framing=binary rings=1", add_ring_worker(0, 4242, 4242, &theirs));
+	ck_assert(fake[0]->rings != NULL);
+
+	job = create_job(save_result, NULL, 10, "/bin/echo hello", NULL, 0);
+	ck_assert(job != NULL);
+	ck_assert_int_eq(OK, wproc_run_job(job, NULL));
+	ck_assert_int_eq(0, worker_ring_peek(&theirs.jobs, &p, &size));
+	frame = (struct worker_job_frame *)p;
+	ck_assert_int_eq(WORKER_FRAME_JOB, frame->hdr.type);
+	ck_assert_int_eq(job->id, frame->job_id);
+	ck_assert_str_eq("/bin/echo hello", p + sizeof(*frame));
+	worker_ring_consume(&theirs.jobs, size);
+
+	/* nothing went by the socket */
+	ck_assert_int_eq(-1, recv(peer[0], buf, sizeof(buf), MSG_DONTWAIT));
+
+	memset(&res, 0, sizeof(res));
+	res.hdr.type = WORKER_FRAME_RESULT;
+	res.hdr.flags = WORKER_RESULT_EXITED_OK;
+	res.hdr.len = sizeof(res) + 6 + 3;
+	res.job_id = job->id;
+	res.outstd_len = 6;
+	memcpy(buf, &res, sizeof(res));
+	memcpy(buf + sizeof(res), "hello\n\0\0\0", 9);
+	ck_assert_int_eq(0, worker_ring_write(&theirs.results, buf, res.hdr.len));
+	handle_worker_ring(fake[0]->rings->results.efd, 0, fake[0]);
+	ck_assert_int_eq(1, result.calls);
+	ck_assert_str_eq("hello\n", result.outstd);
+	ck_assert_str_eq("/bin/echo hello", result.command);
+	ck_assert_int_eq(0, fake[0]->jobs.running);
+
+	close(theirs.jobs.efd);
+	close(theirs.results.efd);
+	worker_rings_destroy(&theirs);
+}
+END_TEST
+
+START_TEST(rings_are_only_for_their_worker)
+{
+	struct worker_rings theirs;
+
+	/* some other worker registering doesn't get them */
+	ck_assert_str_eq("OK framing=binary", add_ring_worker(0, 4243, 4242, &theirs));
+	ck_assert(fake[0]->rings == NULL);
+	ck_assert(g_hash_table_lookup(pending_rings, GINT_TO_POINTER(4242)) != NULL);
+	close(theirs.jobs.efd);
+	close(theirs.results.efd);
+	worker_rings_destroy(&theirs);
+}
+END_TEST
+
+Suite *
+wproc_suite(void)
+{
+	Suite *s = suite_create("Worker process manager");
+	TCase *tc = tcase_create("Least loaded worker");
+	TCase *tc_pool = tcase_create("Worker pool");
+	TCase *tc_credits = tcase_create("Flow control");
+	TCase *tc_framing = tcase_create("Binary framing");
+	TCase *tc_rings = tcase_create("Shared memory rings");
+	TCase *tc_coalesce = tcase_create("Check coalescing");
+	TCase *tc_orphans = tcase_create("Orphaned jobs");
+
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, least_loaded_worker_is_picked);
+	tcase_add_test(tc, slow_workers_get_fewer_jobs);
+	tcase_add_test(tc, full_workers_are_skipped);
+	tcase_add_test(tc, stale_job_ids_are_not_found);
+	tcase_add_test(tc, specialized_workers_are_used);
+	suite_add_tcase(s, tc);
+
+	tcase_add_checked_fixture(tc_pool, setup, teardown);
+	tcase_add_test(tc_pool, pool_follows_demand);
+	tcase_add_test(tc_pool, pool_retires_drained_workers);
+	tcase_add_test(tc_pool, pool_keeps_foreign_workers);
+	suite_add_tcase(s, tc_pool);
+
+	tcase_add_checked_fixture(tc_credits, setup_framing, teardown);
+	tcase_add_test(tc_credits, jobs_wait_for_credits);
+	tcase_add_test(tc_credits, pending_jobs_go_to_new_workers);
+	tcase_add_test(tc_credits, jobs_of_dead_workers_go_first);
+	suite_add_tcase(s, tc_credits);
+
+	tcase_add_checked_fixture(tc_orphans, setup_orphans, teardown);
+	tcase_add_test(tc_orphans, jobs_are_indexed_by_deadline);
+	tcase_add_test(tc_orphans, overdue_jobs_are_orphaned);
+	tcase_add_test(tc_orphans, jobs_of_dead_workers_are_indexed_again);
+	suite_add_tcase(s, tc_orphans);
+
+	tcase_add_checked_fixture(tc_coalesce, setup_coalescing, teardown_coalescing);
+	tcase_add_test(tc_coalesce, identical_checks_share_a_run);
+	tcase_add_test(tc_coalesce, recent_results_are_reused);
+	tcase_add_test(tc_coalesce, coalescing_is_opt_in);
+	suite_add_tcase(s, tc_coalesce);
+
+	tcase_add_checked_fixture(tc_framing, setup_framing, teardown);
+	tcase_add_test(tc_framing, binary_framing_is_negotiated);
+	tcase_add_test(tc_framing, binary_job_frames);
+	tcase_add_test(tc_framing, argv_job_frames);
+	tcase_add_test(tc_framing, persistent_job_frames);
+	tcase_add_test(tc_framing, binary_result_frames);
+	tcase_add_test(tc_framing, kvvec_results_still_work);
+	tcase_add_test(tc_framing, resource_usage_is_accounted);
+	tcase_add_test(tc_framing, broken_frames_disconnect);
+	tcase_add_test(tc_framing, unterminated_results_disconnect);
+	suite_add_tcase(s, tc_framing);
+
+	tcase_add_checked_fixture(tc_rings, setup_framing, teardown);
+	tcase_add_test(tc_rings, rings_pass_frames_around);
+	tcase_add_test(tc_rings, ring_workers_get_jobs_and_send_results);
+	tcase_add_test(tc_rings, rings_are_only_for_their_worker);
+	suite_add_tcase(s, tc_rings);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed = 0;
+	Suite *s = wproc_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_ENV);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}